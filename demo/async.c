@@ -0,0 +1,329 @@
+/** _GNU_SOURCE for pthread_setname_np */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <tinylogger.h>
+#include "demo-utils.h"
+
+/** includes null termination */
+#define NAME_LEN TASK_COMM_LEN
+
+#define N_THREADS	8		/**< number of threads to run */
+#define N_MSGS		100000	/**< number of messages for each thread */
+
+static char *filename = "async.log";
+static char *fork_file = "async-fork.log";
+
+/**
+ * bookkeeping for the threads
+ */
+struct thread_info {
+	char		name[NAME_LEN];		/**< the thread name */
+	pthread_t	thread_id;			/**< the posix thread_id */
+	int			tid;				/**< the linux thread id */
+	int			count;				/**< the number of messages to log */
+	int			next_sn;			/**< next serial number expected */
+	long long	nanos;				/**< time spent in log_info() */
+};
+static struct thread_info threads[N_THREADS];
+
+/**
+ * @fn void *threadFunc(void *)
+ * @brief Log count messages as fast as possible, and time them.
+ * @param parm the thread_info of the thread
+ * @return NULL
+ */
+static void *threadFunc(void *parm) {
+	struct thread_info *info = parm;
+	struct timespec start, end;
+	int rc;
+
+	info->tid = syscall(SYS_gettid);
+	rc = pthread_setname_np(pthread_self(), info->name);
+	if (rc != 0)
+		errExitEN(rc, "pthread setname");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int n = 0; n < info->count; n++) {
+		log_info("s/n=%d of %s", n, info->name);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	info->nanos = get_time_nanos(&end) - get_time_nanos(&start);
+
+	return NULL;
+}
+
+/**
+ * @fn bool scan_file(int n_threads)
+ * @brief Check that every message was written once, in order, and that it
+ * shows the id and name of the thread that logged it, not the writer thread.
+ * @param n_threads the number of threads started
+ * @return true on success
+ */
+static bool scan_file(int n_threads) {
+	char buf[BUFSIZ];
+	bool success = true;
+
+	FILE *file = fopen(filename, "r");
+	if (file == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", filename);
+		return false;
+	}
+
+	while (fgets(buf, sizeof(buf), file) != NULL) {
+		char date[32], time[32], level[16], name[NAME_LEN], from[NAME_LEN];
+		int tid, sn;
+
+		// log_fmt_tall: date time level tid:name message
+		if (sscanf(buf, "%31s %31s %15s %d:%15s s/n=%d of %15s",
+			date, time, level, &tid, name, &sn, from) != 7) {
+			continue;
+		}
+
+		for (int n = 0; n < n_threads; n++) {
+			if (strcmp(threads[n].name, from) != 0) continue;
+			if ((threads[n].tid != tid) || (strcmp(name, from) != 0) ||
+				(threads[n].next_sn != sn)) {
+				printf("bad record: %s", buf);
+				success = false;
+			}
+			threads[n].next_sn = sn + 1;
+		}
+	}
+	fclose(file);
+
+	for (int n = 0; n < n_threads; n++) {
+		if (threads[n].next_sn != threads[n].count) {
+			printf("%s: expected %d messages, found %d\n",
+				threads[n].name, threads[n].count, threads[n].next_sn);
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+/**
+ * @fn bool run_threads(int, bool)
+ * @brief Log n_msgs messages from each of N_THREADS threads to a new file, and
+ * check it.
+ *
+ * With stop_early, asynchronous mode is stopped while the threads are still
+ * logging. The messages queued by then are written, and the rest are written
+ * directly, in order.
+ *
+ * @param n_msgs the number of messages of each thread
+ * @param stop_early stop asynchronous mode half way
+ * @return true if every message was written once, in order
+ */
+static bool run_threads(int n_msgs, bool stop_early) {
+	struct log_stats before, stats;
+	int rc;
+
+	unlink(filename);
+
+	LOG_CHANNEL *ch = log_open_channel_f(filename, LL_INFO, log_fmt_tall, false);
+	if (ch == NULL) {
+		fprintf(stderr, "problem opening %s for appending\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	if (log_start_async(0) != 0) {
+		fprintf(stderr, "can't start asynchronous mode\n");
+		exit(EXIT_FAILURE);
+	}
+
+	log_get_stats(&before);
+	for (int n = 0; n < N_THREADS; n++) {
+		threads[n].count = n_msgs;
+		threads[n].next_sn = 0;
+		snprintf(threads[n].name, NAME_LEN, "async_%d", n);
+		rc = pthread_create(&threads[n].thread_id, NULL,
+			threadFunc, &threads[n]);
+		if (rc != 0)
+			errExitEN(rc, "pthread create");
+	}
+
+	// wait for half the messages to be queued
+	if (stop_early) {
+		unsigned long half = (unsigned long) N_THREADS * n_msgs / 2;
+		do {
+			sched_yield();
+			log_get_stats(&stats);
+		} while (stats.async_records - before.async_records < half);
+		log_stop_async();
+	}
+
+	for (int n = 0; n < N_THREADS; n++) {
+		pthread_join(threads[n].thread_id, NULL);
+	}
+
+	log_get_stats(&stats);
+	log_stop_async();
+	log_close_channel(ch);
+
+	printf("stopped half way: %lu of %lu records queued\n",
+		stats.async_records - before.async_records,
+		(unsigned long) N_THREADS * n_msgs);
+
+	return scan_file(N_THREADS);
+}
+
+/**
+ * @fn bool check_fork(void)
+ * @brief Log in asynchronous mode from the child of a fork().
+ *
+ * The parent's thread has logged, so its thread id and ring are cached. The
+ * child must log with a thread id, and a ring, of its own.
+ *
+ * @return true if the child's message has the child's thread id
+ */
+static bool check_fork(void) {
+	char line[BUFSIZ], message[64], tid[64];
+	bool found = false, own_tid = false;
+
+	unlink(fork_file);
+	if ((log_open_channel_f(fork_file, LL_INFO, log_fmt_debug_tid, true) ==
+		NULL) || (log_start_async(0) != 0)) {
+		fprintf(stderr, "can't log asynchronously to %s\n", fork_file);
+		exit(EXIT_FAILURE);
+	}
+	log_info("from the parent %d", getpid());
+	log_stop_async();
+
+	fflush(stdout);		// or the child would print it again
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		// the main thread of the child has the process id as thread id
+		if (log_start_async(0) != 0) _exit(EXIT_FAILURE);
+		log_info("from the child %d", getpid());
+		log_done();
+		_exit(EXIT_SUCCESS);
+	}
+	waitpid(pid, NULL, 0);
+	log_done();
+
+	snprintf(message, sizeof(message), "from the child %d\n", pid);
+	snprintf(tid, sizeof(tid), " %d ", pid);
+	FILE *fp = fopen(fork_file, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", fork_file);
+		exit(EXIT_FAILURE);
+	}
+	while (!found && (fgets(line, sizeof(line), fp) != NULL)) {
+		char *msg = strstr(line, message);
+		if (msg == NULL) continue;
+		*msg = '\0';
+		found = true;
+		own_tid = (strstr(line, tid) != NULL);
+	}
+	fclose(fp);
+
+	if (!found) {
+		printf("%s: the child's message is missing\n", fork_file);
+	} else if (!own_tid) {
+		printf("%s: the child logged with another thread id\n", fork_file);
+	}
+	return own_tid;
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ *
+ * @brief Demonstrate asynchronous mode.
+ *
+ * Several threads log as fast as they can. In asynchronous mode the calling
+ * threads only format the user message into their own ring, and a writer
+ * thread does the rest. The time per message seen by the callers is printed,
+ * and the output file is checked.
+ *
+ * Then asynchronous mode is stopped while the threads are logging. Every
+ * message must still be written, in order. Last, the child of a fork() logs
+ * asynchronously, and must show its own thread id.
+ *
+ * Use -s to run the same test synchronously for comparison.
+ *
+ * @return 0 on success
+ */
+int main(int argc, char *argv[]) {
+	int n_msgs = N_MSGS;
+	bool async = true;
+	long long nanos = 0;
+	struct log_stats stats;
+	int rc;
+
+	for (int n = 1; n < argc; n++) {
+		if (strcmp(argv[n], "-q") == 0) {
+			n_msgs /= 10;
+		} else if (strcmp(argv[n], "-s") == 0) {
+			async = false;
+		} else {
+			fprintf(stderr, "usage: %s [-q] [-s]\n", argv[0]);
+			fprintf(stderr, "  -q selects quick mode (1/10 the messages)\n");
+			fprintf(stderr, "  -s selects synchronous mode for comparison\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	unlink(filename);
+
+	LOG_CHANNEL *ch = log_open_channel_f(filename, LL_INFO, log_fmt_tall, false);
+	if (ch == NULL) {
+		fprintf(stderr, "problem opening %s for appending\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	if (async && (log_start_async(0) != 0)) {
+		fprintf(stderr, "can't start asynchronous mode\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int n = 0; n < N_THREADS; n++) {
+		threads[n].count = n_msgs;
+		snprintf(threads[n].name, NAME_LEN, "async_%d", n);
+		rc = pthread_create(&threads[n].thread_id, NULL,
+			threadFunc, &threads[n]);
+		if (rc != 0)
+			errExitEN(rc, "pthread create");
+	}
+
+	for (int n = 0; n < N_THREADS; n++) {
+		pthread_join(threads[n].thread_id, NULL);
+		nanos += threads[n].nanos;
+	}
+
+	log_get_stats(&stats);
+
+	// writes everything still queued
+	log_done();
+
+	printf("%s: %lld ns per message seen by the callers\n",
+		async ? "async" : "sync", nanos / ((long long) N_THREADS * n_msgs));
+	printf("%lu records queued, %lu waits for ring space\n",
+		stats.async_records, stats.async_waits);
+
+	bool success = scan_file(N_THREADS);
+	if (success && async) {
+		success = run_threads(n_msgs, true);
+		log_done();
+	}
+	if (success && async) success = check_fork();
+	printf("Verify %s\n", success ? "succeeded" : "failed");
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,237 @@
+/** _GNU_SOURCE for pthread_setname_np() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <tinylogger.h>
+#include "demo-utils.h"
+
+#define N_PASSES 10000	/**< number of times to log the set of messages */
+
+static char *binary_file = "binary.bin";
+static char *json_file = "binary-direct.json";
+static char *decoded_file = "binary-decoded.json";
+
+/**
+ * @fn void log_all(int pass)
+ * @brief Log a set of messages with a variety of arguments.
+ * @param pass the pass number, so that the messages vary
+ */
+static void log_all(int pass) {
+	static char long_text[BUFSIZ + BUFSIZ / 2];
+	char name[32];
+	char format[32];
+
+	snprintf(name, sizeof(name), "name_%d", pass);
+	log_info("pass %d", pass);
+	log_notice("%s has %zu characters, %5.2f%% done", name, strlen(name),
+		pass / 100.0);
+	log_debug("\"quoted\" <xml> & %s", "entities");
+	log_fine("pointer %p, hex %#lx", (void *) name, (unsigned long) pass);
+
+	// longer than BUFSIZ once rendered (but short enough for an asynchronous
+	// ring) - the decoder must not cut them short
+	memset(long_text, 'a' + pass % 26, sizeof(long_text) - 1);
+	log_info("long %s", long_text);
+	log_info("wide %*d", BUFSIZ + BUFSIZ / 2, pass);
+
+	// not a literal - written as a formatted message
+	snprintf(format, sizeof(format), "stack format %%d");
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+	log_info(format, pass);
+#pragma GCC diagnostic pop
+}
+
+/**
+ * @fn void *thread_func(void *)
+ * @brief Log from a second, named thread.
+ */
+static void *thread_func(void *arg) {
+	int n_passes = *(int *) arg;
+
+	pthread_setname_np(pthread_self(), "binary-2");
+	for (int pass = 0; pass < n_passes; pass++) {
+		log_info("from the second thread %d", pass);
+	}
+
+	return NULL;
+}
+
+/**
+ * @fn bool compare_files(char *, char *)
+ * @brief Check that two files hold the same text.
+ * @return true if they match
+ */
+static bool compare_files(char *file1, char *file2) {
+	char buf1[BUFSIZ], buf2[BUFSIZ];
+	bool success = true;
+	int line = 0;
+
+	FILE *fp1 = fopen(file1, "r");
+	FILE *fp2 = fopen(file2, "r");
+	if ((fp1 == NULL) || (fp2 == NULL)) {
+		fprintf(stderr, "can't open the log files for reading\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (success) {
+		char *s1 = fgets(buf1, sizeof(buf1), fp1);
+		char *s2 = fgets(buf2, sizeof(buf2), fp2);
+		line++;
+
+		if ((s1 == NULL) && (s2 == NULL)) break;
+		if ((s1 == NULL) || (s2 == NULL) || (strcmp(s1, s2) != 0)) {
+			printf("line %d differs:\n", line);
+			printf("  %s: %s", file1, s1 ? s1 : "(missing)\n");
+			printf("  %s: %s", file2, s2 ? s2 : "(missing)\n");
+			success = false;
+		}
+	}
+
+	fclose(fp1);
+	fclose(fp2);
+
+	return success;
+}
+
+/**
+ * @fn bool check_truncated(char *)
+ * @brief Decode each cut-off start of a binary log.
+ *
+ * A log may be cut short by a crash or a full disk. The decoder must report
+ * the records it can, and never crash on the one it can't.
+ *
+ * @return true if every start decoded to no more messages than it holds
+ */
+static bool check_truncated(char *filename) {
+	char buf[4096];
+
+	FILE *fp = fopen(filename, "r");
+	FILE *out = fopen("/dev/null", "w");
+	if ((fp == NULL) || (out == NULL)) {
+		fprintf(stderr, "can't open the files to decode\n");
+		exit(EXIT_FAILURE);
+	}
+	size_t size = fread(buf, 1, sizeof(buf), fp);
+	fclose(fp);
+
+	long last = 0;
+	for (size_t len = 1; len < size; len++) {
+		FILE *in = fmemopen(buf, len, "r");
+		if (in == NULL) continue;
+		long n_msgs = log_decode_binary(in, out, log_fmt_json_records);
+		fclose(in);
+
+		// a longer start never holds fewer messages
+		if (n_msgs > last) last = n_msgs;
+		if ((n_msgs >= 0) && (n_msgs < last)) {
+			printf("%zu bytes decoded to %ld messages\n", len, n_msgs);
+			fclose(out);
+			return false;
+		}
+	}
+	fclose(out);
+
+	return true;
+}
+
+/**
+ * @fn long file_size(char *)
+ * @brief Get the size of a file.
+ */
+static long file_size(char *filename) {
+	struct stat st;
+	if (stat(filename, &st) != 0) return -1;
+	return st.st_size;
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ *
+ * @brief Demonstrate the binary format.
+ *
+ * The same messages are logged to a binary channel and to a JSON channel.
+ * The binary log is then decoded to JSON, and must match the JSON written
+ * directly. Half the passes are logged in asynchronous mode.
+ *
+ * The size of each log is printed. Then each start of the binary log is
+ * decoded, as a log cut short would be.
+ *
+ * Use -q for quick mode (1/10 the passes).
+ *
+ * @return 0 on success
+ */
+int main(int argc, char *argv[]) {
+	int n_passes = N_PASSES;
+	pthread_t thread;
+
+	for (int n = 1; n < argc; n++) {
+		if (strcmp(argv[n], "-q") == 0) {
+			n_passes /= 10;
+		} else {
+			fprintf(stderr, "usage: %s [-q]\n", argv[0]);
+			fprintf(stderr, "  -q selects quick mode (1/10 the passes)\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	unlink(binary_file);
+	unlink(json_file);
+	LOG_CHANNEL *ch1 = log_open_channel_f(binary_file, LL_FINEST,
+		log_fmt_binary, false);
+	LOG_CHANNEL *ch2 = log_open_channel_f(json_file, LL_FINEST,
+		log_fmt_json_records, false);
+	if ((ch1 == NULL) || (ch2 == NULL)) {
+		fprintf(stderr, "problem opening the log files for appending\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Each channel is locked on its own, so messages of threads logging at
+	// the same time may be written to the two channels in different orders.
+	// The second thread is done before the main thread logs.
+	pthread_create(&thread, NULL, thread_func, &n_passes);
+	pthread_join(thread, NULL);
+	for (int pass = 0; pass < n_passes / 2; pass++) {
+		log_all(pass);
+	}
+
+	if (log_start_async(0) != 0) {
+		fprintf(stderr, "can't start asynchronous mode\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int pass = n_passes / 2; pass < n_passes; pass++) {
+		log_all(pass);
+	}
+
+	// writes everything still queued, and closes the channels
+	log_done();
+
+	// decode the binary log
+	FILE *in = fopen(binary_file, "r");
+	FILE *out = fopen(decoded_file, "w");
+	if ((in == NULL) || (out == NULL)) {
+		fprintf(stderr, "can't open the files to decode\n");
+		exit(EXIT_FAILURE);
+	}
+	long n_msgs = log_decode_binary(in, out, log_fmt_json_records);
+	fclose(in);
+	fclose(out);
+
+	printf("%ld messages\n", n_msgs);
+	printf("binary: %ld bytes\n", file_size(binary_file));
+	printf("json:   %ld bytes\n", file_size(json_file));
+
+	bool success = (n_msgs > 0) && compare_files(json_file, decoded_file) &&
+		check_truncated(binary_file);
+	printf("Verify %s\n", success ? "succeeded" : "failed");
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
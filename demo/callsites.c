@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tinylogger.h>
+
+#define N_LOOPS 10	/**< times through the logging loop */
+
+/**
+ * @fn int count_call(int *count)
+ * @brief count the times a log message argument is evaluated
+ */
+static int count_call(int *count) {
+	return ++*count;
+}
+
+/**
+ * @fn struct log_callsite *find_callsite(char const *)
+ * @brief Find the log statement with the given format.
+ * @param format the format to look for
+ * @return the log statement, or NULL if not found
+ */
+static struct log_callsite *find_callsite(char const *format) {
+	struct log_callsite *callsites;
+	size_t n_callsites = log_get_callsites(&callsites);
+
+	for (size_t n = 0; n < n_callsites; n++) {
+		if ((callsites[n].format != NULL) &&
+			(strcmp(callsites[n].format, format) == 0)) {
+			return &callsites[n];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @fn int main(void)
+ *
+ * @brief Demonstrate the log statement (callsite) records.
+ *
+ * Every use of a log_xxx() macro defines a struct log_callsite. They are all
+ * listed here, one is disabled, and the per-statement counters are checked.
+ *
+ * @return 0 on success
+ */
+int main(void) {
+	struct log_callsite *callsites;
+	size_t n_callsites;
+	char format[] = "not a literal %d";
+	int n_evaluated = 0;
+	bool success = true;
+
+	log_open_channel_s(stdout, LL_INFO, log_fmt_debug);
+
+	n_callsites = log_get_callsites(&callsites);
+	printf("%zu log statements:\n", n_callsites);
+	for (size_t n = 0; n < n_callsites; n++) {
+		struct log_callsite *cs = &callsites[n];
+		printf("%3d %-8s %s:%d %s() \"%s\"\n", log_callsite_id(cs),
+			log_labels[cs->level].english, cs->file, cs->line, cs->function,
+			cs->format ? cs->format : "(not a literal)");
+	}
+
+	struct log_callsite *quiet = find_callsite("quiet %d");
+	if (quiet == NULL) {
+		printf("\"quiet %%d\" not found\n");
+		exit(EXIT_FAILURE);
+	}
+	log_callsite_enable(quiet, false);
+
+	for (int n = 0; n < N_LOOPS; n++) {
+		log_info("loud %d", n);
+		log_info("quiet %d", count_call(&n_evaluated));
+		log_debug("filtered by level %d", n);
+		log_notice(format, n);
+	}
+
+	log_done();
+
+	struct log_callsite *loud = find_callsite("loud %d");
+	struct log_callsite *filtered = find_callsite("filtered by level %d");
+	if ((loud == NULL) || (loud->count != N_LOOPS)) {
+		printf("\"loud %%d\" count is wrong\n");
+		success = false;
+	}
+	if ((quiet->count != 0) || (n_evaluated != 0)) {
+		printf("disabled statement was logged\n");
+		success = false;
+	}
+	if ((filtered == NULL) || (filtered->count != 0)) {
+		printf("filtered statement was logged\n");
+		success = false;
+	}
+	if (log_callsite_id(loud) < 0) {
+		printf("no id for \"loud %%d\"\n");
+		success = false;
+	}
+
+	printf("Verify %s\n", success ? "succeeded" : "failed");
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
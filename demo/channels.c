@@ -0,0 +1,305 @@
+/** _GNU_SOURCE for pthread_setname_np() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <tinylogger.h>
+
+#define N_CHANNELS 6	/**< channels open for the whole run */
+#define N_THREADS 4		/**< threads logging */
+#define N_MSGS 20000	/**< messages per thread */
+
+static char *churn_file = "channels-churn.log";
+static LOG_CHANNEL *reopened = NULL;	/**< reopened by the churn thread */
+
+static bool running = true;
+
+/**
+ * @fn void *log_thread(void *)
+ * @brief Log N_MSGS numbered messages.
+ * @param arg points to the thread number and the number of messages
+ */
+static void *log_thread(void *arg) {
+	int const *params = arg;
+
+	for (int n = 0; n < params[1]; n++) {
+		log_info("thread %d msg %d", params[0], n);
+	}
+
+	return NULL;
+}
+
+/**
+ * @fn void *churn_thread(void *)
+ * @brief Open and close a channel over and over while the others log, and
+ * reopen one of them each time.
+ * @param arg where to put the number of times the channel was opened
+ */
+static void *churn_thread(void *arg) {
+	long *n_opens = arg;
+
+	pthread_setname_np(pthread_self(), "churn");
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		LOG_CHANNEL *ch = log_open_channel_f(churn_file, LL_INFO,
+			(*n_opens % 2) ? log_fmt_json : log_fmt_basic, false);
+		if (ch == NULL) {
+			fprintf(stderr, "can't open %s\n", churn_file);
+			exit(EXIT_FAILURE);
+		}
+		(*n_opens)++;
+		usleep(100);
+		if (!log_reopen_channel(reopened)) {
+			fprintf(stderr, "can't reopen channels-0.log\n");
+			exit(EXIT_FAILURE);
+		}
+		log_close_channel(ch);
+	}
+
+	return NULL;
+}
+
+/**
+ * @fn bool check_file(char *, int)
+ * @brief Check that a log has every message of every thread, in order.
+ * @param filename the log
+ * @param n_msgs the number of messages logged by each thread
+ * @return true if it does
+ */
+static bool check_file(char *filename, int n_msgs) {
+	char line[BUFSIZ];
+	int next[N_THREADS] = {0};
+	bool success = true;
+
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	while (success && (fgets(line, sizeof(line), fp) != NULL)) {
+		int thread, msg;
+		char *text = strstr(line, "thread ");
+
+		if ((text == NULL) ||
+			(sscanf(text, "thread %d msg %d", &thread, &msg) != 2) ||
+			(thread < 0) || (thread >= N_THREADS) || (msg != next[thread])) {
+			printf("%s: unexpected line: %s", filename, line);
+			success = false;
+		} else {
+			next[thread]++;
+		}
+	}
+	fclose(fp);
+
+	for (int n = 0; success && (n < N_THREADS); n++) {
+		if (next[n] != n_msgs) {
+			printf("%s: %d of %d messages from thread %d\n", filename,
+				next[n], n_msgs, n);
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+/**
+ * @fn bool check_sequence(char *, char *, int, int)
+ * @brief Check that a log numbers its records 1, 2, 3 and so on.
+ * @param filename the log
+ * @param tag the text just before each sequence number
+ * @param n_records the number of records expected
+ * @param n_commas the number of records expected to start with a comma (json
+ * arrays), or -1 to skip that check
+ * @return true if it does
+ */
+static bool check_sequence(char *filename, char *tag, int n_records,
+	int n_commas) {
+	char line[BUFSIZ];
+	int next = 1;
+	int commas = 0;
+	bool success = true;
+
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	while (success && (fgets(line, sizeof(line), fp) != NULL)) {
+		char *text = strstr(line, tag);
+		if (strstr(line, "},  {") != NULL) commas++;
+		if (text == NULL) continue;
+		if (atoi(text + strlen(tag)) != next) {
+			printf("%s: expected sequence %d: %s", filename, next, line);
+			success = false;
+		}
+		next++;
+	}
+	fclose(fp);
+
+	if (success && (next - 1 != n_records)) {
+		printf("%s: %d of %d records\n", filename, next - 1, n_records);
+		success = false;
+	}
+	if (success && (n_commas >= 0) && (commas != n_commas)) {
+		printf("%s: %d records start with a comma, expected %d\n", filename,
+			commas, n_commas);
+		success = false;
+	}
+
+	return success;
+}
+
+/**
+ * @fn bool check_shared(void)
+ * @brief Check channels that share a formatter.
+ *
+ * A record is formatted once for all the channels with the same formatter.
+ * Channels opened later have lower sequence numbers, which must replace the
+ * one the record was formatted with. The first record of a json array has no
+ * leading comma, so it can't be reused.
+ *
+ * @return true if every file numbers its records from 1
+ */
+static bool check_shared(void) {
+	struct {
+		char *filename;
+		log_formatter_t formatter;
+		char *tag;
+		int first_msg;		/**< the message logged before it is opened */
+		int n_commas;		/**< -1 if not a json array */
+	} logs[] = {
+		{"shared-xml-0.log", log_fmt_xml, "<sequence>", 0, -1},
+		{"shared-xml-1.log", log_fmt_xml, "<sequence>", 5, -1},
+		{"shared-json-0.log", log_fmt_json, "\"sequence\" : ", 0, -1},
+		{"shared-json-1.log", log_fmt_json, "\"sequence\" : ", 95, -1},
+		{"shared-records-0.log", log_fmt_json_records, "\"sequence\" : ",
+			0, -1},
+		{"shared-records-1.log", log_fmt_json_records, "\"sequence\" : ",
+			1, -1},
+	};
+	int const n_logs = sizeof(logs) / sizeof(logs[0]);
+	int const n_msgs = 100;
+	LOG_CHANNEL *channels[n_logs];
+	bool success = true;
+
+	for (int n = 0; n < n_logs; n++) {
+		unlink(logs[n].filename);
+		channels[n] = NULL;
+	}
+
+	for (int msg = 0; msg < n_msgs; msg++) {
+		for (int n = 0; n < n_logs; n++) {
+			if ((logs[n].first_msg == msg) && (channels[n] == NULL)) {
+				channels[n] = log_open_channel_f(logs[n].filename, LL_INFO,
+					logs[n].formatter, false);
+				if (channels[n] == NULL) {
+					fprintf(stderr, "can't open %s\n", logs[n].filename);
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+		log_info("shared msg %d", msg);
+	}
+
+	for (int n = 0; n < n_logs; n++) {
+		log_close_channel(channels[n]);
+	}
+
+	for (int n = 0; success && (n < n_logs); n++) {
+		int n_records = n_msgs - logs[n].first_msg;
+		bool array = (logs[n].formatter == log_fmt_json);
+		success = check_sequence(logs[n].filename, logs[n].tag, n_records,
+			array ? n_records - 1 : -1);
+	}
+
+	return success;
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ *
+ * @brief Log to more channels than there used to be room for, while another
+ * thread opens and closes a channel over and over.
+ *
+ * N_CHANNELS file channels are opened, with a mix of formats. N_THREADS
+ * threads log N_MSGS numbered messages each. Meanwhile a thread opens and
+ * closes one more channel as fast as it can, and reopens the first one.
+ *
+ * Each of the N_CHANNELS files must hold every message of every thread, in
+ * order.
+ *
+ * Then channels that share a formatter are checked. Each must number its
+ * records from 1, even though the records are formatted once for all of
+ * them.
+ *
+ * Use -q for quick mode (1/10 the messages).
+ *
+ * @return 0 on success
+ */
+int main(int argc, char *argv[]) {
+	log_formatter_t formatters[] = {log_fmt_basic, log_fmt_standard,
+		log_fmt_debug, log_fmt_debug_tid, log_fmt_debug_tname, log_fmt_tall};
+	char filenames[N_CHANNELS][32];
+	int params[N_THREADS][2];
+	pthread_t threads[N_THREADS];
+	pthread_t churn;
+	long n_opens = 0;
+	int n_msgs = N_MSGS;
+
+	for (int n = 1; n < argc; n++) {
+		if (strcmp(argv[n], "-q") == 0) {
+			n_msgs /= 10;
+		} else {
+			fprintf(stderr, "usage: %s [-q]\n", argv[0]);
+			fprintf(stderr, "  -q selects quick mode (1/10 the messages)\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (int n = 0; n < N_CHANNELS; n++) {
+		snprintf(filenames[n], sizeof(filenames[n]), "channels-%d.log", n);
+		unlink(filenames[n]);
+		LOG_CHANNEL *ch = log_open_channel_f(filenames[n], LL_INFO,
+			formatters[n % (sizeof(formatters) / sizeof(formatters[0]))],
+			false);
+		if (ch == NULL) {
+			fprintf(stderr, "can't open %s\n", filenames[n]);
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0) reopened = ch;
+	}
+	unlink(churn_file);
+
+	pthread_create(&churn, NULL, churn_thread, &n_opens);
+	for (int n = 0; n < N_THREADS; n++) {
+		params[n][0] = n;
+		params[n][1] = n_msgs;
+		pthread_create(&threads[n], NULL, log_thread, params[n]);
+	}
+	for (int n = 0; n < N_THREADS; n++) {
+		pthread_join(threads[n], NULL);
+	}
+	__atomic_store_n(&running, false, __ATOMIC_RELAXED);
+	pthread_join(churn, NULL);
+
+	log_done();
+
+	bool success = true;
+	for (int n = 0; success && (n < N_CHANNELS); n++) {
+		success = check_file(filenames[n], n_msgs);
+	}
+
+	printf("%d channels, %d messages each\n", N_CHANNELS, N_THREADS * n_msgs);
+	printf("churn channel opened %ld times\n", n_opens);
+
+	if (success) success = check_shared();
+	printf("Verify %s\n", success ? "succeeded" : "failed");
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <tinylogger.h>
+#include "demo-utils.h"
+
+#define N_PASSES 1000	/**< number of times to log the set of messages */
+#define RING_SIZE (64 * 1024)	/**< the passes wrap the ring many times */
+
+static char *sync_file = "deferred-sync.log";
+static char *async_file = "deferred-async.log";
+
+/**
+ * @fn void log_all(int pass)
+ * @brief Log a set of messages that exercise the printf conversions.
+ * @param pass the pass number, so that the messages vary
+ */
+static void log_all(int pass) {
+	char name[32];
+	char long_string[601];
+	char *null_string = NULL;
+	char format[32];
+	int value = pass * 7919;
+
+	log_info("pass %d", pass);
+
+	// integers of all sizes
+	log_info("%d %i %u %x %X %o", INT_MIN + pass, value, UINT_MAX - pass,
+		value, value, value);
+	log_info("%hhd %hd %ld %lld %jd %zu %td", (signed char) value,
+		(short) value, LONG_MIN + pass, LLONG_MAX - pass, (intmax_t) value,
+		(size_t) value, (ptrdiff_t) -value);
+	log_info("%#x %+d % d %05d %-5d|", value, value, value, pass, pass);
+
+	// floating point
+	log_info("%5.2f %e %g %a %Lf", value / 3.0, value * 1e10, value / 7.0,
+		1.0 / (pass + 1), (long double) value / 11);
+
+	// strings and characters
+	snprintf(name, sizeof(name), "name_%d", pass);
+	log_info("%-10s|%10s|%.3s|%c%c", name, name, name, 'a' + pass % 26, '!');
+	log_info("%*s|%-*.*s|%.*s|", 12, name, 12, 4, name, -1, name);
+	log_info("%*d|%.*f", -8, pass, 3, value / 13.0);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-overflow"
+	log_info("%s", null_string);
+#pragma GCC diagnostic pop
+
+	// the caller is free to change a string once log_msg() returns
+	log_info("before %s", name);
+	snprintf(name, sizeof(name), "changed");
+
+	memset(long_string, 'a' + pass % 26, sizeof(long_string) - 1);
+	long_string[sizeof(long_string) - 1] = '\0';
+	log_info("%s", long_string);
+
+	// pointers, %% and %m (a glibc extension, as are positional arguments)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat"
+	log_info("%p %p 100%%", (void *) name, (void *) NULL);
+	errno = pass % 30 + 1;
+	log_info("%m");
+
+	// formatted by the caller - not a literal, positional arguments
+	snprintf(format, sizeof(format), "stack format %%d");
+	log_info(format, pass);
+	log_info("%2$s %1$d", pass, "positional");
+#pragma GCC diagnostic pop
+}
+
+/**
+ * @fn bool compare_files(void)
+ * @brief Check that both files hold the same messages.
+ * @return true if they match
+ */
+static bool compare_files(void) {
+	char sync_buf[BUFSIZ], async_buf[BUFSIZ];
+	bool success = true;
+	int line = 0;
+
+	FILE *sync = fopen(sync_file, "r");
+	FILE *async = fopen(async_file, "r");
+	if ((sync == NULL) || (async == NULL)) {
+		fprintf(stderr, "can't open the log files for reading\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (success) {
+		char *s = fgets(sync_buf, sizeof(sync_buf), sync);
+		char *a = fgets(async_buf, sizeof(async_buf), async);
+		line++;
+
+		if ((s == NULL) && (a == NULL)) break;
+		if ((s == NULL) || (a == NULL) || (strcmp(s, a) != 0)) {
+			printf("line %d differs:\n", line);
+			printf("  sync:  %s", s ? s : "(missing)\n");
+			printf("  async: %s", a ? a : "(missing)\n");
+			success = false;
+		}
+	}
+
+	fclose(sync);
+	fclose(async);
+
+	return success;
+}
+
+/**
+ * @fn long long run(char *, bool, int)
+ * @brief Log the messages to a file.
+ * @param filename the file to log to
+ * @param async true to use asynchronous mode
+ * @param n_passes the number of times to log the set of messages
+ * @return the time taken by the calling thread (ns)
+ */
+static long long run(char *filename, bool async, int n_passes) {
+	struct timespec start, end;
+
+	unlink(filename);
+	LOG_CHANNEL *ch = log_open_channel_f(filename, LL_INFO, log_fmt_basic, false);
+	if (ch == NULL) {
+		fprintf(stderr, "problem opening %s for appending\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	if (async && (log_start_async(RING_SIZE) != 0)) {
+		fprintf(stderr, "can't start asynchronous mode\n");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int pass = 0; pass < n_passes; pass++) {
+		log_all(pass);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// writes everything still queued, and closes the channel
+	log_done();
+
+	return get_time_nanos(&end) - get_time_nanos(&start);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ *
+ * @brief Demonstrate deferred formatting in asynchronous mode.
+ *
+ * The same messages are logged synchronously, and then asynchronously, where
+ * the calling thread only copies the arguments and the writer thread formats
+ * the messages. The two files must match.
+ *
+ * The time spent by the calling thread in each mode is printed.
+ *
+ * Use -q for quick mode (1/10 the passes).
+ *
+ * @return 0 on success
+ */
+int main(int argc, char *argv[]) {
+	int n_passes = N_PASSES;
+	long long sync_nanos, async_nanos;
+
+	for (int n = 1; n < argc; n++) {
+		if (strcmp(argv[n], "-q") == 0) {
+			n_passes /= 10;
+		} else {
+			fprintf(stderr, "usage: %s [-q]\n", argv[0]);
+			fprintf(stderr, "  -q selects quick mode (1/10 the passes)\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	sync_nanos = run(sync_file, false, n_passes);
+	async_nanos = run(async_file, true, n_passes);
+
+	printf("sync:  %lld us for the calling thread\n", sync_nanos / 1000);
+	printf("async: %lld us for the calling thread\n", async_nanos / 1000);
+
+	bool success = compare_files();
+	printf("Verify %s\n", success ? "succeeded" : "failed");
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
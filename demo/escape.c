@@ -0,0 +1,352 @@
+/** _GNU_SOURCE for open_memstream() and MAP_ANONYMOUS */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <tinylogger.h>
+#include "demo-utils.h"
+
+#define N_PASSES 100000	/**< number of times to format each message */
+#define MSG_LEN 4096	/**< room for the longest message */
+
+/**
+ * The message mixes to time.
+ */
+static struct {
+	char *name;
+	char msg[MSG_LEN];
+} mixes[] = {
+	{"short", "connection from 10.0.0.1 accepted"},
+	{"typical", "user \"admin\" logged in from C:\\Users\\admin, took 12 ms"},
+	{"markup", "<b>price</b> < 10 & > 5, 'single' and \"double\""},
+	{"long clean", ""},		// filled in by main()
+	{"long escapes", ""},	// filled in by main()
+	{"control", "\ttab\r\nline\b\f\x01\x1f end"},
+};
+#define N_MIXES (sizeof(mixes) / sizeof(mixes[0]))
+#define LONG_CLEAN 3	/**< index of the long line with nothing to escape */
+#define LONG_ESCAPES 4	/**< index of the long line with many escapes */
+
+/**
+ * @fn char *reference_json(char const *, char *)
+ * @brief Escape a string for json a byte at a time, the way it was done
+ * before the block scanners.
+ * @param input the string to escape
+ * @param buf a buffer with room for 6 times the input
+ * @return buf
+ */
+static char *reference_json(char const *input, char *buf) {
+	char *out = buf;
+	char esc_buf[8];
+
+	for (char const *in = input; *in != '\0'; in++) {
+		char *esc = NULL;
+
+		switch (*in) {
+			case '\b': esc = "\\b"; break;
+			case '\t': esc = "\\t"; break;
+			case '\n': esc = "\\n"; break;
+			case '\f': esc = "\\f"; break;
+			case '\r': esc = "\\r"; break;
+			case '\"': esc = "\\\""; break;
+			case '\\': esc = "\\\\"; break;
+			default:
+				if ((unsigned char) *in < 0x20) {
+					snprintf(esc_buf, sizeof(esc_buf), "\\u%04X", *in);
+					esc = esc_buf;
+				}
+		}
+
+		if (esc != NULL) {
+			out = stpcpy(out, esc);
+		} else {
+			*out++ = *in;
+		}
+	}
+	*out = '\0';
+
+	return buf;
+}
+
+/**
+ * @fn char *reference_xml(char const *, char *)
+ * @brief Escape a string for xml a byte at a time, the way it was done
+ * before the block scanners.
+ * @param input the string to escape
+ * @param buf a buffer with room for 6 times the input
+ * @return buf
+ */
+static char *reference_xml(char const *input, char *buf) {
+	char *out = buf;
+
+	for (char const *in = input; *in != '\0'; in++) {
+		char *entity = NULL;
+
+		switch (*in) {
+			case '&': entity = "&amp;"; break;
+			case '<': entity = "&lt;"; break;
+			case '>': entity = "&gt;"; break;
+			case '"': entity = "&quot;"; break;
+			case '\'': entity = "&apos;"; break;
+		}
+
+		if (entity != NULL) {
+			out += snprintf(out, 8, "%s", entity);
+		} else {
+			*out++ = *in;
+		}
+	}
+	*out = '\0';
+
+	return buf;
+}
+
+/**
+ * @fn bool check_record(log_formatter_t, char const *, char const *,
+ *     char const *, char const *)
+ * @brief Check the end of a record against the expected text.
+ * @param formatter the formatter to use
+ * @param file the file name to format
+ * @param msg the message
+ * @param expected the text the record must end with
+ * @param contains text the record must contain, or NULL
+ * @return true if it matches
+ */
+static bool check_record(log_formatter_t formatter, char const *file,
+	char const *msg, char const *expected, char const *contains) {
+	struct timespec ts = {0};
+	char *record = NULL;
+	size_t size = 0;
+
+	FILE *stream = open_memstream(&record, &size);
+	formatter(stream, 1, &ts, LL_INFO, file, "function", 1, (char *) msg);
+	fclose(stream);
+
+	size_t len = strlen(expected);
+	bool success = (size >= len) &&
+		(strcmp(record + size - len, expected) == 0);
+	if ((contains != NULL) && (strstr(record, contains) == NULL)) {
+		success = false;
+	}
+	if (!success) {
+		printf("record differs, expected:\n%s%s\ngot:\n%s",
+			contains ? contains : "", expected, record);
+	}
+	free(record);
+
+	return success;
+}
+
+/**
+ * @fn bool check(char const *)
+ * @brief Check the json and xml messages against the references.
+ * @param msg the message
+ * @return true if they match
+ */
+static bool check(char const *msg) {
+	static char expected[6 * MSG_LEN + 32];
+	char *p;
+
+	p = stpcpy(expected, "    \"message\" : \"");
+	p = reference_json(msg, p);
+	strcpy(p + strlen(p), "\"\n}\n");
+	if (!check_record(log_fmt_json_records, "file", msg, expected, NULL)) {
+		return false;
+	}
+
+	p = stpcpy(expected, "  <message>");
+	p = reference_xml(msg, p);
+	strcpy(p + strlen(p), "</message>\n</record>\n");
+	return check_record(log_fmt_xml, "file", msg, expected, NULL);
+}
+
+/**
+ * @fn bool check_alignments(void)
+ * @brief Check every mix at every alignment and length up to 80.
+ *
+ * The escaped output depends on where the special characters and the null
+ * fall within the blocks, so each alignment and length is a separate case.
+ *
+ * @return true if all match
+ */
+static bool check_alignments(void) {
+	static char buf[MSG_LEN + 64];
+
+	for (size_t m = 0; m < N_MIXES; m++) {
+		for (int offset = 0; offset < 32; offset++) {
+			for (size_t len = 0; len < 80; len++) {
+				strncpy(buf + offset, mixes[m].msg, len);
+				buf[offset + len] = '\0';
+				if (!check(buf + offset)) return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @fn bool check_page_end(void)
+ * @brief Check a message that ends at the very end of a page, before an
+ * inaccessible one. A scanner that reads past the page would crash.
+ * @return true if it matches
+ */
+static bool check_page_end(void) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	char *pages = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pages == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	mprotect(pages + page_size, page_size, PROT_NONE);
+
+	bool success = true;
+	for (size_t len = 0; (len < 100) && success; len++) {
+		char *msg = pages + page_size - len - 1;
+		memset(msg, 'x', len);
+		msg[len] = '\0';
+		success = check(msg);
+	}
+
+	munmap(pages, 2 * page_size);
+
+	return success;
+}
+
+/**
+ * @fn bool check_file_name(void)
+ * @brief Check that the file name is escaped in the xml class element.
+ * @return true if it is
+ */
+static bool check_file_name(void) {
+	return check_record(log_fmt_xml, "a<b>&'c\".c", "msg",
+		"  <message>msg</message>\n</record>\n",
+		"  <class>a&lt;b&gt;&amp;&apos;c&quot;.c</class>\n");
+}
+
+/**
+ * @fn long long time_escape(char *(*)(char const *, char *), char const *,
+ *     int)
+ * @brief Time a reference escape.
+ * @return the nanoseconds per message
+ */
+static long long time_escape(char *(*reference)(char const *, char *),
+	char const *msg, int n_passes) {
+	static char escaped[6 * MSG_LEN + 1];
+	struct timespec start, end, elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int n = 0; n < n_passes; n++) {
+		reference(msg, escaped);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	timespec_diff(&end, &start, &elapsed);
+
+	return get_time_nanos(&elapsed) / n_passes;
+}
+
+/**
+ * @fn long long time_record(log_formatter_t, FILE *, char *, int)
+ * @brief Time formatting a whole record.
+ * @return the nanoseconds per message
+ */
+static long long time_record(log_formatter_t formatter, FILE *stream,
+	char *msg, int n_passes) {
+	struct timespec ts = {0};
+	struct timespec start, end, elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int n = 0; n < n_passes; n++) {
+		formatter(stream, n, &ts, LL_INFO, "file", "function", 1, msg);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	timespec_diff(&end, &start, &elapsed);
+
+	return get_time_nanos(&elapsed) / n_passes;
+}
+
+/**
+ * @fn void time_mixes(int)
+ * @brief Time the reference escapes and the whole json and xml records for
+ * each mix.
+ * @param n_passes the number of times to format each message
+ */
+static void time_mixes(int n_passes) {
+	FILE *null = fopen("/dev/null", "w");
+
+	printf("%-14s %6s %10s %10s %10s %10s\n", "message", "length",
+		"json ref", "json", "xml ref", "xml");
+	for (size_t m = 0; m < N_MIXES; m++) {
+		char *msg = mixes[m].msg;
+
+		printf("%-14s %6zu %10lld %10lld %10lld %10lld\n",
+			mixes[m].name, strlen(msg),
+			time_escape(reference_json, msg, n_passes),
+			time_record(log_fmt_json_records, null, msg, n_passes),
+			time_escape(reference_xml, msg, n_passes),
+			time_record(log_fmt_xml, null, msg, n_passes));
+	}
+	printf("(nanoseconds per message)\n");
+
+	fclose(null);
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ *
+ * @brief Check and time the escaping of json and xml messages.
+ *
+ * The json and xml formatters escape messages with block scanners (SSE2 or
+ * AVX2 on x86). The escaped messages are checked against byte at a time
+ * references for a set of message mixes, at every alignment, and at the end
+ * of a page. The xml file name must be escaped too.
+ *
+ * Then the time to escape each mix with the references is printed, along
+ * with the time to format a whole json or xml record with the same message.
+ * The records include the timestamp and the other fields.
+ *
+ * Use -q for quick mode (1/10 the passes).
+ *
+ * @return 0 on success
+ */
+int main(int argc, char *argv[]) {
+	int n_passes = N_PASSES;
+
+	for (int n = 1; n < argc; n++) {
+		if (strcmp(argv[n], "-q") == 0) {
+			n_passes /= 10;
+		} else {
+			fprintf(stderr, "usage: %s [-q]\n", argv[0]);
+			fprintf(stderr, "  -q selects quick mode (1/10 the passes)\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// a long line of text with nothing to escape
+	char *p = mixes[LONG_CLEAN].msg;
+	while (p + 64 < mixes[LONG_CLEAN].msg + 1024) {
+		p = stpcpy(p, "the quick brown fox jumps over the lazy dog, ");
+	}
+
+	// a long line with an escape every few characters
+	p = mixes[LONG_ESCAPES].msg;
+	while (p + 64 < mixes[LONG_ESCAPES].msg + 1024) {
+		p = stpcpy(p, "key=\"value\" path=\\tmp\\x <a & b> ");
+	}
+
+	bool success = check_alignments() && check_page_end() &&
+		check_file_name();
+	printf("Verify %s\n", success ? "succeeded" : "failed");
+	if (!success) return EXIT_FAILURE;
+
+	time_mixes(n_passes);
+
+	return EXIT_SUCCESS;
+}
@@ -3,6 +3,7 @@
 
 #include <time.h>
 #include <locale.h>
+#include <string.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -101,6 +102,48 @@ int log_fmt_custom_2(FILE *stream, int sequence, struct timespec *ts, int level,
 		file, function, line, msg);
 }
 
+/**
+ * @fn int log_bfmt_custom_3(struct log_buf *, struct log_record const *)
+ *
+ * @brief A CUSTOM buffer formatter.
+ *
+ * Appends "level [thread name] message" to the buffer. The record carries
+ * the thread id and name, and the length of the message.
+ *
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_custom_3(struct log_buf *buf, struct log_record const *r) {
+	char const *label = log_labels[r->level].english;
+	size_t len = strlen(label) + strlen(r->thread_name) + r->msg_len + 5;
+
+	char *p = log_buf_reserve(buf, len);
+	if (p == NULL) return -1;
+
+	p = stpcpy(p, label);
+	p = stpcpy(p, " [");
+	p = stpcpy(p, r->thread_name);
+	p = stpcpy(p, "] ");
+	memcpy(p, r->msg, r->msg_len);
+	p[r->msg_len] = '\n';
+
+	buf->len += len;
+	return len;
+}
+
+/**
+ * @fn int log_fmt_custom_3(FILE *, int, struct timespec *, int,
+ * const char *, const char *, int, char *)
+ *
+ * @brief The stream version of log_bfmt_custom_3(), to open a channel with.
+ */
+int log_fmt_custom_3(FILE *stream, int sequence, struct timespec *ts,
+	int level, const char *file, const char *function, int line, char *msg) {
+	return log_fmt_buffered(log_bfmt_custom_3, stream, sequence, ts, level,
+		file, function, line, msg);
+}
+
 /**
  * @fn int main(void)
  *
@@ -157,6 +200,9 @@ int main(void) {
 	log_change_params(ch, LL_INFO, log_fmt_custom_2);
 	log_info("this message uses a another CUSTOM format");
 
+	log_change_params(ch, LL_INFO, log_fmt_custom_3);
+	log_info("this message uses a CUSTOM buffer format");
+
 	// NOTE: the xml and json messages will be emitted as individual messages,
 	// not enclosed in the Log prologue and epilogue.
 	// Use of log_change_params() with those formats is not recommended.
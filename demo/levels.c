@@ -35,6 +35,14 @@ static void log_messages() {
 	log_finest("finest %d",		log_get_level("finest"));
 }
 
+/**
+ * @fn int count_call(int *count)
+ * @brief count the times a log message argument is evaluated
+ */
+static int count_call(int *count) {
+	return ++*count;
+}
+
 /*
  * Test that get_log_level() properly looks up the level labels.
  * The lookup is case insensitive.
@@ -127,6 +135,19 @@ int main(int argc, char *argv[]) {
 	log_messages();
 	log_emerg("==== end level of LL_FINE");
 
+	/*
+	 * The arguments of a message that no channel accepts are not evaluated.
+	 */
+	int n_evaluated = 0;
+	log_finest("not evaluated %d", count_call(&n_evaluated));
+	log_fine("evaluated %d", count_call(&n_evaluated));
+	printf("==== log_enabled(LL_FINE) = %d, log_enabled(LL_FINEST) = %d\n",
+		log_enabled(LL_FINE), log_enabled(LL_FINEST));
+	if (n_evaluated != 1) {
+		printf("disabled message arguments were evaluated\n");
+		exit(EXIT_FAILURE);
+	}
+
 	log_done();
 
 	if (!json_examples) exit(EXIT_SUCCESS);
@@ -1,7 +1,85 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "tinylogger.h"
 
+#define LARGE_SIZE (1024 * 1024)	/**< size of the large region to dump */
+
+static char *large_file = "log_mem-large.log";
+
+/**
+ * @fn bool check_large(bool)
+ * @brief Dump a large region to a file, and check that every line is there.
+ *
+ * The region is logged in parts. Each part repeats the user message, tagged
+ * with its part number. The offsets must run on from part to part, and the
+ * first byte of each line must match its offset.
+ *
+ * @param async dump it in asynchronous mode
+ * @return true if every line is there, in order
+ */
+static bool check_large(bool async) {
+	char line[256];
+	size_t expected = 0;
+	int n_parts = 0;
+	bool success = true;
+
+	unsigned char *region = malloc(LARGE_SIZE);
+	if (region == NULL) {
+		fprintf(stderr, "can't allocate the region\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t n = 0; n < LARGE_SIZE; n++) {
+		region[n] = n;
+	}
+
+	unlink(large_file);
+	LOG_CHANNEL *ch = log_open_channel_f(large_file, LL_INFO, log_fmt_debug,
+		false);
+	if (ch == NULL) {
+		fprintf(stderr, "can't open %s\n", large_file);
+		exit(EXIT_FAILURE);
+	}
+	if (async) log_start_async(0);
+	log_memory(LL_INFO, region, LARGE_SIZE, "large region");
+	if (async) log_stop_async();
+	log_close_channel(ch);
+	free(region);
+
+	FILE *fp = fopen(large_file, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", large_file);
+		exit(EXIT_FAILURE);
+	}
+	while (success && (fgets(line, sizeof(line), fp) != NULL)) {
+		if (strncmp(line, "  ", 2) != 0) {
+			if (strstr(line, "large region [part ") != NULL) n_parts++;
+			continue;
+		}
+
+		char *end;
+		size_t offset = strtoul(line, &end, 16);
+		unsigned first = strtoul(end, NULL, 16);
+		if ((offset != expected) || (first != (expected & 0xff))) {
+			printf("expected offset %zx, got: %s", expected, line);
+			success = false;
+		}
+		expected += 16;
+	}
+	fclose(fp);
+
+	if (success && (expected != LARGE_SIZE)) {
+		printf("%zu of %d bytes dumped\n", expected, LARGE_SIZE);
+		success = false;
+	}
+	printf("%s: %d parts\n", async ? "async" : "sync", n_parts);
+
+	return success;
+}
+
 /**
  * @fn int main(void)
  *
@@ -37,6 +115,11 @@
   00f0  f0 f1 f2 f3 f4 f5 f6 f7 f8 f9 fa fb fc fd fe ff  ................
   0100  00 01 02 03 04 05 06 07                          ........
 ```
+ *
+ * A NULL format must be refused with -1.
+ *
+ * Then a 1 MB region is dumped to a file, in synchronous and asynchronous
+ * modes. It is logged in parts, and every line must be there.
  *
  * @return 0 on success
  */
@@ -59,6 +142,24 @@ int main(void) {
 	ch = log_open_channel_s(stderr, LL_INFO, log_fmt_json);
 	/* print a short piece of the buffer */
 	log_memory(LL_INFO, buf + 0x20, 24, "hello, %s", "world");
+
+	/* a NULL format is refused, as log_msg() refuses it */
+	char const *no_format = NULL;
+	bool success = (log_memory(LL_INFO, buf, 16, no_format, 0) == -1);
+	if (!success) printf("log_memory() took a NULL format\n");
+
+	/* the level is evaluated once */
+	int levels[] = { LL_INFO, LL_DEBUG };
+	int n_levels = 0;
+	log_memory(levels[n_levels++], buf, 16, "level %d", n_levels);
+	if (n_levels != 1) {
+		printf("log_memory() evaluated its level %d times\n", n_levels);
+		success = false;
+	}
 	log_close_channel(ch);
 
+	if (success) success = check_large(false) && check_large(true);
+	printf("Verify %s\n", success ? "succeeded" : "failed");
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,449 @@
+/** _GNU_SOURCE for pthread_barrier_t */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <tinylogger.h>
+#include "demo-utils.h"
+
+#define N_THREADS 4			/**< threads logging to the rotated channel */
+#define N_MSGS 20000		/**< messages per thread */
+#define MAX_BYTES (256 * 1024)	/**< rotate the file at this size */
+#define TICK_MS 50			/**< time between messages of the interval test */
+#define INTERVAL_SECONDS 1	/**< rotate on each second */
+#define COMPRESS_THREADS 2	/**< the most files compressed at a time */
+#define COMPRESS_WAIT_MS 10000	/**< the longest to wait for them */
+
+#define ROTATE_FILE "rotation-test.log"
+
+/** a function that opens a file channel */
+typedef LOG_CHANNEL *(*open_channel_t)(char *, LOG_LEVEL, log_formatter_t,
+	bool);
+
+/**
+ * @fn LOG_CHANNEL *open_channel_mmap(char *, LOG_LEVEL, log_formatter_t, bool)
+ * @brief log_open_channel_mmap(), which has no line buffering, as an
+ * open_channel_t.
+ */
+static LOG_CHANNEL *open_channel_mmap(char *pathname, LOG_LEVEL level,
+	log_formatter_t formatter, bool line_buffered) {
+	(void) line_buffered;
+	return log_open_channel_mmap(pathname, level, formatter);
+}
+
+/** the ways to write a file channel */
+static struct {
+	char *label;
+	open_channel_t open_channel;
+} sinks[] = {
+	{"stdio", log_open_channel_f},
+	{"fd", log_open_channel_fd},
+	{"uring", log_open_channel_uring},
+	{"mmap", open_channel_mmap},
+};
+#define N_SINKS (sizeof(sinks) / sizeof(sinks[0]))
+
+/** the messages found in the files, by thread and number */
+static int seen[N_THREADS][N_MSGS];
+
+static pthread_barrier_t start_barrier;
+
+/**
+ * @struct log_thread_args
+ * @brief What a logging thread is to do, and what it found.
+ */
+struct log_thread_args {
+	int			thread;		/**< the thread number */
+	int			n_msgs;		/**< the number of messages to log */
+	long long	max_ns;		/**< the longest log_info() call */
+};
+
+/**
+ * @fn bool is_rotated(char const *)
+ * @brief Check that a file is ROTATE_FILE, or one it was rotated to.
+ * @param name the name of the file
+ * @return true if it is
+ */
+static bool is_rotated(char const *name) {
+	size_t len = strlen(ROTATE_FILE);
+
+	return (strncmp(name, ROTATE_FILE, len) == 0) &&
+		((name[len] == '\0') || (name[len] == '.'));
+}
+
+/**
+ * @fn int remove_files(void)
+ * @brief Remove ROTATE_FILE and the files it was rotated to.
+ * @return the number of files removed
+ */
+static int remove_files(void) {
+	struct dirent *entry;
+	int n_files = 0;
+
+	DIR *dir = opendir(".");
+	if (dir == NULL) {
+		perror("opendir");
+		exit(EXIT_FAILURE);
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (is_rotated(entry->d_name) && (unlink(entry->d_name) == 0)) {
+			n_files++;
+		}
+	}
+	closedir(dir);
+
+	return n_files;
+}
+
+/**
+ * @fn void count_messages(char const *)
+ * @brief Count the messages in a file in seen[][]. A compressed file is read
+ * through gzip.
+ * @param name the name of the file
+ */
+static void count_messages(char const *name) {
+	char line[BUFSIZ];
+	size_t len = strlen(name);
+	bool compressed = (len > 3) && (strcmp(name + len - 3, ".gz") == 0);
+	FILE *fp;
+
+	if (compressed) {
+		snprintf(line, sizeof(line), "gzip -dc '%s'", name);
+		fp = popen(line, "r");
+	} else {
+		fp = fopen(name, "r");
+	}
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		int thread, msg;
+		char *text = strstr(line, "thread ");
+
+		if ((text != NULL) &&
+			(sscanf(text, "thread %d msg %d", &thread, &msg) == 2) &&
+			(thread >= 0) && (thread < N_THREADS) &&
+			(msg >= 0) && (msg < N_MSGS)) {
+			seen[thread][msg]++;
+		} else {
+			printf("%s: unexpected line: %.80s\n", name, line);
+		}
+	}
+	if (compressed) {
+		if (pclose(fp) != 0) printf("%s: gzip failed\n", name);
+	} else {
+		fclose(fp);
+	}
+}
+
+/**
+ * @fn bool check_files(int, int, int *)
+ * @brief Check that every message is in ROTATE_FILE, or a file it was
+ * rotated to, once.
+ * @param n_threads the number of threads
+ * @param n_msgs the number of messages of each thread
+ * @param n_files set to the number of files
+ * @return true if they are
+ */
+static bool check_files(int n_threads, int n_msgs, int *n_files) {
+	struct dirent *entry;
+
+	memset(seen, 0, sizeof(seen));
+	*n_files = 0;
+
+	DIR *dir = opendir(".");
+	if (dir == NULL) {
+		perror("opendir");
+		exit(EXIT_FAILURE);
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (is_rotated(entry->d_name)) {
+			count_messages(entry->d_name);
+			(*n_files)++;
+		}
+	}
+	closedir(dir);
+
+	for (int t = 0; t < n_threads; t++) {
+		for (int n = 0; n < n_msgs; n++) {
+			if (seen[t][n] != 1) {
+				printf("thread %d msg %d found %d times\n", t, n, seen[t][n]);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @fn void *log_thread(void *)
+ * @brief Log numbered messages, once all the threads are ready, and time
+ * the longest log_info() call.
+ * @param arg the log_thread_args
+ */
+static void *log_thread(void *arg) {
+	struct log_thread_args *args = arg;
+	struct timespec start, end, elapsed;
+
+	pthread_barrier_wait(&start_barrier);
+	for (int n = 0; n < args->n_msgs; n++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		log_info("thread %d msg %d of the rotation test", args->thread, n);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		timespec_diff(&end, &start, &elapsed);
+		long long ns = get_time_nanos(&elapsed);
+		if (ns > args->max_ns) args->max_ns = ns;
+	}
+
+	return NULL;
+}
+
+/**
+ * @fn bool test_size(open_channel_t, char *, int)
+ * @brief Log from N_THREADS threads to a channel rotated every MAX_BYTES.
+ * @param open_channel the function to open the channel with
+ * @param label the name of the way it is written
+ * @param n_msgs the number of messages of each thread
+ * @return true if every message is in one of the files
+ */
+static bool test_size(open_channel_t open_channel, char *label, int n_msgs) {
+	pthread_t threads[N_THREADS];
+	struct log_thread_args args[N_THREADS];
+	struct log_rotation rotation = {.max_bytes = MAX_BYTES};
+	struct log_stats before, after;
+	long long max_ns = 0;
+	int n_files;
+
+	remove_files();
+	LOG_CHANNEL *ch = open_channel(ROTATE_FILE, LL_INFO, log_fmt_standard,
+		false);
+	if ((ch == NULL) || (log_set_rotation(ch, &rotation) != 0)) {
+		fprintf(stderr, "can't open %s\n", ROTATE_FILE);
+		exit(EXIT_FAILURE);
+	}
+
+	log_get_stats(&before);
+	pthread_barrier_init(&start_barrier, NULL, N_THREADS);
+	for (int n = 0; n < N_THREADS; n++) {
+		args[n] = (struct log_thread_args) {n, n_msgs, 0};
+		pthread_create(&threads[n], NULL, log_thread, &args[n]);
+	}
+	for (int n = 0; n < N_THREADS; n++) {
+		pthread_join(threads[n], NULL);
+		if (args[n].max_ns > max_ns) max_ns = args[n].max_ns;
+	}
+	pthread_barrier_destroy(&start_barrier);
+	log_close_channel(ch);
+	log_get_stats(&after);
+
+	bool success = check_files(N_THREADS, n_msgs, &n_files);
+	printf("%s: %d threads, %d messages each, %lu rotations, %d files, "
+		"longest log_info() %lld us\n", label, N_THREADS, n_msgs,
+		after.rotations - before.rotations, n_files, max_ns / 1000);
+
+	if (success && (after.rotations == before.rotations)) {
+		printf("%s: the file was never rotated\n", label);
+		success = false;
+	}
+
+	remove_files();
+	return success;
+}
+
+/**
+ * @fn bool wait_compressed(void)
+ * @brief Wait for the rotated files to be compressed.
+ * @return false if they weren't within COMPRESS_WAIT_MS
+ */
+static bool wait_compressed(void) {
+	struct log_stats stats;
+
+	for (int ms = 0; ms < COMPRESS_WAIT_MS; ms += TICK_MS) {
+		log_get_stats(&stats);
+		if (stats.compress_pending == 0) return true;
+		usleep(TICK_MS * 1000);
+	}
+
+	return false;
+}
+
+/**
+ * @fn bool test_compress(int)
+ * @brief Log from N_THREADS threads to a channel rotated every MAX_BYTES,
+ * with the rotated files compressed in the background.
+ *
+ * Skipped if the library was built without zlib.
+ *
+ * @param n_msgs the number of messages of each thread
+ * @return true if every message is in the file or one of the .gz files, and
+ * no rotated file was left uncompressed
+ */
+static bool test_compress(int n_msgs) {
+	pthread_t threads[N_THREADS];
+	struct log_thread_args args[N_THREADS];
+	struct log_rotation rotation = {.max_bytes = MAX_BYTES, .compress = true};
+	struct log_stats before, after;
+	long long max_ns = 0;
+	int n_files;
+
+	if (log_set_compression(COMPRESS_THREADS, 1) != 0) {
+		printf("compress: built without zlib, skipped\n");
+		return true;
+	}
+
+	remove_files();
+	LOG_CHANNEL *ch = log_open_channel_fd(ROTATE_FILE, LL_INFO,
+		log_fmt_standard, false);
+	if ((ch == NULL) || (log_set_rotation(ch, &rotation) != 0)) {
+		fprintf(stderr, "can't open %s\n", ROTATE_FILE);
+		exit(EXIT_FAILURE);
+	}
+
+	log_get_stats(&before);
+	pthread_barrier_init(&start_barrier, NULL, N_THREADS);
+	for (int n = 0; n < N_THREADS; n++) {
+		args[n] = (struct log_thread_args) {n, n_msgs, 0};
+		pthread_create(&threads[n], NULL, log_thread, &args[n]);
+	}
+	for (int n = 0; n < N_THREADS; n++) {
+		pthread_join(threads[n], NULL);
+		if (args[n].max_ns > max_ns) max_ns = args[n].max_ns;
+	}
+	pthread_barrier_destroy(&start_barrier);
+	log_close_channel(ch);
+
+	bool success = wait_compressed();
+	log_get_stats(&after);
+	if (!success) printf("compress: the files weren't compressed\n");
+
+	unsigned long files = after.compress_files - before.compress_files;
+	unsigned long bytes_in = after.compress_bytes_in - before.compress_bytes_in;
+	unsigned long bytes_out =
+		after.compress_bytes_out - before.compress_bytes_out;
+	unsigned long nsecs = after.compress_nsecs - before.compress_nsecs;
+
+	if (success) success = check_files(N_THREADS, n_msgs, &n_files);
+	printf("compress: %lu rotations, %lu files compressed, %lu to %lu bytes, "
+		"%.1f MB/s, lag %lu ms (longest %lu ms), longest log_info() %lld us\n",
+		after.rotations - before.rotations, files, bytes_in, bytes_out,
+		(nsecs > 0) ? bytes_in * 1000.0 / nsecs : 0.0,
+		after.compress_lag_nsecs / 1000000,
+		after.compress_max_lag_nsecs / 1000000, max_ns / 1000);
+
+	// all but the open file
+	if (success && (files + 1 != (unsigned long) n_files)) {
+		printf("compress: %d files, expected %lu\n", n_files, files + 1);
+		success = false;
+	}
+	if (success && (files != after.rotations - before.rotations)) {
+		printf("compress: not every rotated file was compressed\n");
+		success = false;
+	}
+
+	remove_files();
+	return success;
+}
+
+/**
+ * @fn bool test_interval(int)
+ * @brief Log a message every TICK_MS to a channel rotated every
+ * INTERVAL_SECONDS, for a number of seconds.
+ * @param seconds how long to log for
+ * @return true if every message is in one of the files, and the file was
+ * rotated
+ */
+static bool test_interval(int seconds) {
+	struct log_rotation rotation = {.interval = INTERVAL_SECONDS};
+	struct log_stats before, after;
+	int n_msgs = seconds * 1000 / TICK_MS;
+	int n_files;
+
+	remove_files();
+	LOG_CHANNEL *ch = log_open_channel_f(ROTATE_FILE, LL_INFO,
+		log_fmt_standard, false);
+	if ((ch == NULL) || (log_set_rotation(ch, &rotation) != 0)) {
+		fprintf(stderr, "can't open %s\n", ROTATE_FILE);
+		exit(EXIT_FAILURE);
+	}
+
+	log_get_stats(&before);
+	for (int n = 0; n < n_msgs; n++) {
+		log_info("thread 0 msg %d of the interval test", n);
+		usleep(TICK_MS * 1000);
+	}
+	log_close_channel(ch);
+	log_get_stats(&after);
+
+	bool success = check_files(1, n_msgs, &n_files);
+	printf("every %d second: %d seconds, %lu rotations, %d files\n",
+		INTERVAL_SECONDS, seconds, after.rotations - before.rotations,
+		n_files);
+
+	if (success && (after.rotations < (unsigned long) seconds - 1)) {
+		printf("expected at least %d rotations\n", seconds - 1);
+		success = false;
+	}
+
+	remove_files();
+	return success;
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ *
+ * @brief Check file channels rotated by the library, with
+ * log_set_rotation().
+ *
+ * N_THREADS threads log to a channel rotated every MAX_BYTES, written each
+ * way (stdio, raw file descriptor, io_uring and mapped). Every message must
+ * be in the file, or one of the files it was rotated to, once. The longest
+ * log_info() call is printed - the threads don't wait for the files to be
+ * renamed and opened.
+ *
+ * Then the same is done with the rotated files compressed, if the library
+ * was built with zlib. The throughput and lag of the compression are printed.
+ *
+ * Then a channel rotated on each second is logged to for a few seconds.
+ *
+ * Use -q for quick mode (1/10 the messages).
+ *
+ * @return 0 on success
+ */
+int main(int argc, char *argv[]) {
+	int n_msgs = N_MSGS;
+	int seconds = 4;
+
+	for (int n = 1; n < argc; n++) {
+		if (strcmp(argv[n], "-q") == 0) {
+			n_msgs /= 10;
+			seconds = 2;
+		} else {
+			fprintf(stderr, "usage: %s [-q]\n", argv[0]);
+			fprintf(stderr, "  -q selects quick mode (1/10 the messages)\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bool success = true;
+	for (size_t s = 0; success && (s < N_SINKS); s++) {
+		success = test_size(sinks[s].open_channel, sinks[s].label, n_msgs);
+	}
+	if (success) success = test_compress(n_msgs);
+	if (success) success = test_interval(seconds);
+	printf("Verify %s\n", success ? "succeeded" : "failed");
+
+	log_done();
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,239 @@
+/** _GNU_SOURCE for pthread_barrier_t */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <tinylogger.h>
+#include "demo-utils.h"
+
+#define MAX_THREADS 64		/**< the most threads to run */
+#define N_MSGS 400000		/**< messages per run, shared by the threads */
+#define OUTPUT_FILE "scaling.log"
+
+/**
+ * The formatters to time. log_fmt_debug_tall is one of the longer text
+ * formats, and json has the most formatting.
+ */
+static struct {
+	char *label;
+	log_formatter_t formatter;
+} formats[] = {
+	{"debug_tall", log_fmt_debug_tall},
+	{"json", log_fmt_json_records},
+};
+#define N_FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+/** taken around each message to serialize the whole call, as it used to be */
+static pthread_mutex_t serialize_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_barrier_t start_barrier;
+
+/**
+ * @struct run
+ * @brief The parameters of a logging thread.
+ */
+struct run {
+	int		thread;		/**< the thread number */
+	int		n_msgs;		/**< the number of messages to log */
+	bool	serialize;	/**< hold serialize_lock around each message */
+};
+
+/**
+ * @fn void *log_thread(void *)
+ * @brief Log numbered messages, once all the threads are ready.
+ * @param arg the struct run
+ */
+static void *log_thread(void *arg) {
+	struct run const *run = arg;
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (int n = 0; n < run->n_msgs; n++) {
+		if (run->serialize) pthread_mutex_lock(&serialize_lock);
+		log_info("thread %d msg %d of the scaling test", run->thread, n);
+		if (run->serialize) pthread_mutex_unlock(&serialize_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * @fn long count_lines(char *)
+ * @brief Count the lines of a file.
+ * @param filename the file
+ * @return the number of lines
+ */
+static long count_lines(char *filename) {
+	char line[BUFSIZ];
+	long n_lines = 0;
+
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strchr(line, '\n') != NULL) n_lines++;
+	}
+	fclose(fp);
+
+	return n_lines;
+}
+
+/**
+ * @fn bool check_sequence(char *, long)
+ * @brief Check that the json records of a file are numbered 1, 2, 3... in
+ * the order they were written.
+ * @param filename the file
+ * @param expected the number of records
+ * @return true if they are
+ */
+static bool check_sequence(char *filename, long expected) {
+	char line[BUFSIZ];
+	long next = 1;
+
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		long sequence;
+		char *field = strstr(line, "\"sequence\" : ");
+
+		if ((field == NULL) ||
+			(sscanf(field, "\"sequence\" : %ld", &sequence) != 1)) continue;
+		if (sequence != next) {
+			printf("%s: sequence %ld where %ld was expected\n", filename,
+				sequence, next);
+			fclose(fp);
+			return false;
+		}
+		next++;
+	}
+	fclose(fp);
+
+	if (next - 1 != expected) {
+		printf("%s: %ld records, expected %ld\n", filename, next - 1, expected);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @fn long long time_run(log_formatter_t, int, int, bool, bool *)
+ * @brief Log n_msgs messages from n_threads threads to a file channel.
+ * @param formatter the formatter of the channel
+ * @param n_threads the number of threads
+ * @param n_msgs the number of messages, shared by the threads
+ * @param serialize true to serialize each whole call
+ * @param success set false if the file doesn't hold every message
+ * @return the nanoseconds per message
+ */
+static long long time_run(log_formatter_t formatter, int n_threads,
+	int n_msgs, bool serialize, bool *success) {
+	pthread_t threads[MAX_THREADS];
+	struct run runs[MAX_THREADS];
+	struct timespec start, end, elapsed;
+
+	unlink(OUTPUT_FILE);
+	LOG_CHANNEL *ch = log_open_channel_f(OUTPUT_FILE, LL_INFO, formatter,
+		false);
+	if (ch == NULL) {
+		fprintf(stderr, "can't open %s\n", OUTPUT_FILE);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, n_threads + 1);
+	for (int n = 0; n < n_threads; n++) {
+		runs[n].thread = n;
+		runs[n].n_msgs = n_msgs / n_threads;
+		runs[n].serialize = serialize;
+		pthread_create(&threads[n], NULL, log_thread, &runs[n]);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int n = 0; n < n_threads; n++) {
+		pthread_join(threads[n], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&start_barrier);
+
+	log_close_channel(ch);
+
+	// the text formats are a line per message
+	long expected = (long) (n_msgs / n_threads) * n_threads;
+	if ((formatter != log_fmt_json_records) &&
+		(count_lines(OUTPUT_FILE) != expected)) {
+		printf("%s: expected %ld lines\n", OUTPUT_FILE, expected);
+		*success = false;
+	}
+	// json records are numbered in the order they are written
+	if ((formatter == log_fmt_json_records) &&
+		!check_sequence(OUTPUT_FILE, expected)) {
+		*success = false;
+	}
+	unlink(OUTPUT_FILE);
+
+	timespec_diff(&end, &start, &elapsed);
+	return get_time_nanos(&elapsed) / expected;
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ *
+ * @brief Time logging to one file channel from 1 to MAX_THREADS threads.
+ *
+ * The user message and the timestamp are done before the channel is locked.
+ * If the channel is busy, the record is formatted before waiting for it too,
+ * so only the sequence number and the write to the stream are serialized. The
+ * json records must be in sequence order.
+ *
+ * For comparison, each run is repeated with the whole log_info() call
+ * serialized by a mutex, as all of it used to be.
+ *
+ * Use -q for quick mode (1/10 the messages).
+ *
+ * @return 0 on success
+ */
+int main(int argc, char *argv[]) {
+	int n_msgs = N_MSGS;
+
+	for (int n = 1; n < argc; n++) {
+		if (strcmp(argv[n], "-q") == 0) {
+			n_msgs /= 10;
+		} else {
+			fprintf(stderr, "usage: %s [-q]\n", argv[0]);
+			fprintf(stderr, "  -q selects quick mode (1/10 the messages)\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bool success = true;
+	for (size_t f = 0; f < N_FORMATS; f++) {
+		printf("%s, %d messages (nanoseconds per message)\n",
+			formats[f].label, n_msgs);
+		printf("%8s %12s %12s\n", "threads", "concurrent", "serialized");
+		for (int n_threads = 1; n_threads <= MAX_THREADS; n_threads *= 2) {
+			long long concurrent = time_run(formats[f].formatter, n_threads,
+				n_msgs, false, &success);
+			long long serialized = time_run(formats[f].formatter, n_threads,
+				n_msgs, true, &success);
+			printf("%8d %12lld %12lld\n", n_threads, concurrent, serialized);
+		}
+	}
+
+	log_done();
+
+	printf("Verify %s\n", success ? "succeeded" : "failed");
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
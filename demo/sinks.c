@@ -0,0 +1,546 @@
+/** _GNU_SOURCE for pthread_barrier_t */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include <tinylogger.h>
+#include "demo-utils.h"
+
+#define N_PROCS 4			/**< processes appending to the same file */
+#define N_PROC_MSGS 20000	/**< messages per process */
+#define MAX_PAD 3000		/**< the longest padding of a message */
+#define N_THREADS 4			/**< threads for the timing */
+#define N_MSGS 400000		/**< messages per timing run */
+
+#define SHARED_FILE "sinks-shared.log"
+#define TIMING_FILE "sinks-timing.log"
+#define REOPEN_FILE "sinks-reopen.log"
+#define REOPEN_SAVE "sinks-reopen.save"
+#define CUSTOM_FILE "sinks-custom.log"
+
+static char pad[MAX_PAD + 1];	/**< MAX_PAD x's */
+
+/** a function that opens a file channel */
+typedef LOG_CHANNEL *(*open_channel_t)(char *, LOG_LEVEL, log_formatter_t,
+	bool);
+
+/**
+ * @fn LOG_CHANNEL *open_channel_mmap(char *, LOG_LEVEL, log_formatter_t, bool)
+ * @brief log_open_channel_mmap(), which has no line buffering, as an
+ * open_channel_t.
+ */
+static LOG_CHANNEL *open_channel_mmap(char *pathname, LOG_LEVEL level,
+	log_formatter_t formatter, bool line_buffered) {
+	(void) line_buffered;
+	return log_open_channel_mmap(pathname, level, formatter);
+}
+
+/**
+ * The ways to write a file channel. stdio may split a record between two
+ * writes, and a mapped file has only one writer, so only fd and uring are
+ * checked with several processes.
+ */
+static struct {
+	char *label;
+	open_channel_t open_channel;
+	int n_procs;		/**< processes to append to a file at once, or 0 */
+} sinks[] = {
+	{"stdio", log_open_channel_f, 0},
+	{"fd", log_open_channel_fd, N_PROCS},
+	{"uring", log_open_channel_uring, N_PROCS},
+	{"mmap", open_channel_mmap, 1},
+};
+#define N_SINKS (sizeof(sinks) / sizeof(sinks[0]))
+
+/**
+ * The directories to time the channels in. /dev/shm is usually a tmpfs, and
+ * the current directory a real disk.
+ */
+static char *timing_dirs[] = {"/dev/shm", "."};
+#define N_TIMING_DIRS (sizeof(timing_dirs) / sizeof(timing_dirs[0]))
+
+/**
+ * @fn int pad_len(int, int)
+ * @brief The padding of a message, from 0 to MAX_PAD characters. Every so
+ * often, a message is longer than the rest of the batch.
+ * @param proc the process number
+ * @param msg the message number
+ * @return the number of x's
+ */
+static int pad_len(int proc, int msg) {
+	return (msg * 7 + proc * 13) % 100 * (MAX_PAD / 100) + (msg % 3);
+}
+
+/**
+ * @fn void append_proc(open_channel_t, int, int)
+ * @brief Log numbered messages of different lengths to SHARED_FILE. Every
+ * other process leaves the last batch to be written at exit.
+ * @param open_channel the function to open the channel with
+ * @param proc the process number
+ * @param n_msgs the number of messages
+ */
+static void append_proc(open_channel_t open_channel, int proc, int n_msgs) {
+	LOG_CHANNEL *ch = open_channel(SHARED_FILE, LL_INFO, log_fmt_debug_tall,
+		false);
+	if (ch == NULL) {
+		fprintf(stderr, "can't open %s\n", SHARED_FILE);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int n = 0; n < n_msgs; n++) {
+		int len = pad_len(proc, n);
+		log_info("proc %d msg %d pad %d %.*s.", proc, n, len, len, pad);
+	}
+
+	if (proc % 2) log_done();
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * @fn bool check_shared(int, int)
+ * @brief Check that every line of SHARED_FILE is whole, and that each
+ * process's messages are all there, in order.
+ * @param n_procs the number of processes
+ * @param n_msgs the number of messages of each process
+ * @return true if they are
+ */
+static bool check_shared(int n_procs, int n_msgs) {
+	static char line[2 * MAX_PAD];
+	int next[N_PROCS] = {0};
+	bool success = true;
+
+	FILE *fp = fopen(SHARED_FILE, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", SHARED_FILE);
+		exit(EXIT_FAILURE);
+	}
+
+	while (success && (fgets(line, sizeof(line), fp) != NULL)) {
+		int proc, msg, len, offset;
+		char *text = strstr(line, "proc ");
+
+		success = (text != NULL) &&
+			(sscanf(text, "proc %d msg %d pad %d %n", &proc, &msg, &len,
+				&offset) == 3) &&
+			(proc >= 0) && (proc < n_procs) && (msg == next[proc]) &&
+			(len == pad_len(proc, msg)) &&
+			(strspn(text + offset, "x") == (size_t) len) &&
+			(strcmp(text + offset + len, ".\n") == 0);
+		if (success) {
+			next[proc]++;
+		} else {
+			printf("%s: unexpected line: %.80s...\n", SHARED_FILE, line);
+		}
+	}
+	fclose(fp);
+
+	for (int n = 0; success && (n < n_procs); n++) {
+		if (next[n] != n_msgs) {
+			printf("%s: %d of %d messages from process %d\n", SHARED_FILE,
+				next[n], n_msgs, n);
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+/**
+ * @fn bool test_processes(open_channel_t, int, int)
+ * @brief Append to one file from several processes at once.
+ * @param open_channel the function to open the channels with
+ * @param n_procs the number of processes, at most N_PROCS
+ * @param n_msgs the number of messages of each process
+ * @return true if the file holds them all, whole
+ */
+static bool test_processes(open_channel_t open_channel, int n_procs,
+	int n_msgs) {
+	pid_t pids[N_PROCS];
+	bool success = true;
+
+	unlink(SHARED_FILE);
+	fflush(stdout);		// or the children would print it again
+	for (int n = 0; n < n_procs; n++) {
+		pids[n] = fork();
+		if (pids[n] < 0) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+		if (pids[n] == 0) append_proc(open_channel, n, n_msgs);
+	}
+	for (int n = 0; n < n_procs; n++) {
+		int status;
+		waitpid(pids[n], &status, 0);
+		if (!WIFEXITED(status) || (WEXITSTATUS(status) != EXIT_SUCCESS)) {
+			success = false;
+		}
+	}
+
+	if (success) success = check_shared(n_procs, n_msgs);
+
+	unlink(SHARED_FILE);
+	return success;
+}
+
+/**
+ * @fn bool check_xml(char *, int)
+ * @brief Check that an xml log is whole.
+ * @param filename the log
+ * @param n_records the number of records it must hold
+ * @return true if it is
+ */
+static bool check_xml(char *filename, int n_records) {
+	char line[BUFSIZ];
+	int records = 0;
+	bool head = false, tail = false;
+
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strcmp(line, "<log>\n") == 0) head = true;
+		if (strcmp(line, "<record>\n") == 0) records++;
+		tail = (strcmp(line, "</log>\n") == 0);
+	}
+	fclose(fp);
+
+	if (!head || !tail || (records != n_records)) {
+		printf("%s: %d of %d records, head %d tail %d\n", filename, records,
+			n_records, head, tail);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @fn void send_rotate_signal(void)
+ * @brief Send SIGUSR1 from a child process, as logrotate would (the
+ * logrotate thread takes one from the process itself as a request to stop),
+ * and wait for the channels to be reopened.
+ *
+ * The file is created before the channel is switched to it, so the wait is
+ * for the head, written after the switch. The channel must be line buffered.
+ */
+static void send_rotate_signal(void) {
+	fflush(stdout);		// or the child would print it again
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		kill(getppid(), SIGUSR1);
+		_exit(EXIT_SUCCESS);
+	}
+	waitpid(pid, NULL, 0);
+
+	// the reopen writes the head to the new file (an mmap file is extended
+	// with zeroes before it)
+	for (int n = 0; n < 1000; n++) {
+		FILE *fp = fopen(REOPEN_FILE, "r");
+		int c = (fp != NULL) ? fgetc(fp) : EOF;
+		if (fp != NULL) fclose(fp);
+		if (c == '<') break;
+		usleep(1000);
+	}
+}
+
+/**
+ * @fn bool test_reopen(open_channel_t, bool)
+ * @brief Reopen an xml channel after renaming its file, as logrotate would.
+ * Both files must have a head, their records and a tail.
+ * @param open_channel the function to open the channel with
+ * @param signal reopen it with the logrotate signal, not log_reopen_channel()
+ * @return true if they do
+ */
+static bool test_reopen(open_channel_t open_channel, bool signal) {
+	unlink(REOPEN_FILE);
+	unlink(REOPEN_SAVE);
+
+	// line buffered for the signal, so the head shows the reopen is done
+	LOG_CHANNEL *ch = open_channel(REOPEN_FILE, LL_INFO, log_fmt_xml, signal);
+	if (ch == NULL) {
+		fprintf(stderr, "can't open %s\n", REOPEN_FILE);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int n = 0; n < 10; n++) log_info("before the reopen %d", n);
+	rename(REOPEN_FILE, REOPEN_SAVE);
+	if (signal) {
+		send_rotate_signal();
+	} else {
+		log_reopen_channel(ch);
+	}
+	for (int n = 0; n < 20; n++) log_info("after the reopen %d", n);
+	log_close_channel(ch);
+
+	bool success = check_xml(REOPEN_SAVE, 10) && check_xml(REOPEN_FILE, 20);
+
+	unlink(REOPEN_FILE);
+	unlink(REOPEN_SAVE);
+	return success;
+}
+
+static pthread_barrier_t start_barrier;
+
+/**
+ * @fn void *log_thread(void *)
+ * @brief Log numbered messages, once all the threads are ready.
+ * @param arg the number of messages
+ */
+static void *log_thread(void *arg) {
+	int n_msgs = *(int *) arg;
+
+	pthread_barrier_wait(&start_barrier);
+	for (int n = 0; n < n_msgs; n++) {
+		log_info("msg %d of the sinks test", n);
+	}
+
+	return NULL;
+}
+
+/**
+ * @fn int custom_format(FILE *, int, struct timespec *, int, char const *,
+ *     char const *, int, char *)
+ * @brief A custom formatter, with no buffer version, that writes a record in
+ * pieces: the sequence number, then the message.
+ * @return the number of characters written
+ */
+static int custom_format(FILE *stream, int sequence, struct timespec *ts,
+	int level, char const *file, char const *function, int line, char *msg) {
+	(void) ts; (void) level; (void) file; (void) function; (void) line;
+
+	int len = fprintf(stream, "%d ", sequence);
+	len += fprintf(stream, "%s", msg);
+	len += fprintf(stream, "\n");
+	return len;
+}
+
+/**
+ * @fn bool test_custom(open_channel_t, int)
+ * @brief Log from N_THREADS threads at once to a channel with a custom
+ * formatter. A record that has to be formatted again, with the sequence
+ * number it gets, must still be written whole.
+ * @param open_channel the function to open the channel with
+ * @param n_msgs the number of messages of each thread
+ * @return true if the sink counted one record per message, and the lines are
+ * in sequence order
+ */
+static bool test_custom(open_channel_t open_channel, int n_msgs) {
+	pthread_t threads[N_THREADS];
+	struct log_stats before, after;
+	char line[BUFSIZ];
+	int sequence = 0;
+	bool success = true;
+
+	unlink(CUSTOM_FILE);
+	LOG_CHANNEL *ch = open_channel(CUSTOM_FILE, LL_INFO, custom_format, false);
+	if (ch == NULL) {
+		fprintf(stderr, "can't open %s\n", CUSTOM_FILE);
+		exit(EXIT_FAILURE);
+	}
+
+	log_get_stats(&before);
+	pthread_barrier_init(&start_barrier, NULL, N_THREADS + 1);
+	for (int n = 0; n < N_THREADS; n++) {
+		pthread_create(&threads[n], NULL, log_thread, &n_msgs);
+	}
+	pthread_barrier_wait(&start_barrier);
+	for (int n = 0; n < N_THREADS; n++) {
+		pthread_join(threads[n], NULL);
+	}
+	log_close_channel(ch);
+	pthread_barrier_destroy(&start_barrier);
+	log_get_stats(&after);
+
+	unsigned long records = after.sink_records - before.sink_records;
+	if (records != (unsigned long) N_THREADS * n_msgs) {
+		printf("%s: %lu records counted for %d messages\n", CUSTOM_FILE,
+			records, N_THREADS * n_msgs);
+		success = false;
+	}
+
+	FILE *fp = fopen(CUSTOM_FILE, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s for reading\n", CUSTOM_FILE);
+		exit(EXIT_FAILURE);
+	}
+	while (success && (fgets(line, sizeof(line), fp) != NULL)) {
+		if (atoi(line) != ++sequence) {
+			printf("%s: line %d is %s", CUSTOM_FILE, sequence, line);
+			success = false;
+		}
+	}
+	fclose(fp);
+
+	unlink(CUSTOM_FILE);
+	return success;
+}
+
+/**
+ * @fn long long time_run(open_channel_t, char *, int, int)
+ * @brief Log n_msgs messages from n_threads threads to a file channel. The
+ * time includes closing the channel, which waits for every write.
+ * @param open_channel the function to open the channel with
+ * @param pathname the file
+ * @param n_threads the number of threads
+ * @param n_msgs the number of messages, shared by the threads
+ * @return the nanoseconds per message
+ */
+static long long time_run(open_channel_t open_channel, char *pathname,
+	int n_threads, int n_msgs) {
+	pthread_t threads[N_THREADS];
+	struct timespec start, end, elapsed;
+	int per_thread = n_msgs / n_threads;
+
+	unlink(pathname);
+	LOG_CHANNEL *ch = open_channel(pathname, LL_INFO, log_fmt_debug_tall,
+		false);
+	if (ch == NULL) {
+		fprintf(stderr, "can't open %s\n", pathname);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, n_threads + 1);
+	for (int n = 0; n < n_threads; n++) {
+		pthread_create(&threads[n], NULL, log_thread, &per_thread);
+	}
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int n = 0; n < n_threads; n++) {
+		pthread_join(threads[n], NULL);
+	}
+	log_close_channel(ch);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&start_barrier);
+
+	unlink(pathname);
+
+	timespec_diff(&end, &start, &elapsed);
+	return get_time_nanos(&elapsed) / (per_thread * n_threads);
+}
+
+/**
+ * @fn void time_dir(char *, int)
+ * @brief Print the time per message to a file channel written each way, in a
+ * directory.
+ * @param dir the directory
+ * @param n_msgs the number of messages of each run
+ */
+static void time_dir(char *dir, int n_msgs) {
+	char pathname[BUFSIZ];
+	struct log_stats before, after;
+
+	if (access(dir, W_OK) != 0) return;
+	snprintf(pathname, sizeof(pathname), "%s/%s", dir, TIMING_FILE);
+
+	printf("debug_tall to %s, %d messages (nanoseconds per message)\n", dir,
+		n_msgs);
+	printf("%8s", "threads");
+	for (size_t s = 0; s < N_SINKS; s++) printf(" %12s", sinks[s].label);
+	printf("\n");
+
+	log_get_stats(&before);
+	for (int n_threads = 1; n_threads <= N_THREADS; n_threads *= N_THREADS) {
+		printf("%8d", n_threads);
+		for (size_t s = 0; s < N_SINKS; s++) {
+			printf(" %12lld", time_run(sinks[s].open_channel, pathname,
+				n_threads, n_msgs));
+		}
+		printf("\n");
+	}
+	log_get_stats(&after);
+
+	unsigned long records = after.sink_records - before.sink_records;
+	unsigned long writes = (after.sink_writes - before.sink_writes) +
+		(after.uring_writes - before.uring_writes);
+	printf("fd, uring and mmap: %lu records per write, %lu waits for a uring "
+		"buffer, %lu mmap windows\n", writes ? records / writes : 0,
+		after.uring_waits - before.uring_waits,
+		after.mmap_windows - before.mmap_windows);
+	if (after.uring_writes == before.uring_writes) {
+		printf("(io_uring isn't available, uring was written with write())\n");
+	}
+}
+
+/**
+ * @fn int main(int argc, char *argv[])
+ *
+ * @brief Check and time file channels opened with log_open_channel_fd(),
+ * log_open_channel_uring() and log_open_channel_mmap().
+ *
+ * N_PROCS processes append messages of many lengths to the same file at
+ * once. Each line of the file must be whole, and each process's messages must
+ * all be there, in order. Half of the processes leave their last batch to be
+ * written at exit. A mapped file is checked the same way, with one process.
+ *
+ * An xml channel is reopened after its file is renamed, with
+ * log_reopen_channel() and with the logrotate signal. Both files must be
+ * whole xml logs. Threads log at once to a channel with a custom formatter,
+ * and each record must be written whole, in sequence order.
+ *
+ * Then the time per message to a file channel with stdio, with a raw file
+ * descriptor, with io_uring and through a mapped window is printed for 1 and
+ * N_THREADS threads, on a tmpfs (/dev/shm) and in the current directory. The number of records per
+ * write system call or io_uring write is printed too.
+ *
+ * Use -q for quick mode (1/10 the messages).
+ *
+ * @return 0 on success
+ */
+int main(int argc, char *argv[]) {
+	int n_proc_msgs = N_PROC_MSGS;
+	int n_msgs = N_MSGS;
+
+	for (int n = 1; n < argc; n++) {
+		if (strcmp(argv[n], "-q") == 0) {
+			n_proc_msgs /= 10;
+			n_msgs /= 10;
+		} else {
+			fprintf(stderr, "usage: %s [-q]\n", argv[0]);
+			fprintf(stderr, "  -q selects quick mode (1/10 the messages)\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memset(pad, 'x', MAX_PAD);
+
+	log_enable_logrotate(SIGUSR1);
+
+	bool success = true;
+	for (size_t s = 0; success && (s < N_SINKS); s++) {
+		if (sinks[s].n_procs > 0) {
+			success = test_processes(sinks[s].open_channel, sinks[s].n_procs,
+				n_proc_msgs);
+			printf("%s: %d processes, %d messages each to %s\n",
+				sinks[s].label, sinks[s].n_procs, n_proc_msgs, SHARED_FILE);
+		}
+		if (success) success = test_reopen(sinks[s].open_channel, false);
+		if (success) success = test_reopen(sinks[s].open_channel, true);
+		if (success && (sinks[s].n_procs > 0)) {
+			success = test_custom(sinks[s].open_channel, n_proc_msgs);
+		}
+	}
+	printf("Verify %s\n", success ? "succeeded" : "failed");
+	if (!success) return EXIT_FAILURE;
+
+	for (size_t d = 0; d < N_TIMING_DIRS; d++) {
+		time_dir(timing_dirs[d], n_msgs);
+	}
+
+	log_done();
+
+	return EXIT_SUCCESS;
+}
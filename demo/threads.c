@@ -46,9 +46,12 @@ static void *threadFunc(void *parm) {
 		name = "oops";
 	}
 	log_info("setting thread name to %s (%d) (%ld)", name, tid, thread);
-	rc = pthread_setname_np(thread, parm);
+
+	// the thread has already logged, and its name has been cached - use
+	// log_set_thread_name() rather than pthread_setname_np()
+	rc = log_set_thread_name(name);
 	if (rc != 0)
-		errExitEN(rc, "pthread getname");
+		errExitEN(rc, "log_set_thread_name");
 
 	usleep(1000);
 
@@ -26,6 +26,22 @@
 /* Define to 1 if you have the <systemd/sd-daemon.h> header file. */
 #define HAVE_SYSTEMD_SD_DAEMON_H 0
 
+/*
+ * Channels opened with log_open_channel_uring() are written with io_uring.
+ * Change to 0 if your kernel headers have no <linux/io_uring.h> (before 5.1),
+ * and they are written with write() instead.
+ */
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+#define HAVE_LINUX_IO_URING_H 1
+
+/*
+ * Rotated files are compressed (see log_set_compression()) with zlib.
+ * If you have <zlib.h> installed on your system, change to 1, and add -lz
+ * to LDLIBS in Makefile.examples (and to the link of your own programs).
+ */
+/* Define to 1 if you have the <zlib.h> header file. */
+#define HAVE_ZLIB_H 0
+
 /*
  * The log messages are limited to a maximum of 8k characters by default.
  * This only applies to the user message part, not the timestamp, log level,
@@ -46,6 +62,12 @@
  * costs about 10 - 20% execution time penalty for basic and systemd formats.
  * The penalty percentage decreases for more complicated message formats.
  * (For ALL messages, not just memory dumps).
+ *
+ * If MAX_MSG_SIZE is set to -1, each thread formats its messages into a buffer
+ * of its own. It starts at BUFSIZ, doubles whenever a message doesn't fit, and
+ * is reused. There is no limit, no memory is allocated once the buffer has
+ * grown to fit, and nothing is put on the stack. Asynchronous mode still
+ * limits messages to a quarter of the ring size.
  */
 //#define MAX_MSG_SIZE 0
 
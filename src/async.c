@@ -0,0 +1,880 @@
+/*
+ * (C) 2020 Edward Hetherington
+ * This code is licensed under MIT license (see LICENSE in top dir for details)
+ */
+
+/** @file       async.c
+ *  @brief      Asynchronous logging with per-thread rings and a writer thread.
+ *  @details    In asynchronous mode, log_msg() does not take the log_lock and
+ *  does not call the channel formatters. The calling thread takes the
+ *  timestamp, copies the arguments (or, failing that, the formatted user
+ *  message) straight into its own ring, and returns. A background writer thread drains the rings in timestamp order and
+ *  passes each record to the channels, exactly as the synchronous path would.
+ *
+ *  Each thread gets its own single producer / single consumer ring the first
+ *  time it logs. The thread is the only producer, and the writer thread is the
+ *  only consumer, so no locks are needed to queue a message.
+ *
+ *  When a ring is full, the calling thread waits for the writer thread to make
+ *  room. Messages are never dropped. A thread marks its ring busy while it
+ *  queues a message, and log_stop_async() waits for the busy rings before the
+ *  writer thread drains them for the last time. A thread that finds
+ *  asynchronous mode stopped logs the message directly, once the messages it
+ *  queued are written.
+ *
+ *  The thread id and thread name of the caller are captured when its ring is
+ *  created. The formatters get them through log_get_tid() and
+ *  log_get_thread_name(), so the thread formats show the thread that called
+ *  log_msg(), not the writer thread.
+ *
+ *  The thread id and name of each thread are also cached the first time they
+ *  are asked for, in synchronous mode as well, so the thread formats don't
+ *  make a system call for every message. log_set_thread_name() renames the
+ *  thread and updates the cache. The child of a fork() looks them up again,
+ *  and doesn't queue to the rings of its parent.
+ *
+ *  Rings belong to their thread for the life of the thread. When a thread
+ *  exits, its ring is marked orphaned and freed by the writer thread once it is
+ *  empty.
+ *
+ *  @author     Edward Hetherington
+ */
+
+#include "config.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#define _GNU_SOURCE
+
+#define ASYNC_RING_SIZE (64 * 1024)	/**< default ring size (bytes) */
+#define ASYNC_ALIGN 8				/**< record alignment in the ring */
+#define ASYNC_PAD 1					/**< len flag - skip to the ring start */
+#define ASYNC_IDLE_MICROS 1000		/**< writer sleep when the rings are empty */
+#define ASYNC_FLUSH_MICROS 100		/**< poll interval for log_async_flush() */
+
+#define ASYNC_ROUND_UP(n) (((n) + ASYNC_ALIGN - 1) & ~((size_t) ASYNC_ALIGN - 1))
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "tinylogger.h"
+#include "private.h"
+
+/**
+ * @struct async_rec
+ * @brief A queued message. The user message follows the header.
+ */
+struct async_rec {
+	size_t			len;		/**< record length, including the header */
+	struct timespec	ts;			/**< the timestamp taken by log_msg() */
+	char const		*file;		/**< __FILE__ of the calling statement */
+	char const		*function;	/**< __func__ of the calling statement */
+	int				level;		/**< the log level */
+	int				line;		/**< __LINE__ of the calling statement */
+	char const		*format;	/**< if set, msg holds the deferred arguments */
+	size_t			msg_len;	/**< length of msg */
+	char			msg[];		/**< the formatted user message */
+};
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#define ASYNC_HDR_LEN ASYNC_ROUND_UP(offsetof(struct async_rec, msg))
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+/**
+ * @struct async_ring
+ * @brief A single producer / single consumer byte ring.
+ *
+ * head and tail are free running byte counts. They are kept on separate cache
+ * lines so that the producer and the writer thread don't fight over them.
+ */
+struct async_ring {
+	_Atomic size_t	head __attribute__((aligned(64)));	/**< producer */
+	atomic_bool		busy;		/**< the producer is queueing a record */
+	_Atomic unsigned long	n_records;	/**< records queued */
+	_Atomic unsigned long	n_waits;	/**< waits for room */
+	_Atomic size_t	tail __attribute__((aligned(64)));	/**< writer thread */
+	atomic_bool		orphaned;	/**< the owning thread has exited */
+	char			*buf;		/**< the ring storage */
+	size_t			size;		/**< size of buf, a power of 2 */
+	struct log_origin owner;	/**< thread id and name of the owner */
+	struct async_ring *next;	/**< list of all rings */
+};
+
+/**
+ * @struct async_config
+ * @brief The state of asynchronous mode.
+ */
+static struct async_config {
+	atomic_bool		running;	/**< log_msg() should queue messages */
+	atomic_bool		stop;		/**< the writer thread should exit */
+	atomic_bool		writing;	/**< the writer thread hasn't exited */
+	size_t			ring_size;	/**< size of rings created from now on */
+	pthread_t		thread;		/**< the writer thread */
+	pthread_mutex_t	lock;		/**< start/stop, and freeing rings */
+	pthread_mutex_t	wake_lock;	/**< for wake */
+	pthread_cond_t	wake;		/**< wake the writer thread early */
+	_Atomic(struct async_ring *) rings;	/**< all rings */
+	unsigned long	retired_records;	/**< counts from freed rings */
+	unsigned long	retired_waits;		/**< counts from freed rings */
+} async_config = {
+	.running = false,
+	.stop = false,
+	.writing = false,
+	.ring_size = ASYNC_RING_SIZE,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake_lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.rings = NULL,
+	.retired_records = 0,
+	.retired_waits = 0,
+};
+
+/** the calling thread's ring */
+static __thread struct async_ring *my_ring = NULL;
+
+/** set by the writer thread while it formats a record from another thread */
+static __thread struct log_origin const *origin = NULL;
+
+/** the calling thread's id and name, filled in by get_self() */
+static __thread struct log_origin self = {0};
+
+/** used to find out when a thread with a ring exits */
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/** registers fork_child() the first time a thread caches its identity */
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @fn void ring_orphan(void *)
+ * @brief Thread exit destructor - let the writer thread free the ring.
+ * @param ring the ring of the exiting thread
+ */
+static void ring_orphan(void *ring) {
+	atomic_store(&((struct async_ring *) ring)->orphaned, true);
+	my_ring = NULL;
+}
+
+static void ring_key_init(void) {
+	pthread_key_create(&ring_key, ring_orphan);
+}
+
+/**
+ * @fn void wake_writer(void)
+ * @brief Wake the writer thread if it is sleeping.
+ */
+static void wake_writer(void) {
+	pthread_mutex_lock(&async_config.wake_lock);
+	pthread_cond_signal(&async_config.wake);
+	pthread_mutex_unlock(&async_config.wake_lock);
+}
+
+/**
+ * @fn void fork_child(void)
+ * @brief In the child of a fork(), forget the id, name and ring of the thread
+ * that forked. The writer thread isn't copied into the child, so the child
+ * logs directly until it starts asynchronous mode again, with rings of its
+ * own.
+ */
+static void fork_child(void) {
+	self.tid = 0;
+	my_ring = NULL;
+	atomic_store(&async_config.running, false);
+	atomic_store(&async_config.writing, false);
+	atomic_store(&async_config.rings, NULL);
+}
+
+static void fork_init(void) {
+	pthread_atfork(NULL, NULL, fork_child);
+}
+
+/**
+ * @fn struct log_origin const *get_self(void)
+ * @brief Get the calling thread's id and name, looking them up only the first
+ * time.
+ * @return the cached id and name
+ */
+static inline struct log_origin const *get_self(void) {
+	if (self.tid == 0) {
+		pthread_once(&fork_once, fork_init);
+		if (pthread_getname_np(pthread_self(), self.name, sizeof(self.name))) {
+			snprintf(self.name, sizeof(self.name), "unknown");
+		}
+		self.tid = syscall(SYS_gettid);
+	}
+	return &self;
+}
+
+/**
+ * @fn struct async_ring *new_ring(void)
+ * @brief Create a ring for the calling thread, and add it to the list.
+ * @return the ring, or NULL if it couldn't be allocated
+ */
+static struct async_ring *new_ring(void) {
+	struct async_ring *ring;
+
+	ring = aligned_alloc(64, sizeof(*ring));
+	if (ring == NULL) return NULL;
+	memset(ring, 0, sizeof(*ring));
+
+	ring->size = async_config.ring_size;
+	ring->buf = aligned_alloc(64, ring->size);
+	if (ring->buf == NULL) {
+		free(ring);
+		return NULL;
+	}
+
+	// the owner's identity is captured once, not for every message
+	ring->owner = *get_self();
+
+	pthread_once(&ring_key_once, ring_key_init);
+	pthread_setspecific(ring_key, ring);
+
+	// push it on the list - only the writer thread ever removes entries
+	ring->next = atomic_load(&async_config.rings);
+	while (!atomic_compare_exchange_weak(&async_config.rings, &ring->next, ring))
+		;
+
+	my_ring = ring;
+	return ring;
+}
+
+/**
+ * @fn size_t ring_reserve(struct async_ring *, size_t)
+ * @brief Wait for room for a contiguous record of len bytes.
+ *
+ * If the record doesn't fit before the end of the ring, a pad record is
+ * written and the record starts at the beginning of the ring.
+ *
+ * @param ring the calling thread's ring
+ * @param len the record length (multiple of ASYNC_ALIGN)
+ * @return the (unpublished) head position for the record
+ */
+static size_t ring_reserve(struct async_ring *ring, size_t len) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t mask = ring->size - 1;
+
+	while (1) {
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		size_t contig = ring->size - (head & mask);
+		size_t need = (len <= contig) ? len : contig + len;
+
+		if (ring->size - (head - tail) >= need) break;
+
+		// full - let the writer thread catch up
+		atomic_fetch_add_explicit(&ring->n_waits, 1, memory_order_relaxed);
+		wake_writer();
+		sched_yield();
+	}
+
+	size_t contig = ring->size - (head & mask);
+	if (len > contig) {
+		struct async_rec *pad = (struct async_rec *) (ring->buf + (head & mask));
+		pad->len = contig | ASYNC_PAD;
+		head += contig;
+	}
+
+	return head;
+}
+
+/**
+ * @fn size_t msg_limit(struct async_ring *)
+ * @brief Get the user message limit (including the null) for a ring.
+ *
+ * A ring must hold at least two messages.
+ *
+ * @param ring the ring
+ * @return the limit
+ */
+static inline size_t msg_limit(struct async_ring const *ring) {
+	size_t limit = ring->size / 4 - ASYNC_HDR_LEN;
+#if MAX_MSG_SIZE > 0
+	if (limit > MAX_MSG_SIZE) limit = MAX_MSG_SIZE;
+#endif
+	return limit;
+}
+
+/**
+ * @fn bool log_async_active(void)
+ * @brief Check if log_msg() should queue messages.
+ * @return true if asynchronous mode is running
+ */
+bool log_async_active(void) {
+	return atomic_load_explicit(&async_config.running, memory_order_relaxed);
+}
+
+/**
+ * @fn void log_async_wait_queued(void)
+ * @brief Wait for the messages the calling thread queued to be written, if
+ * the writer thread is still writing them.
+ *
+ * Called before a message is logged directly, so that a thread's messages
+ * stay in order while asynchronous mode stops.
+ */
+void log_async_wait_queued(void) {
+	struct async_ring *ring = my_ring;
+
+	if (ring == NULL) return;
+
+	while ((atomic_load(&ring->tail) != atomic_load(&ring->head)) &&
+		atomic_load(&async_config.writing)) {
+		wake_writer();
+		sched_yield();
+	}
+}
+
+/**
+ * @fn size_t log_async_msg_limit(void)
+ * @brief Get the user message limit (including the null) for the calling
+ * thread's ring, setting the ring up if needed.
+ * @return the limit, or 0 if the thread has no ring
+ */
+size_t log_async_msg_limit(void) {
+	struct async_ring *ring = my_ring;
+
+	if ((ring == NULL) && ((ring = new_ring()) == NULL)) return 0;
+
+	return msg_limit(ring);
+}
+
+/**
+ * @fn int log_async_vmsg(struct timespec *, int,
+ *     char const *, char const *, int, char const *, va_list)
+ * @brief Queue a user message in the calling thread's ring.
+ *
+ * If the format string can be deferred, only the arguments are copied to the
+ * ring, and the writer thread formats the message (see deferred.c).
+ * Otherwise the message is formatted here.
+ *
+ * Either way, the arguments or message are written straight into the free
+ * space of the ring. Only if they don't fit is room made and the work done
+ * again.
+ *
+ * @param ts the timestamp of the message
+ * @param level the log level of the message
+ * @param file the filename of the line of code
+ * @param function the function of the line of code
+ * @param line the line number of the line of code
+ * @param format the printf format string
+ * @param args the arguments to the format string
+ * @return 0 on success, -1 if the thread has no ring, or asynchronous mode
+ * was stopped
+ */
+int log_async_vmsg(struct timespec *ts, int level,
+	char const *file, char const *function, int line,
+	char const *format, va_list args) {
+	struct async_ring *ring = my_ring;
+	struct async_rec *rec;
+	size_t limit;
+	size_t head;
+	size_t room;
+	size_t len;
+	va_list args_copy;
+	long n;
+
+	if ((ring == NULL) && ((ring = new_ring()) == NULL)) return -1;
+
+	// log_stop_async() clears running, then waits for busy rings - one of the
+	// two sees the other
+	atomic_store(&ring->busy, true);
+	if (!atomic_load(&async_config.running)) {
+		atomic_store(&ring->busy, false);
+		return -1;
+	}
+
+	limit = msg_limit(ring);
+
+	// the contiguous free space at the head
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	room = ring->size - (head & (ring->size - 1));
+	if (room > ring->size -
+		(head - atomic_load_explicit(&ring->tail, memory_order_acquire))) {
+		room = ring->size -
+			(head - atomic_load_explicit(&ring->tail, memory_order_acquire));
+	}
+	room = (room > ASYNC_HDR_LEN) ? room - ASYNC_HDR_LEN : 0;
+	if (room > limit) room = limit;
+
+	rec = (struct async_rec *) (ring->buf + (head & (ring->size - 1)));
+
+	// first choice - copy the arguments and let the writer thread format them
+	n = -1;
+	if (log_is_static(format)) {
+		va_copy(args_copy, args);
+		n = log_pack_args(rec->msg, room, format, args_copy);
+		va_end(args_copy);
+	}
+	if ((n >= 0) && ((size_t) n > room)) {
+		if ((size_t) n <= limit) {
+			head = ring_reserve(ring, ASYNC_ROUND_UP(ASYNC_HDR_LEN + n));
+			rec = (struct async_rec *) (ring->buf + (head & (ring->size - 1)));
+			va_copy(args_copy, args);
+			log_pack_args(rec->msg, n, format, args_copy);
+			va_end(args_copy);
+		} else {
+			// long strings - format them here, truncated to the limit
+			n = -1;
+		}
+	}
+
+	if (n >= 0) {
+		rec->format = format;
+		rec->msg_len = n;
+		len = n;
+	} else {
+		// format the message now, into the free space if it fits
+		va_copy(args_copy, args);
+		n = vsnprintf(room ? rec->msg : NULL, room, format, args_copy);
+		va_end(args_copy);
+		if (n < 0) n = 0;
+
+		// didn't fit - make room for the whole (possibly truncated) message
+		if ((size_t) n >= room) {
+			size_t msg_len = ((size_t) n < limit) ? (size_t) n + 1 : limit;
+
+			head = ring_reserve(ring, ASYNC_ROUND_UP(ASYNC_HDR_LEN + msg_len));
+			rec = (struct async_rec *) (ring->buf + (head & (ring->size - 1)));
+			vsnprintf(rec->msg, msg_len, format, args);
+			n = msg_len - 1;
+		}
+		rec->format = NULL;
+		rec->msg_len = n + 1;
+		len = n + 1;
+	}
+
+	rec->len = ASYNC_ROUND_UP(ASYNC_HDR_LEN + len);
+	rec->ts = *ts;
+	rec->file = file;
+	rec->function = function;
+	rec->level = level;
+	rec->line = line;
+
+	// publish
+	atomic_fetch_add_explicit(&ring->n_records, 1, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + rec->len, memory_order_release);
+	atomic_store_explicit(&ring->busy, false, memory_order_release);
+
+	return 0;
+}
+
+/**
+ * @fn struct async_rec *ring_peek(struct async_ring *)
+ * @brief Get the oldest record of a ring, skipping any padding.
+ * @param ring the ring to look at
+ * @return the record, or NULL if the ring is empty
+ */
+static struct async_rec *ring_peek(struct async_ring *ring) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	while (tail != atomic_load_explicit(&ring->head, memory_order_acquire)) {
+		struct async_rec *rec =
+			(struct async_rec *) (ring->buf + (tail & (ring->size - 1)));
+		if (!(rec->len & ASYNC_PAD)) return rec;
+
+		tail += rec->len & ~(size_t) ASYNC_PAD;
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+
+	return NULL;
+}
+
+/**
+ * @fn bool ts_before(struct timespec const *, struct timespec const *)
+ * @return true if a is earlier than b
+ */
+static inline bool ts_before(struct timespec const *a,
+	struct timespec const *b) {
+	if (a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+/**
+ * @fn bool write_oldest(void)
+ * @brief Write the oldest queued record of all the rings.
+ *
+ * The rings are merged on their timestamps so that the output of different
+ * threads is interleaved in time order.
+ *
+ * @return true if a record was written
+ */
+static bool write_oldest(void) {
+	struct async_ring *oldest = NULL;
+	struct async_rec *oldest_rec = NULL;
+
+	for (struct async_ring *ring = atomic_load(&async_config.rings);
+		ring != NULL; ring = ring->next) {
+		struct async_rec *rec = ring_peek(ring);
+		if (rec == NULL) continue;
+		if ((oldest_rec == NULL) || ts_before(&rec->ts, &oldest_rec->ts)) {
+			oldest = ring;
+			oldest_rec = rec;
+		}
+	}
+
+	if (oldest == NULL) return false;
+
+	// the message is rendered from the packed arguments only if needed
+	struct log_packed packed = {
+		.format = oldest_rec->format,
+		.args = oldest_rec->msg,
+		.len = oldest_rec->msg_len,
+		.msg_limit = msg_limit(oldest),
+	};
+	char *msg = (oldest_rec->format == NULL) ? oldest_rec->msg : NULL;
+
+	// the formatters report the thread that queued the record
+	origin = &oldest->owner;
+	log_emit(&oldest_rec->ts, oldest_rec->level, oldest_rec->file,
+		oldest_rec->function, oldest_rec->line, msg,
+		(msg == NULL) ? &packed : NULL);
+	origin = NULL;
+
+	atomic_store_explicit(&oldest->tail,
+		atomic_load_explicit(&oldest->tail, memory_order_relaxed)
+			+ oldest_rec->len,
+		memory_order_release);
+
+	return true;
+}
+
+/**
+ * @fn void free_orphans(void)
+ * @brief Free the empty rings of threads that have exited.
+ *
+ * Only the writer thread (or log_stop_async() after the writer thread is gone)
+ * removes rings. New rings are only ever pushed on the front of the list.
+ *
+ * Skipped if log_async_flush() holds the lock - it is waiting on the writer.
+ */
+static void free_orphans(void) {
+	if (pthread_mutex_trylock(&async_config.lock) != 0) return;
+
+	struct async_ring *prev = NULL;
+	struct async_ring *ring = atomic_load(&async_config.rings);
+	while (ring != NULL) {
+		struct async_ring *next = ring->next;
+
+		if (atomic_load(&ring->orphaned) && (ring_peek(ring) == NULL)) {
+			struct async_ring *expected = ring;
+
+			// unlink - the front entry may have been pushed down meanwhile
+			if ((prev != NULL) ||
+				!atomic_compare_exchange_strong(&async_config.rings,
+					&expected, next)) {
+				if (prev == NULL) {
+					prev = atomic_load(&async_config.rings);
+					while (prev->next != ring) prev = prev->next;
+				}
+				prev->next = next;
+			}
+
+			async_config.retired_records += atomic_load(&ring->n_records);
+			async_config.retired_waits += atomic_load(&ring->n_waits);
+			free(ring->buf);
+			free(ring);
+		} else {
+			prev = ring;
+		}
+
+		ring = next;
+	}
+
+	pthread_mutex_unlock(&async_config.lock);
+}
+
+/**
+ * @fn void *async_writer(void *)
+ * @brief The writer thread. Drain the rings until told to stop.
+ *
+ * After a stop is requested, the rings are drained one last time.
+ *
+ * @param unused unused
+ * @return NULL
+ */
+static void *async_writer(void *unused) {
+	(void) unused;
+
+	pthread_setname_np(pthread_self(), "log_writer");
+
+	while (1) {
+		bool stopping = atomic_load(&async_config.stop);
+
+		if (write_oldest()) continue;
+
+		if (stopping) break;
+
+		free_orphans();
+
+		// nothing to do - sleep until woken or the idle time passes
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += ASYNC_IDLE_MICROS * 1000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		pthread_mutex_lock(&async_config.wake_lock);
+		if (!atomic_load(&async_config.stop)) {
+			pthread_cond_timedwait(&async_config.wake,
+				&async_config.wake_lock, &until);
+		}
+		pthread_mutex_unlock(&async_config.wake_lock);
+	}
+
+	atomic_store(&async_config.writing, false);
+
+	return NULL;
+}
+
+/**
+ * @fn void log_async_flush(void)
+ * @brief Wait until the messages queued so far have been written.
+ *
+ * Used before channels are changed, so that queued messages go where they
+ * would have gone in synchronous mode.
+ */
+void log_async_flush(void) {
+	if (!log_async_active()) return;
+
+	// the writer thread may be the one changing a channel
+	if (pthread_equal(pthread_self(), async_config.thread)) return;
+
+	pthread_mutex_lock(&async_config.lock);
+	for (struct async_ring *ring = atomic_load(&async_config.rings);
+		ring != NULL; ring = ring->next) {
+		size_t head = atomic_load(&ring->head);
+		while (atomic_load(&ring->tail) < head) {
+			if (!log_async_active()) break;
+			wake_writer();
+			usleep(ASYNC_FLUSH_MICROS);
+		}
+	}
+	pthread_mutex_unlock(&async_config.lock);
+}
+
+/**
+ * @fn void log_async_get_stats(struct log_stats *)
+ * @brief Add the asynchronous mode counters to stats.
+ * @param stats the counters to update
+ */
+void log_async_get_stats(struct log_stats *stats) {
+	pthread_mutex_lock(&async_config.lock);
+
+	stats->async_records += async_config.retired_records;
+	stats->async_waits += async_config.retired_waits;
+	for (struct async_ring *ring = atomic_load(&async_config.rings);
+		ring != NULL; ring = ring->next) {
+		stats->async_records += atomic_load(&ring->n_records);
+		stats->async_waits += atomic_load(&ring->n_waits);
+		stats->async_rings++;
+	}
+
+	pthread_mutex_unlock(&async_config.lock);
+}
+
+/**
+ * @fn long log_get_tid(void)
+ * @brief Get the linux thread id of the thread that logged the message.
+ *
+ * For use by the formatters. In asynchronous mode, this is the thread that
+ * queued the record being written, not the writer thread.
+ *
+ * The id is looked up once per thread.
+ *
+ * @return the thread id
+ */
+long log_get_tid(void) {
+	if (origin != NULL) return origin->tid;
+	return get_self()->tid;
+}
+
+/**
+ * @fn struct log_origin const *log_get_origin(void)
+ * @brief Get the thread that logged the message, as log_get_tid() and
+ * log_get_thread_name() do, without copying the name.
+ * @return the id and name
+ */
+struct log_origin const *log_get_origin(void) {
+	return (origin != NULL) ? origin : get_self();
+}
+
+/**
+ * @fn char *log_get_thread_name(char *buf, size_t len)
+ * @brief Get the name of the thread that logged the message.
+ *
+ * For use by the formatters. This is the name the thread had when it first
+ * logged a message, or the name last given with log_set_thread_name(). In
+ * asynchronous mode, it is the name of the thread that queued the record.
+ *
+ * @param buf the buffer to place the name in
+ * @param len the length of buf
+ * @return buf
+ */
+char *log_get_thread_name(char *buf, size_t len) {
+	struct log_origin const *thread = (origin != NULL) ? origin : get_self();
+
+	snprintf(buf, len, "%s", thread->name);
+	return buf;
+}
+
+/**
+ * @fn int log_set_thread_name(char const *name)
+ * @brief Set the name of the calling thread, as shown by the thread formats.
+ *
+ * The thread names are cached by the library the first time a thread logs.
+ * A name set later with pthread_setname_np() isn't seen. This sets the name
+ * of the thread (with pthread_setname_np()) and the cached name.
+ *
+ * Names are truncated to 15 characters. In asynchronous mode, the messages
+ * already queued by the thread are written first, with the old name (unless
+ * the writer thread has stopped).
+ *
+ * @param name the new name
+ * @return 0 on success, or the pthread_setname_np() error
+ */
+int log_set_thread_name(char const *name) {
+	struct log_origin thread = *get_self();
+	struct async_ring *ring = my_ring;
+	int status;
+
+	if (name == NULL) return -1;
+
+	snprintf(thread.name, sizeof(thread.name), "%s", name);
+	status = pthread_setname_np(pthread_self(), thread.name);
+	if (status != 0) return status;
+
+	self = thread;
+
+	// the writer thread only reads the owner while the ring holds records
+	if (ring != NULL) {
+		while ((atomic_load(&ring->tail) != atomic_load(&ring->head)) &&
+			atomic_load(&async_config.writing)) {
+			wake_writer();
+			usleep(ASYNC_FLUSH_MICROS);
+		}
+		ring->owner = thread;
+	}
+
+	return 0;
+}
+
+/**
+ * @fn void log_set_origin(struct log_origin const *)
+ * @brief Set the thread reported by log_get_tid() and log_get_thread_name()
+ * for the calling thread.
+ *
+ * Used by the binary log decoder to replay messages logged by other threads.
+ *
+ * @param thread the thread to report, or NULL for the calling thread
+ */
+void log_set_origin(struct log_origin const *thread) {
+	origin = thread;
+}
+
+/**
+ * @fn int log_start_async(size_t ring_size)
+ * @brief Start asynchronous mode.
+ *
+ * From now on, log_msg() formats the user message into a ring that belongs to
+ * the calling thread, and returns without waiting for the output to be
+ * written. A background writer thread writes the messages to the channels.
+ *
+ * Each thread that logs gets its own ring of ring_size bytes. User messages
+ * are limited to a quarter of the ring size (or MAX_MSG_SIZE, whichever is
+ * smaller). A thread whose ring is full waits for the writer thread.
+ *
+ * Channels may be opened, changed and closed as usual. Messages queued before
+ * the change are written first.
+ *
+ * @param ring_size size of the per-thread rings. 0 selects the default of 64k.
+ * It is rounded up to a power of 2, and is at least 4k.
+ * @return 0 on success, -1 if already running, or the pthread_create() error
+ */
+int log_start_async(size_t ring_size) {
+	int status = 0;
+	size_t size = 4096;
+
+	if (ring_size == 0) ring_size = ASYNC_RING_SIZE;
+	while (size < ring_size) size <<= 1;
+
+	pthread_mutex_lock(&async_config.lock);
+
+	if (log_async_active()) {
+		status = -1;
+		goto unlock;
+	}
+
+	// rings that already exist keep their size
+	async_config.ring_size = size;
+	atomic_store(&async_config.stop, false);
+
+	// where static format strings can be found
+	log_defer_init();
+
+	atomic_store(&async_config.writing, true);
+	status = pthread_create(&async_config.thread, NULL, async_writer, NULL);
+	if (status != 0) {
+		atomic_store(&async_config.writing, false);
+		goto unlock;
+	}
+
+	atomic_store(&async_config.running, true);
+
+unlock:
+	pthread_mutex_unlock(&async_config.lock);
+
+	return status;
+}
+
+/**
+ * @fn int log_stop_async(void)
+ * @brief Write all queued messages, stop the writer thread, and return to
+ * synchronous mode.
+ *
+ * Messages being queued by other threads as it is called are written too.
+ *
+ * Called by log_done().
+ *
+ * @return 0 on success, -1 if asynchronous mode wasn't running
+ */
+int log_stop_async(void) {
+	pthread_mutex_lock(&async_config.lock);
+
+	if (!log_async_active()) {
+		pthread_mutex_unlock(&async_config.lock);
+		return -1;
+	}
+
+	// new messages are written directly from here on
+	atomic_store(&async_config.running, false);
+
+	// let the threads already queueing a message publish it. The writer
+	// thread is still draining, so a thread waiting for room gets it.
+	for (struct async_ring *ring = atomic_load(&async_config.rings);
+		ring != NULL; ring = ring->next) {
+		while (atomic_load(&ring->busy)) {
+			wake_writer();
+			sched_yield();
+		}
+	}
+
+	atomic_store(&async_config.stop, true);
+	wake_writer();
+
+	pthread_mutex_unlock(&async_config.lock);
+
+	pthread_join(async_config.thread, NULL);
+
+	// rings of threads that have exited are no longer needed
+	free_orphans();
+
+	return 0;
+}
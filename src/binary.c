@@ -0,0 +1,814 @@
+/*
+ * (C) 2020 Edward Hetherington
+ * This code is licensed under MIT license (see LICENSE in top dir for details)
+ */
+
+/** @file       binary.c
+ *  @brief      A compact binary log format.
+ *  @details    A channel opened with the log_fmt_binary formatter writes the
+ *  strings that repeat from record to record only once, in dictionary
+ *  records. A message record then holds:
+ *
+ *  - the id of its log statement (level, file, function, line and format)
+ *  - the timestamp, as the difference from that of the previous record
+ *  - the sequence number, as the difference from the previous record
+ *  - the thread id (the thread name is in a dictionary record)
+ *  - the packed arguments (see deferred.c), or the formatted message if they
+ *    couldn't be packed
+ *
+ *  utils/binary-decode turns the file back into any of the text, JSON or XML
+ *  formats, using log_decode_binary().
+ *
+ *  A file is a header followed by records. Each record starts with its type.
+ *  A header may appear again later in the file (a channel that was reopened
+ *  onto the same file). The dictionaries start over after a header.
+ *
+ *  The header is BIN_MAGIC (including its null), then one byte each for
+ *  sizeof(int), sizeof(long), sizeof(long long), sizeof(void *),
+ *  sizeof(size_t), sizeof(double), sizeof(long double), and 1 if the writer
+ *  was little endian, 0 if not. The packed arguments are in the native layout
+ *  of the machine that wrote them, so the decoder checks these.
+ *
+ *  Records (v = LEB128 varint, s = zigzag varint, str = varint length + 1,
+ *  then the characters, length 0 for NULL):
+ *
+ *  - BIN_CALLSITE: v id, v level, v line, str file, str function, str format
+ *  - BIN_THREAD:   v tid, str name
+ *  - BIN_PACKED:   v callsite id, s ns since the previous record,
+ *                  s sequence - previous sequence, v tid,
+ *                  v length, the packed arguments
+ *  - BIN_MESSAGE:  as BIN_PACKED, but str message in place of the arguments.
+ *                  The callsite format is NULL.
+ *
+ *  @author     Edward Hetherington
+ */
+
+#include "config.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#define _GNU_SOURCE
+
+#define MIN_TABLE_SIZE 64	/**< initial dictionary hash table size */
+#define VARINT_MAX 10		/**< the longest 64 bit varint */
+
+#define BIN_MAGIC "\177TLBIN1"	/**< the file header magic, with its null */
+#define BIN_HEADER '\177'		/**< the first byte of BIN_MAGIC */
+
+#define BIN_CALLSITE 'C'	/**< log statement dictionary record */
+#define BIN_THREAD 'T'		/**< thread dictionary record */
+#define BIN_PACKED 'P'		/**< message record, packed arguments */
+#define BIN_MESSAGE 'M'		/**< message record, formatted message */
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tinylogger.h"
+#include "private.h"
+
+/**
+ * @struct bin_callsite
+ * @brief A log statement entry of the dictionary.
+ */
+struct bin_callsite {
+	char const	*file;		/**< \_\_FILE\_\_ */
+	char const	*function;	/**< \_\_func\_\_ */
+	char const	*format;	/**< the format, NULL for formatted messages */
+	int			line;		/**< \_\_LINE\_\_ */
+	int			level;		/**< the log level */
+	unsigned long	id;		/**< the id written in the message records */
+};
+
+/**
+ * @struct log_binary
+ * @brief The state of a binary channel.
+ *
+ * The dictionaries are open addressed hash tables, at most half full.
+ */
+struct log_binary {
+	struct bin_callsite	*callsites;	/**< log statements written */
+	size_t		callsites_size;		/**< size of callsites, a power of 2 */
+	size_t		n_callsites;		/**< entries in callsites */
+	long		*tids;				/**< threads written, 0 is empty */
+	size_t		tids_size;			/**< size of tids, a power of 2 */
+	size_t		n_tids;				/**< entries in tids */
+	int64_t		last_ns;			/**< timestamp of the previous record */
+	int			last_sequence;		/**< sequence of the previous record */
+	char		*buf;				/**< the record being built */
+	size_t		buf_size;			/**< size of buf */
+	size_t		buf_len;			/**< bytes used in buf */
+};
+
+/**
+ * @fn bool reserve(struct log_binary *, size_t)
+ * @brief Make room for len more bytes in the record buffer.
+ * @return false if out of memory
+ */
+static bool reserve(struct log_binary *bin, size_t len) {
+	if (bin->buf_len + len <= bin->buf_size) return true;
+
+	size_t size = bin->buf_size ? bin->buf_size : BUFSIZ;
+	while (size < bin->buf_len + len) size *= 2;
+
+	char *buf = realloc(bin->buf, size);
+	if (buf == NULL) return false;
+	bin->buf = buf;
+	bin->buf_size = size;
+	return true;
+}
+
+/**
+ * @fn void put_varint(struct log_binary *, uint64_t)
+ * @brief Append an unsigned LEB128 varint. Room must have been reserved.
+ */
+static inline void put_varint(struct log_binary *bin, uint64_t value) {
+	char *p = bin->buf + bin->buf_len;
+
+	while (value >= 0x80) {
+		*p++ = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	bin->buf_len = p - bin->buf;
+}
+
+/**
+ * @fn void put_svarint(struct log_binary *, int64_t)
+ * @brief Append a zigzag encoded signed varint. Room must have been reserved.
+ */
+static inline void put_svarint(struct log_binary *bin, int64_t value) {
+	put_varint(bin, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+/**
+ * @fn bool put_bytes(struct log_binary *, void const *, size_t)
+ * @brief Append a length, then the bytes.
+ * @return false if out of memory
+ */
+static bool put_bytes(struct log_binary *bin, void const *bytes, size_t len) {
+	if (!reserve(bin, VARINT_MAX + len)) return false;
+	put_varint(bin, len);
+	memcpy(bin->buf + bin->buf_len, bytes, len);
+	bin->buf_len += len;
+	return true;
+}
+
+/**
+ * @fn bool put_string(struct log_binary *, char const *)
+ * @brief Append a string. NULL is written as length 0, "" as length 1, and
+ * others as their length + 1, then their characters.
+ * @return false if out of memory
+ */
+static bool put_string(struct log_binary *bin, char const *str) {
+	size_t len = (str == NULL) ? 0 : strlen(str) + 1;
+
+	if (!reserve(bin, VARINT_MAX + len)) return false;
+	put_varint(bin, len);
+	if (len > 1) {
+		memcpy(bin->buf + bin->buf_len, str, len - 1);
+		bin->buf_len += len - 1;
+	}
+	return true;
+}
+
+/**
+ * @fn size_t hash_callsite(char const *, char const *, char const *, int, int)
+ * @brief Hash a log statement by the addresses of its strings.
+ */
+static inline size_t hash_callsite(char const *file, char const *function,
+	char const *format, int line, int level) {
+	uint64_t h = (uintptr_t) format;
+
+	h = (h ^ (uintptr_t) file) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (uintptr_t) function) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (((uint64_t) line << 8) | level)) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+/**
+ * @fn bool grow_callsites(struct log_binary *)
+ * @brief Double the size of the log statement dictionary.
+ * @return false if out of memory
+ */
+static bool grow_callsites(struct log_binary *bin) {
+	size_t size = bin->callsites_size ? bin->callsites_size * 2 : MIN_TABLE_SIZE;
+	struct bin_callsite *table = calloc(size, sizeof(*table));
+	if (table == NULL) return false;
+
+	for (size_t n = 0; n < bin->callsites_size; n++) {
+		struct bin_callsite *cs = &bin->callsites[n];
+		if (cs->file == NULL) continue;
+
+		size_t slot = hash_callsite(cs->file, cs->function, cs->format,
+			cs->line, cs->level) & (size - 1);
+		while (table[slot].file != NULL) slot = (slot + 1) & (size - 1);
+		table[slot] = *cs;
+	}
+
+	free(bin->callsites);
+	bin->callsites = table;
+	bin->callsites_size = size;
+	return true;
+}
+
+/**
+ * @fn long callsite_id(struct log_binary *, char const *, char const *,
+ *     char const *, int, int)
+ * @brief Look up a log statement, adding a dictionary record to the record
+ * buffer the first time it is seen.
+ * @return the id, or -1 if out of memory
+ */
+static long callsite_id(struct log_binary *bin, char const *file,
+	char const *function, char const *format, int line, int level) {
+	size_t slot;
+
+	if ((bin->n_callsites + 1) * 2 > bin->callsites_size) {
+		if (!grow_callsites(bin)) return -1;
+	}
+
+	// file is never NULL in a used slot
+	if (file == NULL) file = "";
+	if (function == NULL) function = "";
+
+	slot = hash_callsite(file, function, format, line, level)
+		& (bin->callsites_size - 1);
+	while (bin->callsites[slot].file != NULL) {
+		struct bin_callsite *cs = &bin->callsites[slot];
+		if ((cs->format == format) && (cs->file == file) &&
+			(cs->function == function) && (cs->line == line) &&
+			(cs->level == level)) {
+			return cs->id;
+		}
+		slot = (slot + 1) & (bin->callsites_size - 1);
+	}
+
+	struct bin_callsite *cs = &bin->callsites[slot];
+	cs->file = file;
+	cs->function = function;
+	cs->format = format;
+	cs->line = line;
+	cs->level = level;
+	cs->id = bin->n_callsites++;
+
+	if (!reserve(bin, 1 + 3 * VARINT_MAX)) return -1;
+	bin->buf[bin->buf_len++] = BIN_CALLSITE;
+	put_varint(bin, cs->id);
+	put_varint(bin, level);
+	put_varint(bin, line);
+	if (!put_string(bin, file) || !put_string(bin, function) ||
+		!put_string(bin, format)) {
+		return -1;
+	}
+
+	return cs->id;
+}
+
+/**
+ * @fn bool add_thread(struct log_binary *, long)
+ * @brief Add a thread dictionary record to the record buffer the first time
+ * a thread id is seen.
+ * @return false if out of memory
+ */
+static bool add_thread(struct log_binary *bin, long tid) {
+	size_t slot;
+
+	if ((bin->n_tids + 1) * 2 > bin->tids_size) {
+		size_t size = bin->tids_size ? bin->tids_size * 2 : MIN_TABLE_SIZE;
+		long *table = calloc(size, sizeof(*table));
+		if (table == NULL) return false;
+
+		for (size_t n = 0; n < bin->tids_size; n++) {
+			if (bin->tids[n] == 0) continue;
+			slot = (bin->tids[n] * 0x9e3779b97f4a7c15ULL) >> 32 & (size - 1);
+			while (table[slot] != 0) slot = (slot + 1) & (size - 1);
+			table[slot] = bin->tids[n];
+		}
+		free(bin->tids);
+		bin->tids = table;
+		bin->tids_size = size;
+	}
+
+	slot = (tid * 0x9e3779b97f4a7c15ULL) >> 32 & (bin->tids_size - 1);
+	while (bin->tids[slot] != 0) {
+		if (bin->tids[slot] == tid) return true;
+		slot = (slot + 1) & (bin->tids_size - 1);
+	}
+	bin->tids[slot] = tid;
+	bin->n_tids++;
+
+	char name[LOG_NAME_LEN];
+	log_get_thread_name(name, sizeof(name));
+
+	if (!reserve(bin, 1 + VARINT_MAX)) return false;
+	bin->buf[bin->buf_len++] = BIN_THREAD;
+	put_varint(bin, tid);
+	return put_string(bin, name);
+}
+
+/**
+ * @fn bool put_header(struct log_binary *)
+ * @brief Add the file header to the record buffer.
+ * @return false if out of memory
+ */
+static bool put_header(struct log_binary *bin) {
+	uint16_t endian = 1;
+	unsigned char header[] = {
+		sizeof(int), sizeof(long), sizeof(long long), sizeof(void *),
+		sizeof(size_t), sizeof(double), sizeof(long double),
+		*(unsigned char *) &endian,
+	};
+
+	if (!reserve(bin, sizeof(BIN_MAGIC) + sizeof(header))) return false;
+	memcpy(bin->buf + bin->buf_len, BIN_MAGIC, sizeof(BIN_MAGIC));
+	bin->buf_len += sizeof(BIN_MAGIC);
+	memcpy(bin->buf + bin->buf_len, header, sizeof(header));
+	bin->buf_len += sizeof(header);
+	return true;
+}
+
+/**
+ * @fn int log_do_binary(LOG_CHANNEL *, struct timespec *, int,
+ *     char const *, char const *, int, char const *, struct log_packed const *)
+ * @brief Write a message record to a binary channel.
+ *
+ * Called with the channel lock held, after the channel sequence number has
+ * been incremented. Any dictionary records the message needs are written first.
+ *
+ * @param channel the binary channel
+ * @param ts the timestamp of the message
+ * @param level the log level of the message
+ * @param file the filename of the line of code
+ * @param function the function of the line of code
+ * @param line the line number of the line of code
+ * @param msg the formatted user message, or NULL
+ * @param packed the packed user message, or NULL. Written rather than msg if
+ * both are given.
+ * @return the number of bytes written, or -1 on error
+ */
+int log_do_binary(LOG_CHANNEL *channel, struct timespec *ts, int level,
+	char const *file, char const *function, int line,
+	char const *msg, struct log_packed const *packed) {
+	struct log_binary *bin = channel->binary;
+	long tid = log_get_tid();
+	long id;
+
+	if (bin == NULL) {
+		bin = channel->binary = calloc(1, sizeof(*bin));
+		if (bin == NULL) return -1;
+		if (!put_header(bin)) goto fail;
+	}
+
+	// dictionary records first
+	id = callsite_id(bin, file, function,
+		(packed != NULL) ? packed->format : NULL, line, level);
+	if ((id < 0) || !add_thread(bin, tid)) goto fail;
+
+	int64_t ns = ts->tv_sec * 1000000000LL + ts->tv_nsec;
+
+	if (!reserve(bin, 1 + 4 * VARINT_MAX)) goto fail;
+	bin->buf[bin->buf_len++] = (packed != NULL) ? BIN_PACKED : BIN_MESSAGE;
+	put_varint(bin, id);
+	put_svarint(bin, ns - bin->last_ns);
+	put_svarint(bin, channel->sequence - bin->last_sequence);
+	put_varint(bin, tid);
+	bin->last_ns = ns;
+	bin->last_sequence = channel->sequence;
+
+	bool ok = (packed != NULL) ? put_bytes(bin, packed->args, packed->len) :
+		put_string(bin, msg);
+	if (!ok) goto fail;
+
+	size_t written = fwrite(bin->buf, 1, bin->buf_len, channel->stream);
+	bin->buf_len = 0;
+
+	return written;
+
+fail:
+	// out of memory - the dictionaries may be out of step with the file, so
+	// start over with a new header
+	log_binary_free(channel);
+	return -1;
+}
+
+/**
+ * @fn void log_binary_free(LOG_CHANNEL *)
+ * @brief Free the state of a binary channel. The next record written starts a
+ * new file, with a header and empty dictionaries.
+ * @param channel the channel
+ */
+void log_binary_free(LOG_CHANNEL *channel) {
+	struct log_binary *bin = channel->binary;
+
+	if (bin == NULL) return;
+
+	free(bin->callsites);
+	free(bin->tids);
+	free(bin->buf);
+	free(bin);
+	channel->binary = NULL;
+}
+
+/**
+ * @struct bin_reader
+ * @brief The state of log_decode_binary().
+ */
+struct bin_reader {
+	FILE		*in;				/**< the binary log */
+	struct bin_callsite	*callsites;	/**< log statements, indexed by id */
+	size_t		n_callsites;		/**< entries in callsites */
+	struct log_origin	*threads;	/**< thread names */
+	size_t		n_threads;			/**< entries in threads */
+	char		*args;				/**< packed arguments or message */
+	size_t		args_size;			/**< size of args */
+	char		*msg;				/**< a message rendered from args */
+	size_t		msg_size;			/**< size of msg */
+	int64_t		last_ns;			/**< timestamp of the previous record */
+	int			last_sequence;		/**< sequence of the previous record */
+};
+
+/**
+ * @fn bool get_varint(FILE *, uint64_t *)
+ * @brief Read an unsigned LEB128 varint.
+ * @return false at end of file
+ */
+static bool get_varint(FILE *in, uint64_t *value) {
+	int shift = 0;
+	int c;
+
+	*value = 0;
+	do {
+		if (((c = getc(in)) == EOF) || (shift > 63)) return false;
+		*value |= (uint64_t) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return true;
+}
+
+/**
+ * @fn bool get_svarint(FILE *, int64_t *)
+ * @brief Read a zigzag encoded signed varint.
+ * @return false at end of file
+ */
+static bool get_svarint(FILE *in, int64_t *value) {
+	uint64_t u;
+
+	if (!get_varint(in, &u)) return false;
+	*value = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+	return true;
+}
+
+/**
+ * @fn bool get_bytes(struct bin_reader *, bool, size_t *)
+ * @brief Read bytes (put_bytes()) or a string (put_string()) into the args
+ * buffer, and null terminate them.
+ * @param reader the reader
+ * @param string true for a string
+ * @param len set to the length read
+ * @return false at end of file, or if out of memory
+ */
+static bool get_bytes(struct bin_reader *reader, bool string, size_t *len) {
+	uint64_t n;
+
+	if (!get_varint(reader->in, &n)) return false;
+	if (string && (n > 0)) n--;
+	if (n + 1 > reader->args_size) {
+		char *args = realloc(reader->args, n + 1);
+		if (args == NULL) return false;
+		reader->args = args;
+		reader->args_size = n + 1;
+	}
+	if (fread(reader->args, 1, n, reader->in) != n) return false;
+	reader->args[n] = '\0';
+
+	*len = n;
+	return true;
+}
+
+/**
+ * @fn bool get_string(FILE *, char **)
+ * @brief Read a string written by put_string().
+ * @param in the binary log
+ * @param str set to a malloc()'ed copy, or NULL (always NULL on error)
+ * @return false at end of file, or if out of memory
+ */
+static bool get_string(FILE *in, char **str) {
+	uint64_t len;
+
+	*str = NULL;
+	if (!get_varint(in, &len)) return false;
+	if (len == 0) return true;
+
+	*str = malloc(len);
+	if (*str == NULL) return false;
+	if (fread(*str, 1, len - 1, in) != len - 1) {
+		free(*str);
+		*str = NULL;
+		return false;
+	}
+	(*str)[len - 1] = '\0';
+
+	return true;
+}
+
+/**
+ * @fn void reader_reset(struct bin_reader *)
+ * @brief Forget the dictionaries - a new header was read.
+ */
+static void reader_reset(struct bin_reader *reader) {
+	for (size_t n = 0; n < reader->n_callsites; n++) {
+		free((char *) reader->callsites[n].file);
+		free((char *) reader->callsites[n].function);
+		free((char *) reader->callsites[n].format);
+	}
+	free(reader->callsites);
+	free(reader->threads);
+	reader->callsites = NULL;
+	reader->n_callsites = 0;
+	reader->threads = NULL;
+	reader->n_threads = 0;
+	reader->last_ns = 0;
+	reader->last_sequence = 0;
+}
+
+/**
+ * @fn bool get_header(struct bin_reader *)
+ * @brief Read and check the rest of a file header, after its first byte.
+ * @return false if the file wasn't written on a compatible machine
+ */
+static bool get_header(struct bin_reader *reader) {
+	char magic[sizeof(BIN_MAGIC)];
+	uint16_t endian = 1;
+	unsigned char expected[] = {
+		sizeof(int), sizeof(long), sizeof(long long), sizeof(void *),
+		sizeof(size_t), sizeof(double), sizeof(long double),
+		*(unsigned char *) &endian,
+	};
+	unsigned char header[sizeof(expected)];
+
+	magic[0] = BIN_HEADER;
+	if (fread(magic + 1, 1, sizeof(magic) - 1, reader->in) != sizeof(magic) - 1)
+		return false;
+	if (memcmp(magic, BIN_MAGIC, sizeof(magic)) != 0) return false;
+	if (fread(header, 1, sizeof(header), reader->in) != sizeof(header))
+		return false;
+	if (memcmp(header, expected, sizeof(header)) != 0) return false;
+
+	reader_reset(reader);
+	return true;
+}
+
+/**
+ * @fn bool get_callsite(struct bin_reader *)
+ * @brief Read a log statement dictionary record.
+ * @return false on error
+ */
+static bool get_callsite(struct bin_reader *reader) {
+	uint64_t id, level, line;
+	char *file = NULL, *function = NULL, *format = NULL;
+
+	if (!get_varint(reader->in, &id) || !get_varint(reader->in, &level) ||
+		!get_varint(reader->in, &line)) return false;
+	if ((id != reader->n_callsites) || (level >= LL_N_VALUES)) return false;
+
+	struct bin_callsite *callsites = realloc(reader->callsites,
+		(reader->n_callsites + 1) * sizeof(*callsites));
+	if (callsites == NULL) return false;
+	reader->callsites = callsites;
+
+	bool ok = get_string(reader->in, &file) &&
+		get_string(reader->in, &function) && get_string(reader->in, &format);
+	if (!ok) {
+		// a cut-off record - keep only the complete ones
+		free(file);
+		free(function);
+		free(format);
+		return false;
+	}
+
+	callsites[id].file = file;
+	callsites[id].function = function;
+	callsites[id].format = format;
+	callsites[id].line = line;
+	callsites[id].level = level;
+	callsites[id].id = id;
+	reader->n_callsites++;
+
+	return true;
+}
+
+/**
+ * @fn bool get_thread(struct bin_reader *)
+ * @brief Read a thread dictionary record.
+ * @return false on error
+ */
+static bool get_thread(struct bin_reader *reader) {
+	uint64_t tid;
+	char *name;
+
+	if (!get_varint(reader->in, &tid)) return false;
+	if (!get_string(reader->in, &name)) return false;
+
+	struct log_origin *threads = realloc(reader->threads,
+		(reader->n_threads + 1) * sizeof(*threads));
+	if (threads == NULL) {
+		free(name);
+		return false;
+	}
+	reader->threads = threads;
+	threads[reader->n_threads].tid = tid;
+	snprintf(threads[reader->n_threads].name,
+		sizeof(threads[reader->n_threads].name), "%s", name ? name : "");
+	reader->n_threads++;
+	free(name);
+
+	return true;
+}
+
+/**
+ * @fn bool render_message(struct bin_reader *, char const *, size_t)
+ * @brief Render a message from its packed arguments into reader->msg.
+ *
+ * The buffer starts from the length of the packed arguments, and grows until
+ * the message fits. With MAX_MSG_SIZE set, the message is cut to that, as the
+ * text channels of the logging program had it.
+ *
+ * @param reader the reader, with the arguments in args
+ * @param format the format of the log statement
+ * @param len the length of the packed arguments
+ * @return false if out of memory
+ */
+static bool render_message(struct bin_reader *reader, char const *format,
+	size_t len) {
+#if MAX_MSG_SIZE > 0
+	size_t size = MAX_MSG_SIZE;
+	(void) len;
+#else
+	size_t size = BUFSIZ;
+	while (size < 2 * len) size *= 2;
+#endif
+
+	while (1) {
+		if (size > reader->msg_size) {
+			char *msg = realloc(reader->msg, size);
+			if (msg == NULL) return false;
+			reader->msg = msg;
+			reader->msg_size = size;
+		}
+
+		size_t n = log_render_deferred(reader->msg, reader->msg_size, format,
+			reader->args);
+		if ((MAX_MSG_SIZE > 0) || (n + 1 < reader->msg_size)) return true;
+
+		// it may have been cut short
+		size = reader->msg_size * 2;
+	}
+}
+
+/**
+ * @fn bool get_message(struct bin_reader *, int, FILE *, log_formatter_t)
+ * @brief Read a message record, and format it.
+ * @return false on error
+ */
+static bool get_message(struct bin_reader *reader, int type, FILE *out,
+	log_formatter_t formatter) {
+	uint64_t id, tid;
+	int64_t delta_ns, delta_sequence;
+	size_t len;
+
+	if (!get_varint(reader->in, &id) || !get_svarint(reader->in, &delta_ns) ||
+		!get_svarint(reader->in, &delta_sequence) ||
+		!get_varint(reader->in, &tid)) return false;
+	if (id >= reader->n_callsites) return false;
+	if (!get_bytes(reader, type == BIN_MESSAGE, &len)) return false;
+
+	struct bin_callsite *cs = &reader->callsites[id];
+	reader->last_ns += delta_ns;
+	reader->last_sequence += delta_sequence;
+	struct timespec ts = {
+		.tv_sec = reader->last_ns / 1000000000LL,
+		.tv_nsec = reader->last_ns % 1000000000LL,
+	};
+
+	char *text = reader->args;
+	if (type == BIN_PACKED) {
+		if (cs->format == NULL) return false;
+		if (!render_message(reader, cs->format, len)) return false;
+		text = reader->msg;
+	}
+
+	// the thread formats show the thread that logged the message
+	struct log_origin thread = {.tid = tid, .name = "unknown"};
+	for (size_t n = 0; n < reader->n_threads; n++) {
+		if (reader->threads[n].tid == (long) tid) thread = reader->threads[n];
+	}
+
+	log_set_origin(&thread);
+	formatter(out, reader->last_sequence, &ts, cs->level,
+		cs->file, cs->function, cs->line, text);
+	log_set_origin(NULL);
+
+	return true;
+}
+
+/**
+ * @fn long log_decode_binary(FILE *, FILE *, log_formatter_t)
+ * @brief Convert a log written with log_fmt_binary to another format.
+ *
+ * The log must have been written on a machine with the same data sizes and
+ * byte order - the packed arguments are in the native layout.
+ *
+ * @param in the binary log
+ * @param out the stream to write to
+ * @param formatter the formatter to use. log_fmt_json and log_fmt_xml get
+ * their head and tail.
+ * @return the number of messages, or -1 if the log is not valid
+ */
+long log_decode_binary(FILE *in, FILE *out, log_formatter_t formatter) {
+	struct bin_reader reader = {.in = in};
+	long n_msgs = 0;
+	bool ok = true;
+	int type;
+
+	if ((in == NULL) || (out == NULL) || (formatter == NULL)) return -1;
+
+	// a valid log starts with a header
+	if (((type = getc(in)) != EOF) &&
+		((type != BIN_HEADER) || !get_header(&reader))) {
+		return -1;
+	}
+	if (type == EOF) return 0;
+
+	if (formatter == log_fmt_xml) {
+		log_do_xml_head(out);
+	} else if (formatter == log_fmt_json) {
+		log_do_json_head(out, NULL);
+	}
+
+	while (ok && ((type = getc(in)) != EOF)) {
+		switch (type) {
+			case BIN_HEADER:
+				ok = get_header(&reader);
+				break;
+			case BIN_CALLSITE:
+				ok = get_callsite(&reader);
+				break;
+			case BIN_THREAD:
+				ok = get_thread(&reader);
+				break;
+			case BIN_PACKED:
+			case BIN_MESSAGE:
+				ok = get_message(&reader, type, out, formatter);
+				n_msgs++;
+				break;
+			default:
+				ok = false;
+				break;
+		}
+	}
+
+	if (formatter == log_fmt_xml) {
+		log_do_xml_tail(out);
+	} else if (formatter == log_fmt_json) {
+		log_do_json_tail(out);
+	}
+
+	reader_reset(&reader);
+	free(reader.args);
+	free(reader.msg);
+
+	return ok ? n_msgs : -1;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+/**
+ * @fn int log_fmt_binary(FILE *, int, struct timespec *, int,
+ * const char *, const char *, int, char *)
+ * @brief Select the binary format for a channel.
+ *
+ * Binary channels are written by the library directly, from the packed
+ * arguments of the message when possible. This function is only a marker,
+ * and writes nothing if called.
+ *
+ * Use utils/binary-decode to read the output.
+ *
+ * @param stream the output stream to write to
+ * @param sequence the sequence number of the message
+ * @param ts the struct timespec timestamp
+ * @param level the log level to print
+ * @param file the name of the file to print
+ * @param function the name of the function to print
+ * @param line the line number to print
+ * @param msg the actual use message to print
+ * @return 0
+ */
+int log_fmt_binary(FILE *stream, int sequence, struct timespec *ts, int level,
+	const char *file, const char *function, int line, char *msg) {
+	return 0;
+}
+
+#pragma GCC diagnostic pop
@@ -0,0 +1,410 @@
+/*
+ * (C) 2020 Edward Hetherington
+ * This code is licensed under MIT license (see LICENSE in top dir for details)
+ */
+
+/** @file       compress.c
+ *  @brief      Background gzip compression of rotated log files.
+ *  @details    A file channel rotated with log_set_rotation(), with compress
+ *  set, hands each file it rotates to log_compress_file(). The file is queued,
+ *  and compressed to pathname.gz by a pool of worker threads, with zlib.
+ *
+ *  The queue is only touched by the rotation thread and the workers - the
+ *  threads that log never wait for it. There are at most max_threads workers
+ *  (see log_set_compression()), started as the files are queued. Each runs at
+ *  the lowest CPU priority (nice 19), in the idle I/O class, so it only uses
+ *  the disk when nothing else wants it, and tells the kernel it won't read the
+ *  file again.
+ *
+ *  The file is written to pathname.gz.part, which is renamed to pathname.gz
+ *  when it is complete. Only then is the rotated file removed. A process that
+ *  stops part way leaves the rotated file, and a .part to be removed.
+ *
+ *  log_done() waits for the queued files to be compressed, and stops the
+ *  workers.
+ *
+ *  Without zlib (HAVE_ZLIB_H), the rotated files are left as they are.
+ *
+ *  @author     Edward Hetherington
+ */
+
+#include "config.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#define _GNU_SOURCE
+
+#define COMPRESS_MAX_THREADS 16		/**< the most workers */
+#define COMPRESS_CHUNK (64 * 1024)	/**< read from the file at a time */
+#define COMPRESS_NICE 19			/**< CPU priority of the workers */
+#define IOPRIO_WHO_PROCESS 1		/**< from linux/ioprio.h */
+#define IOPRIO_CLASS_IDLE 3			/**< from linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT 13		/**< from linux/ioprio.h */
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "tinylogger.h"
+#include "private.h"
+
+#if HAVE_ZLIB_H
+
+#include <zlib.h>
+
+/**
+ * @struct compress_job
+ * @brief A rotated file waiting to be compressed.
+ */
+struct compress_job {
+	struct compress_job	*next;		/**< next in the queue */
+	struct timespec		queued;		/**< when it was rotated */
+	char				pathname[];	/**< the rotated file */
+};
+
+/**
+ * @struct compress_config
+ * @brief The queue and the workers.
+ */
+static struct compress_config {
+	pthread_mutex_t	lock;		/**< for all of it */
+	pthread_cond_t	work;		/**< a file was queued, or stop */
+	pthread_cond_t	done;		/**< a worker finished a file */
+	struct compress_job *head;	/**< the queue */
+	struct compress_job *tail;	/**< the end of the queue */
+	int			max_threads;	/**< the most workers */
+	int			level;			/**< the zlib compression level */
+	int			n_threads;		/**< the workers started */
+	int			n_idle;			/**< the workers waiting for a file */
+	bool		stop;			/**< the workers should return */
+	pthread_t	threads[COMPRESS_MAX_THREADS];	/**< the workers */
+	unsigned long	pending;	/**< files queued or being compressed */
+	unsigned long	files;		/**< files compressed */
+	unsigned long	bytes_in;	/**< bytes read from them */
+	unsigned long	bytes_out;	/**< bytes of .gz written */
+	unsigned long	nsecs;		/**< time the workers spent on them */
+	unsigned long	lag_nsecs;	/**< rotation to .gz, of the last file */
+	unsigned long	max_lag_nsecs;	/**< the longest of those */
+} compress_config = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.head = NULL,
+	.tail = NULL,
+	.max_threads = 1,
+	.level = Z_DEFAULT_COMPRESSION,
+	.n_threads = 0,
+	.n_idle = 0,
+	.stop = false,
+};
+
+/**
+ * @fn unsigned long nsecs_since(struct timespec const *)
+ * @brief Get the time since a CLOCK_MONOTONIC time.
+ * @param start the time
+ * @return the nanoseconds since then
+ */
+static unsigned long nsecs_since(struct timespec const *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000000L +
+		(now.tv_nsec - start->tv_nsec);
+}
+
+/**
+ * @fn bool compress_file(char const *, int, char *, unsigned long *,
+ *     unsigned long *)
+ * @brief Compress a file to pathname.gz, and remove it.
+ * @param pathname the file
+ * @param level the zlib compression level
+ * @param chunk the worker's COMPRESS_CHUNK buffer
+ * @param bytes_in set to the length of the file
+ * @param bytes_out set to the length of the .gz
+ * @return false on error (errno is set)
+ */
+static bool compress_file(char const *pathname, int level, char *chunk,
+	unsigned long *bytes_in, unsigned long *bytes_out) {
+	char part[PATH_MAX], gz_name[PATH_MAX];
+	char mode[] = "wb6";
+	struct stat st;
+	ssize_t len;
+	int err = 0;
+
+	*bytes_in = 0;
+	*bytes_out = 0;
+
+	snprintf(gz_name, sizeof(gz_name), "%s.gz", pathname);
+	snprintf(part, sizeof(part), "%s.gz.part", pathname);
+	if (level > 0) mode[2] = '0' + level;
+
+	int in = open(pathname, O_RDONLY);
+	if (in < 0) return false;
+	int out = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		close(in);
+		return false;
+	}
+
+	gzFile gz = gzdopen(out, mode);
+	if (gz == NULL) {
+		close(out);
+		close(in);
+		unlink(part);
+		return false;
+	}
+
+	// the file is read once - don't keep it in the page cache
+	posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while ((err == 0) && ((len = read(in, chunk, COMPRESS_CHUNK)) != 0)) {
+		if (len < 0) {
+			if (errno != EINTR) err = errno;
+			continue;
+		}
+		if (gzwrite(gz, chunk, len) != len) {
+			// errno is only zlib's to set if the write itself failed
+			int errnum, write_errno = errno;
+			gzerror(gz, &errnum);
+			err = (errnum == Z_ERRNO) ? write_errno : EIO;
+		}
+		*bytes_in += len;
+	}
+	posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+	close(in);
+
+	// closes out too
+	int status = gzclose(gz);
+	if ((err == 0) && (status != Z_OK)) {
+		err = (status == Z_ERRNO) ? errno : EIO;
+	}
+	if (err != 0) {
+		unlink(part);
+		errno = err;
+		return false;
+	}
+
+	if (stat(part, &st) == 0) *bytes_out = st.st_size;
+	if (rename(part, gz_name) != 0) {
+		unlink(part);
+		return false;
+	}
+
+	return unlink(pathname) == 0;
+}
+
+/**
+ * @fn void *compress_worker(void *)
+ * @brief A worker - compress the queued files, at low priority, until
+ * stopped.
+ * @return NULL
+ */
+static void *compress_worker(void *arg) {
+	pid_t tid = syscall(SYS_gettid);
+	char *chunk = malloc(COMPRESS_CHUNK);
+	(void) arg;
+
+	pthread_setname_np(pthread_self(), "log_compress");
+
+	// out of the way of the threads doing real work
+	setpriority(PRIO_PROCESS, tid, COMPRESS_NICE);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+		IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+	pthread_mutex_lock(&compress_config.lock);
+	while (1) {
+		struct compress_job *job = compress_config.head;
+
+		if (job == NULL) {
+			if (compress_config.stop) break;
+			compress_config.n_idle++;
+			pthread_cond_wait(&compress_config.work, &compress_config.lock);
+			compress_config.n_idle--;
+			continue;
+		}
+
+		compress_config.head = job->next;
+		if (compress_config.head == NULL) compress_config.tail = NULL;
+		int level = compress_config.level;
+		pthread_mutex_unlock(&compress_config.lock);
+
+		struct timespec start;
+		unsigned long bytes_in, bytes_out;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		bool ok = (chunk != NULL) &&
+			compress_file(job->pathname, level, chunk, &bytes_in, &bytes_out);
+		if (!ok) {
+			char buf[BUFSIZ];
+			char *err_msg = strerror_r((chunk != NULL) ? errno : ENOMEM, buf,
+				sizeof(buf));
+			log_report_error("can't compress file %s:%s\n", job->pathname,
+				err_msg);
+		}
+		unsigned long nsecs = nsecs_since(&start);
+		unsigned long lag = nsecs_since(&job->queued);
+		free(job);
+
+		pthread_mutex_lock(&compress_config.lock);
+		compress_config.pending--;
+		compress_config.nsecs += nsecs;
+		if (ok) {
+			compress_config.files++;
+			compress_config.bytes_in += bytes_in;
+			compress_config.bytes_out += bytes_out;
+			compress_config.lag_nsecs = lag;
+			if (lag > compress_config.max_lag_nsecs) {
+				compress_config.max_lag_nsecs = lag;
+			}
+		}
+		pthread_cond_broadcast(&compress_config.done);
+	}
+	pthread_mutex_unlock(&compress_config.lock);
+	free(chunk);
+
+	return NULL;
+}
+
+/**
+ * @fn void log_compress_file(char const *)
+ * @brief Queue a rotated file to be compressed, and start a worker for it if
+ * they are all busy (and there are fewer than max_threads).
+ * @param pathname the file
+ */
+void log_compress_file(char const *pathname) {
+	struct compress_job *job = malloc(sizeof(*job) + strlen(pathname) + 1);
+
+	// it stays as it is
+	if (job == NULL) return;
+
+	job->next = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &job->queued);
+	strcpy(job->pathname, pathname);
+
+	pthread_mutex_lock(&compress_config.lock);
+
+	if (compress_config.tail != NULL) {
+		compress_config.tail->next = job;
+	} else {
+		compress_config.head = job;
+	}
+	compress_config.tail = job;
+	compress_config.pending++;
+
+	if ((compress_config.n_idle == 0) &&
+		(compress_config.n_threads < compress_config.max_threads)) {
+		compress_config.stop = false;
+		if (pthread_create(&compress_config.threads[compress_config.n_threads],
+			NULL, compress_worker, NULL) == 0) {
+			compress_config.n_threads++;
+		}
+	}
+	pthread_cond_signal(&compress_config.work);
+
+	pthread_mutex_unlock(&compress_config.lock);
+}
+
+/**
+ * @fn void log_compress_stop(void)
+ * @brief Wait for the queued files, and those being compressed, to be done,
+ * and stop the workers. Unless no worker could be started, compress_pending
+ * is 0 once it returns.
+ */
+void log_compress_stop(void) {
+	pthread_mutex_lock(&compress_config.lock);
+	// without a worker (it couldn't be started), nothing is done
+	while ((compress_config.pending > 0) && (compress_config.n_threads > 0)) {
+		pthread_cond_wait(&compress_config.done, &compress_config.lock);
+	}
+	int n_threads = compress_config.n_threads;
+	compress_config.stop = true;
+	compress_config.n_threads = 0;
+	pthread_cond_broadcast(&compress_config.work);
+	pthread_mutex_unlock(&compress_config.lock);
+
+	for (int n = 0; n < n_threads; n++) {
+		pthread_join(compress_config.threads[n], NULL);
+	}
+}
+
+/**
+ * @fn int log_set_compression(int max_threads, int level)
+ * @brief Set how rotated files are compressed.
+ *
+ * The files of a channel are compressed if it was given a struct
+ * log_rotation with compress set. See log_set_rotation().
+ *
+ * Files are compressed by up to max_threads worker threads at a time,
+ * started as the files are rotated. The workers run at the lowest CPU and
+ * I/O priority. The default is 1 worker, at zlib's default level.
+ *
+ * The workers already started stay until log_done().
+ *
+ * @param max_threads The most files to compress at a time, 1 to 16.
+ * @param level The zlib compression level, 1 (fastest) to 9 (smallest), or
+ * -1 for the default (6).
+ * @return 0 on success, -1 if an argument is out of range, or the library
+ * was built without zlib.
+ */
+int log_set_compression(int max_threads, int level) {
+	if ((max_threads < 1) || (max_threads > COMPRESS_MAX_THREADS)) return -1;
+	if ((level < -1) || (level == 0) || (level > 9)) return -1;
+
+	pthread_mutex_lock(&compress_config.lock);
+	compress_config.max_threads = max_threads;
+	compress_config.level = level;
+	pthread_mutex_unlock(&compress_config.lock);
+
+	return 0;
+}
+
+/**
+ * @fn void log_compress_get_stats(struct log_stats *)
+ * @brief Add the compression counters to the stats.
+ * @param stats the stats
+ */
+void log_compress_get_stats(struct log_stats *stats) {
+	pthread_mutex_lock(&compress_config.lock);
+
+	stats->compress_pending = compress_config.pending;
+	stats->compress_files = compress_config.files;
+	stats->compress_bytes_in = compress_config.bytes_in;
+	stats->compress_bytes_out = compress_config.bytes_out;
+	stats->compress_nsecs = compress_config.nsecs;
+	stats->compress_lag_nsecs = compress_config.lag_nsecs;
+	stats->compress_max_lag_nsecs = compress_config.max_lag_nsecs;
+
+	pthread_mutex_unlock(&compress_config.lock);
+}
+
+#else /* HAVE_ZLIB_H */
+
+/*
+ * Without <zlib.h>, the rotated files are left as they are.
+ */
+
+void log_compress_file(char const *pathname) {
+	(void) pathname;
+}
+
+void log_compress_stop(void) {
+}
+
+int log_set_compression(int max_threads, int level) {
+	(void) max_threads; (void) level;
+	return -1;
+}
+
+void log_compress_get_stats(struct log_stats *stats) {
+	(void) stats;
+}
+
+#endif /* HAVE_ZLIB_H */
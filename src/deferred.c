@@ -0,0 +1,518 @@
+/*
+ * (C) 2020 Edward Hetherington
+ * This code is licensed under MIT license (see LICENSE in top dir for details)
+ */
+
+/** @file       deferred.c
+ *  @brief      Deferred formatting of user messages.
+ *  @details    Instead of running vsnprintf() on the calling thread, the
+ *  arguments are copied into the thread's ring as raw bytes, along with the
+ *  format pointer. The writer thread renders the message later. Binary
+ *  channels write the packed arguments as they are (see binary.c).
+ *
+ *  The format string is walked once to learn the argument types. Numbers and
+ *  pointers are copied by value. The contents of %s strings are copied, so the
+ *  caller is free to change them as soon as log_msg() returns. %m captures
+ *  errno.
+ *
+ *  The format string itself is not copied, so it must still be there when the
+ *  writer thread gets to the record. Formatting is only deferred if the
+ *  format lies in a read-only segment of the program or of a library that was
+ *  loaded when asynchronous mode was first started (or a binary channel first
+ *  opened) - in practice, a string literal.
+ *  Anything else is formatted on the calling thread as before.
+ *
+ *  Formats with positional arguments (%1$d), %n, or wide strings and
+ *  characters (%ls, %S, %C) are also formatted on the calling thread.
+ *
+ *  @author     Edward Hetherington
+ */
+
+#include "config.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#define _GNU_SOURCE
+
+#define MAX_RO_SEGMENTS 64		/**< read-only segments remembered */
+#define SPEC_LEN 64				/**< longest conversion spec rebuilt */
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <link.h>
+#include <pthread.h>
+
+#include "tinylogger.h"
+#include "private.h"
+
+/**
+ * The type of argument consumed by a conversion
+ */
+enum arg_type {
+	ARG_NONE,			/**< %% */
+	ARG_INT,			/**< int, and everything promoted to it */
+	ARG_LONG,			/**< long */
+	ARG_LLONG,			/**< long long */
+	ARG_INTMAX,			/**< intmax_t */
+	ARG_SIZE,			/**< size_t */
+	ARG_PTRDIFF,		/**< ptrdiff_t */
+	ARG_DOUBLE,			/**< double */
+	ARG_LDOUBLE,		/**< long double */
+	ARG_POINTER,		/**< void * */
+	ARG_STRING,			/**< char *, contents copied */
+	ARG_ERRNO,			/**< %m, takes no argument but needs errno */
+	ARG_UNSUPPORTED		/**< can't be deferred */
+};
+
+/**
+ * @struct spec
+ * @brief A parsed conversion specification.
+ */
+struct spec {
+	size_t			len;			/**< length of the spec, including '%' */
+	enum arg_type	type;			/**< the argument it consumes */
+	bool			star_width;		/**< width is an int argument */
+	bool			star_precision;	/**< precision is an int argument */
+	int				precision;		/**< literal precision, -1 if none */
+};
+
+/**
+ * @struct ro_segment
+ * @brief A read-only range of the address space.
+ */
+static struct ro_segment {
+	uintptr_t start;	/**< first address */
+	uintptr_t end;		/**< one past the last address */
+} ro_segments[MAX_RO_SEGMENTS];
+static int n_ro_segments = 0;
+
+/**
+ * @fn int add_segments(struct dl_phdr_info *, size_t, void *)
+ * @brief dl_iterate_phdr() callback - remember the read-only PT_LOAD segments
+ */
+static int add_segments(struct dl_phdr_info *info, size_t size, void *data) {
+	(void) size;
+	(void) data;
+
+	for (int n = 0; n < info->dlpi_phnum; n++) {
+		ElfW(Phdr) const *phdr = &info->dlpi_phdr[n];
+
+		if ((phdr->p_type != PT_LOAD) || (phdr->p_flags & PF_W)) continue;
+		if (n_ro_segments >= MAX_RO_SEGMENTS) return 1;
+
+		ro_segments[n_ro_segments].start = info->dlpi_addr + phdr->p_vaddr;
+		ro_segments[n_ro_segments].end =
+			ro_segments[n_ro_segments].start + phdr->p_memsz;
+		n_ro_segments++;
+	}
+
+	return 0;
+}
+
+/**
+ * @fn void find_segments(void)
+ * @brief Find the read-only segments that format strings may live in.
+ *
+ * The main program is listed first, so it is checked first.
+ */
+static void find_segments(void) {
+	dl_iterate_phdr(add_segments, NULL);
+}
+
+/**
+ * @fn void log_defer_init(void)
+ * @brief Find the read-only segments, once.
+ *
+ * Called by log_start_async(), and when a binary channel is opened.
+ */
+void log_defer_init(void) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, find_segments);
+}
+
+/**
+ * @fn bool log_is_static(char const *)
+ * @brief Check if a format string will outlive the call to log_msg().
+ *
+ * log_defer_init() must have been called.
+ *
+ * @param format the format string
+ * @return true if it is in a read-only segment
+ */
+bool log_is_static(char const *format) {
+	uintptr_t addr = (uintptr_t) format;
+
+	for (int n = 0; n < n_ro_segments; n++) {
+		if ((addr >= ro_segments[n].start) && (addr < ro_segments[n].end)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @fn void parse_spec(char const *, struct spec *)
+ * @brief Parse the printf conversion spec that starts at p (at the '%').
+ *
+ * Flags, width, precision and length modifiers are those of glibc printf(3).
+ *
+ * @param p the '%' that starts the spec
+ * @param spec the parsed result
+ */
+static void parse_spec(char const *p, struct spec *spec) {
+	char const *start = p++;
+	int length = 0;		// 'h' = -1, "hh" = -2, 'l' = 1, "ll"/'q'/'L' = 2
+	char length_char = '\0';
+
+	spec->type = ARG_UNSUPPORTED;
+	spec->star_width = false;
+	spec->star_precision = false;
+	spec->precision = -1;
+
+	// flags
+	while (strchr("-+ #0'I", *p) && (*p != '\0')) p++;
+
+	// width - positional arguments aren't supported
+	if (*p == '*') {
+		spec->star_width = true;
+		p++;
+	}
+	while ((*p >= '0') && (*p <= '9')) p++;
+	if (*p == '$') goto done;
+
+	// precision
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->star_precision = true;
+			p++;
+		} else {
+			spec->precision = 0;
+			while ((*p >= '0') && (*p <= '9')) {
+				spec->precision = spec->precision * 10 + (*p++ - '0');
+			}
+		}
+	}
+
+	// length modifiers
+	while (strchr("hlqLjzZt", *p) && (*p != '\0')) {
+		switch (*p) {
+			case 'h': length--; break;
+			case 'l': length++; break;
+			case 'q': case 'L': length = 2; break;
+			default: length_char = *p; break;
+		}
+		p++;
+	}
+
+	switch (*p) {
+		case '%':
+			spec->type = ARG_NONE;
+			break;
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+			if (length_char == 'j') spec->type = ARG_INTMAX;
+			else if ((length_char == 'z') || (length_char == 'Z'))
+				spec->type = ARG_SIZE;
+			else if (length_char == 't') spec->type = ARG_PTRDIFF;
+			else if (length >= 2) spec->type = ARG_LLONG;
+			else if (length == 1) spec->type = ARG_LONG;
+			else spec->type = ARG_INT;
+			break;
+		case 'c':
+			// wint_t is promoted like an int, but needs the locale
+			if (length <= 0) spec->type = ARG_INT;
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			spec->type = (length >= 2) ? ARG_LDOUBLE : ARG_DOUBLE;
+			break;
+		case 's':
+			if (length <= 0) spec->type = ARG_STRING;
+			break;
+		case 'p':
+			spec->type = ARG_POINTER;
+			break;
+		case 'm':
+			spec->type = ARG_ERRNO;
+			break;
+		default:
+			// %n, %C, %S, and anything unknown
+			break;
+	}
+	if (*p != '\0') p++;
+
+done:
+	spec->len = p - start;
+}
+
+/**
+ * @fn void put(char *, size_t, size_t *, void const *, size_t)
+ * @brief Append bytes to the argument buffer if they fit, and count them
+ * whether they fit or not.
+ */
+static inline void put(char *buf, size_t room, size_t *used,
+	void const *value, size_t len) {
+	if (*used + len <= room) memcpy(buf + *used, value, len);
+	*used += len;
+}
+
+/**
+ * @fn long log_pack_args(char *, size_t, char const *, va_list)
+ * @brief Copy the arguments of format into buf.
+ *
+ * The format itself is not copied - see log_is_static().
+ *
+ * Like vsnprintf(), the length needed is returned even if it doesn't fit in
+ * buf. In that case, the caller makes room and calls again with a fresh
+ * va_list.
+ *
+ * @param buf the buffer to copy the arguments to
+ * @param room the length of buf
+ * @param format the printf format string
+ * @param args the arguments
+ * @return the length of the copied arguments, or -1 if the format can't be
+ * deferred
+ */
+long log_pack_args(char *buf, size_t room, char const *format, va_list args) {
+	size_t used = 0;
+	struct spec spec;
+
+	for (char const *p = format; (p = strchr(p, '%')) != NULL; p += spec.len) {
+		parse_spec(p, &spec);
+
+		if (spec.star_width) {
+			int width = va_arg(args, int);
+			put(buf, room, &used, &width, sizeof(width));
+		}
+		if (spec.star_precision) {
+			int precision = va_arg(args, int);
+			put(buf, room, &used, &precision, sizeof(precision));
+			spec.precision = precision;
+		}
+
+		switch (spec.type) {
+			case ARG_NONE:
+				break;
+			case ARG_INT: {
+				int value = va_arg(args, int);
+				put(buf, room, &used, &value, sizeof(value));
+			} break;
+			case ARG_LONG: {
+				long value = va_arg(args, long);
+				put(buf, room, &used, &value, sizeof(value));
+			} break;
+			case ARG_LLONG: {
+				long long value = va_arg(args, long long);
+				put(buf, room, &used, &value, sizeof(value));
+			} break;
+			case ARG_INTMAX: {
+				intmax_t value = va_arg(args, intmax_t);
+				put(buf, room, &used, &value, sizeof(value));
+			} break;
+			case ARG_SIZE: {
+				size_t value = va_arg(args, size_t);
+				put(buf, room, &used, &value, sizeof(value));
+			} break;
+			case ARG_PTRDIFF: {
+				ptrdiff_t value = va_arg(args, ptrdiff_t);
+				put(buf, room, &used, &value, sizeof(value));
+			} break;
+			case ARG_DOUBLE: {
+				double value = va_arg(args, double);
+				put(buf, room, &used, &value, sizeof(value));
+			} break;
+			case ARG_LDOUBLE: {
+				long double value = va_arg(args, long double);
+				put(buf, room, &used, &value, sizeof(value));
+			} break;
+			case ARG_POINTER: {
+				void *value = va_arg(args, void *);
+				put(buf, room, &used, &value, sizeof(value));
+			} break;
+			case ARG_STRING: {
+				// length, then the contents - SIZE_MAX marks a NULL pointer
+				char const *value = va_arg(args, char const *);
+				size_t len = SIZE_MAX;
+				if (value != NULL) {
+					len = (spec.precision >= 0) ?
+						strnlen(value, spec.precision) : strlen(value);
+				}
+				put(buf, room, &used, &len, sizeof(len));
+				if (value != NULL) {
+					put(buf, room, &used, value, len);
+					put(buf, room, &used, "", 1);
+				}
+			} break;
+			case ARG_ERRNO: {
+				int value = errno;
+				put(buf, room, &used, &value, sizeof(value));
+			} break;
+			case ARG_UNSUPPORTED:
+				return -1;
+		}
+	}
+
+	return used;
+}
+
+/**
+ * @fn void get(char const **, void *, size_t)
+ * @brief Take the next argument out of the argument buffer.
+ */
+static inline void get(char const **args, void *value, size_t len) {
+	memcpy(value, *args, len);
+	*args += len;
+}
+
+/**
+ * @fn size_t log_render_deferred(char *, size_t, char const *, char const *)
+ * @brief Render a message from its format and the arguments copied by
+ * log_pack_args().
+ *
+ * Each conversion is rebuilt as a format of its own, with any '*' width or
+ * precision filled in, and passed to snprintf() with its argument. The result
+ * is identical to that of vsnprintf() on the calling thread.
+ *
+ * @param buf the buffer for the message
+ * @param len the length of buf
+ * @param format the printf format string
+ * @param args the copied arguments
+ * @return the length of the message in buf (truncated to fit)
+ */
+size_t log_render_deferred(char *buf, size_t len, char const *format,
+	char const *args) {
+	size_t used = 0;
+	struct spec spec;
+	char const *p = format;
+
+	if (len == 0) return 0;
+	buf[0] = '\0';
+
+	while (used < len - 1) {
+		char sub[SPEC_LEN];
+		char *out = buf + used;
+		size_t room = len - used;
+		size_t sub_len = 0;
+		int width = 0, precision = -1;
+		int n = 0;
+
+		// literal text up to the next conversion
+		char const *pct = strchrnul(p, '%');
+		if (pct != p) {
+			size_t text_len = pct - p;
+			if (text_len > room - 1) text_len = room - 1;
+			memcpy(out, p, text_len);
+			used += text_len;
+			buf[used] = '\0';
+			p = pct;
+			continue;
+		}
+		if (*p == '\0') break;
+
+		parse_spec(p, &spec);
+		if (spec.star_width) get(&args, &width, sizeof(width));
+		if (spec.star_precision) get(&args, &precision, sizeof(precision));
+
+		// rebuild the spec with the '*'s replaced by their values
+		for (size_t i = 0; (i < spec.len) && (sub_len < sizeof(sub) - 16); i++) {
+			if (p[i] != '*') {
+				sub[sub_len++] = p[i];
+			} else if (spec.star_width && (p[i - 1] != '.')) {
+				sub_len += snprintf(sub + sub_len, sizeof(sub) - sub_len,
+					"%d", width);
+			} else if (precision >= 0) {
+				sub_len += snprintf(sub + sub_len, sizeof(sub) - sub_len,
+					"%d", precision);
+			} else {
+				// a negative precision is taken as if it were omitted
+				sub_len--;
+			}
+		}
+		sub[sub_len] = '\0';
+		p += spec.len;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+		switch (spec.type) {
+			case ARG_NONE:
+				n = snprintf(out, room, "%%");
+				break;
+			case ARG_INT: {
+				int value;
+				get(&args, &value, sizeof(value));
+				n = snprintf(out, room, sub, value);
+			} break;
+			case ARG_LONG: {
+				long value;
+				get(&args, &value, sizeof(value));
+				n = snprintf(out, room, sub, value);
+			} break;
+			case ARG_LLONG: {
+				long long value;
+				get(&args, &value, sizeof(value));
+				n = snprintf(out, room, sub, value);
+			} break;
+			case ARG_INTMAX: {
+				intmax_t value;
+				get(&args, &value, sizeof(value));
+				n = snprintf(out, room, sub, value);
+			} break;
+			case ARG_SIZE: {
+				size_t value;
+				get(&args, &value, sizeof(value));
+				n = snprintf(out, room, sub, value);
+			} break;
+			case ARG_PTRDIFF: {
+				ptrdiff_t value;
+				get(&args, &value, sizeof(value));
+				n = snprintf(out, room, sub, value);
+			} break;
+			case ARG_DOUBLE: {
+				double value;
+				get(&args, &value, sizeof(value));
+				n = snprintf(out, room, sub, value);
+			} break;
+			case ARG_LDOUBLE: {
+				long double value;
+				get(&args, &value, sizeof(value));
+				n = snprintf(out, room, sub, value);
+			} break;
+			case ARG_POINTER: {
+				void *value;
+				get(&args, &value, sizeof(value));
+				n = snprintf(out, room, sub, value);
+			} break;
+			case ARG_STRING: {
+				size_t str_len;
+				get(&args, &str_len, sizeof(str_len));
+				if (str_len == SIZE_MAX) {
+					n = snprintf(out, room, sub, (char *) NULL);
+				} else {
+					n = snprintf(out, room, sub, args);
+					args += str_len + 1;
+				}
+			} break;
+			case ARG_ERRNO: {
+				int value;
+				get(&args, &value, sizeof(value));
+				errno = value;
+				n = snprintf(out, room, sub);
+			} break;
+			case ARG_UNSUPPORTED:
+				// log_pack_args() doesn't let these through
+				break;
+		}
+#pragma GCC diagnostic pop
+
+		if (n < 0) n = 0;
+		used += ((size_t) n < room) ? (size_t) n : room - 1;
+	}
+
+	return used;
+}
@@ -0,0 +1,120 @@
+/*
+ * (C) 2020 Edward Hetherington
+ * This code is licensed under MIT license (see LICENSE in top dir for details)
+ */
+
+/** @file       digits.c
+ *  @brief      Integer to decimal conversion for the formatters.
+ *  @details    The formatters print a lot of small integers: the fields of
+ *  the timestamp, line numbers, thread ids and sequence numbers. snprintf()
+ *  parses its format and handles every case for each of them.
+ *
+ *  These write the digits straight into a buffer, two at a time from a table.
+ *  Each returns a pointer just past the last character written, so calls can
+ *  be chained. No terminating null is written.
+ *
+ *  They are public for use by custom formatters.
+ *
+ *  @author     Edward Hetherington
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "tinylogger.h"
+#include "private.h"
+
+/**
+ * "00" to "99", the two digit pairs for each value
+ */
+static char const pairs[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/**
+ * @fn char *log_put_uint2(char *buf, unsigned value)
+ * @brief Write a 2 digit field, with a leading zero if needed.
+ * @param buf where to write the digits
+ * @param value the value, 0 - 99
+ * @return buf + 2
+ */
+char *log_put_uint2(char *buf, unsigned value) {
+	memcpy(buf, pairs + (value % 100) * 2, 2);
+	return buf + 2;
+}
+
+/**
+ * @fn char *log_put_uint4(char *buf, unsigned value)
+ * @brief Write a 4 digit field, with leading zeros if needed.
+ * @param buf where to write the digits
+ * @param value the value, 0 - 9999
+ * @return buf + 4
+ */
+char *log_put_uint4(char *buf, unsigned value) {
+	value %= 10000;
+	memcpy(buf, pairs + (value / 100) * 2, 2);
+	memcpy(buf + 2, pairs + (value % 100) * 2, 2);
+	return buf + 4;
+}
+
+/**
+ * @fn char *log_put_uint9(char *buf, unsigned long value)
+ * @brief Write a 9 digit field, with leading zeros if needed. Suits the
+ * nanoseconds of a struct timespec.
+ * @param buf where to write the digits
+ * @param value the value, 0 - 999999999
+ * @return buf + 9
+ */
+char *log_put_uint9(char *buf, unsigned long value) {
+	unsigned low;
+
+	value %= 1000000000UL;
+	buf[0] = '0' + value / 100000000UL;
+	low = value % 100000000UL;
+	buf = log_put_uint4(buf + 1, low / 10000);
+	return log_put_uint4(buf, low % 10000);
+}
+
+/**
+ * @fn char *log_put_long(char *buf, long value)
+ * @brief Write a signed long, as "%ld" would.
+ * @param buf where to write the digits. Room for LOG_LONG_LEN - 1 characters
+ * is needed.
+ * @param value the value
+ * @return a pointer past the last digit
+ */
+char *log_put_long(char *buf, long value) {
+	char digits[LOG_LONG_LEN];
+	char *p = digits + sizeof(digits);
+	unsigned long u = value;
+
+	if (value < 0) {
+		*buf++ = '-';
+		u = -u;
+	}
+
+	while (u >= 100) {
+		p -= 2;
+		memcpy(p, pairs + (u % 100) * 2, 2);
+		u /= 100;
+	}
+	if (u >= 10) {
+		p -= 2;
+		memcpy(p, pairs + u * 2, 2);
+	} else {
+		*--p = '0' + u;
+	}
+
+	size_t len = digits + sizeof(digits) - p;
+	memcpy(buf, p, len);
+	return buf + len;
+}
@@ -0,0 +1,434 @@
+/*
+ * (C) 2020 Edward Hetherington
+ * This code is licensed under MIT license (see LICENSE in top dir for details)
+ */
+
+/** @file       escape.c
+ *  @brief      Escape messages for the json and xml formatters.
+ *  @details    Most messages have nothing to escape, so the formatters spend
+ *  its time copying clean runs of characters. Here the input is classified a
+ *  block at a time, and clean blocks are copied whole.
+ *
+ *  On x86 an SSE2 version (16 bytes at a time) is the baseline. An AVX2
+ *  version (32 bytes at a time) is selected at run time if the processor
+ *  supports it. Elsewhere a table driven scalar version is used.
+ *
+ *  Each special character in a block is found from the bit mask of the
+ *  block, rather than by classifying the input again after it. That keeps the
+ *  cost of an escape close to that of the scalar version.
+ *
+ *  The blocks, and the clean runs within them, are read and written whole.
+ *  So:
+ *  - Bytes past the terminating null may be read, but never past the end of
+ *    the page the null is in. Near the end of a page, the input is handled a
+ *    byte at a time.
+ *  - Up to ESCAPE_SLACK bytes past the end of the output may be written.
+ *
+ *  @author     Edward Hetherington
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define ESCAPE_X86 1	/**< use the SSE2 and AVX2 versions */
+#include <immintrin.h>
+#endif
+
+#include "tinylogger.h"
+#include "private.h"
+
+/**
+ * An escape sequence, padded so that it can be copied as a fixed size block.
+ */
+struct escape {
+	char			text[8];	/**< the escape sequence, null terminated */
+	unsigned char	len;		/**< the length of the escape sequence */
+};
+
+/**
+ * The json escape sequence for each character that needs one: the control
+ * characters, '"' and '\\'.
+ */
+static struct escape const json_escapes[256] = {
+	[0x00] = {"\\u0000", 6}, [0x01] = {"\\u0001", 6}, // 0x00 hmmm...
+	[0x02] = {"\\u0002", 6}, [0x03] = {"\\u0003", 6},
+	[0x04] = {"\\u0004", 6}, [0x05] = {"\\u0005", 6},
+	[0x06] = {"\\u0006", 6}, [0x07] = {"\\u0007", 6},
+	['\b'] = {"\\b", 2},     ['\t'] = {"\\t", 2},     // 0x08, 0x09
+	['\n'] = {"\\n", 2},     [0x0B] = {"\\u000B", 6}, // 0x0A
+	['\f'] = {"\\f", 2},     ['\r'] = {"\\r", 2},     // 0x0C, 0x0D
+	[0x0E] = {"\\u000E", 6}, [0x0F] = {"\\u000F", 6},
+	[0x10] = {"\\u0010", 6}, [0x11] = {"\\u0011", 6},
+	[0x12] = {"\\u0012", 6}, [0x13] = {"\\u0013", 6},
+	[0x14] = {"\\u0014", 6}, [0x15] = {"\\u0015", 6},
+	[0x16] = {"\\u0016", 6}, [0x17] = {"\\u0017", 6},
+	[0x18] = {"\\u0018", 6}, [0x19] = {"\\u0019", 6},
+	[0x1A] = {"\\u001A", 6}, [0x1B] = {"\\u001B", 6},
+	[0x1C] = {"\\u001C", 6}, [0x1D] = {"\\u001D", 6},
+	[0x1E] = {"\\u001E", 6}, [0x1F] = {"\\u001F", 6},
+	['"']  = {"\\\"", 2},    // 0x22
+	['\\'] = {"\\\\", 2},    // 0x5C
+};
+
+/**
+ * The xml entity for each character that needs one.
+ */
+static struct escape const xml_escapes[256] = {
+	['&']  = {"&amp;", 5},
+	['<']  = {"&lt;", 4},
+	['>']  = {"&gt;", 4},
+	['"']  = {"&quot;", 6},
+	['\''] = {"&apos;", 6},
+};
+
+/**
+ * @fn char *put_escape(char *, struct escape const *)
+ * @brief Write an escape sequence.
+ * @return a pointer past the escape sequence
+ */
+static inline char *put_escape(char *out, struct escape const *esc) {
+	memcpy(out, esc->text, sizeof(esc->text));
+	return out + esc->len;
+}
+
+/**
+ * @fn char *escape_scalar(char *, char const *, struct escape const *)
+ * @brief Escape a string a byte at a time.
+ * @param out where to write
+ * @param in the string to escape
+ * @param table the escape sequence for each character
+ * @return a pointer past the last character written
+ */
+static inline char *escape_scalar(char *out, char const *in,
+	struct escape const *table) {
+	for (; *in != '\0'; in++) {
+		struct escape const *esc = &table[(unsigned char) *in];
+
+		if (esc->len != 0) {
+			out = put_escape(out, esc);
+		} else {
+			*out++ = *in;
+		}
+	}
+
+	return out;
+}
+
+/**
+ * @fn char *escape_json_scalar(char *, char const *)
+ * @brief Escape a string for json a byte at a time.
+ */
+static char *escape_json_scalar(char *out, char const *in) {
+	return escape_scalar(out, in, json_escapes);
+}
+
+/**
+ * @fn char *escape_xml_scalar(char *, char const *)
+ * @brief Escape a string for xml a byte at a time.
+ */
+static char *escape_xml_scalar(char *out, char const *in) {
+	return escape_scalar(out, in, xml_escapes);
+}
+
+#if ESCAPE_X86
+/**
+ * The smallest page size. A read that doesn't cross a multiple of it doesn't
+ * cross into the next page.
+ */
+#define PAGE_MIN 4096
+
+/**
+ * @fn unsigned json_mask_sse2(__m128i)
+ * @brief Classify 16 bytes for json.
+ * @return a bit for each byte that json requires to be escaped, or that is
+ * the terminating null
+ */
+static inline unsigned json_mask_sse2(__m128i block) {
+	__m128i const control = _mm_set1_epi8(0x1F);
+	__m128i const quote = _mm_set1_epi8('"');
+	__m128i const backslash = _mm_set1_epi8('\\');
+
+	// block <= 0x1F, unsigned
+	__m128i special = _mm_cmpeq_epi8(_mm_min_epu8(block, control), block);
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(block, quote));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(block, backslash));
+
+	return _mm_movemask_epi8(special);
+}
+
+/**
+ * @fn unsigned xml_mask_sse2(__m128i)
+ * @brief Classify 16 bytes for xml.
+ * @return a bit for each byte that has an xml entity, or that is the
+ * terminating null
+ */
+static inline unsigned xml_mask_sse2(__m128i block) {
+	__m128i special = _mm_cmpeq_epi8(block, _mm_setzero_si128());
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8('&')));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8('<')));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8('>')));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+	special =
+		_mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8('\'')));
+
+	return _mm_movemask_epi8(special);
+}
+
+/**
+ * @fn char *escape_sse2(char *, char const *, struct escape const *,
+ *     unsigned (*)(__m128i))
+ * @brief Escape a string 16 bytes at a time.
+ * @param out where to write
+ * @param in the string to escape
+ * @param table the escape sequence for each character
+ * @param classify finds the special characters, and the null, in a block
+ * @return a pointer past the last character written
+ */
+static inline char *escape_sse2(char *out, char const *in,
+	struct escape const *table, unsigned (*classify)(__m128i)) {
+	for (;;) {
+		if (((uintptr_t) in & (PAGE_MIN - 1)) > PAGE_MIN - 2 * 16) {
+			// a block, or a run copied from it, could cross into the next page
+			struct escape const *esc = &table[(unsigned char) *in];
+			if (*in == '\0') return out;
+			if (esc->len != 0) {
+				out = put_escape(out, esc);
+			} else {
+				*out++ = *in;
+			}
+			in++;
+			continue;
+		}
+
+		__m128i block = _mm_loadu_si128((__m128i const *) in);
+		unsigned mask = classify(block);
+		if (mask == 0) {
+			_mm_storeu_si128((__m128i *) out, block);
+			in += 16;
+			out += 16;
+			continue;
+		}
+
+		// each special character in the block, and the clean run ahead of it
+		char const *run = in;
+		for (; mask != 0; mask &= mask - 1) {
+			char const *special = in + __builtin_ctz(mask);
+			_mm_storeu_si128((__m128i *) out,
+				_mm_loadu_si128((__m128i const *) run));
+			out += special - run;
+			if (*special == '\0') return out;
+			out = put_escape(out, &table[(unsigned char) *special]);
+			run = special + 1;
+		}
+
+		// the clean run after the last special character
+		_mm_storeu_si128((__m128i *) out,
+			_mm_loadu_si128((__m128i const *) run));
+		out += in + 16 - run;
+		in += 16;
+	}
+}
+
+/**
+ * @fn char *escape_json_sse2(char *, char const *)
+ * @brief Escape a string for json 16 bytes at a time.
+ */
+static char *escape_json_sse2(char *out, char const *in) {
+	return escape_sse2(out, in, json_escapes, json_mask_sse2);
+}
+
+/**
+ * @fn char *escape_xml_sse2(char *, char const *)
+ * @brief Escape a string for xml 16 bytes at a time.
+ */
+static char *escape_xml_sse2(char *out, char const *in) {
+	return escape_sse2(out, in, xml_escapes, xml_mask_sse2);
+}
+
+/**
+ * @fn unsigned json_mask_avx2(__m256i)
+ * @brief Classify 32 bytes for json.
+ * @return a bit for each byte that json requires to be escaped, or that is
+ * the terminating null
+ */
+__attribute__((target("avx2")))
+static inline unsigned json_mask_avx2(__m256i block) {
+	__m256i const control = _mm256_set1_epi8(0x1F);
+	__m256i const quote = _mm256_set1_epi8('"');
+	__m256i const backslash = _mm256_set1_epi8('\\');
+
+	// block <= 0x1F, unsigned
+	__m256i special =
+		_mm256_cmpeq_epi8(_mm256_min_epu8(block, control), block);
+	special = _mm256_or_si256(special, _mm256_cmpeq_epi8(block, quote));
+	special = _mm256_or_si256(special, _mm256_cmpeq_epi8(block, backslash));
+
+	return _mm256_movemask_epi8(special);
+}
+
+/**
+ * @fn unsigned xml_mask_avx2(__m256i)
+ * @brief Classify 32 bytes for xml.
+ * @return a bit for each byte that has an xml entity, or that is the
+ * terminating null
+ */
+__attribute__((target("avx2")))
+static inline unsigned xml_mask_avx2(__m256i block) {
+	__m256i special = _mm256_cmpeq_epi8(block, _mm256_setzero_si256());
+	special = _mm256_or_si256(special,
+		_mm256_cmpeq_epi8(block, _mm256_set1_epi8('&')));
+	special = _mm256_or_si256(special,
+		_mm256_cmpeq_epi8(block, _mm256_set1_epi8('<')));
+	special = _mm256_or_si256(special,
+		_mm256_cmpeq_epi8(block, _mm256_set1_epi8('>')));
+	special = _mm256_or_si256(special,
+		_mm256_cmpeq_epi8(block, _mm256_set1_epi8('"')));
+	special = _mm256_or_si256(special,
+		_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\'')));
+
+	return _mm256_movemask_epi8(special);
+}
+
+/**
+ * @fn char *escape_avx2(char *, char const *, struct escape const *,
+ *     unsigned (*)(__m256i))
+ * @brief Escape a string 32 bytes at a time.
+ * @param out where to write
+ * @param in the string to escape
+ * @param table the escape sequence for each character
+ * @param classify finds the special characters, and the null, in a block
+ * @return a pointer past the last character written
+ */
+__attribute__((target("avx2")))
+static inline char *escape_avx2(char *out, char const *in,
+	struct escape const *table, unsigned (*classify)(__m256i)) {
+	for (;;) {
+		if (((uintptr_t) in & (PAGE_MIN - 1)) > PAGE_MIN - 2 * 32) {
+			// a block, or a run copied from it, could cross into the next page
+			struct escape const *esc = &table[(unsigned char) *in];
+			if (*in == '\0') return out;
+			if (esc->len != 0) {
+				out = put_escape(out, esc);
+			} else {
+				*out++ = *in;
+			}
+			in++;
+			continue;
+		}
+
+		__m256i block = _mm256_loadu_si256((__m256i const *) in);
+		unsigned mask = classify(block);
+		if (mask == 0) {
+			_mm256_storeu_si256((__m256i *) out, block);
+			in += 32;
+			out += 32;
+			continue;
+		}
+
+		// each special character in the block, and the clean run ahead of it
+		char const *run = in;
+		for (; mask != 0; mask &= mask - 1) {
+			char const *special = in + __builtin_ctz(mask);
+			_mm256_storeu_si256((__m256i *) out,
+				_mm256_loadu_si256((__m256i const *) run));
+			out += special - run;
+			if (*special == '\0') return out;
+			out = put_escape(out, &table[(unsigned char) *special]);
+			run = special + 1;
+		}
+
+		// the clean run after the last special character
+		_mm256_storeu_si256((__m256i *) out,
+			_mm256_loadu_si256((__m256i const *) run));
+		out += in + 32 - run;
+		in += 32;
+	}
+}
+
+/**
+ * @fn char *escape_json_avx2(char *, char const *)
+ * @brief Escape a string for json 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static char *escape_json_avx2(char *out, char const *in) {
+	return escape_avx2(out, in, json_escapes, json_mask_avx2);
+}
+
+/**
+ * @fn char *escape_xml_avx2(char *, char const *)
+ * @brief Escape a string for xml 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static char *escape_xml_avx2(char *out, char const *in) {
+	return escape_avx2(out, in, xml_escapes, xml_mask_avx2);
+}
+#endif /* ESCAPE_X86 */
+
+/**
+ * The json escaper selected for this processor.
+ */
+static char *(*escape_json)(char *, char const *) = escape_json_scalar;
+
+/**
+ * The xml escaper selected for this processor.
+ */
+static char *(*escape_xml)(char *, char const *) = escape_xml_scalar;
+
+/**
+ * pthread_once() control for select_escapers()
+ */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/**
+ * @fn void select_escapers(void)
+ * @brief Select the fastest escapers the processor supports.
+ */
+static void select_escapers(void) {
+#if ESCAPE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		escape_json = escape_json_avx2;
+		escape_xml = escape_xml_avx2;
+	} else {
+		escape_json = escape_json_sse2;
+		escape_xml = escape_xml_sse2;
+	}
+#endif
+}
+
+/**
+ * @fn char *log_escape_json(char *, char const *)
+ * @brief Escape &apos;\\b&apos;, &apos;\\f&apos;,
+ *     &apos;\\n&apos;,  &apos;\\r&apos;,
+ *     &apos;\\t&apos;, &apos;\\"&apos;, &apos;\\\\&apos; and the other
+ *     control characters.
+ *
+ * @param out where to write. Room for JSON_ESCAPE_MAX times the length of in,
+ * plus ESCAPE_SLACK, is needed.
+ * @param in the string to escape
+ * @return a pointer past the last character written. No null is written.
+ */
+char *log_escape_json(char *out, char const *in) {
+	pthread_once(&once, select_escapers);
+	return escape_json(out, in);
+}
+
+/**
+ * @fn char *log_escape_xml(char *, char const *)
+ * @brief Escape '&', '<', '>', '\"', '\''
+ * No special treatment of non-ascii characters is performed.
+ *
+ * @param out where to write. Room for XML_ESCAPE_MAX times the length of in,
+ * plus ESCAPE_SLACK, is needed.
+ * @param in the string to escape
+ * @return a pointer past the last character written. No null is written.
+ */
+char *log_escape_xml(char *out, char const *in) {
+	pthread_once(&once, select_escapers);
+	return escape_xml(out, in);
+}
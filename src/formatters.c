@@ -12,6 +12,10 @@
  *
  *  log_fmt_elapsed_time() is unusual as it uses an elapsed time timestamp.
  *
+ *  Each log_fmt_xxx() is a wrapper of its buffer version, log_bfmt_xxx(),
+ *  which appends the record to a struct log_buf rather than writing it to a
+ *  stream. The buffer versions take the message as a struct log_record.
+ *
  *  log_format_timestamp() and log_get_level() are not message formatters.
  *
  *  log_format_timestamp() is exposed for use by custom message formatters.
@@ -31,12 +35,10 @@
 #define TASK_COMM_LEN 16
 #define NAME_LEN TASK_COMM_LEN  // includes null termination
 
-#define FMT_STRING_STD "%04d-%02d-%02d %02d:%02d:%02d.%09ld"
-#define FMT_STRING_ISO "%04d-%02d-%02dT%02d:%02d:%02d.%09ld"
-
 #endif /* DOXYGEN_SHOULD_SKIP_THIS */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -106,28 +108,84 @@ LOG_LEVEL log_get_level(const char *label) {
  * @param len The length of that buffer.
  */
 static void do_offset(struct tm const *tm, char *buf, int len) {
-static char *fmt_min  = "%+03ld:%02ld";
-static char *fmt_sec  = "%+03ld:%02ld:%02ld";
-	long hours, minutes, seconds;
-	long off_remainder;
-
-	hours = tm->tm_gmtoff / (60 *60);
-	off_remainder = tm->tm_gmtoff % (60 * 60);
-	minutes = off_remainder / 60;
-	off_remainder = off_remainder % 60;
-	seconds = off_remainder;
-
-	if (seconds == 0) {
-		snprintf(buf, len, fmt_min, hours, minutes);
-	} else {
-		snprintf(buf, len, fmt_sec, hours, minutes, seconds);
+	long offset = tm->tm_gmtoff;
+	char *p = buf;
+
+	if (len < 10) return;
+
+	// "+hh:mm", or "+hh:mm:ss" if there are seconds
+	*p++ = (offset < 0) ? '-' : '+';
+	if (offset < 0) offset = -offset;
+	p = log_put_uint2(p, offset / (60 * 60));
+	*p++ = ':';
+	p = log_put_uint2(p, offset / 60 % 60);
+	if (offset % 60 != 0) {
+		*p++ = ':';
+		p = log_put_uint2(p, offset % 60);
 	}
+	*p = '\0';
 	/*
 	 * Consider adding the timezone.
 	printf(" (%s)\n", tm->tm_zone);
 	*/
 }
 
+/**
+ * @struct ts_cache
+ * @brief The date and time of the last second formatted by the calling
+ * thread.
+ *
+ * localtime_r() and the formatting of the date and time are only done when
+ * the second changes. Within the same second, only the fraction is formatted.
+ * So a change of TZ (and tzset()) shows from the next second on.
+ *
+ * The date, a 9 digit fraction and the longest offset, with the null, fit in
+ * TIMESTAMP_LEN.
+ */
+static __thread struct ts_cache {
+	bool	valid;			/**< sec, date and offset have been filled in */
+	time_t	sec;			/**< the second cached */
+	char	date[20];		/**< "YYYY-MM-DD HH:MM:SS" */
+	char	offset[10];		/**< the UTC offset "+hh:mm" or "+hh:mm:ss" */
+} ts_cache;
+
+/**
+ * @fn struct ts_cache *get_ts_cache(time_t)
+ * @brief Get the calling thread's cached date, time and UTC offset for a
+ * second, filling it in if it is for a different second.
+ * @param sec the second
+ * @return the cache, or NULL if localtime_r() failed
+ */
+static struct ts_cache *get_ts_cache(time_t sec) {
+	struct ts_cache *cache = &ts_cache;
+	struct tm	tm;
+
+	if (cache->valid && (cache->sec == sec)) return cache;
+
+	cache->valid = false;
+	if (localtime_r(&sec, &tm) != &tm) return NULL;
+
+	// "YYYY-MM-DD HH:MM:SS"
+	char *p = log_put_uint4(cache->date, tm.tm_year + 1900);
+	*p++ = '-';
+	p = log_put_uint2(p, tm.tm_mon + 1);
+	*p++ = '-';
+	p = log_put_uint2(p, tm.tm_mday);
+	*p++ = ' ';
+	p = log_put_uint2(p, tm.tm_hour);
+	*p++ = ':';
+	p = log_put_uint2(p, tm.tm_min);
+	*p++ = ':';
+	p = log_put_uint2(p, tm.tm_sec);
+	*p = '\0';
+
+	do_offset(&tm, cache->offset, sizeof(cache->offset));
+	cache->sec = sec;
+	cache->valid = true;
+
+	return cache;
+}
+
 /**
  * @fn void log_format_timestamp(struct timespec *ts, LOG_TS_FORMAT format,
  * 	char *buf, int len)
@@ -149,19 +207,26 @@ static char *fmt_sec  = "%+03ld:%02ld:%02ld";
  *  - FMT_DELTA = 64,       print an elapsed time (used in
  *                          log_format_elapsed_time())
  *
+ * The date, time and UTC offset are cached per thread, and only worked out
+ * again when the second changes. A change of TZ within the second (followed
+ * by tzset()) isn't seen until the next second.
+ *
+ * len is not used to cut the timestamp short. The longest timestamp fits in
+ * TIMESTAMP_LEN characters, and nothing is written to a shorter buffer (an
+ * error is printed to stderr instead).
+ *
  * @param ts the previously obtained struct timespec timestamp.
  * @param format the format of the fraction of second to display
  * @param buf the buffer to format the timestamp to
  * @param len the length of that buffer. Must be >= TIMESTAMP_LEN
  * @note Exposed as public for use by custom message formatters.
  */
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-truncation"
 void log_format_timestamp(struct timespec *ts, LOG_TS_FORMAT format,
 	char *buf, int len) {
-	struct tm	tm;
-	char const *fmt = FMT_STRING_STD;
+	struct ts_cache *cache;
+	bool iso = false;
 	bool want_offset = false;
+	int n_digits;
 
 	if (format >= LOG_FMT_DELTA) {
 		log_format_delta(ts, format, buf, len);
@@ -169,7 +234,7 @@ void log_format_timestamp(struct timespec *ts, LOG_TS_FORMAT format,
 	}
 
 	if (format & FMT_ISO) {
-		fmt = FMT_STRING_ISO;
+		iso = true;
 		format &= ~FMT_ISO;
 	}
 
@@ -185,28 +250,432 @@ void log_format_timestamp(struct timespec *ts, LOG_TS_FORMAT format,
 		return;
 	}
 
-	if (localtime_r(&(ts->tv_sec), &tm) == &tm) {
-		snprintf(buf, len, fmt,
-			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-			tm.tm_hour, tm.tm_min, tm.tm_sec,
-			ts->tv_nsec);
-		switch (format) {
-			case SP_NONE:  buf[19] = '\0'; break;
-			case SP_MILLI: buf[23] = '\0'; break;
-			case SP_MICRO: buf[26] = '\0'; break;
-			case SP_NANO:  buf[29] = '\0'; break;
-			default: break;	/* quiet warning about no case for ISO_FMT */
-		}
-	} else {
+	cache = get_ts_cache(ts->tv_sec);
+	if (cache == NULL) {
 		snprintf(buf, len, "%s", "oops");
+		return;
 	}
 
+	switch (format) {
+		case SP_NONE:  n_digits = 0; break;
+		case SP_MILLI: n_digits = 3; break;
+		case SP_MICRO: n_digits = 6; break;
+		default:       n_digits = 9; break;
+	}
+
+	// the date and time
+	char *p = buf;
+	memcpy(p, cache->date, sizeof(cache->date) - 1);
+	if (iso) p[10] = 'T';
+	p += sizeof(cache->date) - 1;
+
+	// the fraction - the leading digits of the nanoseconds
+	if (n_digits > 0) {
+		char digits[9];
+
+		log_put_uint9(digits, ts->tv_nsec);
+		*p++ = '.';
+		memcpy(p, digits, n_digits);
+		p += n_digits;
+	}
+	*p = '\0';
+
 	if (want_offset) {
-		int end = strlen(buf);
-		do_offset(&tm, buf + end, len - end);
+		strcpy(p, cache->offset);
 	}
 }
-#pragma GCC diagnostic pop
+
+/**
+ * @fn char *log_buf_reserve(struct log_buf *buf, size_t len)
+ * @brief Make room for len more bytes in a buffer.
+ *
+ * The buffer starts at BUFSIZ, and doubles as needed. The bytes already in it
+ * are kept.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes to be appended
+ * @return where to append them (buf->data + buf->len), or NULL if out of
+ * memory. Add the number actually appended to buf->len.
+ */
+char *log_buf_reserve(struct log_buf *buf, size_t len) {
+	if (buf->len + len > buf->size) {
+		size_t size = buf->size ? buf->size : BUFSIZ;
+		while (size < buf->len + len) size *= 2;
+
+		char *data = realloc(buf->data, size);
+		if (data == NULL) return NULL;
+		buf->data = data;
+		buf->size = size;
+	}
+
+	return buf->data + buf->len;
+}
+
+/**
+ * @fn void log_buf_free(struct log_buf *buf)
+ * @brief Free the memory of a buffer, and leave it empty.
+ * @param buf the buffer
+ */
+void log_buf_free(struct log_buf *buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = 0;
+	buf->size = 0;
+}
+
+/**
+ * The calling thread's buffer for log_fmt_buffered(). It is reused for each
+ * record, and freed when the thread exits.
+ */
+static __thread struct log_buf thread_buf = {0};
+
+/** used to free thread_buf when a thread exits */
+static pthread_key_t thread_buf_key;
+static pthread_once_t thread_buf_once = PTHREAD_ONCE_INIT;
+
+static void thread_buf_free(void *unused) {
+	(void) unused;
+	log_buf_free(&thread_buf);
+}
+
+static void thread_buf_key_init(void) {
+	pthread_key_create(&thread_buf_key, thread_buf_free);
+}
+
+/**
+ * @fn int log_fmt_buffered(log_buf_formatter_t formatter, FILE *stream,
+ *     int sequence, struct timespec *ts, int level, const char *file,
+ *     const char *function, int line, char *msg)
+ * @brief Format a record with a buffer formatter, and write it to a stream.
+ *
+ * The FILE * formatters are wrappers of their buffer versions with this. It
+ * is public, so that a custom buffer formatter can be wrapped the same way
+ * and passed to log_open_channel_f().
+ *
+ * @param formatter the buffer formatter
+ * @param stream the output stream to write to
+ * @param sequence the sequence number of the message
+ * @param ts the struct timespec timestamp
+ * @param level the log level to print
+ * @param file the name of the file to print
+ * @param function the name of the function to print
+ * @param line the line number to print
+ * @param msg the actual use message to print
+ * @return the number of characters written.
+ */
+int log_fmt_buffered(log_buf_formatter_t formatter, FILE *stream,
+	int sequence, struct timespec *ts, int level,
+	const char *file, const char *function, int line, char *msg) {
+	struct log_origin const *origin = log_get_origin();
+	struct log_record record = {
+		.ts = ts,
+		.level = level,
+		.sequence = sequence,
+		.file = file,
+		.function = function,
+		.line = line,
+		.tid = origin->tid,
+		.thread_name = origin->name,
+		.msg = msg,
+		.msg_len = strlen(msg),
+	};
+
+	if (thread_buf.data == NULL) {
+		pthread_once(&thread_buf_once, thread_buf_key_init);
+		pthread_setspecific(thread_buf_key, &thread_buf);
+	}
+
+	thread_buf.len = 0;
+	if (formatter(&thread_buf, &record) < 0) return 0;
+
+	return fwrite(thread_buf.data, 1, thread_buf.len, stream);
+}
+
+/**
+ * The most a text record needs, besides its strings: the timestamp, the
+ * padded level, the numbers and the separators.
+ */
+#define TEXT_FIXED_LEN (TIMESTAMP_LEN + 2 * LOG_LONG_LEN + 32)
+
+/**
+ * @fn char *text_reserve(struct log_buf *, struct log_record const *)
+ * @brief Make room for any of the text records.
+ * @return where to append the record, or NULL if out of memory
+ */
+static char *text_reserve(struct log_buf *buf, struct log_record const *r) {
+	return log_buf_reserve(buf, TEXT_FIXED_LEN + strlen(r->file) +
+		strlen(r->function) + strlen(r->thread_name) + r->msg_len);
+}
+
+/**
+ * @fn int text_done(struct log_buf *, char *)
+ * @brief Finish a text record that was appended up to p.
+ * @return the length of the record
+ */
+static int text_done(struct log_buf *buf, char *p) {
+	int len = p - (buf->data + buf->len);
+	buf->len += len;
+	return len;
+}
+
+/** as "%s" of log_format_timestamp() */
+static char *put_date(char *p, struct timespec *ts, LOG_TS_FORMAT format) {
+	char date[TIMESTAMP_LEN];
+
+	log_format_timestamp(ts, format, date, sizeof(date));
+	return stpcpy(p, date);
+}
+
+/** as "%-7s " of the level label - 7 for all level names to align messages */
+static char *put_level(char *p, int level) {
+	char const *label = log_labels[level].english;
+	size_t len = strlen(label);
+
+	memcpy(p, label, len);
+	p += len;
+	do {
+		*p++ = ' ';
+	} while (++len < 8);
+	return p;
+}
+
+/** as "%6ld" of the thread id */
+static char *put_tid(char *p, long tid) {
+	char digits[LOG_LONG_LEN];
+	size_t len = log_put_long(digits, tid) - digits;
+
+	for (size_t pad = len; pad < 6; pad++) *p++ = ' ';
+	memcpy(p, digits, len);
+	return p + len;
+}
+
+/** as "%s:%s:%d " of the file, function and line */
+static char *put_callsite(char *p, struct log_record const *r) {
+	p = stpcpy(p, r->file);
+	*p++ = ':';
+	p = stpcpy(p, r->function);
+	*p++ = ':';
+	p = log_put_long(p, r->line);
+	*p++ = ' ';
+	return p;
+}
+
+/** as "%s\n" of the user message */
+static char *put_msg(char *p, struct log_record const *r) {
+	memcpy(p, r->msg, r->msg_len);
+	p += r->msg_len;
+	*p++ = '\n';
+	return p;
+}
+
+/**
+ * @fn int log_bfmt_basic(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_basic().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_basic(struct log_buf *buf, struct log_record const *r) {
+	char *p = text_reserve(buf, r);
+	if (p == NULL) return -1;
+
+	p = put_msg(p, r);
+	return text_done(buf, p);
+}
+
+/**
+ * @fn int log_bfmt_systemd(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_systemd().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_systemd(struct log_buf *buf, struct log_record const *r) {
+	char *p = text_reserve(buf, r);
+	if (p == NULL) return -1;
+
+	p = stpcpy(p, log_labels[r->level].systemd);
+	p = put_msg(p, r);
+	return text_done(buf, p);
+}
+
+/**
+ * @fn int log_bfmt_standard(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_standard().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_standard(struct log_buf *buf, struct log_record const *r) {
+	char *p = text_reserve(buf, r);
+	if (p == NULL) return -1;
+
+	p = put_date(p, r->ts, SP_NONE);
+	*p++ = ' ';
+	p = put_level(p, r->level);
+	p = put_msg(p, r);
+	return text_done(buf, p);
+}
+
+/**
+ * @fn int log_bfmt_debug(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_debug().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_debug(struct log_buf *buf, struct log_record const *r) {
+	char *p = text_reserve(buf, r);
+	if (p == NULL) return -1;
+
+	p = put_date(p, r->ts, SP_MILLI);
+	*p++ = ' ';
+	p = put_level(p, r->level);
+	p = put_callsite(p, r);
+	p = put_msg(p, r);
+	return text_done(buf, p);
+}
+
+/**
+ * @fn int log_bfmt_tall(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_tall().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_tall(struct log_buf *buf, struct log_record const *r) {
+	char *p = text_reserve(buf, r);
+	if (p == NULL) return -1;
+
+	p = put_date(p, r->ts, SP_MILLI);
+	*p++ = ' ';
+	p = put_level(p, r->level);
+	p = put_tid(p, r->tid);
+	*p++ = ':';
+	p = stpcpy(p, r->thread_name);
+	*p++ = ' ';
+	p = put_msg(p, r);
+	return text_done(buf, p);
+}
+
+/**
+ * @fn int log_bfmt_debug_tid(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_debug_tid().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_debug_tid(struct log_buf *buf, struct log_record const *r) {
+	char *p = text_reserve(buf, r);
+	if (p == NULL) return -1;
+
+	p = put_date(p, r->ts, SP_MILLI);
+	*p++ = ' ';
+	p = put_level(p, r->level);
+	p = put_tid(p, r->tid);
+	*p++ = ' ';
+	p = put_callsite(p, r);
+	p = put_msg(p, r);
+	return text_done(buf, p);
+}
+
+/**
+ * @fn int log_bfmt_debug_tname(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_debug_tname().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_debug_tname(struct log_buf *buf, struct log_record const *r) {
+	char *p = text_reserve(buf, r);
+	if (p == NULL) return -1;
+
+	p = put_date(p, r->ts, SP_MILLI);
+	*p++ = ' ';
+	p = put_level(p, r->level);
+	p = stpcpy(p, r->thread_name);
+	*p++ = ' ';
+	p = put_callsite(p, r);
+	p = put_msg(p, r);
+	return text_done(buf, p);
+}
+
+/**
+ * @fn int log_bfmt_debug_tall(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_debug_tall().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_debug_tall(struct log_buf *buf, struct log_record const *r) {
+	char *p = text_reserve(buf, r);
+	if (p == NULL) return -1;
+
+	p = put_date(p, r->ts, SP_MILLI);
+	*p++ = ' ';
+	p = put_level(p, r->level);
+	p = put_tid(p, r->tid);
+	*p++ = ':';
+	p = stpcpy(p, r->thread_name);
+	*p++ = ' ';
+	p = put_callsite(p, r);
+	p = put_msg(p, r);
+	return text_done(buf, p);
+}
+
+/**
+ * @fn int log_bfmt_elapsed_time(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_elapsed_time().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_elapsed_time(struct log_buf *buf, struct log_record const *r) {
+	char *p = text_reserve(buf, r);
+	if (p == NULL) return -1;
+
+	p = put_date(p, r->ts, LOG_FMT_DELTA);
+	*p++ = ' ';
+	p = put_level(p, r->level);
+	p = put_callsite(p, r);
+	p = put_msg(p, r);
+	return text_done(buf, p);
+}
+
+/**
+ * @fn log_buf_formatter_t log_get_buf_formatter(log_formatter_t formatter)
+ * @brief Look up the buffer version of a built in formatter.
+ * @param formatter the formatter
+ * @return its buffer version, or NULL for log_fmt_binary() and custom
+ * formatters
+ */
+log_buf_formatter_t log_get_buf_formatter(log_formatter_t formatter) {
+	static struct {
+		log_formatter_t formatter;
+		log_buf_formatter_t buf_formatter;
+	} const versions[] = {
+		{log_fmt_basic, log_bfmt_basic},
+		{log_fmt_systemd, log_bfmt_systemd},
+		{log_fmt_standard, log_bfmt_standard},
+		{log_fmt_debug, log_bfmt_debug},
+		{log_fmt_tall, log_bfmt_tall},
+		{log_fmt_debug_tid, log_bfmt_debug_tid},
+		{log_fmt_debug_tname, log_bfmt_debug_tname},
+		{log_fmt_debug_tall, log_bfmt_debug_tall},
+		{log_fmt_elapsed_time, log_bfmt_elapsed_time},
+		{log_fmt_xml, log_bfmt_xml},
+		{log_fmt_xml_records, log_bfmt_xml},
+		{log_fmt_json, log_bfmt_json},
+		{log_fmt_json_records, log_bfmt_json_records},
+	};
+
+	for (size_t n = 0; n < sizeof(versions) / sizeof(versions[0]); n++) {
+		if (versions[n].formatter == formatter) {
+			return versions[n].buf_formatter;
+		}
+	}
+	return NULL;
+}
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -233,7 +702,8 @@ eth0     AF_PACKET (17)
  */
 int log_fmt_basic(FILE *stream, int sequence, struct timespec *ts, int level,
 	const char *file, const char *function, int line, char *msg) {
-	return fprintf(stream, "%s\n", msg);
+	return log_fmt_buffered(log_bfmt_basic, stream, sequence, ts, level,
+		file, function, line, msg);
 }
 
 /**
@@ -258,7 +728,8 @@ int log_fmt_basic(FILE *stream, int sequence, struct timespec *ts, int level,
  */
 int log_fmt_systemd(FILE *stream, int sequence, struct timespec *ts, int level,
 	const char *file, const char *function, int line, char *msg) {
-	return fprintf(stream, "%s%s\n", log_labels[level].systemd, msg);
+	return log_fmt_buffered(log_bfmt_systemd, stream, sequence, ts, level,
+		file, function, line, msg);
 }
 
 
@@ -284,11 +755,8 @@ int log_fmt_systemd(FILE *stream, int sequence, struct timespec *ts, int level,
  */
 int log_fmt_standard(FILE *stream, int sequence, struct timespec *ts, int level,
 	const char *file, const char *function, int line, char *msg) {
-	char date[TIMESTAMP_LEN];
-	// (-7 reserve space for all level names to align the messages)
-	log_format_timestamp(ts, SP_NONE, date, sizeof(date));
-	return fprintf(stream, "%s %-7s %s\n",
-		date, log_labels[level].english, msg);
+	return log_fmt_buffered(log_bfmt_standard, stream, sequence, ts, level,
+		file, function, line, msg);
 }
 
 /**
@@ -314,11 +782,8 @@ int log_fmt_standard(FILE *stream, int sequence, struct timespec *ts, int level,
  */
 int log_fmt_debug(FILE *stream, int sequence, struct timespec *ts, int level,
 	const char *file, const char *function, int line, char *msg) {
-	char date[TIMESTAMP_LEN];
-	log_format_timestamp(ts, SP_MILLI, date, sizeof(date));
-	// (-7 reserve space for all level names to align the messages)
-	return fprintf(stream, "%s %-7s %s:%s:%d %s\n",
-		date, log_labels[level].english, file, function, line, msg);
+	return log_fmt_buffered(log_bfmt_debug, stream, sequence, ts, level,
+		file, function, line, msg);
 }
 
 /**
@@ -343,18 +808,8 @@ int log_fmt_debug(FILE *stream, int sequence, struct timespec *ts, int level,
  */
 int log_fmt_tall(FILE *stream, int sequence, struct timespec *ts, int level,
 	const char *file, const char *function, int line, char *msg) {
-	char date[TIMESTAMP_LEN];
-	pthread_t thread = pthread_self();
-	char thread_name[NAME_LEN];
-	int rc;
-	log_format_timestamp(ts, SP_MILLI, date, sizeof(date));
-	rc = pthread_getname_np(thread, thread_name, sizeof(thread_name));
-	if (rc != 0) {
-		snprintf(thread_name, sizeof(thread_name), "unknown");
-	}
-	return fprintf(stream, "%s %-7s %6ld:%s %s\n",
-		date, log_labels[level].english,
-		syscall(__NR_gettid), thread_name, msg);
+	return log_fmt_buffered(log_bfmt_tall, stream, sequence, ts, level,
+		file, function, line, msg);
 }
 
 /**
@@ -379,11 +834,8 @@ int log_fmt_tall(FILE *stream, int sequence, struct timespec *ts, int level,
  */
 int log_fmt_debug_tid(FILE *stream, int sequence, struct timespec *ts, int level,
 	const char *file, const char *function, int line, char *msg) {
-	char date[TIMESTAMP_LEN];
-	log_format_timestamp(ts, SP_MILLI, date, sizeof(date));
-	return fprintf(stream, "%s %-7s %6ld %s:%s:%d %s\n",
-		date, log_labels[level].english,
-		 syscall(__NR_gettid), file, function, line, msg);	// or SYS_gettid
+	return log_fmt_buffered(log_bfmt_debug_tid, stream, sequence, ts, level,
+		file, function, line, msg);
 }
 
 /**
@@ -408,18 +860,8 @@ int log_fmt_debug_tid(FILE *stream, int sequence, struct timespec *ts, int level
  */
 int log_fmt_debug_tname(FILE *stream, int sequence, struct timespec *ts, int level,
 	const char *file, const char *function, int line, char *msg) {
-	char date[TIMESTAMP_LEN];
-	pthread_t thread = pthread_self();
-	char thread_name[NAME_LEN];
-	int rc;
-	log_format_timestamp(ts, SP_MILLI, date, sizeof(date));
-	rc = pthread_getname_np(thread, thread_name, sizeof(thread_name));
-	if (rc != 0) {
-		snprintf(thread_name, sizeof(thread_name), "unknown");
-	}
-	return fprintf(stream, "%s %-7s %s %s:%s:%d %s\n",
-		date, log_labels[level].english,
-		thread_name, file, function, line, msg);
+	return log_fmt_buffered(log_bfmt_debug_tname, stream, sequence, ts, level,
+		file, function, line, msg);
 }
 
 
@@ -445,18 +887,8 @@ int log_fmt_debug_tname(FILE *stream, int sequence, struct timespec *ts, int lev
  */
 int log_fmt_debug_tall(FILE *stream, int sequence, struct timespec *ts, int level,
 	const char *file, const char *function, int line, char *msg) {
-	char date[TIMESTAMP_LEN];
-	pthread_t thread = pthread_self();
-	char thread_name[NAME_LEN];
-	int rc;
-	log_format_timestamp(ts, SP_MILLI, date, sizeof(date));
-	rc = pthread_getname_np(thread, thread_name, sizeof(thread_name));
-	if (rc != 0) {
-		snprintf(thread_name, sizeof(thread_name), "unknown");
-	}
-	return fprintf(stream, "%s %-7s %6ld:%s %s:%s:%d %s\n",
-		date, log_labels[level].english,
-		syscall(__NR_gettid), thread_name, file, function, line, msg);
+	return log_fmt_buffered(log_bfmt_debug_tall, stream, sequence, ts, level,
+		file, function, line, msg);
 }
 
 
@@ -496,10 +928,7 @@ int log_fmt_debug_tall(FILE *stream, int sequence, struct timespec *ts, int leve
  */
 int log_fmt_elapsed_time(FILE *stream, int sequence, struct timespec *ts, int level,
 	const char *file, const char *function, int line, char *msg) {
-	char date[TIMESTAMP_LEN];
-	log_format_timestamp(ts, LOG_FMT_DELTA, date, sizeof(date));
-	return fprintf(stream, "%s %-7s %s:%s:%d %s\n",
-		date, log_labels[level].english,
+	return log_fmt_buffered(log_bfmt_elapsed_time, stream, sequence, ts, level,
 		file, function, line, msg);
 }
 
@@ -37,8 +37,6 @@ note the 2 leading spaces and the treatment of partial last lines:
 
 #include <stdio.h>
 #include <string.h>
-#include <stdlib.h>
-#include <ctype.h>
 
 #include "private.h" /**< make sure declaration and definition match */
 
@@ -66,32 +64,21 @@ note the 2 leading spaces and the treatment of partial last lines:
 #define ASCII_OFFSET (BYTES_PER_LINE * 3 + 1)
 
 /**
- * ascii field has one positon per BYTES_PER_LINE
- */
-#define TERMINATING_NULL_INDEX (ASCII_OFFSET + BYTES_PER_LINE)
-
-/**
- * The printf format specifier for the buffer offset field.
- * Must match MAX_ADDRESS_FIELD for proper results.
+ * The address offsets are printed with a minimum of four hex digits, but may
+ * be up to 16 digits (64 bits).
  */
-#define ADDRESS_FORMAT "  %04zu  "
+#define MIN_ADDRESS_DIGITS 4
 
 /**
- * Assume 64 bit addresses => 8 hex digits
- *
- * max address field = 2 spaces + 8 hex digits + 2 spaces
- *
- * The address offsets are printed with a minimum of four hex digits, but may
- * be up to 8 digits (64 bits). MAX_ADDRESS_FIELD includes two leading spaces,
- * the maximum of 8 digits, and the two trailing spaces.
+ * max address field = 2 spaces + 16 hex digits + 2 spaces
  */
-#define MAX_ADDRESS_FIELD (12)
+#define MAX_ADDRESS_FIELD (2 + 2 * sizeof(size_t) + 2)
 
 /**
  * The fixed length portion of the line...
  * (3 * BYTES_PER_LINE + 1)                 (ASCII_OFFSET)
  * + BYTES_PER_LINE                         (16)
- * + separating newline or terminating null (1)
+ * + separating newline                     (1)
  */
 #define FIXED_LINE_LENGTH (ASCII_OFFSET + BYTES_PER_LINE + 1)
 
@@ -101,139 +88,202 @@ note the 2 leading spaces and the treatment of partial last lines:
  */
 #define MAX_LINE_LENGTH (MAX_ADDRESS_FIELD + FIXED_LINE_LENGTH)
 
+/** a hex digit */
+#define HEX_DIGIT(d) ((d) < 10 ? '0' + (d) : 'a' - 10 + (d))
+
+/** the printable representation of a byte, as isprint() in the "C" locale */
+#define PRINTABLE(n) (((n) >= 0x20) && ((n) < 0x7f) ? (n) : '.')
+
+/** the hex_table entry for a byte */
+#define HEX_ENTRY(n) \
+	{HEX_DIGIT((n) >> 4), HEX_DIGIT((n) & 0x0f), ' ', PRINTABLE(n)}
+
+/** the hex_table entries for 16 bytes */
+#define HEX_ROW(n) \
+	HEX_ENTRY((n) + 0x0), HEX_ENTRY((n) + 0x1), HEX_ENTRY((n) + 0x2), \
+	HEX_ENTRY((n) + 0x3), HEX_ENTRY((n) + 0x4), HEX_ENTRY((n) + 0x5), \
+	HEX_ENTRY((n) + 0x6), HEX_ENTRY((n) + 0x7), HEX_ENTRY((n) + 0x8), \
+	HEX_ENTRY((n) + 0x9), HEX_ENTRY((n) + 0xa), HEX_ENTRY((n) + 0xb), \
+	HEX_ENTRY((n) + 0xc), HEX_ENTRY((n) + 0xd), HEX_ENTRY((n) + 0xe), \
+	HEX_ENTRY((n) + 0xf)
+
 #endif /* DOXYGEN_SHOULD_SKIP_THIS */
 
-static char const digits[16] = {
-	'0', '1', '2', '3', '4', '5', '6', '7',
-	'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+/**
+ * For each byte value: its hex pair and a space, then its printable char.
+ * The first three are copied as a block of four, the fourth being overwritten
+ * by the next byte.
+ */
+static char const hex_table[256][4] = {
+	HEX_ROW(0x00), HEX_ROW(0x10), HEX_ROW(0x20), HEX_ROW(0x30),
+	HEX_ROW(0x40), HEX_ROW(0x50), HEX_ROW(0x60), HEX_ROW(0x70),
+	HEX_ROW(0x80), HEX_ROW(0x90), HEX_ROW(0xa0), HEX_ROW(0xb0),
+	HEX_ROW(0xc0), HEX_ROW(0xd0), HEX_ROW(0xe0), HEX_ROW(0xf0),
 };
 
 /**
- * @fn void fmt_line(char const * const buf, size_t const len, char *line_buf)
+ * @fn char *put_address(char *, size_t)
+ *
+ * @brief Write the buffer offset field, with its leading and trailing spaces.
+ *
+ * @return a pointer past the field
+ */
+static char *put_address(char *out, size_t offset) {
+	int n_digits = MIN_ADDRESS_DIGITS;
+
+	while ((n_digits < (int) (2 * sizeof(size_t))) &&
+		(offset >> (4 * n_digits)) != 0) {
+		n_digits++;
+	}
+
+	*out++ = ' ';
+	*out++ = ' ';
+	for (int n = n_digits - 1; n >= 0; n--) {
+		*out++ = HEX_DIGIT((offset >> (4 * n)) & 0x0f);
+	}
+	*out++ = ' ';
+	*out++ = ' ';
+
+	return out;
+}
+
+/**
+ * @fn char *fmt_line(char *, unsigned char const *, size_t)
  *
  * @brief format the data portion of an output line.
  *
  * This function produces the fixed length output after the address offset
- * field
+ * field, without the separating newline.
+ *
+ * @return a pointer past the line
  */
-static void fmt_line(unsigned char const *buf, size_t const len, char *line_buf) {
+static char *fmt_line(char *out, unsigned char const *buf, size_t const len) {
+	char *ascii = out + ASCII_OFFSET;
 	size_t n;
 
 	/* actual data */
 	for (n = 0; n < len; n++) {
-		/* hex */
-		line_buf[n * 3    ] = digits[(buf[n] >> 4)];
-		line_buf[n * 3 + 1] = digits[(buf[n] & 0x0f)];
-		line_buf[n * 3 + 2] = ' ';
+		char const *entry = hex_table[buf[n]];
 
-		/* ascii */
-		line_buf[ASCII_OFFSET + n] = isprint(buf[n]) ? buf[n] : '.';
+		memcpy(out + n * 3, entry, 4);	/* hex */
+		ascii[n] = entry[3];			/* ascii */
 	}
 
 	/* pad a short last line with spaces */
-	for (; n < BYTES_PER_LINE; n++) {
-		/* hex */
-		line_buf[n * 3    ] = ' ';
-		line_buf[n * 3 + 1] = ' ';
-		line_buf[n * 3 + 2] = ' ';
-
-		/* ascii */
-		line_buf[ASCII_OFFSET + n] = ' ';
+	if (n < BYTES_PER_LINE) {
+		memset(out + n * 3, ' ', (BYTES_PER_LINE - n) * 3);
+		memset(ascii + n, ' ', BYTES_PER_LINE - n);
 	}
 
 	/* put the extra space between the hex and ascii fields */
-	line_buf[ASCII_OFFSET - 1] = ' ';
+	out[ASCII_OFFSET - 1] = ' ';
 
-	/* Terminate the buffer. If followed by more lines, the main routine
-	 * replaces the '\0' with a '\n'.
-	 * May be omitted when not debugging this function.
-	 */
-	line_buf[TERMINATING_NULL_INDEX] = '\0';
+	return ascii + BYTES_PER_LINE;
 }
 
 /**
- * If the address of the buffer is NULL, return a pointer to a message instead
- * of a hex format result.
+ * If the address of the buffer is NULL, write a message instead of a hex
+ * format result.
  */
 #define NULL_POINTER_MSG \
 	"  0000           <null pointer - check your code >                       \n"
 
 /**
- * If the length of the buffer is less than 1, return a pointer to message
- * instead of a hex format result.
+ * If the length of the buffer is less than 1, write a message instead of a
+ * hex format result.
  */
 #define NO_CONTENT_MSG \
 	"  0000           <no content - zero length buffer>                       \n"
 
 /**
- * @fn char *log_hexformat(void const * const mem, size_t const len)
+ * @fn size_t log_hexformat_len(size_t)
  *
- * @brief Format a memory region to hex + ascii representation.
+ * @brief Get the room needed by log_hexformat().
  *
- * @param mem accept a pointer to anything
  * @param len the length of the memory region
  *
- * @return A malloc(3)'ed buffer with the results. If mem is NULL or len is
- * zero, a "result" with an appropriate message is returned. If the malloc(3)
- * fails, NULL is returned. All non-null results must be freed with free(3).
+ * @return the most that log_hexformat() will write for len bytes
  */
-char *log_hexformat(void const * const mem, size_t const len) {
+size_t log_hexformat_len(size_t const len) {
+	size_t total_lines = (len + BYTES_PER_LINE - 1) / BYTES_PER_LINE;
+	size_t total = total_lines * MAX_LINE_LENGTH;
+
+	// room for the NULL pointer and zero length messages
+	if (total < sizeof(NULL_POINTER_MSG)) total = sizeof(NULL_POINTER_MSG);
+
+	return total;
+}
+
+/**
+ * @fn size_t log_hexformat_fit(size_t)
+ *
+ * @brief Get the number of bytes whose dump fits in a given room.
+ *
+ * @param room the room available
+ *
+ * @return a whole number of lines worth of bytes, at least one line
+ */
+size_t log_hexformat_fit(size_t const room) {
+	size_t total_lines = room / MAX_LINE_LENGTH;
+
+	if (total_lines < 1) total_lines = 1;
+
+	return total_lines * BYTES_PER_LINE;
+}
+
+/**
+ * @fn char *log_hexformat(char *, void const * const, size_t const,
+ *     size_t const)
+ *
+ * @brief Format a memory region, or a part of one, to hex + ascii
+ * representation.
+ *
+ * The lines are separated by newlines. There is no newline after the last
+ * line, and no terminating null is written.
+ *
+ * The offsets printed are relative to mem, so a large region can be dumped a
+ * part at a time with the same result.
+ *
+ * @param out where to write. log_hexformat_len() gives the room needed.
+ * @param mem accept a pointer to anything
+ * @param offset where the part to format starts in the memory region
+ * @param len the length of the part
+ *
+ * @return a pointer past the last character written. If mem is NULL or len
+ * is zero, an appropriate message is written.
+ */
+char *log_hexformat(char *out, void const * const mem, size_t const offset,
+	size_t const len) {
 	unsigned char const * const u_mem = mem;	/* avoid a cast */
-	char *hex_buf;
-	char *current_ptr;
-	size_t num2do = len;
 	size_t num_done = 0;
-	size_t total_lines;
 
-	/* Sanity check buffer address. Use strdup(3) so that it can be free(3)'d.
-	 */
+	/* Sanity check buffer address. */
 	if (u_mem == NULL) {
-		return strdup(NULL_POINTER_MSG);
+		memcpy(out, NULL_POINTER_MSG, sizeof(NULL_POINTER_MSG) - 1);
+		return out + sizeof(NULL_POINTER_MSG) - 1;
 	}
 
-	/* Sanity check buffer length. Use strdup(3) so that it can be free(3)'d.
-	 */
+	/* Sanity check buffer length. */
 	if (len < 1) {
-		return strdup(NO_CONTENT_MSG);
+		memcpy(out, NO_CONTENT_MSG, sizeof(NO_CONTENT_MSG) - 1);
+		return out + sizeof(NO_CONTENT_MSG) - 1;
 	}
 
-	/* calculate number of lines */
-	total_lines = len / BYTES_PER_LINE;
-	total_lines += (len % BYTES_PER_LINE) ? 1 : 0;
-
-	/* allocate buffer to construct those lines */
-	hex_buf = malloc(total_lines * MAX_LINE_LENGTH);
-
-	/* return NULL on failure */
-	if (hex_buf == NULL) return NULL;
+	while (num_done < len) {
+		size_t num_this_line = len - num_done < BYTES_PER_LINE ?
+			len - num_done : BYTES_PER_LINE;
 
-	/* start at the beginning */
-	current_ptr = hex_buf;
+		/* separate the lines */
+		if (num_done > 0) *out++ = '\n';
 
-	while (num2do > 0) {
-		int num_this_line = num2do < BYTES_PER_LINE ? num2do : BYTES_PER_LINE;
-
-		/* produce the variable length buffer offset, and remember the length */
-		int header_len =
-			snprintf(current_ptr, MAX_ADDRESS_FIELD + 1, ADDRESS_FORMAT, num_done);
+		/* produce the variable length buffer offset */
+		out = put_address(out, offset + num_done);
 
 		/* produce the fixed length hex/ascii regions */
-		fmt_line(u_mem + num_done, num_this_line, current_ptr + header_len);
+		out = fmt_line(out, u_mem + offset + num_done, num_this_line);
 
-		/* keep track of progress */
 		num_done += num_this_line;
-		num2do -= num_this_line;
-
-		/* update the "next" pointer */
-		current_ptr += header_len + FIXED_LINE_LENGTH;
-
-		/* if not done yet, replace the '\0' with a '\n' */
-		if (num2do > 0) {
-			*(current_ptr - 1) = '\n';
-		} else {
-			*(current_ptr - 1) = '\0';
-		}
 	}
 
-	return hex_buf;
+	return out;
 }
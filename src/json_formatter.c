@@ -88,120 +88,45 @@
 #include "private.h"
 
 /**
- * @fn char *escape_json(char const *, char *, int)
- * @brief Escape &apos;\\b&apos;, &apos;\\f&apos;,
- *     &apos;\\n&apos;,  &apos;\\r&apos;,
- *     &apos;\\t&apos;, &apos;\\"&apos; and
- *     &apos;\\\\&apos;.
- *
- * @param input the string to escape
- * @param buf a buffer to place the escaped output
- * @param len the length of that buffer - termination null will be added
+ * The most a record needs, besides its strings: the key fragments and the
+ * numbers.
  */
-static char *escape_json(char const *input, char *buf, int len) {
-	char const *ptr_in;
-	char *ptr_out;
-
-	// len must be at least 1 for the terminating null
-	if ((input == NULL) || (buf == NULL) || (len < 1)) return NULL;
-
-	// stop when there isn't even room for an un-escaped char
-	for (ptr_in = input, ptr_out = buf;
-		*ptr_in != '\0' && (ptr_out < (buf + len) - 1);
-		ptr_in++) {
-
-		char *esc = NULL;
-
-		switch (*ptr_in) {
-			case 0x00: esc = "\\u0000"; break; // hmmm...
-			case 0x01: esc = "\\u0001"; break;
-			case 0x02: esc = "\\u0002"; break;
-			case 0x03: esc = "\\u0003"; break;
-			case 0x04: esc = "\\u0004"; break;
-			case 0x05: esc = "\\u0005"; break;
-			case 0x06: esc = "\\u0006"; break;
-			case 0x07: esc = "\\u0007"; break;
-			case '\b': esc = "\\b";     break; // 0x08
-			case '\t': esc = "\\t";     break; // 0x09
-			case '\n': esc = "\\n";     break; // 0x0A
-			case 0x0B: esc = "\\u000B"; break;
-			case '\f': esc = "\\f";     break; // 0x0C
-			case '\r': esc = "\\r";     break; // 0x0D
-			case 0x0E: esc = "\\u000E"; break;
-			case 0x0F: esc = "\\u000F"; break;
-
-			case 0x10: esc = "\\u0010"; break;
-			case 0x11: esc = "\\u0011"; break;
-			case 0x12: esc = "\\u0012"; break;
-			case 0x13: esc = "\\u0013"; break;
-			case 0x14: esc = "\\u0014"; break;
-			case 0x15: esc = "\\u0015"; break;
-			case 0x16: esc = "\\u0016"; break;
-			case 0x17: esc = "\\u0017"; break;
-			case 0x18: esc = "\\u0018"; break;
-			case 0x19: esc = "\\u0019"; break;
-			case 0x1A: esc = "\\u001A"; break;
-			case 0x1B: esc = "\\u001B"; break;
-			case 0x1C: esc = "\\u001C"; break;
-			case 0x1D: esc = "\\u001D"; break;
-			case 0x1E: esc = "\\u001E"; break;
-			case 0x1F: esc = "\\u001F"; break;
-
-			case '\"': esc = "\\\""; break;  // 0x22 ('"')
-			case '\\': esc = "\\\\"; break;  // 0x5C ('\")
-		}
-
-		if (esc != NULL) {
-			// Make sure we can fit the whole escape sequence.
-			// Truncate output at the first character that doesn't fit.
-			// Leave room for terminating null.
-			size_t escape_len = strlen(esc);
-			size_t n_available = len - (ptr_out - buf) - 1;
+#define RECORD_FIXED_LEN 512
 
-			if (escape_len > n_available) break;
-
-			memcpy(ptr_out, esc, escape_len);
-			ptr_out += escape_len;
-		} else {
-			*ptr_out++ = *ptr_in;
-		}
-	}
-
-	*ptr_out = '\0';
-
-	return buf;
-}
+/**
+ * Copy a string literal (a key fragment), and advance past it.
+ */
+#define PUT_LITERAL(p, literal) \
+	(memcpy((p), (literal), sizeof(literal) - 1), (p) + sizeof(literal) - 1)
 
 #if ENABLE_JSON_HEADER
 #define HOSTNAME_FILE "/proc/sys/kernel/hostname"
-static inline char *get_hostname() {
-	static char hostname[64] = {0};
-	static bool init_done = false;
+static char hostname[64] = {0};
+static pthread_once_t hostname_once = PTHREAD_ONCE_INIT;
+static void hostname_init(void) {
 	int fd;
 	char *newline;
 
-	if (init_done) return hostname;
-
 	fd = open(HOSTNAME_FILE, O_RDONLY);
 	if (fd != -1) {
 		read(fd, hostname, sizeof(hostname) - 1);
+		close(fd);
 		newline = index(hostname, '\n');
 		if (newline != NULL) *newline = '\0';
 	}
-	init_done = true;
+}
 
+// heads of different channels may be written at the same time
+static inline char *get_hostname() {
+	pthread_once(&hostname_once, hostname_init);
 	return hostname;
 }
 #endif /* ENABLE_JSON_HEADER */
 
-// not re-entrant, but only called from mutex protected code
-static inline char *get_timezone() {
-	static char tz[PATH_MAX] = {0};
-	static bool init_done = false;
+static char tz[PATH_MAX] = {0};
+static void timezone_init(void) {
 	char *result;
 
-	if (init_done) return tz;
-
 	result = log_get_timezone(tz + 1, sizeof(tz) - 2);
 
 #pragma GCC diagnostic push
@@ -212,11 +137,17 @@ static inline char *get_timezone() {
 		strncat(tz, "]", sizeof(tz));
 	}
 #pragma GCC diagnostic pop
+}
 
+// heads of different channels may be written at the same time
+static inline char *get_timezone() {
 // for generating a test file with json-timezones.c
 //#define TIMEZONE_TEST
 #ifndef TIMEZONE_TEST
-	init_done = true;
+	static pthread_once_t timezone_once = PTHREAD_ONCE_INIT;
+	pthread_once(&timezone_once, timezone_init);
+#else
+	timezone_init();
 #endif
 
 	return tz;
@@ -235,7 +166,7 @@ static inline void json_format_timestamp(struct timespec *ts,
 
 #if ENABLE_JSON_HEADER
 static inline int do_header(FILE *stream, char *notes) {
-	char notes_buf[BUFSIZ] = {0};
+	char *notes_buf = "null";
 	char date[TIMESTAMP_LEN + TIMEZONE_LEN];
 	struct timespec ts;
 
@@ -249,20 +180,28 @@ static inline int do_header(FILE *stream, char *notes) {
 		date, sizeof(date));
 #endif /* ENABLE_TIMEZONE */
 
-	if (notes == NULL) {
-		snprintf(notes_buf, sizeof(notes_buf), "null");
-	} else {
-		// leave room for enclosing quotes
-		escape_json(notes, notes_buf + 1, sizeof(notes_buf) - 2);
-		notes_buf[0] = '"';
-		strcat(notes_buf, "\"");
+	struct log_buf escaped = {0};
+	if (notes != NULL) {
+		// escaped, with room for enclosing quotes
+		char *p = log_buf_reserve(&escaped,
+			JSON_ESCAPE_MAX * strlen(notes) + ESCAPE_SLACK + 3);
+		if (p != NULL) {
+			notes_buf = p;
+			*p++ = '"';
+			p = log_escape_json(p, notes);
+			*p++ = '"';
+			*p = '\0';
+		}
 	}
 
-	return fprintf(stream,	"  \"header\" : {\n"
+	int n_written = fprintf(stream,	"  \"header\" : {\n"
 							"    \"startDate\" : \"%s\",\n"
 							"    \"hostname\" : \"%s\",\n"
 							"    \"notes\" : %s\n  },",
 					date, get_hostname(), notes_buf);
+	log_buf_free(&escaped);
+
+	return n_written;
 }
 #endif /* ENABLE_JSON_HEADER */
 
@@ -315,101 +254,117 @@ int log_do_json_tail(FILE *stream) {
 	return fprintf(stream, " ]\n}\n");
 }
 
-static int do_json_start(FILE *stream, int sequence, bool records) {
-	return records ?
-				fprintf(stream, "{\n") :
-				fprintf(stream, "%s  {\n", sequence > 1 ? "," : "");
-}
-
-static int do_json_timespec(FILE *stream, struct timespec *timespec) {
-	return fprintf(stream,	"    \"timespec\" : {\n"
-							"      \"sec\" : %ld,\n"
-							"      \"nsec\" : %ld\n    },\n",
-					timespec->tv_sec, timespec->tv_nsec);
-}
-
-static int do_json_text(FILE *stream,
-	char const *label, char const *value, bool do_comma) {
-	return fprintf(stream, "    \"%s\" : \"%s\"%s\n",
-		label, value, do_comma ? "," : "");
-}
-
-static int do_json_int(FILE *stream,
-	char const *label, long const value, bool do_comma) {
-	return fprintf(stream, "    \"%s\" : %ld%s\n",
-		label, value, do_comma ? "," : "");
-}
-
-/**
- * End-of-Record
- * If we are producing a Log, the next record will insert a comma to separate
- * the list of record elements, or the End-of-Log will be appended at stream
- * end.
- * If we are producing a list of records, no comma will be necessary.
- */
-static int do_json_end(FILE *stream, bool records) {
-	return fprintf(stream, records ? "}\n" :"  }");
-}
-
 /**
- * @fn int _log_fmt_json(FILE *stream, int sequence, struct timespec *ts, int level,
- * const char *file, const char *function, int line, char *msg)
- * @brief Output messages with timestamp, level and message.
- * @param stream the output stream to write to
- * @param sequence the sequence number of the message
- * @param ts the struct timespec timestamp
- * @param level the log level to print
- * @param file the name of the file to print
- * @param function the name of the function to print
- * @param line the line number to print
- * @param msg the actual use message to print
+ * @fn int json_record(struct log_buf *, struct log_record const *, bool)
+ * @brief Append a json record to a buffer.
+ * @param out the buffer to append the record to
+ * @param r the record
  * @param records select a log with an array of records, or a stream of records
- * @return the number of characters written.
+ * @return the length of the record, or -1 if out of memory
  */
-static int _log_fmt_json(FILE *stream, int sequence, struct timespec *ts, int level,
-	const char *file, const char *function, int line, char *msg, bool records) {
+static int json_record(struct log_buf *out, struct log_record const *r,
+	bool records) {
 	char date[TIMESTAMP_LEN + TIMEZONE_LEN];
-	char buf[BUFSIZ] = {0};
-
-	pthread_t thread = pthread_self();
-	char thread_name[NAME_LEN];
-	int rc;
-	rc = pthread_getname_np(thread, thread_name, sizeof(thread_name));
-	if (rc != 0) {
-		snprintf(thread_name, sizeof(thread_name), "unknown");
-	}
-
-	int n_written = 0;
-
-	// The message must be properly escaped for the JSON output
-	// TODO: escape file also ???
-	escape_json(msg, buf, sizeof(buf));
+	char const *label = log_labels[r->level].english;
 
 	/*
 	 * Save some clock cycles if use of timezone is not configured.
 	 */
 #if ENABLE_TIMEZONE
-	json_format_timestamp(ts, date, sizeof(date));
+	json_format_timestamp(r->ts, date, sizeof(date));
 #else
-	log_format_timestamp(ts, FMT_UTC_OFFSET | FMT_ISO | SP_NANO,
+	log_format_timestamp(r->ts, FMT_UTC_OFFSET | FMT_ISO | SP_NANO,
 		date, sizeof(date));
 #endif
 
-	n_written += do_json_start(stream, sequence, records);
-	n_written += do_json_text(stream, "isoDateTime", date, true);
-	n_written += do_json_timespec(stream, ts);
-	n_written += do_json_int(stream, "sequence", sequence, true);
-	n_written += do_json_text(stream, "logger", "tinylogger", true);
-	n_written += do_json_text(stream, "level", log_labels[level].english, true);
-	n_written += do_json_text(stream, "file", file, true);
-	n_written += do_json_text(stream, "function", function, true);
-	n_written += do_json_int(stream, "line", line, true);
-	n_written += do_json_int(stream, "threadId", syscall(SYS_gettid), true);
-	n_written += do_json_text(stream, "threadName", thread_name, true);
-	n_written += do_json_text(stream, "message", buf, false);
-	n_written += do_json_end(stream, records);
+	char *buf = log_buf_reserve(out, RECORD_FIXED_LEN + strlen(date) +
+		strlen(label) + strlen(r->file) + strlen(r->function) +
+		strlen(r->thread_name) + JSON_ESCAPE_MAX * r->msg_len + ESCAPE_SLACK);
+	if (buf == NULL) return -1;
 
-	return n_written;
+	char *p = buf;
+
+	/*
+	 * If we are producing a Log, each record after the first is preceded by
+	 * a comma, as the records are the elements of an array.
+	 * If we are producing a list of records, no comma will be necessary.
+	 */
+	if (records) {
+		p = PUT_LITERAL(p, "{\n");
+	} else if (r->sequence > 1) {
+		p = PUT_LITERAL(p, ",  {\n");
+	} else {
+		p = PUT_LITERAL(p, "  {\n");
+	}
+
+	p = PUT_LITERAL(p, "    \"isoDateTime\" : \"");
+	p = stpcpy(p, date);
+	p = PUT_LITERAL(p, "\",\n    \"timespec\" : {\n      \"sec\" : ");
+	p = log_put_long(p, r->ts->tv_sec);
+	p = PUT_LITERAL(p, ",\n      \"nsec\" : ");
+	p = log_put_long(p, r->ts->tv_nsec);
+	p = PUT_LITERAL(p, "\n    },\n    \"sequence\" : ");
+	char *digits = p;
+	p = log_put_long(p, r->sequence);
+
+	// the first record of an array has no leading comma, so it only suits
+	// sequence 1
+	log_sequence_field = (struct log_sequence_field) {
+		.set = records || (r->sequence > 1),
+		.offset = digits - buf,
+		.len = p - digits,
+		.min = records ? 1 : 2,
+	};
+
+	p = PUT_LITERAL(p, ",\n    \"logger\" : \"tinylogger\",\n"
+		"    \"level\" : \"");
+	p = stpcpy(p, label);
+	p = PUT_LITERAL(p, "\",\n    \"file\" : \"");
+	p = stpcpy(p, r->file);	// TODO: escape file also ???
+	p = PUT_LITERAL(p, "\",\n    \"function\" : \"");
+	p = stpcpy(p, r->function);
+	p = PUT_LITERAL(p, "\",\n    \"line\" : ");
+	p = log_put_long(p, r->line);
+	p = PUT_LITERAL(p, ",\n    \"threadId\" : ");
+	p = log_put_long(p, r->tid);
+	p = PUT_LITERAL(p, ",\n    \"threadName\" : \"");
+	p = stpcpy(p, r->thread_name);
+	p = PUT_LITERAL(p, "\",\n    \"message\" : \"");
+	// The message must be properly escaped for the JSON output
+	p = log_escape_json(p, r->msg);
+	p = PUT_LITERAL(p, "\"\n");
+
+	// End-of-Record
+	if (records) {
+		p = PUT_LITERAL(p, "}\n");
+	} else {
+		p = PUT_LITERAL(p, "  }");
+	}
+
+	out->len += p - buf;
+	return p - buf;
+}
+
+/**
+ * @fn int log_bfmt_json(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_json().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_json(struct log_buf *buf, struct log_record const *r) {
+	return json_record(buf, r, false);
+}
+
+/**
+ * @fn int log_bfmt_json_records(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_json_records().
+ * @param buf the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_json_records(struct log_buf *buf, struct log_record const *r) {
+	return json_record(buf, r, true);
 }
 
 /**
@@ -436,8 +391,8 @@ static int _log_fmt_json(FILE *stream, int sequence, struct timespec *ts, int le
 int log_fmt_json(FILE *stream,
 		int sequence, struct timespec *ts, int level,
 		const char *file, const char *function, int line, char *msg) {
-	return _log_fmt_json(stream, sequence, ts, level,
-		file, function, line, msg, false);
+	return log_fmt_buffered(log_bfmt_json, stream, sequence, ts, level,
+		file, function, line, msg);
 }
 
 /**
@@ -462,6 +417,6 @@ int log_fmt_json(FILE *stream,
 int log_fmt_json_records(FILE *stream,
 		int sequence, struct timespec *ts, int level,
 		const char *file, const char *function, int line, char *msg) {
-	return _log_fmt_json(stream, sequence, ts, level,
-		file, function, line, msg, true);
+	return log_fmt_buffered(log_bfmt_json_records, stream, sequence, ts, level,
+		file, function, line, msg);
 }
@@ -0,0 +1,226 @@
+/*
+ * (C) 2020 Edward Hetherington
+ * This code is licensed under MIT license (see LICENSE in top dir for details)
+ */
+
+/** @file       mapped.c
+ *  @brief      A log_sink written through a memory mapped window of the file.
+ *  @details    A channel opened with log_open_channel_mmap() appends its
+ *  records with memcpy() into a MAPPED_WINDOW window of the file, mapped
+ *  with mmap(). No system call is made per record, or per batch.
+ *
+ *  The file is grown with fallocate() MAPPED_EXTENT at a time, ahead of the
+ *  window, so that the disk space is there before the pages are touched. The
+ *  window is mapped with MAP_POPULATE, so appending to it takes no page
+ *  faults. When a record doesn't fit in the rest of the window, the window is
+ *  moved up to the end of the records (and the file grown, if needed).
+ *
+ *  The file is cut back to the end of the records when the channel is closed
+ *  or reopened (log_reopen_channel() or the logrotate signal), and at exit.
+ *  Until then, it has preallocated zeros past the records. A process that is
+ *  killed leaves them.
+ *
+ *  Only one process may append to the file.
+ *
+ *  Like the rest of the sink, it is only used with the lock of its channel
+ *  held.
+ *
+ *  @author     Edward Hetherington
+ */
+
+#include "config.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#define _GNU_SOURCE
+
+#define MAPPED_WINDOW (1024 * 1024)			/**< size of the mapped window */
+#define MAPPED_EXTENT (4 * 1024 * 1024)		/**< the file grows this much */
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "tinylogger.h"
+#include "private.h"
+
+/**
+ * @struct log_mapped
+ * @brief The mapped window of a sink's file.
+ */
+struct log_mapped {
+	char	*window;		/**< the mapped window, or NULL */
+	off_t	window_off;		/**< where the window starts in the file */
+	off_t	end;			/**< the end of the records */
+	off_t	allocated;		/**< the length the file has been grown to */
+	size_t	n_records;		/**< records not yet counted in the stats */
+};
+
+/** windows mapped by all the sinks */
+static unsigned long mapped_windows = 0;
+
+/**
+ * @fn bool grow_file(struct log_mapped *, int, off_t)
+ * @brief Grow the file, a whole number of extents at a time, to at least len.
+ *
+ * The space is allocated with fallocate(). If the file system can't do that,
+ * the file is extended with ftruncate() - a full disk would then fault on
+ * the pages appended to.
+ *
+ * @param mapped the mapped file
+ * @param fd the file
+ * @param len the length needed
+ * @return false on error
+ */
+static bool grow_file(struct log_mapped *mapped, int fd, off_t len) {
+	if (len <= mapped->allocated) return true;
+
+	off_t size = (len + MAPPED_EXTENT - 1) / MAPPED_EXTENT * MAPPED_EXTENT;
+	if ((fallocate(fd, 0, mapped->allocated, size - mapped->allocated) != 0) &&
+		(ftruncate(fd, size) != 0)) return false;
+	mapped->allocated = size;
+
+	return true;
+}
+
+/**
+ * @fn bool map_window(struct log_mapped *, int)
+ * @brief Map a window starting at the page of the end of the records.
+ *
+ * If no window is mapped, the file was just opened, or just cut back, and the
+ * records end at the end of the file.
+ *
+ * @param mapped the mapped file
+ * @param fd the file
+ * @return false on error
+ */
+static bool map_window(struct log_mapped *mapped, int fd) {
+	if (mapped->window == NULL) {
+		struct stat st;
+		if (fstat(fd, &st) != 0) return false;
+		mapped->end = st.st_size;
+		mapped->allocated = st.st_size;
+	} else {
+		munmap(mapped->window, MAPPED_WINDOW);
+		mapped->window = NULL;
+	}
+
+	log_sink_count_records(mapped->n_records);
+	mapped->n_records = 0;
+
+	off_t page_size = sysconf(_SC_PAGESIZE);
+	mapped->window_off = mapped->end / page_size * page_size;
+	if (!grow_file(mapped, fd, mapped->window_off + MAPPED_WINDOW)) {
+		return false;
+	}
+
+	char *window = mmap(NULL, MAPPED_WINDOW, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, mapped->window_off);
+	if (window == MAP_FAILED) return false;
+	mapped->window = window;
+	__atomic_add_fetch(&mapped_windows, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+/**
+ * @fn int log_mapped_writev(struct log_mapped *, int, struct iovec const *,
+ *     int)
+ * @brief Append a record, in parts, to the window.
+ *
+ * A record too big for a window is appended with writev(), after the file is
+ * cut back.
+ *
+ * @param mapped the mapped file
+ * @param fd the file
+ * @param iov the parts of the record
+ * @param iovcnt the number of parts
+ * @return 0 on success, -1 on error
+ */
+int log_mapped_writev(struct log_mapped *mapped, int fd,
+	struct iovec const *iov, int iovcnt) {
+	struct iovec parts[iovcnt > 0 ? iovcnt : 1];
+	size_t len = 0;
+
+	for (int n = 0; n < iovcnt; n++) len += iov[n].iov_len;
+
+	// too big for any window - cut the file back and write it at the end
+	if (len > MAPPED_WINDOW - (size_t) sysconf(_SC_PAGESIZE)) {
+		if (log_mapped_flush(mapped, fd) != 0) return -1;
+		memcpy(parts, iov, iovcnt * sizeof(iov[0]));
+		return log_sink_write_all(fd, parts, iovcnt, 1);
+	}
+
+	if ((mapped->window == NULL) ||
+		(mapped->end + (off_t) len > mapped->window_off + MAPPED_WINDOW)) {
+		if (!map_window(mapped, fd)) return -1;
+	}
+
+	char *p = mapped->window + (mapped->end - mapped->window_off);
+	for (int n = 0; n < iovcnt; n++) {
+		memcpy(p, iov[n].iov_base, iov[n].iov_len);
+		p += iov[n].iov_len;
+	}
+	mapped->end += len;
+	mapped->n_records++;
+
+	return 0;
+}
+
+/**
+ * @fn int log_mapped_flush(struct log_mapped *, int)
+ * @brief Unmap the window, and cut the file back to the end of the records.
+ * The next record maps a new window.
+ * @param mapped the mapped file
+ * @param fd the file
+ * @return 0 on success, -1 on error
+ */
+int log_mapped_flush(struct log_mapped *mapped, int fd) {
+	if (mapped->window == NULL) return 0;
+
+	munmap(mapped->window, MAPPED_WINDOW);
+	mapped->window = NULL;
+
+	log_sink_count_records(mapped->n_records);
+	mapped->n_records = 0;
+
+	if (mapped->allocated > mapped->end) {
+		if (ftruncate(fd, mapped->end) != 0) return -1;
+		mapped->allocated = mapped->end;
+	}
+
+	return 0;
+}
+
+/**
+ * @fn struct log_mapped *log_mapped_open(void)
+ * @brief Set up the window of a sink. Nothing is mapped until the first
+ * record.
+ * @return the mapped file, or NULL if out of memory
+ */
+struct log_mapped *log_mapped_open(void) {
+	return calloc(1, sizeof(struct log_mapped));
+}
+
+/**
+ * @fn void log_mapped_close(struct log_mapped *)
+ * @brief Free the state of a window. It must have been flushed.
+ * @param mapped the mapped file
+ */
+void log_mapped_close(struct log_mapped *mapped) {
+	free(mapped);
+}
+
+/**
+ * @fn void log_mapped_get_stats(struct log_stats *)
+ * @brief Add the mapped window counters to the stats.
+ * @param stats the stats
+ */
+void log_mapped_get_stats(struct log_stats *stats) {
+	stats->mmap_windows += __atomic_load_n(&mapped_windows, __ATOMIC_RELAXED);
+}
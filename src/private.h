@@ -26,8 +26,11 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "tinylogger.h"
 
@@ -35,16 +38,48 @@
 TL_BEGIN_C_DECLS
 
 #define TIMESTAMP_LEN 40	/**< buffer size for formatting date/time */
+#define LOG_NAME_LEN 16		/**< TASK_COMM_LEN, includes null termination */
 
 #endif /* DOXYGEN_SHOULD_SKIP_THIS */
 
+/**
+ * The user messages are limited to MAX_MSG_SIZE characters. This does not
+ * include information added by log_msg().
+ *
+ * Memory dumps from log_mem() are not limited by it. They are logged in parts
+ * instead (see LOG_MEM_CHUNK).
+ *
+ * To configure with configure (autotools)
+
+```
+$ MAX_MSG_SIZE=xxxx ./configure
+```
+
+ * To configure with the quick-start setup edit the config.h in the quick-start
+ * directory.
+ *
+ * 0 = unlimited - uses asprintf
+ * -1 = unlimited - uses a buffer per thread, grown as needed and reused
+ */
+#ifndef MAX_MSG_SIZE
+#define MAX_MSG_SIZE BUFSIZ
+#endif
+
 /**
  * @struct _logChannel
  * @brief Parameters used to configure a logging channel.
  * This structure definition is not "user" visible. It is protected with mutex
  * so that multiple threads can access it in a consistant state.
+ *
+ * Each channel has its own lock, held while a message is written to it, and
+ * while its stream is swapped or closed. The level and formatter are changed
+ * with the log_lock held as well.
+ *
+ * The rotation state is read by the rotation thread with the log_lock held.
+ * The length of the file is counted with the channel lock held.
  */
 struct _logChannel {
+	pthread_mutex_t	lock;		/**< serializes the writes to the stream */
 	LOG_LEVEL	level;			/**< the minimum level to log */
 	log_formatter_t	formatter;	/**< the formatter to use */
 	char		*pathname;		/**< pathname of the file, if logging to file */
@@ -54,6 +89,37 @@ struct _logChannel {
 	int			sequence;		/**< sequence number for structured streams (Json and XML) */
 	void (*open_action)(void);	/**< open function for structured streams (Json and XML) */
 	void (*close_action)(void);	/**< close function for structured streams (Json and XML) */
+	struct log_binary *binary;	/**< dictionaries of a binary channel */
+	struct log_sink *sink;		/**< raw file descriptor output, or NULL */
+	struct log_rotation rotation;	/**< when to rotate the file, all 0 if never */
+	unsigned long	file_len;	/**< the length of the file, near enough */
+	time_t		started;		/**< when the file was opened */
+	time_t		rotate_at;		/**< when to rotate it by age or time, or 0 */
+	bool		rotate_now;		/**< it has reached rotation.max_bytes */
+	bool		closed;			/**< closed, but left in the set (it couldn't be
+									 replaced) until the next one */
+	struct _logChannel *removed_next;	/**< next channel freed with the same
+										 retired set */
+};
+
+/**
+ * @struct log_packed
+ * @brief A user message as its format and packed arguments (see deferred.c).
+ */
+struct log_packed {
+	char const	*format;	/**< the format string - static */
+	char const	*args;		/**< the arguments packed by log_pack_args() */
+	size_t		len;		/**< length of args */
+	size_t		msg_limit;	/**< buffer size if the message is rendered */
+};
+
+/**
+ * @struct log_origin
+ * @brief The thread that logged a message, for the thread formats.
+ */
+struct log_origin {
+	long	tid;					/**< linux thread id */
+	char	name[LOG_NAME_LEN];		/**< thread name */
 };
 
 /*
@@ -65,8 +131,127 @@ int log_do_xml_tail(FILE *stream);
 int log_do_json_head(FILE *stream, char *notes);
 int log_do_json_tail(FILE *stream);
 
+/* defined in tinylogger.c, used in async.c */
+void log_emit(struct timespec *ts, int level,
+	char const *file, char const *function, int line,
+	char *msg, struct log_packed const *packed);
+
+/* defined in async.c, used in tinylogger.c */
+bool log_async_active(void);
+void log_async_wait_queued(void);
+size_t log_async_msg_limit(void);
+int log_async_vmsg(struct timespec *ts, int level,
+	char const *file, char const *function, int line,
+	char const *format, va_list args);
+void log_async_flush(void);
+void log_async_get_stats(struct log_stats *stats);
+
+/* defined in async.c, used by the formatters */
+long log_get_tid(void);
+char *log_get_thread_name(char *buf, size_t len);
+struct log_origin const *log_get_origin(void);
+void log_set_origin(struct log_origin const *origin);
+
+/* defined in deferred.c, used in async.c and tinylogger.c */
+void log_defer_init(void);
+bool log_is_static(char const *format);
+long log_pack_args(char *buf, size_t room, char const *format, va_list args);
+size_t log_render_deferred(char *buf, size_t len, char const *format,
+	char const *args);
+
+/* defined in binary.c, used in tinylogger.c */
+int log_do_binary(LOG_CHANNEL *channel, struct timespec *ts, int level,
+	char const *file, char const *function, int line,
+	char const *msg, struct log_packed const *packed);
+void log_binary_free(LOG_CHANNEL *channel);
+
+/**
+ * @enum log_sink_type
+ * @brief How a log_sink writes its batches.
+ */
+enum log_sink_type {
+	LOG_SINK_FD,		/**< with write() */
+	LOG_SINK_URING,		/**< with io_uring, if it can be used */
+	LOG_SINK_MMAP,		/**< by copying into a mapped window of the file */
+};
+
+/* defined in sink.c, used in tinylogger.c */
+struct log_sink *log_sink_open(char const *pathname, enum log_sink_type type,
+	bool line_buffered);
+FILE *log_sink_stream(struct log_sink *sink);
+int log_sink_writev(struct log_sink *sink, struct iovec const *iov,
+	int iovcnt);
+int log_sink_flush(struct log_sink *sink);
+struct log_sink *log_sink_reopen(struct log_sink *sink, char const *pathname);
+void log_sink_close(struct log_sink *sink);
+void log_sink_get_stats(struct log_stats *stats);
+
+/* defined in sink.c, used in uring.c and mapped.c */
+int log_sink_write_all(int fd, struct iovec *iov, int iovcnt,
+	size_t n_records);
+void log_sink_count_records(size_t n_records);
+
+/* defined in uring.c, used in sink.c */
+struct log_uring *log_uring_open(void);
+int log_uring_writev(struct log_uring *uring, int fd, struct iovec const *iov,
+	int iovcnt, bool line_buffered);
+int log_uring_flush(struct log_uring *uring, int fd);
+void log_uring_close(struct log_uring *uring);
+void log_uring_get_stats(struct log_stats *stats);
+
+/* defined in mapped.c, used in sink.c */
+struct log_mapped *log_mapped_open(void);
+int log_mapped_writev(struct log_mapped *mapped, int fd,
+	struct iovec const *iov, int iovcnt);
+int log_mapped_flush(struct log_mapped *mapped, int fd);
+void log_mapped_close(struct log_mapped *mapped);
+void log_mapped_get_stats(struct log_stats *stats);
+
+/* defined in tinylogger.c, used in compress.c */
+void log_report_error(char const * const format, ...)
+	__attribute__ ((format (printf, 1, 2)));
+
+/* defined in compress.c, used in tinylogger.c */
+void log_compress_file(char const *pathname);
+void log_compress_stop(void);
+void log_compress_get_stats(struct log_stats *stats);
+
+/* defined in escape.c, used by the json and xml formatters */
+#define JSON_ESCAPE_MAX 6	/**< the longest json escape sequence */
+#define XML_ESCAPE_MAX 6	/**< the longest xml entity */
+#define ESCAPE_SLACK 32		/**< room needed past the end of the escaped output */
+char *log_escape_json(char *out, char const *in);
+char *log_escape_xml(char *out, char const *in);
+
+/**
+ * @struct log_sequence_field
+ * @brief Where the json or xml formatter put the sequence number in the
+ * record it just wrote.
+ *
+ * A record is formatted once for all the channels with the same formatter.
+ * For each of the other channels, the digits are replaced with its own
+ * sequence number, rather than formatting the record again.
+ */
+struct log_sequence_field {
+	bool	set;		/**< the rest is valid for the last record */
+	size_t	offset;		/**< where the digits start in the record */
+	size_t	len;		/**< the number of digits */
+	int		min;		/**< the lowest sequence number the record suits */
+};
+/* defined in tinylogger.c, set by the json and xml formatters */
+extern __thread struct log_sequence_field log_sequence_field;
+
+/**
+ * log_mem() logs large memory dumps in parts of at most LOG_MEM_CHUNK bytes,
+ * so that the memory it uses does not depend on the size of the region.
+ */
+#define LOG_MEM_CHUNK 4096
+
 /* defined in hexformat.c, used in tinylogger.c */
-char *log_hexformat (void const * const addr, size_t const len);
+size_t log_hexformat_len(size_t const len);
+size_t log_hexformat_fit(size_t const room);
+char *log_hexformat(char *out, void const * const mem, size_t const offset,
+	size_t const len);
 /* defined in timezone.c, used in tinylogger.c */
 char *log_get_timezone(char * const buf, size_t const buf_len);
 
@@ -0,0 +1,327 @@
+/*
+ * (C) 2020 Edward Hetherington
+ * This code is licensed under MIT license (see LICENSE in top dir for details)
+ */
+
+/** @file       sink.c
+ *  @brief      File output with a raw file descriptor, bypassing stdio.
+ *  @details    A channel opened with log_open_channel_fd() writes its records
+ *  to a log_sink rather than a FILE. The records are formatted by the buffer
+ *  formatters (see formatters.c) and gathered in a batch buffer of the sink,
+ *  which is written with a single write() when it fills. A record that
+ *  doesn't fit is written along with the batch, with writev().
+ *
+ *  The file is opened with O_APPEND, and a write only ever holds whole
+ *  records, so several processes appending to the same file never interleave
+ *  partial lines. (Unless the write comes up short, say the disk is full.)
+ *
+ *  The json and xml heads and tails, binary records and the rare record that
+ *  can't be formatted into a buffer are written to an unbuffered stream of the
+ *  sink, which passes each write on to the batch.
+ *
+ *  A channel opened with log_open_channel_uring() writes its batches with
+ *  io_uring instead (see uring.c), and one opened with log_open_channel_mmap()
+ *  copies its records into a mapped window of the file (see mapped.c).
+ *
+ *  The sink has no lock of its own. It is only used with the lock of its
+ *  channel held.
+ *
+ *  @author     Edward Hetherington
+ */
+
+#include "config.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#define _GNU_SOURCE
+
+#define SINK_BATCH (64 * 1024)	/**< size of the batch buffer */
+#define SINK_ALIGN 4096			/**< alignment of the batch buffer */
+#define SINK_MAX_PARTS 4		/**< the most parts of a record */
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "tinylogger.h"
+#include "private.h"
+
+/**
+ * @struct log_sink
+ * @brief A file written with a raw file descriptor.
+ */
+struct log_sink {
+	int		fd;				/**< the file */
+	FILE	*stream;		/**< unbuffered, writes to the batch */
+	char	*buf;			/**< the batch of whole records */
+	size_t	len;			/**< the length of the batch */
+	size_t	n_records;		/**< the records in the batch */
+	bool	line_buffered;	/**< write each record at once */
+	enum log_sink_type type;	/**< how it was asked to write */
+	struct log_uring *uring;	/**< writes the batches instead, or NULL */
+	struct log_mapped *mapped;	/**< takes the records instead, or NULL */
+};
+
+/** records written by all the sinks */
+static unsigned long sink_records = 0;
+/** write() and writev() calls made by all the sinks */
+static unsigned long sink_writes = 0;
+
+/**
+ * @fn void log_sink_count_records(size_t)
+ * @brief Count records written.
+ * @param n_records the number of records
+ */
+void log_sink_count_records(size_t n_records) {
+	__atomic_add_fetch(&sink_records, n_records, __ATOMIC_RELAXED);
+}
+
+/**
+ * @fn int log_sink_write_all(int, struct iovec *, int, size_t)
+ * @brief Write the parts with as few system calls as possible - one, unless
+ * the write comes up short or is interrupted.
+ * @param fd the file
+ * @param iov the parts, advanced past what was written
+ * @param iovcnt the number of parts
+ * @param n_records the number of records in them
+ * @return 0 on success, -1 on error
+ */
+int log_sink_write_all(int fd, struct iovec *iov, int iovcnt,
+	size_t n_records) {
+	while (iovcnt > 0) {
+		ssize_t written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		__atomic_add_fetch(&sink_writes, 1, __ATOMIC_RELAXED);
+
+		// skip what was written
+		while ((iovcnt > 0) && ((size_t) written >= iov->iov_len)) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	log_sink_count_records(n_records);
+
+	return 0;
+}
+
+/**
+ * @fn int log_sink_writev(struct log_sink *, struct iovec const *, int)
+ * @brief Add a record, in parts, to the batch.
+ *
+ * If it doesn't fit, the batch and the record are written together. The
+ * batch is written at once if the sink is line buffered.
+ *
+ * @param sink the sink
+ * @param iov the parts of the record
+ * @param iovcnt the number of parts, at most SINK_MAX_PARTS
+ * @return 0 on success, -1 on error
+ */
+int log_sink_writev(struct log_sink *sink, struct iovec const *iov,
+	int iovcnt) {
+	struct iovec parts[1 + SINK_MAX_PARTS];
+	size_t len = 0;
+	int status = 0;
+
+	if ((iovcnt < 0) || (iovcnt > SINK_MAX_PARTS)) return -1;
+
+	if (sink->uring != NULL) {
+		return log_uring_writev(sink->uring, sink->fd, iov, iovcnt,
+			sink->line_buffered);
+	}
+	if (sink->mapped != NULL) {
+		return log_mapped_writev(sink->mapped, sink->fd, iov, iovcnt);
+	}
+
+	for (int n = 0; n < iovcnt; n++) len += iov[n].iov_len;
+
+	if (sink->len + len <= SINK_BATCH) {
+		for (int n = 0; n < iovcnt; n++) {
+			memcpy(sink->buf + sink->len, iov[n].iov_base, iov[n].iov_len);
+			sink->len += iov[n].iov_len;
+		}
+		sink->n_records++;
+		return sink->line_buffered ? log_sink_flush(sink) : 0;
+	}
+
+	// too big for what is left - write the batch and the record in one go
+	parts[0].iov_base = sink->buf;
+	parts[0].iov_len = sink->len;
+	memcpy(parts + 1, iov, iovcnt * sizeof(iov[0]));
+	status = log_sink_write_all(sink->fd, parts, 1 + iovcnt,
+		sink->n_records + 1);
+
+	// on error, the batch is dropped, as stdio would
+	sink->len = 0;
+	sink->n_records = 0;
+
+	return status;
+}
+
+/**
+ * @fn int log_sink_flush(struct log_sink *)
+ * @brief Write the batch.
+ * @param sink the sink
+ * @return 0 on success, -1 on error
+ */
+int log_sink_flush(struct log_sink *sink) {
+	struct iovec part = {.iov_base = sink->buf, .iov_len = sink->len};
+	int status = 0;
+
+	if (sink->uring != NULL) return log_uring_flush(sink->uring, sink->fd);
+	if (sink->mapped != NULL) return log_mapped_flush(sink->mapped, sink->fd);
+	if (sink->len == 0) return 0;
+
+	status = log_sink_write_all(sink->fd, &part, 1, sink->n_records);
+
+	sink->len = 0;
+	sink->n_records = 0;
+
+	return status;
+}
+
+/**
+ * @fn ssize_t stream_write(void *, char const *, size_t)
+ * @brief The write function of the sink's stream.
+ * @return len on success, 0 on error
+ */
+static ssize_t stream_write(void *cookie, char const *data, size_t len) {
+	struct iovec part = {.iov_base = (char *) data, .iov_len = len};
+
+	return (log_sink_writev(cookie, &part, 1) == 0) ? (ssize_t) len : 0;
+}
+
+/**
+ * @fn int stream_close(void *)
+ * @brief The close function of the sink's stream. The file and the batch
+ * belong to the sink.
+ * @return 0
+ */
+static int stream_close(void *cookie) {
+	(void) cookie;
+	return 0;
+}
+
+/**
+ * @fn int open_file(char const *, bool)
+ * @brief Open a file for appending, as fopen(pathname, "a") would.
+ * @param pathname the file
+ * @param mapped it will be mapped, and so must be readable too
+ * @return the file descriptor, or -1 on error
+ */
+static int open_file(char const *pathname, bool mapped) {
+	return open(pathname, (mapped ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND,
+		0666);
+}
+
+/**
+ * @fn struct log_sink *log_sink_open(char const *, enum log_sink_type, bool)
+ * @brief Open a file for a sink.
+ *
+ * A LOG_SINK_URING sink falls back to write() if io_uring can't be used.
+ *
+ * @param pathname the file
+ * @param type how the batches are written
+ * @param line_buffered write each record at once, rather than in batches
+ * @return the sink, or NULL on error (errno is set)
+ */
+struct log_sink *log_sink_open(char const *pathname, enum log_sink_type type,
+	bool line_buffered) {
+	cookie_io_functions_t functions = {
+		.write = stream_write,
+		.close = stream_close,
+	};
+
+	struct log_sink *sink = calloc(1, sizeof(*sink));
+	if (sink == NULL) return NULL;
+
+	sink->line_buffered = line_buffered;
+	sink->type = type;
+	sink->fd = open_file(pathname, type == LOG_SINK_MMAP);
+	if (sink->fd < 0) goto fail;
+
+	// an io_uring has buffers of its own, and a mapped file needs none
+	if (type == LOG_SINK_URING) sink->uring = log_uring_open();
+	if (type == LOG_SINK_MMAP) {
+		sink->mapped = log_mapped_open();
+		if (sink->mapped == NULL) goto fail;
+	} else if (sink->uring == NULL) {
+		sink->buf = aligned_alloc(SINK_ALIGN, SINK_BATCH);
+		if (sink->buf == NULL) goto fail;
+	}
+
+	sink->stream = fopencookie(sink, "w", functions);
+	if (sink->stream == NULL) goto fail;
+	setvbuf(sink->stream, NULL, _IONBF, 0);
+
+	return sink;
+
+fail:
+	if (sink->uring != NULL) log_uring_close(sink->uring);
+	if (sink->mapped != NULL) log_mapped_close(sink->mapped);
+	if (sink->fd >= 0) close(sink->fd);
+	free(sink->buf);
+	free(sink);
+	return NULL;
+}
+
+/**
+ * @fn FILE *log_sink_stream(struct log_sink *)
+ * @brief Get the stream of a sink, for the writes that need a FILE.
+ * @param sink the sink
+ * @return the stream
+ */
+FILE *log_sink_stream(struct log_sink *sink) {
+	return sink->stream;
+}
+
+/**
+ * @fn struct log_sink *log_sink_reopen(struct log_sink *, char const *)
+ * @brief Open a new sink, written the same way as another one, for a channel
+ * that is reopened. The old one is left for log_sink_close().
+ * @param sink the sink to copy
+ * @param pathname the file
+ * @return the new sink, or NULL on error (errno is set)
+ */
+struct log_sink *log_sink_reopen(struct log_sink *sink, char const *pathname) {
+	return log_sink_open(pathname, sink->type, sink->line_buffered);
+}
+
+/**
+ * @fn void log_sink_close(struct log_sink *)
+ * @brief Write the batch, close the file, and free the sink.
+ * @param sink the sink
+ */
+void log_sink_close(struct log_sink *sink) {
+	log_sink_flush(sink);
+
+	fclose(sink->stream);
+	if (sink->uring != NULL) log_uring_close(sink->uring);
+	if (sink->mapped != NULL) log_mapped_close(sink->mapped);
+	if (sink->fd >= 0) close(sink->fd);
+	free(sink->buf);
+	free(sink);
+}
+
+/**
+ * @fn void log_sink_get_stats(struct log_stats *)
+ * @brief Add the sink counters to the stats.
+ * @param stats the stats
+ */
+void log_sink_get_stats(struct log_stats *stats) {
+	stats->sink_records += __atomic_load_n(&sink_records, __ATOMIC_RELAXED);
+	stats->sink_writes += __atomic_load_n(&sink_writes, __ATOMIC_RELAXED);
+	log_uring_get_stats(stats);
+	log_mapped_get_stats(stats);
+}
@@ -25,37 +25,18 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include <linux/version.h>
 
 #include "tinylogger.h"
 #include "private.h"
 
-/**
- * The user messages are limited to MAX_MSG_SIZE characters. This does not
- * include information added by log_msg().
- *
- * If using large memory dumps with log_mem(), you may want to remove any
- * limit by setting MAX_MSG_SIZE to 0.
- *
- * To configure with configure (autotools)
-
-```
-$ MAX_MSG_SIZE=xxxx ./configure
-```
-
- * To configure with the quick-start setup edit the config.h in the quick-start
- * directory.
- *
- * 0 = unlimited - uses asprintf
- */
-#ifndef MAX_MSG_SIZE
-#define MAX_MSG_SIZE BUFSIZ
-#endif
-
 /***************************************************/
 /********************* private *********************/
 /***************************************************/
@@ -77,9 +58,68 @@ static LOG_LEVEL pre_init_level = LL_INFO;
  */
 static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/**
+ * The most verbose level that any open channel accepts, or the pre_init_level
+ * before configuration. LL_OFF if nothing would be logged.
+ *
+ * It is written with log_lock held, and read without it by log_msg(),
+ * log_mem() and the log_xxx() macros, so that a message nobody wants costs a
+ * single load and compare.
+ */
+int log_max_level = LL_INFO;
+
+/**
+ * The number of open channels using log_fmt_binary. While there are any,
+ * log_msg() packs the arguments instead of formatting the message. Written
+ * with log_lock held, read without it.
+ */
+static int binary_channels = 0;
+
+/**
+ * Messages that arrive with packed arguments are rendered here, per thread,
+ * for the text channels. It is freed when the thread exits.
+ */
+static __thread char *render_buf = NULL;
+static __thread size_t render_len = 0;
+
+/**
+ * The calling thread's message buffer. log_mem() builds its messages here,
+ * and so does log_msg() when MAX_MSG_SIZE is -1. It starts at BUFSIZ, doubles
+ * whenever a message doesn't fit, and is reused, so once it has grown to fit
+ * no memory is allocated. It is freed when the thread exits.
+ */
+static __thread struct {
+	char	*buf;	/**< the message is built here */
+	size_t	size;	/**< size of buf */
+} thread_msg = {0};
+
+/**
+ * The calling thread's record buffer. When a channel is busy, or a record is
+ * written to several channels, it is formatted here first, and then written
+ * to the channels in one piece.
+ */
+static __thread struct {
+	struct log_buf	buf;	/**< built by a buffer formatter */
+	FILE	*stream;		/**< memory stream, for custom formatters */
+	char	*stream_buf;	/**< what the memory stream wrote, after fflush() */
+	size_t	stream_len;		/**< its length */
+	char const	*data;		/**< the record, in buf or stream_buf */
+	size_t	len;			/**< the length of the record */
+} thread_record = {0};
+
+/** where the json and xml formatters put the sequence number */
+__thread struct log_sequence_field log_sequence_field = {0};
+
+/**
+ * used to free the message, render and record buffers of a thread when it
+ * exits
+ */
+static pthread_key_t thread_msg_key;
+static pthread_once_t thread_msg_once = PTHREAD_ONCE_INIT;
+
 /**
  * @struct log_config
- * Parameters common to all (both) channels.
+ * Parameters common to all channels.
  */
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 static struct log_config {
@@ -94,19 +134,88 @@ static struct log_config {
 #endif /* DOXYGEN_SHOULD_SKIP_THIS */
 
 /**
- * Threads accessing log_channels[]
+ * @struct channel_set
+ * @brief The open channels, as a compact array for log_dispatch() to walk.
  *
- * Any thread calling the configuration functions. They modify it.
+ * A set is never changed once it is published. Opening or closing a channel,
+ * or changing its level, builds a new set and swaps it in, so the channels
+ * are not limited in number and walking them costs no more than walking an
+ * array.
  *
- * Any thread calling the log_msg() function, They read the config.
+ * Threads accessing the channel set:
  *
- * The logrotate thread. It reads the config.
+ * Any thread calling the configuration functions. They replace it, with the
+ * log_lock held.
+ *
+ * Any thread calling the log_msg() function, They read it without a lock,
+ * between enter_channels() and leave_channels().
+ *
+ * The logrotate thread. It reads it with the log_lock held.
+ *
+ * A replaced set, and a channel closed with it, is retired rather than freed.
+ * It is freed once every thread that might still be walking it has left.
  */
-static struct _logChannel log_channels[] = {
-	{LL_OFF,	NULL,	NULL, false, NULL, NULL, 0, NULL, NULL},
-	{LL_OFF,	NULL,	NULL, false, NULL, NULL, 0, NULL, NULL},
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+struct channel_set {
+	struct channel_set *retired_next;	/**< next on the retired list */
+	unsigned long	retired_epoch;	/**< channel_epoch when it was retired */
+	LOG_CHANNEL		*removed;		/**< channels closed when it was retired */
+	size_t	count;					/**< the number of channels */
+	struct channel_entry {
+		LOG_LEVEL	level;			/**< copy of the channel level */
+		log_formatter_t	formatter;	/**< copy of the channel formatter */
+		log_buf_formatter_t	buf_formatter;	/**< its buffer version, if any */
+		int			next_shared;	/**< the next entry with the same
+										 formatter, or -1 */
+		bool		follows;		/**< written with an earlier entry */
+		bool		has_sink;		/**< written with a log_sink */
+		LOG_CHANNEL	*channel;		/**< the channel */
+	} entries[];					/**< the channels, in order of opening */
 };
-#define LOG_CH_COUNT (sizeof(log_channels) / sizeof(log_channels[0]))
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+/** the set before any channel is opened */
+static struct channel_set no_channels = {.count = 0};
+
+/**
+ * The current channel set. Swapped with log_lock held, and read with it held,
+ * or with an atomic load.
+ */
+static struct channel_set *log_channels = &no_channels;
+
+/** the sets waiting to be freed, with log_lock held */
+static struct channel_set *retired_sets = NULL;
+
+/**
+ * Advanced each time a set is retired. Starts at 1 - an epoch of 0 means a
+ * thread is not walking the channel set.
+ */
+static unsigned long channel_epoch = 1;
+
+/**
+ * @struct channel_reader
+ * @brief A thread that walks the channel set, for reclaiming retired sets.
+ *
+ * The readers are on a list that only grows. The record of a thread that
+ * exits is reused by the next new thread.
+ */
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+struct channel_reader {
+	struct channel_reader *next;	/**< next on the list */
+	unsigned long	epoch;		/**< channel_epoch on entry, 0 when outside */
+	int				in_use;		/**< owned by a live thread */
+} __attribute__((aligned(64)));
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+/** all the readers */
+static struct channel_reader *channel_readers = NULL;
+
+/** the calling thread's reader record */
+static __thread struct channel_reader *my_reader = NULL;
+
+/** used to release the reader record of a thread when it exits */
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
 
 /**
  * Parameters used to support logrotate
@@ -124,33 +233,165 @@ static struct rotate_config {
 #endif /* DOXYGEN_SHOULD_SKIP_THIS */
 
 /**
- * @fn LOG_CHANNEL *get_channel(void)
- * @brief get an available channel
- * @return a LOG_CHANNEL *, or NULL if none available
+ * The rotation thread, which rotates the channels given a policy by
+ * log_set_rotation(). Started and stopped with log_lock held.
+ */
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+static struct rotation_config {
+	sem_t		wakeup;			/**< posted when a file reaches its max_bytes */
+	bool		stop;			/**< asks the thread to return */
+	bool		thread_running;
+	pthread_t	thread;
+	unsigned long rotations;	/**< files rotated */
+} rotation_config = {
+	.stop = false,
+	.thread_running = false,
+	.rotations = 0
+};
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+static pthread_once_t rotation_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @fn void reader_release(void *)
+ * @brief Thread exit destructor - let another thread have the reader record.
+ * @param reader the reader record of the exiting thread
+ */
+static void reader_release(void *reader) {
+	__atomic_store_n(&((struct channel_reader *) reader)->in_use, 0,
+		__ATOMIC_RELEASE);
+	my_reader = NULL;
+}
+
+static void reader_key_init(void) {
+	pthread_key_create(&reader_key, reader_release);
+}
+
+/**
+ * @fn struct channel_reader *get_reader(void)
+ * @brief Get the calling thread's reader record, the first time by reusing a
+ * free one or adding a new one.
+ * @return the record, or NULL if out of memory
+ */
+static struct channel_reader *get_reader(void) {
+	struct channel_reader *reader = my_reader;
+
+	if (reader != NULL) return reader;
+
+	for (reader = __atomic_load_n(&channel_readers, __ATOMIC_ACQUIRE);
+		reader != NULL; reader = reader->next) {
+		int free = 0;
+		if (__atomic_compare_exchange_n(&reader->in_use, &free, 1, false,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+	}
+
+	if (reader == NULL) {
+		reader = aligned_alloc(64, sizeof(*reader));
+		if (reader == NULL) return NULL;
+		reader->epoch = 0;
+		reader->in_use = 1;
+		reader->next = __atomic_load_n(&channel_readers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&channel_readers, &reader->next,
+			reader, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	pthread_once(&reader_key_once, reader_key_init);
+	pthread_setspecific(reader_key, reader);
+
+	my_reader = reader;
+	return reader;
+}
+
+/**
+ * @fn struct channel_set *enter_channels(void)
+ * @brief Start walking the channel set, without the log_lock.
+ *
+ * The calling thread publishes the current epoch, so that no set it may see
+ * is freed until leave_channels(). If no reader record could be had, the
+ * log_lock is taken instead.
+ *
+ * @return the channel set
+ */
+static struct channel_set *enter_channels(void) {
+	struct channel_reader *reader = get_reader();
+
+	if (reader == NULL) {
+		pthread_mutex_lock(&log_lock);
+		return log_channels;
+	}
+
+	__atomic_store_n(&reader->epoch,
+		__atomic_load_n(&channel_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&log_channels, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @fn void leave_channels(void)
+ * @brief Done walking the channel set.
+ */
+static void leave_channels(void) {
+	if (my_reader == NULL) {
+		pthread_mutex_unlock(&log_lock);
+		return;
+	}
+
+	__atomic_store_n(&my_reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @fn void free_retired(void)
+ * @brief Free the retired sets (and the channels closed with them) that no
+ * thread can still be walking.
+ *
+ * Must be called with log_lock held.
  */
-static LOG_CHANNEL *get_channel(void) {
-	LOG_CHANNEL *channel = (LOG_CHANNEL *) log_channels;
-	for (size_t n = 0; n < LOG_CH_COUNT; n++, channel++) {
-		if ((channel->pathname == NULL) &&
-			(channel->stream == NULL)) {
-			return channel;
+static void free_retired(void) {
+	unsigned long oldest = (unsigned long) -1;
+
+	for (struct channel_reader *reader =
+		__atomic_load_n(&channel_readers, __ATOMIC_ACQUIRE);
+		reader != NULL; reader = reader->next) {
+		unsigned long epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+		if ((epoch != 0) && (epoch < oldest)) oldest = epoch;
+	}
+
+	struct channel_set **prev = &retired_sets;
+	while (*prev != NULL) {
+		struct channel_set *set = *prev;
+
+		// a thread that entered after the set was retired can't see it
+		if (set->retired_epoch < oldest) {
+			*prev = set->retired_next;
+			while (set->removed != NULL) {
+				LOG_CHANNEL *channel = set->removed;
+				set->removed = channel->removed_next;
+				pthread_mutex_destroy(&channel->lock);
+				free(channel);
+			}
+			free(set);
+		} else {
+			prev = &set->retired_next;
 		}
 	}
-	return NULL;
 }
 
 /**
  * @fn bool is_channel(LOG_CHANNEL *channel)
  * @brief verify that the given channel is valid
+ *
+ * Must be called with log_lock held. A channel closed, but still in the set,
+ * isn't.
+ *
  * @param channel the channel to verify
  * @return true if the channel exists
  */
 static inline bool is_channel(LOG_CHANNEL *channel) {
-	// verify that it is actually a channel
-	LOG_CHANNEL  *log_ch = (LOG_CHANNEL *) log_channels;
-	for (size_t n = 0; n < LOG_CH_COUNT; n++, log_ch++) {
-		if (channel == log_ch) {
-			return true;
+	struct channel_set const *set = log_channels;
+
+	for (size_t n = 0; n < set->count; n++) {
+		if (set->entries[n].channel == channel) {
+			return !channel->closed;
 		}
 	}
 
@@ -158,14 +399,119 @@ static inline bool is_channel(LOG_CHANNEL *channel) {
 }
 
 /**
- * @fn bool is_open_channel(LOG_CHANNEL *channel)
- * @brief verify that the given channel is valid and open (in use)
- * @param channel the channel to verify
- * @return true if the channel exists
+ * @fn bool ignores_sequence(log_formatter_t)
+ * @brief Check for a built in formatter that doesn't print the sequence
+ * number, so its record suits any channel.
+ * @param formatter the formatter
+ * @return true if it doesn't
  */
-static inline bool is_open_channel(LOG_CHANNEL *channel) {
-	if (!is_channel(channel)) return false;
-	return channel->stream != NULL ? true : false;
+static bool ignores_sequence(log_formatter_t formatter) {
+	return (formatter == log_fmt_basic) || (formatter == log_fmt_systemd) ||
+		(formatter == log_fmt_standard) || (formatter == log_fmt_debug) ||
+		(formatter == log_fmt_tall) || (formatter == log_fmt_debug_tid) ||
+		(formatter == log_fmt_debug_tname) ||
+		(formatter == log_fmt_debug_tall) ||
+		(formatter == log_fmt_elapsed_time);
+}
+
+/**
+ * @fn bool can_share(log_formatter_t)
+ * @brief Check if a record of the formatter can be written to more than one
+ * channel: it is a built in formatter with a buffer version. Those ignore the
+ * sequence number, or report where they put it in log_sequence_field. Custom
+ * formatters are called for each channel.
+ * @param formatter the formatter
+ * @return true if it can
+ */
+static bool can_share(log_formatter_t formatter) {
+	return log_get_buf_formatter(formatter) != NULL;
+}
+
+/**
+ * @fn int update_channels(LOG_CHANNEL *, LOG_CHANNEL *)
+ * @brief Publish a new channel set after a channel has been opened, closed,
+ * or has changed, and recompute log_max_level and binary_channels.
+ *
+ * Must be called with log_lock held. log_dispatch() walks the set without
+ * it, so the old set is retired, and freed when no thread can still be
+ * walking it. A removed channel is freed with it, as are the channels closed
+ * while the set couldn't be replaced (see log_close_channel()).
+ *
+ * @param add a channel to add to the set, or NULL
+ * @param remove a channel to remove from the set, or NULL
+ * @return 0 on success, -1 if the new set couldn't be allocated (the old one
+ * is kept)
+ */
+static int update_channels(LOG_CHANNEL *add, LOG_CHANNEL *remove) {
+	struct channel_set *old = log_channels;
+	struct channel_set *set;
+	int max_level = LL_OFF;
+	int n_binary = 0;
+
+	set = malloc(sizeof(*set) + (old->count + 1) * sizeof(set->entries[0]));
+	if (set == NULL) return -1;
+
+	LOG_CHANNEL *removed = NULL;
+	set->count = 0;
+	for (size_t n = 0; n < old->count; n++) {
+		LOG_CHANNEL *channel = old->entries[n].channel;
+
+		if ((channel == remove) || channel->closed) {
+			channel->removed_next = removed;
+			removed = channel;
+		} else {
+			set->entries[set->count++].channel = channel;
+		}
+	}
+	if (add != NULL) set->entries[set->count++].channel = add;
+
+	// the level and formatter only change with log_lock held
+	for (size_t n = 0; n < set->count; n++) {
+		LOG_CHANNEL *channel = set->entries[n].channel;
+
+		set->entries[n].level = channel->level;
+		set->entries[n].formatter = channel->formatter;
+		set->entries[n].buf_formatter =
+			log_get_buf_formatter(channel->formatter);
+		set->entries[n].next_shared = -1;
+		set->entries[n].follows = false;
+		set->entries[n].has_sink = (channel->sink != NULL);
+		for (size_t prev = n; prev-- > 0; ) {
+			if ((set->entries[prev].formatter == channel->formatter) &&
+				can_share(channel->formatter)) {
+				set->entries[prev].next_shared = n;
+				set->entries[n].follows = true;
+				break;
+			}
+		}
+		if (channel->level > max_level) {
+			max_level = channel->level;
+		}
+		if (channel->formatter == log_fmt_binary) {
+			n_binary++;
+		}
+	}
+
+	if (!configured) max_level = pre_init_level;
+
+	set->retired_next = NULL;
+	set->retired_epoch = 0;
+	set->removed = NULL;
+	__atomic_store_n(&log_channels, set, __ATOMIC_SEQ_CST);
+
+	if (old != &no_channels) {
+		old->removed = removed;
+		old->retired_epoch = __atomic_fetch_add(&channel_epoch, 1,
+			__ATOMIC_SEQ_CST);
+		old->retired_next = retired_sets;
+		retired_sets = old;
+	}
+	free_retired();
+
+	__atomic_store_n(&log_max_level, max_level, __ATOMIC_RELAXED);
+	__atomic_store_n(&binary_channels, n_binary, __ATOMIC_RELAXED);
+
+	return 0;
 }
 
 /**
@@ -219,9 +565,7 @@ static inline void timespec_diff(struct timespec *a, struct timespec *b,
  * @fn void log_report_error(char const * const format, ...)
  * @brief log internal errors to stderr
  */
-static void log_report_error(char const * const format, ...)
-	__attribute__ ((format (printf, 1, 2)));
-static void log_report_error(char const * const format, ...) {
+void log_report_error(char const * const format, ...) {
 	va_list args;
 	va_start(args, format);
 	vfprintf(stderr, format, args);
@@ -231,6 +575,10 @@ static void log_report_error(char const * const format, ...) {
 /**
  * @fn void log_do_head(LOG_CHANNEL  *channel)
  * @brief Write the head for XML and Json output.
+ *
+ * Binary output starts over with empty dictionaries. Its header is written
+ * with the first record.
+ *
  * @param channel the channel to handle
  */
 static void log_do_head(LOG_CHANNEL  *channel) {
@@ -238,6 +586,9 @@ static void log_do_head(LOG_CHANNEL  *channel) {
 		log_do_xml_head(channel->stream);
 	} else if (channel->formatter == log_fmt_json) {
 		log_do_json_head(channel->stream, log_config.json_notes);
+	} else if (channel->formatter == log_fmt_binary) {
+		log_defer_init();
+		log_binary_free(channel);
 	}
 }
 
@@ -254,54 +605,161 @@ static void log_do_tail(LOG_CHANNEL  *channel) {
 	}
 }
 
+/**
+ * @fn unsigned long file_length(char const *)
+ * @brief Get the length of a file.
+ * @param pathname the file
+ * @return its length, or 0 if it can't be found
+ */
+static unsigned long file_length(char const *pathname) {
+	struct stat st;
+
+	return (stat(pathname, &st) == 0) ? (unsigned long) st.st_size : 0;
+}
+
+/**
+ * @fn time_t next_boundary(time_t, unsigned long)
+ * @brief Get the next multiple of an interval of local time, such as the
+ * next hour.
+ * @param now the time to start from
+ * @param interval the interval, in seconds
+ * @return the time of the boundary
+ */
+static time_t next_boundary(time_t now, unsigned long interval) {
+	struct tm tm;
+	long offset = 0;
+
+	if (localtime_r(&now, &tm) != NULL) offset = tm.tm_gmtoff;
+
+	return ((now + offset) / (time_t) interval + 1) * interval - offset;
+}
+
+/**
+ * @fn void set_rotate_at(LOG_CHANNEL *)
+ * @brief Work out when a channel's file is next rotated by age or by time.
+ * Must be called with log_lock held.
+ * @param channel the channel
+ */
+static void set_rotate_at(LOG_CHANNEL *channel) {
+	time_t at = 0;
+
+	if (channel->rotation.max_age > 0) {
+		at = channel->started + channel->rotation.max_age;
+	}
+	if (channel->rotation.interval > 0) {
+		time_t boundary = next_boundary(channel->started,
+			channel->rotation.interval);
+		if ((at == 0) || (boundary < at)) at = boundary;
+	}
+
+	channel->rotate_at = at;
+}
+
 /**
  * @fn bool _reopen_channel(LOG_CHANNEL *channel)
- * @brief used by log_sighandler() and log_reopen_channel().
+ * @brief used by log_sighandler(), log_reopen_channel() and the rotation
+ * thread.
+ *
+ * Must be called with log_lock held. The file is opened again before the
+ * channel is locked, and the old one closed after, so the channel's own lock
+ * is only held to write the tail and head and swap the streams. Logging to
+ * the channel goes on meanwhile, to the old file.
  */
 static bool _reopen_channel(LOG_CHANNEL *channel) {
 	char buf[BUFSIZ];
 	char *err_msg;
+	FILE *stream = NULL;
+	struct log_sink *sink = NULL;
+	unsigned long file_len = 0;
 
-	// verify that it is actually an open channel
-	if (!is_open_channel(channel)) return false;
-	
-	// for Json and XML
-	log_do_tail(channel);
+	// verify that it is actually a channel
+	if (!is_channel(channel)) return false;
 
-	// flush the output
-	fflush(channel->stream);
+	// a reopen may have failed before (the stream is only replaced with the
+	// log_lock held)
+	if (channel->stream == NULL) return false;
 
-	// if the channel is file based, close an reopen the channel
+	// if the channel is file based, open the next file
 	if (channel->pathname != NULL) {
-		fclose(channel->stream);
-
-		// open the file in append mode
-		channel->stream = fopen(channel->pathname, "a");
+		if (channel->sink != NULL) {
+			sink = log_sink_reopen(channel->sink, channel->pathname);
+			if (sink != NULL) stream = log_sink_stream(sink);
+		} else {
+			// open the file in append mode
+			stream = fopen(channel->pathname, "a");
+		}
 
 		// check for failure
-		if (channel->stream == NULL) {
+		if (stream == NULL) {
 			err_msg = strerror_r(errno, buf, sizeof(buf));
 			log_report_error("can't reopen file %s:%s\n", channel->pathname, err_msg);
-			free(channel->pathname);
-			bzero(channel, sizeof(*channel));
+
+			pthread_mutex_lock(&channel->lock);
+			log_do_tail(channel);
+			if (channel->sink != NULL) {
+				log_sink_close(channel->sink);
+				channel->sink = NULL;
+			} else {
+				fclose(channel->stream);
+			}
+			channel->stream = NULL;
+			log_binary_free(channel);
+
+			// it stays in the set, but nothing is sent to it
+			channel->level = LL_OFF;
+			update_channels(NULL, NULL);
+			pthread_mutex_unlock(&channel->lock);
 			return false;
 		}
 
-		// set line buffered output, if requested
-		if (channel->line_buffered && setvbuf(channel->stream, NULL, _IOLBF, BUFSIZ)) {
+		// set line buffered output, if requested (the file is used anyway)
+		if (channel->line_buffered && (sink == NULL) &&
+			setvbuf(stream, NULL, _IOLBF, BUFSIZ)) {
 			err_msg = strerror_r(errno, buf, sizeof(buf));
 			log_report_error("can't set line buffering on %s: %s",
 				channel->pathname, err_msg);
-			return false;
 		}
+
+		file_len = file_length(channel->pathname);
+	}
+
+	pthread_mutex_lock(&channel->lock);
+
+	// for Json and XML
+	log_do_tail(channel);
+
+	// swap in the next file
+	FILE *old_stream = channel->stream;
+	struct log_sink *old_sink = channel->sink;
+	if (stream != NULL) {
+		channel->stream = stream;
+		channel->sink = sink;
+		channel->file_len = file_len;
+		channel->started = time(NULL);
+		__atomic_store_n(&channel->rotate_now, false, __ATOMIC_RELAXED);
+	} else {
+		// flush the output
+		fflush(channel->stream);
 	}
 
 	// reset the sequence number
-	channel->sequence = 0;
+	__atomic_store_n(&channel->sequence, 0, __ATOMIC_RELAXED);
 
 	// for Json and XML
 	log_do_head(channel);
 
+	pthread_mutex_unlock(&channel->lock);
+
+	// write out and close the old file, with the channel already unlocked
+	if (stream != NULL) {
+		if (old_sink != NULL) {
+			log_sink_close(old_sink);
+		} else {
+			fclose(old_stream);
+		}
+	}
+	set_rotate_at(channel);
+
 	return true;
 }
 
@@ -324,7 +782,6 @@ static void *log_sighandler(void *config) {
 	int			signum;
 	int			rc;
 	struct rotate_config *tc = config;
-	LOG_CHANNEL *ch = (LOG_CHANNEL *) log_channels;
 
 	// TODO: don't be so drastic on failure
 	rc = pthread_setname_np(me, "log_sighandler");
@@ -346,15 +803,160 @@ static void *log_sighandler(void *config) {
 			break;
 
 		pthread_mutex_lock(&log_lock);
-		for (size_t n = 0; n < LOG_CH_COUNT; n++, ch++) {
-			_reopen_channel(ch);
+		struct channel_set *set = log_channels;
+		for (size_t n = 0; n < set->count; n++) {
+			// a failed reopen publishes a new set, but leaves this one alive
+			_reopen_channel(set->entries[n].channel);
+			set = log_channels;
+		}
+		pthread_mutex_unlock(&log_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * @fn void rotated_name(LOG_CHANNEL const *, char *, size_t)
+ * @brief Name the file of a channel is rotated to - the pathname, with the
+ * time the file was opened, and a number if that is taken (by the file,
+ * or its compressed .gz).
+ * @param channel the channel
+ * @param name where to put the name
+ * @param size the size of name
+ */
+static void rotated_name(LOG_CHANNEL const *channel, char *name, size_t size) {
+	char stamp[32] = "";
+	char gz_name[PATH_MAX + 4];
+	struct tm tm;
+
+	if (localtime_r(&channel->started, &tm) != NULL) {
+		strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	}
+
+	snprintf(name, size, "%s.%s", channel->pathname, stamp);
+	for (int n = 1; ; n++) {
+		snprintf(gz_name, sizeof(gz_name), "%s.gz", name);
+		if ((access(name, F_OK) != 0) && (access(gz_name, F_OK) != 0)) break;
+		snprintf(name, size, "%s.%s.%d", channel->pathname, stamp, n);
+	}
+}
+
+/**
+ * @fn void rotate_channel(LOG_CHANNEL *)
+ * @brief Rename the file of a channel, and reopen the channel. Must be called
+ * with log_lock held.
+ *
+ * Records go on to the renamed file until the new one is swapped in. Then it
+ * is queued to be compressed, if the rotation says so.
+ *
+ * @param channel the channel
+ */
+static void rotate_channel(LOG_CHANNEL *channel) {
+	char rotated[PATH_MAX];
+
+	// a reopen may have failed before
+	if (channel->stream == NULL) return;
+
+	rotated_name(channel, rotated, sizeof(rotated));
+	if (rename(channel->pathname, rotated) != 0) {
+		char buf[BUFSIZ];
+		char *err_msg = strerror_r(errno, buf, sizeof(buf));
+		log_report_error("can't rotate file %s:%s\n", channel->pathname,
+			err_msg);
+
+		// try again after another max_bytes, or at the next time
+		pthread_mutex_lock(&channel->lock);
+		channel->file_len = 0;
+		channel->started = time(NULL);
+		__atomic_store_n(&channel->rotate_now, false, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&channel->lock);
+		set_rotate_at(channel);
+		return;
+	}
+
+	if (_reopen_channel(channel)) {
+		__atomic_add_fetch(&rotation_config.rotations, 1, __ATOMIC_RELAXED);
+		if (channel->rotation.compress) log_compress_file(rotated);
+	}
+}
+
+/**
+ * @fn void *log_rotation_thread(void *)
+ * @brief The rotation thread. It rotates the files that have reached their
+ * max_bytes (it is woken when one does), or their time, then sleeps until
+ * the next time.
+ *
+ * The thread is stopped by setting rotation_config.stop and waking it.
+ * @return NULL
+ */
+static void *log_rotation_thread(void *arg) {
+	(void) arg;
+
+	pthread_setname_np(pthread_self(), "log_rotation");
+
+	while (1) {
+		time_t next = 0;
+
+		pthread_mutex_lock(&log_lock);
+		if (rotation_config.stop) {
+			pthread_mutex_unlock(&log_lock);
+			break;
+		}
+
+		time_t now = time(NULL);
+		struct channel_set *set = log_channels;
+		for (size_t n = 0; n < set->count; n++) {
+			LOG_CHANNEL *channel = set->entries[n].channel;
+
+			// being closed
+			if (channel->closed) continue;
+
+			if (__atomic_load_n(&channel->rotate_now, __ATOMIC_RELAXED) ||
+				((channel->rotate_at != 0) && (now >= channel->rotate_at))) {
+				// a failed reopen publishes a new set, but leaves this one
+				// alive
+				rotate_channel(channel);
+				set = log_channels;
+			}
+			if ((channel->rotate_at != 0) &&
+				((next == 0) || (channel->rotate_at < next))) {
+				next = channel->rotate_at;
+			}
 		}
 		pthread_mutex_unlock(&log_lock);
+
+		// sleep until the next time, or until a file is full
+		struct timespec until = {.tv_sec = next, .tv_nsec = 0};
+		while (((next != 0) ? sem_timedwait(&rotation_config.wakeup, &until) :
+			sem_wait(&rotation_config.wakeup)) && (errno == EINTR)) {
+		}
 	}
 
 	return NULL;
 }
 
+static void rotation_init(void) {
+	sem_init(&rotation_config.wakeup, 0, 0);
+}
+
+/**
+ * @fn void stop_rotation(void)
+ * @brief Stop the rotation thread, if it is running.
+ */
+static void stop_rotation(void) {
+	pthread_mutex_lock(&log_lock);
+	bool running = rotation_config.thread_running;
+	pthread_t thread = rotation_config.thread;
+	rotation_config.stop = true;
+	rotation_config.thread_running = false;
+	pthread_mutex_unlock(&log_lock);
+
+	if (running) {
+		sem_post(&rotation_config.wakeup);
+		pthread_join(thread, NULL);
+	}
+}
+
 /**************************************************/
 /********************* public *********************/
 /**************************************************/
@@ -371,7 +973,10 @@ static void *log_sighandler(void *config) {
  * @param log_level the minimum level to output.
  */
 void log_set_pre_init_level(LOG_LEVEL log_level) {
+	pthread_mutex_lock(&log_lock);
 	pre_init_level = log_level;
+	update_channels(NULL, NULL);
+	pthread_mutex_unlock(&log_lock);
 }
 
 /**
@@ -431,6 +1036,7 @@ bool log_select_clock(clockid_t clock_id) {
 void log_format_delta(struct timespec *ts, LOG_TS_FORMAT precision, char *buf, int len) {
 	struct timespec delta;
 	char seconds_buf[26];
+	char *p = buf;
 
 	if ((buf == NULL) || (len < TIMESTAMP_LEN)) {
 		fprintf(stderr,
@@ -441,113 +1047,779 @@ void log_format_delta(struct timespec *ts, LOG_TS_FORMAT precision, char *buf, i
 
 	timespec_diff(ts, &log_config.ts, &delta);
 
+	if (delta.tv_sec < 0) {
+		// before t0 - not worth a fast path
+		if (precision & LOG_FMT_HMS) {
+			snprintf(seconds_buf, sizeof(seconds_buf), "%ld:%02d:%02d",
+				delta.tv_sec / (60 * 60), (int) (delta.tv_sec % (60 * 60) / 60),
+				(int) (delta.tv_sec % 60));
+		} else {
+			snprintf(seconds_buf, sizeof(seconds_buf), "% 3ld", delta.tv_sec);
+		}
+		snprintf(buf, len, "%s.%09ld", seconds_buf, delta.tv_nsec);
+		return;
+	}
+
 	if (precision & LOG_FMT_HMS) {
-		long hours;
-		int minutes, seconds;
-		long off_remainder;
-
-		hours = delta.tv_sec / (60 *60);
-		off_remainder = delta.tv_sec % (60 * 60);
-		minutes = off_remainder / 60;
-		off_remainder = off_remainder % 60;
-		seconds = off_remainder;
-
-		snprintf(seconds_buf, sizeof(seconds_buf), "%ld:%02d:%02d",
-			hours, minutes, seconds);
+		// H:MM:SS
+		p = log_put_long(p, delta.tv_sec / (60 * 60));
+		*p++ = ':';
+		p = log_put_uint2(p, delta.tv_sec / 60 % 60);
+		*p++ = ':';
+		p = log_put_uint2(p, delta.tv_sec % 60);
 	} else {
-		snprintf(seconds_buf, sizeof(seconds_buf), "% 3ld", delta.tv_sec);
+		// as "% 3ld" - a space for the sign, right aligned in 3 characters
+		char *end = log_put_long(seconds_buf, delta.tv_sec);
+		int n_digits = end - seconds_buf;
+		for (int n = n_digits + 1; n < 3; n++) *p++ = ' ';
+		*p++ = ' ';
+		memcpy(p, seconds_buf, n_digits);
+		p += n_digits;
 	}
 
-	snprintf(buf, len, "%s.%09ld", seconds_buf, delta.tv_nsec);
+	*p++ = '.';
+	p = log_put_uint9(p, delta.tv_nsec);
+	*p = '\0';
 }
 
 /**
- * @fn int log_msg(int,
- *     const char *, const char *, const int,
- *     const char *, ...)
- *
- * @brief Log a message.
- *
- * This is the actual logging function. The convenience log_xxx() macros
- * should normally be used. See tinylogger.h for their definitions.
- *
- * @param level the log level desired
- * @param file the filename of the line of code (debug format)
- * @param function the function of the line of code (debug format)
- * @param line the line number of the line of code (debug format)
- * @param format the printf format string (required)
- * @param ... the arguments to the format string
- *
- * @return 0 on success, -1 if the format was NULL, -2 if clock_gettime() error
+ * @fn void thread_msg_free(void *)
+ * @brief Thread exit destructor - free the thread's message, render and
+ * record buffers.
+ * @param unused not used
  */
-int log_msg(int const level,
-	char const * const file, char const * const function, int const line,
-	char const * const format, ...) {
-	va_list	args;
-	struct timespec ts;
-	int status = 0;	// assume success
-#if MAX_MSG_SIZE == 0
-	char *msg;
-#else
-	char	msg[MAX_MSG_SIZE];		// user message
-#endif
+static void thread_msg_free(void *unused) {
+	(void) unused;
+
+	free(thread_msg.buf);
+	thread_msg.buf = NULL;
+	thread_msg.size = 0;
+
+	free(render_buf);
+	render_buf = NULL;
+	render_len = 0;
+
+	log_buf_free(&thread_record.buf);
+	if (thread_record.stream != NULL) fclose(thread_record.stream);
+	free(thread_record.stream_buf);
+	thread_record.stream = NULL;
+	thread_record.stream_buf = NULL;
+	thread_record.stream_len = 0;
+	thread_record.data = NULL;
+	thread_record.len = 0;
+}
 
-	// make sure we have something to log
-	if (!format)	return -1;	// error - require format string
+static void thread_msg_key_init(void) {
+	pthread_key_create(&thread_msg_key, thread_msg_free);
+}
+
+/**
+ * @fn bool reserve_msg(size_t)
+ * @brief Make sure the calling thread's message buffer holds len bytes,
+ * keeping its contents.
+ * @param len the length needed
+ * @return false if it couldn't be grown
+ */
+static bool reserve_msg(size_t len) {
+	if (len <= thread_msg.size) return true;
+
+	size_t size = thread_msg.size ? thread_msg.size : BUFSIZ;
+	while (size < len) size *= 2;
+
+	char *buf = realloc(thread_msg.buf, size);
+	if (buf == NULL) return false;
+	thread_msg.buf = buf;
+	thread_msg.size = size;
+
+	pthread_once(&thread_msg_once, thread_msg_key_init);
+	pthread_setspecific(thread_msg_key, &thread_msg);
+
+	return true;
+}
+
+/**
+ * @fn int thread_vformat(size_t, char const *, va_list)
+ * @brief Format a message into the calling thread's buffer, growing it if
+ * needed. The message is never truncated.
+ * @param offset where the message starts in the buffer
+ * @param format the printf format string
+ * @param args the arguments to the format string - not consumed
+ * @return the length of the message, or -1 on error
+ */
+static int thread_vformat(size_t offset, char const *format, va_list args) {
+	va_list args_copy;
+	size_t room = (thread_msg.size > offset) ? thread_msg.size - offset : 0;
+
+	va_copy(args_copy, args);
+	int n = vsnprintf(room ? thread_msg.buf + offset : NULL, room, format,
+		args_copy);
+	va_end(args_copy);
+	if (n < 0) return -1;
+
+	// didn't fit - grow the buffer and do it again
+	if ((size_t) n >= room) {
+		if (!reserve_msg(offset + n + 1)) return -1;
+		va_copy(args_copy, args);
+		vsnprintf(thread_msg.buf + offset, n + 1, format, args_copy);
+		va_end(args_copy);
+	}
+
+	return n;
+}
+
+/**
+ * @fn char *render_msg(struct log_packed const *)
+ * @brief Render a user message from its packed arguments.
+ *
+ * @param packed the format and packed arguments
+ * @return the message
+ */
+static char *render_msg(struct log_packed const *packed) {
+	static char none[] = "";
+
+	if (render_len < packed->msg_limit) {
+		char *buf = realloc(render_buf, packed->msg_limit);
+		if (buf != NULL) {
+			render_buf = buf;
+			render_len = packed->msg_limit;
+			pthread_once(&thread_msg_once, thread_msg_key_init);
+			pthread_setspecific(thread_msg_key, &thread_msg);
+		}
+	}
+	if (render_buf == NULL) return none;
+
+	log_render_deferred(render_buf, render_len, packed->format, packed->args);
+	return render_buf;
+}
+
+/**
+ * @fn bool format_record(struct channel_entry const *, int,
+ *     struct timespec *, int, char const *, char const *, int, char *)
+ * @brief Format a record into the calling thread's record buffer.
+ *
+ * The buffer version of the formatter is used if there is one. A custom
+ * formatter writes to a memory stream.
+ *
+ * @param entry the channel set entry, with the formatters
+ * @return true if the record is in thread_record.data
+ */
+static bool format_record(struct channel_entry const *entry, int sequence,
+	struct timespec *ts, int level,
+	char const *file, char const *function, int line, char *msg) {
+	if ((thread_record.buf.data == NULL) && (thread_record.stream == NULL)) {
+		pthread_once(&thread_msg_once, thread_msg_key_init);
+		pthread_setspecific(thread_msg_key, &thread_msg);
+	}
+
+	if (entry->buf_formatter != NULL) {
+		struct log_origin const *origin = log_get_origin();
+		struct log_record record = {
+			.ts = ts,
+			.level = level,
+			.sequence = sequence,
+			.file = file,
+			.function = function,
+			.line = line,
+			.tid = origin->tid,
+			.thread_name = origin->name,
+			.msg = msg,
+			.msg_len = strlen(msg),
+		};
+
+		thread_record.buf.len = 0;
+		if (entry->buf_formatter(&thread_record.buf, &record) < 0) {
+			return false;
+		}
+		thread_record.data = thread_record.buf.data;
+		thread_record.len = thread_record.buf.len;
+		return true;
+	}
+
+	if (thread_record.stream == NULL) {
+		thread_record.stream = open_memstream(&thread_record.stream_buf,
+			&thread_record.stream_len);
+		if (thread_record.stream == NULL) return false;
+	} else {
+		rewind(thread_record.stream);
+	}
+
+	if (entry->formatter(thread_record.stream, sequence, ts, level,
+		file, function, line, msg) < 0) return false;
+	if (fflush(thread_record.stream) != 0) return false;
+
+	thread_record.data = thread_record.stream_buf;
+	thread_record.len = thread_record.stream_len;
+	return true;
+}
+
+/**
+ * @fn void count_written(LOG_CHANNEL *, long)
+ * @brief Count what was written to a channel's file, and wake the rotation
+ * thread when it reaches its max_bytes.
+ *
+ * Must be called with the channel lock held.
+ *
+ * @param channel the channel
+ * @param len the bytes written, or a negative value on error
+ */
+static inline void count_written(LOG_CHANNEL *channel, long len) {
+	if (len > 0) channel->file_len += len;
+
+	if ((channel->rotation.max_bytes > 0) && !channel->rotate_now &&
+		(channel->file_len >= channel->rotation.max_bytes)) {
+		__atomic_store_n(&channel->rotate_now, true, __ATOMIC_RELAXED);
+		sem_post(&rotation_config.wakeup);
+	}
+}
+
+/**
+ * @fn void write_record(LOG_CHANNEL *, struct iovec const *, int)
+ * @brief Write a formatted record, in parts, to a channel.
+ *
+ * Must be called with the channel lock held, and the channel open. A channel
+ * with a log_sink gets the whole record in one piece.
+ *
+ * @param channel the channel
+ * @param iov the parts of the record
+ * @param iovcnt the number of parts
+ */
+static void write_record(LOG_CHANNEL *channel, struct iovec const *iov,
+	int iovcnt) {
+	size_t len = 0;
+
+	for (int n = 0; n < iovcnt; n++) len += iov[n].iov_len;
+	count_written(channel, len);
+
+	if (channel->sink != NULL) {
+		log_sink_writev(channel->sink, iov, iovcnt);
+		return;
+	}
+
+	for (int n = 0; n < iovcnt; n++) {
+		fwrite(iov[n].iov_base, 1, iov[n].iov_len, channel->stream);
+	}
+}
+
+/**
+ * @struct preformatted
+ * @brief A record formatted into thread_record before the channel lock was
+ * taken.
+ */
+struct preformatted {
+	bool	formatted;	/**< the record is in thread_record.data */
+	int		sequence;	/**< the sequence number it was formatted with */
+	struct log_sequence_field field;	/**< where the formatter put it */
+};
+
+/**
+ * @fn void write_formatted(LOG_CHANNEL *, struct channel_entry const *,
+ *     struct preformatted *, struct timespec *, int,
+ *     char const *, char const *, int, char *)
+ * @brief Take the next sequence number of a channel, and write a record
+ * formatted before the lock was taken, with that sequence number.
+ *
+ * Must be called with the channel lock held, and the channel open. The
+ * record is written as it is if it was formatted with the sequence number,
+ * or doesn't show it. Otherwise the sequence number is spliced in where the
+ * json or xml formatter put it. A record that can't take it (the first
+ * record of a json array, or a custom formatter's) is formatted again,
+ * straight into the stream - or, for a log_sink, which takes whole records,
+ * into thread_record, and pre is updated to match.
+ *
+ * @param channel the channel
+ * @param entry the channel set entry, with the formatters
+ * @param pre the record in thread_record
+ */
+static void write_formatted(LOG_CHANNEL *channel,
+	struct channel_entry const *entry, struct preformatted *pre,
+	struct timespec *ts, int level,
+	char const *file, char const *function, int line, char *msg) {
+	// pre-increment sequence - it is cleared to 0 on open
+	int sequence = __atomic_add_fetch(&channel->sequence, 1, __ATOMIC_RELAXED);
+
+	if (pre->formatted && ((sequence == pre->sequence) ||
+		ignores_sequence(entry->formatter))) {
+		struct iovec record[] = {
+			{(char *) thread_record.data, thread_record.len},
+		};
+		write_record(channel, record, 1);
+		return;
+	}
+
+	if (pre->formatted && pre->field.set && (sequence >= pre->field.min)) {
+		char digits[LOG_LONG_LEN];
+		size_t rest = pre->field.offset + pre->field.len;
+		struct iovec record[] = {
+			{(char *) thread_record.data, pre->field.offset},
+			{digits, log_put_long(digits, sequence) - digits},
+			{(char *) thread_record.data + rest, thread_record.len - rest},
+		};
+		write_record(channel, record, 3);
+		return;
+	}
+
+	if (channel->sink != NULL) {
+		log_sequence_field.set = false;
+		pre->formatted = format_record(entry, sequence,
+			ts, level, file, function, line, msg);
+		pre->sequence = sequence;
+		pre->field = log_sequence_field;
+		if (pre->formatted) {
+			struct iovec record[] = {
+				{(char *) thread_record.data, thread_record.len},
+			};
+			write_record(channel, record, 1);
+			return;
+		}
+	}
+
+	count_written(channel, entry->formatter(channel->stream, sequence,
+		ts, level, file, function, line, msg));
+}
+
+/**
+ * @fn void write_shared(struct channel_set const *, size_t,
+ *     struct timespec *, int, char const *, char const *, int, char *)
+ * @brief Format a record once, and write it to every channel with the same
+ * formatter that wants the message.
+ *
+ * The record is formatted with the next sequence number of the first of
+ * those channels, before any of them is locked. Each channel takes its
+ * sequence number with its lock held, and gets the record with that number
+ * in place of the one it was formatted with (see write_formatted()).
+ *
+ * @param set the channel set
+ * @param first the first entry with the formatter
+ */
+static void write_shared(struct channel_set const *set, size_t first,
+	struct timespec *ts, int level,
+	char const *file, char const *function, int line, char *msg) {
+	bool tried = false;
+	struct preformatted pre = {0};
+
+	for (int n = first; n >= 0; n = set->entries[n].next_shared) {
+		if (level > set->entries[n].level) continue;
+
+		LOG_CHANNEL *channel = set->entries[n].channel;
+
+		if (!tried) {
+			// most likely the sequence number it gets
+			pre.sequence = __atomic_load_n(&channel->sequence,
+				__ATOMIC_RELAXED) + 1;
+			log_sequence_field.set = false;
+			pre.formatted = format_record(&set->entries[first], pre.sequence,
+				ts, level, file, function, line, msg);
+			pre.field = log_sequence_field;
+			tried = true;
+		}
+
+		pthread_mutex_lock(&channel->lock);
+		// closed, or a reopen failed, since the set was published
+		if (channel->stream != NULL) {
+			write_formatted(channel, &set->entries[n], &pre,
+				ts, level, file, function, line, msg);
+		}
+		pthread_mutex_unlock(&channel->lock);
+	}
+}
+
+/**
+ * @fn void log_dispatch(struct timespec *, int,
+ *     char const *, char const *, int, char *, struct log_packed const *)
+ * @brief Send a user message to the channels that accept its level.
+ *
+ * The message comes formatted (msg), as its format and packed arguments
+ * (packed), or both. Binary channels take the packed arguments as they are.
+ * For the others, the message is rendered once, when first needed.
+ *
+ * The log_lock is not needed. Each channel is locked while the message is
+ * written to it, so a slow channel only holds up the threads writing to it.
+ * The user message and timestamp are ready before any channel is locked. If
+ * a channel is busy, the record is formatted before waiting for it too, so
+ * that only the sequence number and the write are serialized. The records
+ * are written in sequence order.
+ *
+ * @param ts the timestamp of the message
+ * @param level the log level of the message
+ * @param file the filename of the line of code
+ * @param function the function of the line of code
+ * @param line the line number of the line of code
+ * @param msg the formatted user message, or NULL
+ * @param packed the packed user message, or NULL
+ */
+static void log_dispatch(struct timespec *ts, int level,
+	char const *file, char const *function, int line,
+	char *msg, struct log_packed const *packed) {
+
+	// if the log_channels have not been configured,
+	// send the output to the stderr
+	if (!__atomic_load_n(&configured, __ATOMIC_ACQUIRE)) {
+		if (level > pre_init_level) return; 	// discard
+		if (msg == NULL) msg = render_msg(packed);
+		// use a dummy sequence number of 0 - discarded by log_fmt_standard
+		log_fmt_standard(stderr, 0, ts, level, file, function, line, msg);
+		return;
+	}
+
+	//
+	// send the message to any active channels with the proper log level
+	//
+	struct channel_set const *set = enter_channels();
+	for (size_t n = 0; n < set->count; n++) {
+		struct channel_entry const *entry = &set->entries[n];
+
+		// written along with the first channel of its formatter
+		if (entry->follows) continue;
+
+		if (entry->next_shared >= 0) {
+			if (msg == NULL) msg = render_msg(packed);
+			write_shared(set, n, ts, level, file, function, line, msg);
+			continue;
+		}
+
+		// the level is in the set - only touch the channels that want it
+		if (level > entry->level) continue;
+
+		LOG_CHANNEL *channel = entry->channel;
+		log_formatter_t formatter = entry->formatter;
+		int sequence;
+
+		if (formatter == log_fmt_binary) {
+			pthread_mutex_lock(&channel->lock);
+			// closed, or a reopen failed, since the set was published
+			if (channel->stream != NULL) {
+				__atomic_add_fetch(&channel->sequence, 1, __ATOMIC_RELAXED);
+				count_written(channel, log_do_binary(channel, ts, level,
+					file, function, line, msg, packed));
+			}
+			pthread_mutex_unlock(&channel->lock);
+			continue;
+		}
+
+		if (msg == NULL) msg = render_msg(packed);
+
+		// not busy - format straight into the stream (a log_sink takes whole
+		// records, formatted first)
+		if (!entry->has_sink && (pthread_mutex_trylock(&channel->lock) == 0)) {
+			if (channel->stream != NULL) {
+				// pre-increment sequence - it is cleared to 0 on open
+				sequence = __atomic_add_fetch(&channel->sequence, 1,
+					__ATOMIC_RELAXED);
+				count_written(channel, formatter(channel->stream, sequence,
+					ts, level, file, function, line, msg));
+			}
+			pthread_mutex_unlock(&channel->lock);
+			continue;
+		}
+
+		// busy - format the record first, with the sequence number it will
+		// most likely get, and only hold the channel to take the sequence
+		// number and write it
+		struct preformatted pre = {
+			.sequence = __atomic_load_n(&channel->sequence,
+				__ATOMIC_RELAXED) + 1,
+		};
+		log_sequence_field.set = false;
+		pre.formatted = format_record(entry, pre.sequence,
+			ts, level, file, function, line, msg);
+		pre.field = log_sequence_field;
+
+		pthread_mutex_lock(&channel->lock);
+		if (channel->stream != NULL) {
+			write_formatted(channel, entry, &pre,
+				ts, level, file, function, line, msg);
+		}
+		pthread_mutex_unlock(&channel->lock);
+	}
+	leave_channels();
+}
+
+/**
+ * @fn void log_emit(struct timespec *, int,
+ *     char const *, char const *, int, char *, struct log_packed const *)
+ * @brief Send a user message to the channels.
+ *
+ * Used by the asynchronous writer thread for messages that were queued by
+ * log_msg().
+ *
+ * @param ts the timestamp taken when the message was queued
+ * @param level the log level of the message
+ * @param file the filename of the line of code
+ * @param function the function of the line of code
+ * @param line the line number of the line of code
+ * @param msg the formatted user message, or NULL
+ * @param packed the packed user message if msg is NULL
+ */
+void log_emit(struct timespec *ts, int level,
+	char const *file, char const *function, int line,
+	char *msg, struct log_packed const *packed) {
+	log_dispatch(ts, level, file, function, line, msg, packed);
+}
+
+/**
+ * @fn int log_vmsg(int, const char *, const char *, const int,
+ *     const char *, va_list)
+ *
+ * @brief Log a message - the work of log_msg() and log_callsite_msg().
+ *
+ * If asynchronous mode has been started with log_start_async(), the message
+ * is queued in the calling thread's ring and written later by the writer
+ * thread.
+ *
+ * @param level the log level desired
+ * @param file the filename of the line of code (debug format)
+ * @param function the function of the line of code (debug format)
+ * @param line the line number of the line of code (debug format)
+ * @param format the printf format string (required)
+ * @param args the arguments to the format string
+ * @return 0 on success, -1 if the format was NULL, -2 if clock_gettime() error
+ */
+static int log_vmsg(int const level,
+	char const * const file, char const * const function, int const line,
+	char const * const format, va_list args) {
+	va_list args_copy;
+	struct timespec ts;
+	int status = 0;	// assume success
+#if MAX_MSG_SIZE == 0
+	char *msg = NULL;
+#elif MAX_MSG_SIZE < 0
+	char *msg;						// user message, in thread_msg
+	struct log_packed packed = {.format = NULL, .len = 0};
+#else
+	char	msg[MAX_MSG_SIZE];		// user message
+#endif
+
+	// nobody wants it - don't bother formatting it
+	if (!log_enabled(level)) return 0;
+
+	// make sure we have something to log
+	if (!format)	return -1;	// error - require format string
 	if (!*format)	return 0;	// no msg - silly format string, but let it go
 
-	// lock the actual write(s) that may be through streams that may be
-	// managed by SIG_ROTATE
-	pthread_mutex_lock(&log_lock);
+	// queue the message for the writer thread if running asynchronously
+	if (log_async_active()) {
+		if (clock_gettime(log_config.clock_id, &ts) == -1) return -2;
+
+		va_copy(args_copy, args);
+		status = log_async_vmsg(&ts, level, file, function, line, format,
+			args_copy);
+		va_end(args_copy);
+
+		// if no ring could be set up for this thread, or asynchronous mode was
+		// stopped meanwhile, log it directly
+		if (status == 0) return 0;
+		status = 0;
+	}
+
+	// after the messages this thread queued, if asynchronous mode stopped
+	log_async_wait_queued();
+
+	// no global lock - log_dispatch() locks each channel as it writes to it
 
 	// get a timestamp
 	if (clock_gettime(log_config.clock_id, &ts) == -1) {
 		// drop the message, but return error status
-		status = -2;
-		goto unlock;
+		return -2;
 	}
 
 	/* format the user message contents */
-	va_start(args, format);
 #if MAX_MSG_SIZE == 0
 	vasprintf(&msg, format, args);
-#else
-	vsnprintf(msg, sizeof(msg), format, args);
-#endif
-	va_end(args);
+#elif MAX_MSG_SIZE < 0
+	// binary channels want the arguments too - put them first
+	if (__atomic_load_n(&binary_channels, __ATOMIC_RELAXED) &&
+		log_is_static(format)) {
+		va_copy(args_copy, args);
+		long len = log_pack_args(thread_msg.buf, thread_msg.size, format,
+			args_copy);
+		va_end(args_copy);
+
+		if ((len >= 0) && ((size_t) len > thread_msg.size)) {
+			if (reserve_msg(len)) {
+				va_copy(args_copy, args);
+				log_pack_args(thread_msg.buf, len, format, args_copy);
+				va_end(args_copy);
+			} else {
+				len = -1;
+			}
+		}
+		if (len >= 0) {
+			packed.format = format;
+			packed.len = len;
+		}
+	}
 
-	// if the log_channels have not been configured,
-	// send the output to the stderr
-	if (!configured) {
-		if (level > pre_init_level) goto unlock; 	// discard
-		// use a dummy sequence number of 0 - discarded by log_fmt_standard
-		log_fmt_standard(stderr, 0,
-				&ts, level, file, function, line, msg);
-		goto unlock;
+	// then the message, which the other channels take as it is
+	int n = thread_vformat(packed.len, format, args);
+	if (n < 0) {
+		status = -1;
+		goto done;
 	}
+	msg = thread_msg.buf + packed.len;
 
-	//
-	// send the message to any active channels with the proper log level
-	//
-	LOG_CHANNEL *channel = (LOG_CHANNEL *) log_channels;
-	for (size_t n = 0; n < LOG_CH_COUNT; n++, channel++) {
-		if ((channel->stream != NULL) && (level <= channel->level)) {
-			// pre-increment sequence - it is cleared to 0 on open
-			channel->formatter(channel->stream, ++channel->sequence,
-				&ts, level, file, function, line, msg);
+	if (packed.format != NULL) {
+		packed.args = thread_msg.buf;
+		packed.msg_limit = n + 1;
+		log_dispatch(&ts, level, file, function, line, msg, &packed);
+		goto done;
+	}
+#else
+	// binary channels want the arguments, not the message
+	if (__atomic_load_n(&binary_channels, __ATOMIC_RELAXED) &&
+		log_is_static(format)) {
+		va_copy(args_copy, args);
+		long len = log_pack_args(msg, sizeof(msg), format, args_copy);
+		va_end(args_copy);
+
+		if ((len >= 0) && ((size_t) len <= sizeof(msg))) {
+			struct log_packed packed = {
+				.format = format,
+				.args = msg,
+				.len = len,
+				.msg_limit = sizeof(msg),
+			};
+			log_dispatch(&ts, level, file, function, line, NULL, &packed);
+			goto done;
 		}
 	}
 
-	// unlock
-unlock:
-	pthread_mutex_unlock(&log_lock);
+	vsnprintf(msg, sizeof(msg), format, args);
+#endif
+
+	log_dispatch(&ts, level, file, function, line, msg, NULL);
+
 #if MAX_MSG_SIZE == 0
 	free(msg);
+#else
+done:
 #endif
 
 	return status;	// 0 on success
 }
 
+/**
+ * @fn int log_msg(int,
+ *     const char *, const char *, const int,
+ *     const char *, ...)
+ *
+ * @brief Log a message.
+ *
+ * This is the actual logging function. The convenience log_xxx() macros
+ * should normally be used. See tinylogger.h for their definitions.
+ *
+ * If asynchronous mode has been started with log_start_async(), the message
+ * is formatted into the calling thread's ring and written later by the writer
+ * thread.
+ *
+ * @param level the log level desired
+ * @param file the filename of the line of code (debug format)
+ * @param function the function of the line of code (debug format)
+ * @param line the line number of the line of code (debug format)
+ * @param format the printf format string (required)
+ * @param ... the arguments to the format string
+ *
+ * A message whose level no channel accepts is discarded before anything else
+ * is done.
+ *
+ * @return 0 on success, -1 if the format was NULL, -2 if clock_gettime() error
+ */
+int log_msg(int const level,
+	char const * const file, char const * const function, int const line,
+	char const * const format, ...) {
+	va_list	args;
+	int status;
+
+	va_start(args, format);
+	status = log_vmsg(level, file, function, line, format, args);
+	va_end(args);
+
+	return status;
+}
+
+/**
+ * @fn int log_callsite_msg(struct log_callsite *, const char *, ...)
+ *
+ * @brief Log a message from a log statement.
+ *
+ * Used by the log_xxx() macros. The level, file, function and line come from
+ * the callsite, which also counts the messages logged.
+ *
+ * @param callsite the log statement
+ * @param format the printf format string (required)
+ * @param ... the arguments to the format string
+ * @return 0 on success, -1 if the format was NULL, -2 if clock_gettime() error
+ */
+int log_callsite_msg(struct log_callsite *callsite,
+	char const * const format, ...) {
+	va_list	args;
+	int status;
+
+	if (__atomic_load_n(&callsite->disabled, __ATOMIC_RELAXED)) return 0;
+	__atomic_fetch_add(&callsite->count, 1, __ATOMIC_RELAXED);
+
+	va_start(args, format);
+	status = log_vmsg(callsite->level, callsite->file, callsite->function,
+		callsite->line, format, args);
+	va_end(args);
+
+	return status;
+}
+
+/**
+ * @fn void log_callsite_enable(struct log_callsite *, bool)
+ *
+ * @brief Enable or disable a single log statement.
+ *
+ * A disabled statement logs nothing, whatever the channel levels, and its
+ * arguments are not evaluated. See log_get_callsites() to find them.
+ *
+ * @param callsite the log statement
+ * @param enable false to disable it
+ */
+void log_callsite_enable(struct log_callsite *callsite, bool enable) {
+	__atomic_store_n(&callsite->disabled, !enable, __ATOMIC_RELAXED);
+}
+
+/**
+ * @fn int queue_text(struct timespec *, int,
+ *     char const *, char const *, int, char const *, ...)
+ * @brief Queue a message in the calling thread's ring - log_async_vmsg()
+ * with variable arguments.
+ * @return 0 on success, -1 if the thread has no ring, or asynchronous mode
+ * was stopped
+ */
+static int queue_text(struct timespec *ts, int level,
+	char const *file, char const *function, int line,
+	char const *format, ...) {
+	va_list	args;
+	int status;
+
+	va_start(args, format);
+	status = log_async_vmsg(ts, level, file, function, line, format, args);
+	va_end(args);
+
+	return status;
+}
+
+/**
+ * Room for the " [part n/m]" tag of a dump logged in several parts.
+ */
+#define MEM_PART_LEN (sizeof(" [part /]") + 2 * (LOG_LONG_LEN - 1))
+
+/**
+ * @fn char *put_part(char *, size_t, size_t)
+ * @brief Write the " [part n/m]" tag of a dump logged in several parts.
+ * @return a pointer past the tag
+ */
+static char *put_part(char *p, size_t part, size_t n_parts) {
+	p = stpcpy(p, " [part ");
+	p = log_put_long(p, part);
+	*p++ = '/';
+	p = log_put_long(p, n_parts);
+	*p++ = ']';
+
+	return p;
+}
 
 /**
  * @fn int log_mem(int const, void const * const, int const,
@@ -560,6 +1832,16 @@ unlock:
  * This function is intended to be called with the log_memory() macro. See
  * tinylogger.h for its definitions.
  *
+ * The dump is logged in parts of at most LOG_MEM_CHUNK bytes (fewer if a part
+ * would not fit in an asynchronous ring), so the memory used is bounded
+ * whatever the size of the region. Each part is a message of its own: the
+ * user message tagged " [part n/m]", a newline and the lines of that part.
+ * The parts share a timestamp, and the offsets continue from part to part,
+ * so nothing is lost. Messages from other threads may come between the
+ * parts.
+ *
+ * A dump that fits in one part is logged as a single, untagged message.
+ *
  * @param level the log level
  * @param buf address of the memory region
  * @param len length of the memory region
@@ -568,65 +1850,177 @@ unlock:
  * @param line the line number of the calling statement
  * @param format the printf format specifier
  *
- * @return 0 on success, -1 otherwise
+ * @return 0 on success, -1 if the format was NULL or the message couldn't be
+ * formatted, -2 if clock_gettime() error
  */
 int log_mem(int const level, void const * const buf, int const len,
 	char const * const file, char const * const function, int const line,
 	char const * const format, ...) {
 	va_list	args;
-#if MAX_MSG_SIZE == 0
-	char *msg;
-#else
-	char	msg[MAX_MSG_SIZE];		// user message
-#endif
+	struct timespec ts;
+	size_t n_bytes = ((buf != NULL) && (len > 0)) ? (size_t) len : 0;
+	size_t chunk = LOG_MEM_CHUNK;
+	bool async = false;
+
+	// nobody wants it - don't bother with the hex dump
+	if (!log_enabled(level)) return 0;
 
-	/* format the memory region */
-	char *hex = log_hexformat(buf, len);
-	if (hex == NULL) return -1;
+	// make sure we have something to log
+	if (!format)	return -1;	// error - require format string
 
 	/* format the user message contents */
 	va_start(args, format);
-#if MAX_MSG_SIZE == 0
-	vasprintf(&msg, format, args);
-#else
-	vsnprintf(msg, sizeof(msg), format, args);
-#endif
+	int n = thread_vformat(0, format, args);
 	va_end(args);
+	if (n < 0) return -1;
+	size_t msg_len = n;
 
-	// separate the message from the dump with a newline
-	int status =
-		log_msg(level, file, function, line, "%s\n%s", msg, hex);
+	/* make room for the message, tag, newline, one part of the dump and null */
+	if (!reserve_msg(msg_len + MEM_PART_LEN + 1 + log_hexformat_len(chunk) + 1)) {
+		return -1;
+	}
 
-#if MAX_MSG_SIZE == 0
-	free(msg);
-#endif
+	// drop the message, but return error status
+	if (clock_gettime(log_config.clock_id, &ts) == -1) return -2;
+
+	/* a queued part must fit in the ring - shorten the parts, then the user
+	 * message, to make sure that at least one line of the dump gets through */
+	if (log_async_active()) {
+		size_t limit = log_async_msg_limit();
+		size_t one_line = log_hexformat_len(1);
+
+		if (limit > 0) {
+			async = true;
+			if (msg_len + MEM_PART_LEN + 1 + one_line + 1 > limit) {
+				msg_len = (limit > MEM_PART_LEN + one_line + 2) ?
+					limit - (MEM_PART_LEN + one_line + 2) : 0;
+			}
+			size_t room = limit - msg_len - MEM_PART_LEN - 2;
+			size_t fit = log_hexformat_fit((limit > msg_len + MEM_PART_LEN + 2) ?
+				room : 0);
+			if (fit < chunk) chunk = fit;
+		}
+	}
 
-	free(hex);
+	size_t n_parts = (n_bytes > 0) ? (n_bytes + chunk - 1) / chunk : 1;
 
-	return status;
+	for (size_t part = 0; part < n_parts; part++) {
+		size_t offset = part * chunk;
+		size_t part_len = (n_bytes - offset < chunk) ? n_bytes - offset : chunk;
+		char *p = thread_msg.buf + msg_len;
+
+		if (n_parts > 1) p = put_part(p, part + 1, n_parts);
+		*p++ = '\n';
+		p = log_hexformat(p, buf, offset, part_len);
+		*p = '\0';
+
+		// if asynchronous mode was stopped meanwhile, log it directly
+		if (!async || (queue_text(&ts, level, file, function, line, "%s",
+			thread_msg.buf) != 0)) {
+			log_async_wait_queued();
+			log_dispatch(&ts, level, file, function, line, thread_msg.buf, NULL);
+		}
+	}
+
+	return 0;
 }
 
 /**
  * @fn void log_done(void)
- * @brief Close any open channels and stop the logrotate thread if it was
- * running, in that sequence.
+ * @brief Stop the logrotate and rotation threads if they were running, and
+ * close any open channels.
+ *
+ * If asynchronous mode is active, it is stopped first so that any queued
+ * messages are written.
  *
- * It calls log_close_ch() for each channel, then log_enable_logrotate(0).
+ * It stops the logrotate and rotation threads, then calls
+ * log_close_channel() for each channel.
  *
  * The software does not return to the pre-init state where messages are passed
  * to the stderr. All output is stopped. Channels must be opened again to resume
  * output. The fact that logging had been configured is remembered.
  */
 void log_done(void) {
+	// write any queued messages and stop the writer thread
+	log_stop_async();
+
 	// stop the logrotate support
 	log_enable_logrotate(0);
+	stop_rotation();
+
+	// finish compressing the rotated files
+	log_compress_stop();
 
 	// disable all log_channels
 	// if a channel was file based, flush and close it
-	LOG_CHANNEL  *log_ch = (LOG_CHANNEL *) log_channels;
-	for (size_t n = 0; n < LOG_CH_COUNT; n++, log_ch++) {
-		log_close_channel(log_ch);
+	while (1) {
+		LOG_CHANNEL *channel = NULL;
+
+		pthread_mutex_lock(&log_lock);
+		for (size_t n = 0; n < log_channels->count; n++) {
+			if (!log_channels->entries[n].channel->closed) {
+				channel = log_channels->entries[n].channel;
+				break;
+			}
+		}
+		// free the channels that are closed, but still in the set
+		if ((channel == NULL) && (log_channels->count > 0)) {
+			update_channels(NULL, NULL);
+		}
+		pthread_mutex_unlock(&log_lock);
+
+		if (channel == NULL) break;
+		log_close_channel(channel);
+	}
+}
+
+/**
+ * @fn LOG_CHANNEL *add_channel(LOG_CHANNEL *)
+ * @brief Add a channel, set up by the caller, to the channel set.
+ *
+ * The channel was allocated and its stream opened without log_lock held, so
+ * that logging goes on meanwhile. The lock is only held to write the head and
+ * publish the new set. On failure, the channel is freed (but its stream is
+ * left to the caller).
+ *
+ * @param channel the new channel
+ * @return the channel, or NULL on error
+ */
+static LOG_CHANNEL *add_channel(LOG_CHANNEL *channel) {
+	pthread_mutex_init(&channel->lock, NULL);
+
+	// for rotation
+	if (channel->pathname != NULL) {
+		channel->file_len = file_length(channel->pathname);
+		channel->started = time(NULL);
+	}
+
+	// LOCK global resources
+	pthread_mutex_lock(&log_lock);
+
+	// for Json and XML
+	log_do_head(channel);
+
+	// initialize the start time for delta time formats
+	if (!configured) {
+		log_select_clock(log_config.clock_id);
+		
+		// user has set up at least one channel
+		__atomic_store_n(&configured, true, __ATOMIC_RELEASE);
+	}
+
+	if (update_channels(channel, NULL) != 0) {
+		log_binary_free(channel);
+		pthread_mutex_destroy(&channel->lock);
+		free(channel->pathname);
+		free(channel);
+		channel = NULL;
 	}
+
+	// UNLOCK global resources
+	pthread_mutex_unlock(&log_lock);
+
+	return channel;
 }
 
 /**
@@ -644,7 +2038,7 @@ void log_done(void) {
  */
 LOG_CHANNEL *log_open_channel_s(FILE *stream, LOG_LEVEL level,
 	log_formatter_t formatter) {
-	LOG_CHANNEL *channel = NULL;	// assume failure
+	LOG_CHANNEL *channel;
 	
 	// check that we have a stream
 	if (stream == NULL) return NULL;
@@ -655,37 +2049,16 @@ LOG_CHANNEL *log_open_channel_s(FILE *stream, LOG_LEVEL level,
 	// make sure the level is a valid one
 	level = log_constrain_level(level);
 
-	// LOCK global resources
-	pthread_mutex_lock(&log_lock);
-
-	// find an available channel
-	channel = get_channel();
-	if (channel == NULL) goto unlock;
-
-	// clear all params
-	bzero(channel, sizeof(*channel));
+	// a new channel
+	channel = calloc(1, sizeof(*channel));
+	if (channel == NULL) return NULL;
 
 	// record the stream, level and formatter
 	channel->stream = stream;
 	channel->level = level;
 	channel->formatter = formatter;
 
-	// for Json and XML
-	log_do_head(channel);
-
-	// initialize the start time for delta time formats
-	if (!configured) {
-		log_select_clock(log_config.clock_id);
-		
-		// user has set up at least one channel
-		configured = true;
-	}
-
-unlock:
-	// UNLOCK global resources
-	pthread_mutex_unlock(&log_lock);
-
-	return channel;
+	return add_channel(channel);
 }
 
 /**
@@ -706,7 +2079,7 @@ unlock:
  */
 LOG_CHANNEL *log_open_channel_f(char *pathname, LOG_LEVEL level,
 	log_formatter_t formatter, bool line_buffered) {
-	LOG_CHANNEL *channel = NULL;
+	LOG_CHANNEL *channel;
 	
 	// check that we have a pathname
 	if (pathname == NULL) return NULL;
@@ -717,20 +2090,10 @@ LOG_CHANNEL *log_open_channel_f(char *pathname, LOG_LEVEL level,
 	// make sure the level is a valid one
 	level = log_constrain_level(level);
 
-	// LOCK global resources
-	pthread_mutex_lock(&log_lock);
-
-	// find an available channel
-	channel = get_channel();
-	if (channel == NULL) goto unlock;
-
-	// clear unused params
-	bzero(channel, sizeof(*channel));
-
 	// open the file in append mode
 	FILE *file = fopen(pathname, "a");
 
-	if (file == NULL) goto unlock;
+	if (file == NULL) return NULL;
 
 	// set line buffered output, if requested
 	if (line_buffered && setvbuf(file, NULL, _IOLBF, BUFSIZ)) {
@@ -738,35 +2101,191 @@ LOG_CHANNEL *log_open_channel_f(char *pathname, LOG_LEVEL level,
 		char *err_msg;
 		err_msg = strerror_r(errno, buf, sizeof(buf));
 		log_err("can't set line buffering on %s: %s", pathname, err_msg);
-		goto unlock;
+		fclose(file);
+		return NULL;
+	}
+
+	// a new channel, with a duplicate of the pathname
+	channel = calloc(1, sizeof(*channel));
+	if (channel != NULL) channel->pathname = strdup(pathname);
+	if ((channel == NULL) || (channel->pathname == NULL)) {
+		free(channel);
+		fclose(file);
+		return NULL;
 	}
 
-	// duplicate the pathname,
 	// record the stream, level, formatter, and line_bufferd status
-	channel->pathname = strdup(pathname);
 	channel->line_buffered = line_buffered;
 	channel->stream = file;
 	channel->level = level;
 	channel->formatter = formatter;
 
-	// for Json and XML
-	log_do_head(channel);
+	channel = add_channel(channel);
+	if (channel == NULL) fclose(file);
 
-	// initialize the start time for delta time formats
-	if (!configured) {
-		log_select_clock(log_config.clock_id);
-		
-		// user has set up at least one channel
-		configured = true;
+	return channel;
+}
+
+/**
+ * @fn void flush_sinks(void)
+ * @brief At exit, write the batches of the channels opened with
+ * log_open_channel_fd(), as exit() flushes the stdio streams.
+ */
+static void flush_sinks(void) {
+	pthread_mutex_lock(&log_lock);
+
+	struct channel_set const *set = log_channels;
+	for (size_t n = 0; n < set->count; n++) {
+		LOG_CHANNEL *channel = set->entries[n].channel;
+
+		pthread_mutex_lock(&channel->lock);
+		if ((channel->stream != NULL) && (channel->sink != NULL)) {
+			log_sink_flush(channel->sink);
+		}
+		pthread_mutex_unlock(&channel->lock);
 	}
 
-unlock:
-	// UNLOCK global resources
 	pthread_mutex_unlock(&log_lock);
+}
+
+static void flush_sinks_init(void) {
+	atexit(flush_sinks);
+}
+
+/**
+ * @fn LOG_CHANNEL *open_sink_channel(char *, LOG_LEVEL, log_formatter_t,
+ * bool, enum log_sink_type)
+ * @brief Open a channel for output to a file with a log_sink - the work of
+ * log_open_channel_fd(), log_open_channel_uring() and log_open_channel_mmap().
+ * @param pathname The pathname of the file to manage.
+ * @param level The minimum log level to output.
+ * @param formatter The message formatter to use.
+ * @param line_buffered Write each record at once, rather than in batches
+ * @param type how the sink writes its batches
+ * @return NULL on error, else the LOG_CHANNEL
+ */
+static LOG_CHANNEL *open_sink_channel(char *pathname, LOG_LEVEL level,
+	log_formatter_t formatter, bool line_buffered, enum log_sink_type type) {
+	static pthread_once_t flush_once = PTHREAD_ONCE_INIT;
+	LOG_CHANNEL *channel;
+
+	// check that we have a pathname
+	if (pathname == NULL) return NULL;
+
+	// give a default formatter in case none was specified
+	if (formatter == NULL) formatter = log_fmt_standard;
+
+	// make sure the level is a valid one
+	level = log_constrain_level(level);
+
+	// open the file in append mode
+	struct log_sink *sink = log_sink_open(pathname, type, line_buffered);
+
+	if (sink == NULL) return NULL;
+
+	// a new channel, with a duplicate of the pathname
+	channel = calloc(1, sizeof(*channel));
+	if (channel != NULL) channel->pathname = strdup(pathname);
+	if ((channel == NULL) || (channel->pathname == NULL)) {
+		free(channel);
+		log_sink_close(sink);
+		return NULL;
+	}
+
+	// record the sink, level, formatter, and line_bufferd status
+	channel->line_buffered = line_buffered;
+	channel->sink = sink;
+	channel->stream = log_sink_stream(sink);
+	channel->level = level;
+	channel->formatter = formatter;
+
+	pthread_once(&flush_once, flush_sinks_init);
+
+	channel = add_channel(channel);
+	if (channel == NULL) log_sink_close(sink);
 
 	return channel;
 }
 
+/**
+ * @fn LOG_CHANNEL *log_open_channel_fd(char *pathname, LOG_LEVEL level,
+ * log_formatter_t formatter, bool line_buffered)
+ * @brief Open a channel for output to a file, with a raw file descriptor
+ * rather than stdio.
+ *
+ * The records are gathered in a batch, and written with a single write()
+ * when it fills, or at once if the channel is line buffered. The file is
+ * opened with O_APPEND, and each write holds only whole records, so several
+ * processes can append to the same file without interleaving partial lines.
+ *
+ * The batch is written when the channel is closed or reopened, and at exit.
+ *
+ * @param pathname The pathname of the file to manage.
+ * @param level The minimum log level to output.
+ * @param formatter The message formatter to use.
+ * @param line_buffered Write each record at once, rather than in batches
+ * @return NULL on error, else the LOG_CHANNEL
+ */
+LOG_CHANNEL *log_open_channel_fd(char *pathname, LOG_LEVEL level,
+	log_formatter_t formatter, bool line_buffered) {
+	return open_sink_channel(pathname, level, formatter, line_buffered,
+		LOG_SINK_FD);
+}
+
+/**
+ * @fn LOG_CHANNEL *log_open_channel_uring(char *pathname, LOG_LEVEL level,
+ * log_formatter_t formatter, bool line_buffered)
+ * @brief Open a channel for output to a file, written with io_uring.
+ *
+ * As log_open_channel_fd(), but the batches are submitted to an io_uring of
+ * the channel, and the caller goes on filling the next one while the kernel
+ * writes it. The caller only waits when all the buffers are busy. With line
+ * buffering, a record is submitted as soon as the writes ahead of it are
+ * done.
+ *
+ * If io_uring isn't available (at build time, or in the running kernel), the
+ * channel writes as a log_open_channel_fd() one does.
+ *
+ * @param pathname The pathname of the file to manage.
+ * @param level The minimum log level to output.
+ * @param formatter The message formatter to use.
+ * @param line_buffered Submit each record at once, rather than in batches
+ * @return NULL on error, else the LOG_CHANNEL
+ */
+LOG_CHANNEL *log_open_channel_uring(char *pathname, LOG_LEVEL level,
+	log_formatter_t formatter, bool line_buffered) {
+	return open_sink_channel(pathname, level, formatter, line_buffered,
+		LOG_SINK_URING);
+}
+
+/**
+ * @fn LOG_CHANNEL *log_open_channel_mmap(char *pathname, LOG_LEVEL level,
+ * log_formatter_t formatter)
+ * @brief Open a channel for output to a file, appended to through a memory
+ * mapped window.
+ *
+ * The file is preallocated with fallocate() in large extents, and each record
+ * is copied into a window of it mapped with mmap() - no system call is made
+ * until the window fills. The records are in the page cache as soon as they
+ * are copied, so there is no line buffering to ask for.
+ *
+ * The file is cut back to the end of the records when the channel is closed
+ * or reopened (as by the logrotate signal), and at exit. If the process is
+ * killed, the file keeps the zeros preallocated past the records.
+ *
+ * Only one process may append to the file.
+ *
+ * @param pathname The pathname of the file to manage.
+ * @param level The minimum log level to output.
+ * @param formatter The message formatter to use.
+ * @return NULL on error, else the LOG_CHANNEL
+ */
+LOG_CHANNEL *log_open_channel_mmap(char *pathname, LOG_LEVEL level,
+	log_formatter_t formatter) {
+	return open_sink_channel(pathname, level, formatter, false,
+		LOG_SINK_MMAP);
+}
+
 /**
  * @fn void log_set_json_notes(char *notes)
  * @brief Set the notes to use in future logs opened using the json formatter.
@@ -814,6 +2333,9 @@ void log_set_json_notes(char *notes) {
 int log_change_params(LOG_CHANNEL  *channel, LOG_LEVEL level, log_formatter_t formatter) {
 	int status = -1;	// assume failure
 
+	// messages already queued are written with the current params
+	log_async_flush();
+
 	// LOCK global resources
 	pthread_mutex_lock(&log_lock);
 
@@ -825,12 +2347,12 @@ int log_change_params(LOG_CHANNEL  *channel, LOG_LEVEL level, log_formatter_t fo
 		goto unlock;
 	}
 
-	// change the params
+	// change the params - the formatter is used with the channel lock held
+	pthread_mutex_lock(&channel->lock);
 	channel->level = log_constrain_level(level);
 	channel->formatter = formatter;
-
-	// success
-	status = 0;
+	pthread_mutex_unlock(&channel->lock);
+	status = update_channels(NULL, NULL);
 
 unlock:
 	// UNLOCK global resources
@@ -850,7 +2372,7 @@ unlock:
 int log_set_level(LOG_CHANNEL  *channel, LOG_LEVEL level) {
 	int status = -1;	// assume failure
 
-	// UNLOCK global resources
+	// LOCK global resources
 	pthread_mutex_lock(&log_lock);
 
 	if (!is_channel(channel)) {
@@ -859,9 +2381,7 @@ int log_set_level(LOG_CHANNEL  *channel, LOG_LEVEL level) {
 
 	// change the level
 	channel->level = log_constrain_level(level);
-
-	// success
-	status = 0;
+	status = update_channels(NULL, NULL);
 
 unlock:
 	// UNLOCK global resources
@@ -874,9 +2394,9 @@ unlock:
  * @fn int log_reopen_channel(LOG_CHANNEL *channel)
  * @brief Re-open a channel to support *programatic* logrotate.
  *
- * If the channel is a file based channel, the file is flushed and closed.
- * The file is then opened again with the same log level, formatter, and
- * selected line buffering.
+ * If the channel is a file based channel, the file is opened again with the
+ * same log level, formatter, and selected line buffering. The old file is
+ * then flushed and closed.
  *
  * If the channel is a stream based channel, it is just flushed.
  *
@@ -887,11 +2407,11 @@ unlock:
  *
  * - rename the current file to, say, currentfile.save
  * - call log_reopen_channel(). The next things happen:
- *   - logging is locked
- *   - the file is flushed
- *   - the file is closed
  *   - a new file with the original name is opened
- *   - logging is unlocked
+ *   - logging to the channel is locked
+ *   - the new file takes the place of the old one
+ *   - logging to the channel is unlocked
+ *   - the old file is flushed and closed
  * - logging then resumes without any messages being lost
  *
  *```
@@ -909,6 +2429,9 @@ unlock:
  */
 int log_reopen_channel(LOG_CHANNEL *channel) {
 
+	// messages already queued belong in the current file
+	log_async_flush();
+
 	// LOCK global resources
 	pthread_mutex_lock(&log_lock);
 
@@ -920,50 +2443,103 @@ int log_reopen_channel(LOG_CHANNEL *channel) {
 	return status;
 }
 
+/**
+ * @fn int close_stream(LOG_CHANNEL *)
+ * @brief Write the tail of the channel, close its file and free its state.
+ * The channel itself is left for free_retired().
+ * @param channel the channel
+ * @return 0 on success, -2 if it wasn't actually open
+ */
+static int close_stream(LOG_CHANNEL *channel) {
+	int status = 0;
+
+	// wait for a message being written to it
+	pthread_mutex_lock(&channel->lock);
+
+	// see if it was actually open
+	if (channel->stream == NULL) {
+		status = -2;
+	} else {
+		// for Json and XML
+		log_do_tail(channel);
+
+		// If we are closing an existing file based config, that means we need
+		// to flush and close the file.
+		if (channel->sink != NULL) {
+			log_sink_close(channel->sink);
+		} else if (channel->pathname != NULL) {
+			fflush(channel->stream);
+			fclose(channel->stream);
+		}
+	}
+	channel->sink = NULL;
+	free(channel->pathname);	// remember to free the stdrup()'ed pathname
+	channel->pathname = NULL;
+	log_binary_free(channel);
+	channel->stream = NULL;
+
+	pthread_mutex_unlock(&channel->lock);
+
+	return status;
+}
+
 /**
  * @fn int log_close_channel(LOG_CHANNEL *channel)
- * @brief Flush and close the channel, and mark it not in use.
+ * @brief Flush and close the channel, and free it.
+ *
+ * The channel is taken out of the channel set first. Its tail is written and
+ * its file closed after that, with only its own lock held, so logging to the
+ * other channels goes on. The channel itself is freed once no thread can
+ * still be about to write to it.
+ *
+ * If the set without it can't be allocated, the channel is left in the set,
+ * closed, and freed when the next set is published.
  *
  * @param channel The channel to close
  * @return 0 on success. If channel is not an actual channel, -1 is returned.
- * If the channel wasn't actually open, -2 is returned.
+ * If the channel wasn't actually open (a reopen failed), it is freed, and -2
+ * is returned.
  */
 int log_close_channel(LOG_CHANNEL *channel) {
 	int status = 0;	// assume success
 
+	// messages already queued are written before the channel goes away
+	log_async_flush();
+
+	// Keep the channel from being freed until it is closed below. Without a
+	// reader record, it is closed before it is taken out of the set instead,
+	// with logging locked.
+	bool pinned = (get_reader() != NULL);
+	if (pinned) enter_channels();
+
 	// LOCK global resources
 	pthread_mutex_lock(&log_lock);
 
 	// verify that it is actually a channel
 	if (!is_channel(channel)) {
-		status = -1;
-		goto unlock;
-	}
-
-	// see if it was actually open
-	if (channel->stream == NULL) {
-		status = -2;
-		goto unlock;
+		pthread_mutex_unlock(&log_lock);
+		if (pinned) leave_channels();
+		return -1;
 	}
 
-	// for Json and XML
-	log_do_tail(channel);
+	if (!pinned) status = close_stream(channel);
 
-	// If we are closing an existing file based config, that means we need to
-	// flush and close the file.
-	if (channel->pathname != NULL) {
-		fflush(channel->stream);
-		fclose(channel->stream);
-		free(channel->pathname);	// remember to free the stdrup()'ed pathname
+	// take it out of the set - no new message will be sent to it
+	if (update_channels(NULL, channel) != 0) {
+		// out of memory - leave it in the set, marked closed. Nothing is
+		// written to it once its stream is closed, and it is freed with the
+		// set, once the next one is published.
+		channel->closed = true;
 	}
 
-	// clear the target channel to indicate it is no longer active
-	bzero(channel, sizeof(*channel));
-
-unlock:
 	// UNLOCK global resources
 	pthread_mutex_unlock(&log_lock);
 
+	if (pinned) {
+		status = close_stream(channel);
+		leave_channels();
+	}
+
 	return status;
 }
 
@@ -1022,3 +2598,101 @@ int log_enable_logrotate(int signal) {
 
 	return 0;
 }
+
+/**
+ * @fn int log_set_rotation(LOG_CHANNEL *channel,
+ * struct log_rotation const *rotation)
+ * @brief Have the library rotate the file of a channel, by size, by age, or
+ * on the hour (or any other interval of local time).
+ *
+ * The file is renamed to its pathname with the time it was opened added
+ * (app.log.20201231-235900), and the channel reopened, by a rotation thread.
+ * The thread is started with the first call, and stopped by log_done().
+ *
+ * The new file is opened before the channel is locked, and the old one
+ * closed after, so logging to the channel isn't held up. The records logged
+ * meanwhile go on to the renamed file.
+ *
+ * The size is counted as records are written to the channel (starting from
+ * the length of the file when it is opened), and checked with each record.
+ * The age and time are checked by the rotation thread.
+ *
+ *```
+ *    LOG_CHANNEL *ch = log_open_channel_f("app.log", LL_INFO, log_fmt_debug, false);
+ *    struct log_rotation hourly = {.max_bytes = 100 * 1024 * 1024, .interval = 3600};
+ *    log_set_rotation(ch, &hourly);
+ *```
+ *
+ * @param channel The file channel to rotate.
+ * @param rotation When to rotate it, NULL (or all 0) for never.
+ * @return 0 on success, -1 if the channel is not a file channel, or the
+ * thread couldn't be started
+ */
+int log_set_rotation(LOG_CHANNEL *channel,
+	struct log_rotation const *rotation) {
+	int status = -1;	// assume failure
+
+	pthread_once(&rotation_once, rotation_init);
+
+	// LOCK global resources
+	pthread_mutex_lock(&log_lock);
+
+	if (!is_channel(channel) || (channel->pathname == NULL)) {
+		goto unlock;
+	}
+
+	if (!rotation_config.thread_running) {
+		sigset_t all, old;
+
+		// the logrotate signal, or any other, is not for the thread
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		rotation_config.stop = false;
+		int retval = pthread_create(&rotation_config.thread, NULL,
+			log_rotation_thread, NULL);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (retval != 0) goto unlock;
+		rotation_config.thread_running = true;
+	}
+
+	// the size is checked with the channel lock held
+	pthread_mutex_lock(&channel->lock);
+	if (rotation != NULL) {
+		channel->rotation = *rotation;
+	} else {
+		memset(&channel->rotation, 0, sizeof(channel->rotation));
+	}
+	__atomic_store_n(&channel->rotate_now, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&channel->lock);
+	set_rotate_at(channel);
+
+	// the thread works out when to wake again
+	sem_post(&rotation_config.wakeup);
+	status = 0;
+
+unlock:
+	// UNLOCK global resources
+	pthread_mutex_unlock(&log_lock);
+
+	return status;
+}
+
+/**
+ * @fn void log_get_stats(struct log_stats *stats)
+ * @brief Get a snapshot of the library counters.
+ *
+ * The counters are gathered without stopping the logging threads, so they
+ * may be slightly behind by the time they are examined.
+ *
+ * @param stats the structure to fill in
+ */
+void log_get_stats(struct log_stats *stats) {
+	if (stats == NULL) return;
+
+	bzero(stats, sizeof(*stats));
+	log_async_get_stats(stats);
+	log_sink_get_stats(stats);
+	stats->rotations = __atomic_load_n(&rotation_config.rotations,
+		__ATOMIC_RELAXED);
+	log_compress_get_stats(stats);
+}
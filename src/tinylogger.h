@@ -20,22 +20,70 @@
  * Use these macros for logging messages. They set the log_level parameter,
  * and capture \_\_FILE\_\_, \_\_func\_\_, and \_\_LINE\_\_ for use by the
  * log_formatter_debug() formatter.
+ *
+ * Each use of a macro defines a static struct log_callsite holding the level,
+ * file, function, line and (literal) format, and passes only a pointer to it.
+ *
+ * If no channel accepts the level, or the callsite is disabled, the arguments
+ * are not evaluated.
+ */
+#define log_emerg(...)   _log_callsite_msg(LL_EMERG, __VA_ARGS__)   /**< emerg */
+#define log_alert(...)   _log_callsite_msg(LL_ALERT, __VA_ARGS__)   /**< alert */
+#define log_crit(...)    _log_callsite_msg(LL_CRIT, __VA_ARGS__)    /**< crit */
+#define log_severe(...)  _log_callsite_msg(LL_SEVERE, __VA_ARGS__)  /**< severe */
+#define log_err(...)     _log_callsite_msg(LL_ERR, __VA_ARGS__)     /**< err */
+#define log_warning(...) _log_callsite_msg(LL_WARNING, __VA_ARGS__) /**< warning */
+#define log_notice(...)  _log_callsite_msg(LL_NOTICE, __VA_ARGS__)  /**< notice */
+#define log_info(...)    _log_callsite_msg(LL_INFO, __VA_ARGS__)    /**< info */
+#define log_config(...)  _log_callsite_msg(LL_CONFIG, __VA_ARGS__)  /**< config */
+#define log_debug(...)   _log_callsite_msg(LL_DEBUG, __VA_ARGS__)   /**< debug */
+#define log_fine(...)    _log_callsite_msg(LL_FINE, __VA_ARGS__)    /**< fine */
+#define log_finer(...)   _log_callsite_msg(LL_FINER, __VA_ARGS__)   /**< finer */
+#define log_finest(...)  _log_callsite_msg(LL_FINEST, __VA_ARGS__)  /**< finest */
+
+#define log_memory(level, ptr, len, ...)  __extension__ ({ \
+	int const _log_level = (level); \
+	log_enabled(_log_level) ? log_mem(_log_level, (ptr), (len), \
+		__FILE__, __func__, __LINE__, __VA_ARGS__) : 0; }) /**< hex dump */
+
+/**
+ * True if at least one channel (or the stderr before any channel is opened)
+ * would accept a message of the given level. A single relaxed load - no lock
+ * is taken.
  */
-#define log_emerg(...)   log_msg(LL_EMERG, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< emerg */
-#define log_alert(...)   log_msg(LL_ALERT, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< alert */
-#define log_crit(...)    log_msg(LL_CRIT, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< crit */
-#define log_severe(...)  log_msg(LL_SEVERE, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< severe */
-#define log_err(...)     log_msg(LL_ERR, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< err */
-#define log_warning(...) log_msg(LL_WARNING, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< warning */
-#define log_notice(...)  log_msg(LL_NOTICE, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< notice */
-#define log_info(...)    log_msg(LL_INFO, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< info */
-#define log_config(...)  log_msg(LL_CONFIG, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< config */
-#define log_debug(...)   log_msg(LL_DEBUG, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< debug */
-#define log_fine(...)    log_msg(LL_FINE, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< fine */
-#define log_finer(...)   log_msg(LL_FINER, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< finer */
-#define log_finest(...)  log_msg(LL_FINEST, __FILE__, __func__, __LINE__, __VA_ARGS__) /**< finest */
-
-#define log_memory(level, ptr, len, ...)  log_mem((level), (ptr), (len), __FILE__, __func__, __LINE__, __VA_ARGS__) /**< hex dump */
+#define log_enabled(level) ((level) <= __atomic_load_n(&log_max_level, __ATOMIC_RELAXED))
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+/** the ELF section holding the struct log_callsite of every log statement */
+#define LOG_CALLSITE_SECTION log_callsites
+#define _log_str(s) #s
+#define _log_xstr(s) _log_str(s)
+#define _log_start(s) _log_xcat(__start_, s)
+#define _log_stop(s) _log_xcat(__stop_, s)
+#define _log_xcat(a, b) _log_cat(a, b)
+#define _log_cat(a, b) a ## b
+
+/* the format, if it is a string literal, else NULL */
+#define _log_first(format, ...) format
+#define _log_literal(format) \
+	__builtin_choose_expr(__builtin_constant_p(format), (format), (char const *) 0)
+
+#if defined __cplusplus
+#define _log_callsite_msg(level, ...) (log_enabled(level) ? \
+	log_msg((level), __FILE__, __func__, __LINE__, __VA_ARGS__) : 0)
+#else
+#define _log_callsite_msg(_lvl, ...) __extension__ ({ \
+	static struct log_callsite _log_cs __attribute__((used, \
+		section(_log_xstr(LOG_CALLSITE_SECTION)), aligned(LOG_CALLSITE_ALIGN))) = { \
+		.level = (_lvl), .line = __LINE__, \
+		.file = __FILE__, .function = __func__, \
+		.format = _log_literal(_log_first(__VA_ARGS__, 0)), \
+	}; \
+	(log_enabled(_lvl) && \
+		!__atomic_load_n(&_log_cs.disabled, __ATOMIC_RELAXED)) ? \
+		log_callsite_msg(&_log_cs, __VA_ARGS__) : 0; })
+#endif
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
 
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 #if defined __cplusplus
@@ -77,12 +125,50 @@ struct log_label {
 };
 extern struct log_label log_labels[LL_N_VALUES];
 
+/** the most verbose level enabled - use log_enabled() */
+extern int log_max_level;
+
 /**
  * Formatters must have this signature.
  */
 typedef int (*log_formatter_t)(FILE *, int, struct timespec *, int,
 	const char *, const char *, int, char *);
 
+/**
+ * @struct log_record
+ * A message, as given to the buffer formatters.
+ */
+struct log_record {
+	struct timespec	*ts;		/**< the timestamp */
+	int			level;			/**< the log level */
+	int			sequence;		/**< the sequence number in the channel */
+	char const	*file;			/**< \_\_FILE\_\_ of the log statement */
+	char const	*function;		/**< \_\_func\_\_ of the log statement */
+	int			line;			/**< \_\_LINE\_\_ of the log statement */
+	long		tid;			/**< the thread id, as log_get_tid() */
+	char const	*thread_name;	/**< the thread name, as log_get_thread_name() */
+	char const	*msg;			/**< the user message, null terminated */
+	size_t		msg_len;		/**< the length of the user message */
+};
+
+/**
+ * @struct log_buf
+ * A growable buffer that the buffer formatters append records to. Start with
+ * an all zero log_buf, grow it with log_buf_reserve(), and release it with
+ * log_buf_free(). The bytes are not null terminated.
+ */
+struct log_buf {
+	char	*data;	/**< the bytes */
+	size_t	len;	/**< the number of bytes in use */
+	size_t	size;	/**< the size of data */
+};
+
+/**
+ * Buffer formatters must have this signature. They append one record to the
+ * buffer, and return its length, or -1 if out of memory.
+ */
+typedef int (*log_buf_formatter_t)(struct log_buf *, struct log_record const *);
+
 /**
  * For use of log_format_timestamp()
  */
@@ -97,6 +183,69 @@ typedef enum {
 	LOG_FMT_HMS = 128		/**< elapsed time in H:M:S   */
 } LOG_TS_FORMAT;
 
+/**
+ * @struct log_stats
+ * Counters reported by log_get_stats().
+ */
+struct log_stats {
+	unsigned long async_records;	/**< records queued in asynchronous mode */
+	unsigned long async_waits;		/**< times a caller waited for ring space */
+	unsigned long async_rings;		/**< per-thread rings currently allocated */
+	unsigned long sink_records;		/**< records written by fd, uring, mmap */
+	unsigned long sink_writes;		/**< write system calls they took */
+	unsigned long uring_writes;		/**< writes submitted to io_uring */
+	unsigned long uring_waits;		/**< times its buffers were all busy */
+	unsigned long mmap_windows;		/**< windows mapped by mmap channels */
+	unsigned long rotations;		/**< files rotated by the rotation thread */
+	unsigned long compress_files;	/**< rotated files compressed */
+	unsigned long compress_pending;	/**< rotated files waiting to be, or being,
+									 compressed */
+	unsigned long compress_bytes_in;	/**< bytes of the files compressed */
+	unsigned long compress_bytes_out;	/**< bytes of the .gz files */
+	unsigned long compress_nsecs;	/**< time spent compressing, for the
+									 throughput */
+	unsigned long compress_lag_nsecs;	/**< time from rotation to .gz, of the
+										 last file compressed */
+	unsigned long compress_max_lag_nsecs;	/**< the longest of those */
+};
+
+/**
+ * @struct log_rotation
+ * When a file channel is rotated by the library - see log_set_rotation(). A
+ * field of 0 is not used.
+ */
+struct log_rotation {
+	unsigned long max_bytes;	/**< rotate once the file is this long */
+	unsigned long max_age;		/**< rotate once the file is this many
+									 seconds old */
+	unsigned long interval;		/**< rotate at each multiple of this many
+									 seconds of local time (3600 = hourly) */
+	bool compress;				/**< gzip the rotated files, in the
+									 background - see log_set_compression() */
+};
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#define LOG_CALLSITE_ALIGN 64
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+/**
+ * @struct log_callsite
+ * A log statement. One is defined by every use of the log_xxx() macros, in
+ * the LOG_CALLSITE_SECTION section of the program (or library) containing it.
+ *
+ * The structs are all the same size and alignment, so the section is an array
+ * of them. See log_get_callsites().
+ */
+struct log_callsite {
+	int			level;		/**< the log level */
+	int			line;		/**< \_\_LINE\_\_ of the statement */
+	char const	*file;		/**< \_\_FILE\_\_ of the statement */
+	char const	*function;	/**< \_\_func\_\_ of the statement */
+	char const	*format;	/**< the format, NULL if not a string literal */
+	unsigned long	count;	/**< messages logged by the statement */
+	int			disabled;	/**< set by log_callsite_enable() */
+} __attribute__((aligned(LOG_CALLSITE_ALIGN)));
+
 struct _logChannel;
 /** make opaque - library users shouldn't see implementation details */
 typedef struct _logChannel LOG_CHANNEL;
@@ -110,6 +259,9 @@ bool log_select_clock(clockid_t clock_id);
 /* channel control */
 LOG_CHANNEL *log_open_channel_s(FILE *, LOG_LEVEL, log_formatter_t);
 LOG_CHANNEL *log_open_channel_f(char *, LOG_LEVEL, log_formatter_t, bool);
+LOG_CHANNEL *log_open_channel_fd(char *, LOG_LEVEL, log_formatter_t, bool);
+LOG_CHANNEL *log_open_channel_uring(char *, LOG_LEVEL, log_formatter_t, bool);
+LOG_CHANNEL *log_open_channel_mmap(char *, LOG_LEVEL, log_formatter_t);
 int log_change_params(LOG_CHANNEL *, LOG_LEVEL, log_formatter_t);
 int log_reopen_channel(LOG_CHANNEL *);
 int log_close_channel(LOG_CHANNEL *);
@@ -120,6 +272,9 @@ void log_set_json_notes(char *);
 int log_msg(int level,
 	char const * file, char const * function, int line,
 	char const * format, ...) __attribute__((format (printf, 5, 6)));
+/* log a message from a log statement - used by the log_xxx() macros */
+int log_callsite_msg(struct log_callsite *callsite,
+	char const * format, ...) __attribute__((format (printf, 2, 3)));
 /* format and log a memory region */
 int log_mem(int level, void const * mem, int len,
 	char const * file, char const * function, int line,
@@ -127,6 +282,60 @@ int log_mem(int level, void const * mem, int len,
 
 /* control logrotate support */
 int log_enable_logrotate(int signal);
+int log_set_rotation(LOG_CHANNEL *, struct log_rotation const *);
+int log_set_compression(int, int);
+
+/* asynchronous mode - messages are written by a background thread */
+int log_start_async(size_t ring_size);
+int log_stop_async(void);
+
+/* convert a log_fmt_binary log to another format */
+long log_decode_binary(FILE *in, FILE *out, log_formatter_t formatter);
+
+/* name the calling thread, for the thread formats */
+int log_set_thread_name(char const *name);
+
+/* library counters */
+void log_get_stats(struct log_stats *stats);
+
+/* log statements */
+void log_callsite_enable(struct log_callsite *callsite, bool enable);
+
+#if !defined __cplusplus && !defined DOXYGEN_SHOULD_SKIP_THIS
+extern struct log_callsite _log_start(LOG_CALLSITE_SECTION)[]
+	__attribute__((weak, visibility("hidden")));
+extern struct log_callsite _log_stop(LOG_CALLSITE_SECTION)[]
+	__attribute__((weak, visibility("hidden")));
+
+/**
+ * @fn size_t log_get_callsites(struct log_callsite **)
+ * @brief Get the log statements of the calling program (or library).
+ *
+ * Inline, so that it finds the log statements of the module that calls it.
+ * In a program linked against the shared library, those of the library are
+ * not included.
+ *
+ * @param callsites set to the first log statement
+ * @return the number of log statements
+ */
+static inline size_t log_get_callsites(struct log_callsite **callsites) {
+	*callsites = _log_start(LOG_CALLSITE_SECTION);
+	if (*callsites == NULL) return 0;
+	return _log_stop(LOG_CALLSITE_SECTION) - _log_start(LOG_CALLSITE_SECTION);
+}
+
+/**
+ * @fn int log_callsite_id(struct log_callsite const *)
+ * @brief Get the number of a log statement - its index in log_get_callsites().
+ * @param callsite the log statement
+ * @return the number, or -1 if it belongs to another module
+ */
+static inline int log_callsite_id(struct log_callsite const *callsite) {
+	if ((callsite < _log_start(LOG_CALLSITE_SECTION)) ||
+		(callsite >= _log_stop(LOG_CALLSITE_SECTION))) return -1;
+	return callsite - _log_start(LOG_CALLSITE_SECTION);
+}
+#endif
 
 /* the formatters */
 int log_fmt_basic(FILE *, int, struct timespec *, int, const char *, const char *, int, char *);
@@ -142,11 +351,42 @@ int log_fmt_xml(FILE *, int, struct timespec *, int, const char *, const char *,
 int log_fmt_xml_records(FILE *, int, struct timespec *, int, const char *, const char *, int, char *);
 int log_fmt_json(FILE *, int, struct timespec *, int, const char *, const char *, int, char *);
 int log_fmt_json_records(FILE *, int, struct timespec *, int, const char *, const char *, int, char *);
+int log_fmt_binary(FILE *, int, struct timespec *, int, const char *, const char *, int, char *);
+
+/* the buffer versions of the formatters - the ones above wrap these */
+int log_bfmt_basic(struct log_buf *, struct log_record const *);
+int log_bfmt_systemd(struct log_buf *, struct log_record const *);
+int log_bfmt_standard(struct log_buf *, struct log_record const *);
+int log_bfmt_debug(struct log_buf *, struct log_record const *);
+int log_bfmt_tall(struct log_buf *, struct log_record const *);
+int log_bfmt_debug_tid(struct log_buf *, struct log_record const *);
+int log_bfmt_debug_tname(struct log_buf *, struct log_record const *);
+int log_bfmt_debug_tall(struct log_buf *, struct log_record const *);
+int log_bfmt_elapsed_time(struct log_buf *, struct log_record const *);
+int log_bfmt_xml(struct log_buf *, struct log_record const *);
+int log_bfmt_json(struct log_buf *, struct log_record const *);
+int log_bfmt_json_records(struct log_buf *, struct log_record const *);
+log_buf_formatter_t log_get_buf_formatter(log_formatter_t);
+
+/* for buffer formatters, and for wrapping them as log_formatter_t */
+char *log_buf_reserve(struct log_buf *, size_t);
+void log_buf_free(struct log_buf *);
+int log_fmt_buffered(log_buf_formatter_t, FILE *, int, struct timespec *, int,
+	const char *, const char *, int, char *);
 
 /* timestamp formatters for use by the main formatters */
 void log_format_timestamp(struct timespec *ts, LOG_TS_FORMAT precision, char *buf, int len);
 void log_format_delta(struct timespec *ts, LOG_TS_FORMAT precision, char *buf, int len);
 
+/** room for the longest log_put_long(), and a null */
+#define LOG_LONG_LEN 21
+
+/* integer writers for use by the formatters - no null is written */
+char *log_put_uint2(char *buf, unsigned value);
+char *log_put_uint4(char *buf, unsigned value);
+char *log_put_uint9(char *buf, unsigned long value);
+char *log_put_long(char *buf, long value);
+
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 TL_END_C_DECLS
 #endif /* DOXYGEN_SHOULD_SKIP_THIS */
@@ -0,0 +1,521 @@
+/*
+ * (C) 2020 Edward Hetherington
+ * This code is licensed under MIT license (see LICENSE in top dir for details)
+ */
+
+/** @file       uring.c
+ *  @brief      Batches of a log_sink written with io_uring.
+ *  @details    A channel opened with log_open_channel_uring() gathers its
+ *  records in a set of URING_DEPTH buffers, registered with the kernel. When
+ *  a buffer fills, a write of it is submitted to an io_uring of the sink, and
+ *  the records go on into the next buffer. The caller only waits for the
+ *  kernel when every buffer is full or being written.
+ *
+ *  One write is in flight at a time, so the batches reach an O_APPEND file in
+ *  order. The full buffers wait their turn, and are submitted as the writes
+ *  before them complete. Completions are checked, without a system call, each
+ *  time a record is added. A short write is submitted again for the rest. A
+ *  write that can't be submitted is done with write() instead.
+ *
+ *  Before the file is reopened or closed, every buffer is written, and the
+ *  writes waited for.
+ *
+ *  The io_uring system calls are used directly - liburing is not needed. If
+ *  the kernel has no io_uring (or it is disabled), the sink writes its batches
+ *  with write(), as a log_open_channel_fd() sink does.
+ *
+ *  Like the rest of the sink, it is only used with the lock of its channel
+ *  held.
+ *
+ *  @author     Edward Hetherington
+ */
+
+#include "config.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#define _GNU_SOURCE
+
+#define URING_DEPTH 4				/**< buffers per sink */
+#define URING_BUF_SIZE (64 * 1024)	/**< size of each buffer */
+#define URING_ALIGN 4096			/**< alignment of the buffers */
+#endif /* DOXYGEN_SHOULD_SKIP_THIS */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "tinylogger.h"
+#include "private.h"
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/**
+ * @struct log_uring
+ * @brief The io_uring and the buffers of a sink.
+ *
+ * The buffers are used round robin. From head, n_queued buffers are full and
+ * waiting to be written (the first of them may be in flight), and then comes
+ * the one being filled.
+ */
+struct log_uring {
+	int		ring_fd;		/**< the io_uring */
+	void	*sq_ring;		/**< the mapped submission queue ring */
+	size_t	sq_ring_size;	/**< its size */
+	void	*cq_ring;		/**< the mapped completion queue ring */
+	size_t	cq_ring_size;	/**< its size */
+	struct io_uring_sqe	*sqes;	/**< the mapped submission queue entries */
+	size_t	sqes_size;		/**< their size */
+	unsigned	*sq_tail;	/**< submission queue tail */
+	unsigned	*sq_mask;	/**< submission queue mask */
+	unsigned	*sq_array;	/**< submission queue index array */
+	unsigned	*cq_head;	/**< completion queue head */
+	unsigned	*cq_tail;	/**< completion queue tail */
+	unsigned	*cq_mask;	/**< completion queue mask */
+	struct io_uring_cqe	*cqes;	/**< the completion queue entries */
+	bool	fixed;			/**< the buffers are registered */
+	char	*mem;			/**< the buffers */
+	struct {
+		size_t	len;		/**< the length of the batch */
+		size_t	done;		/**< how much of it has been written */
+		size_t	n_records;	/**< the records in it */
+	} bufs[URING_DEPTH];	/**< the state of each buffer */
+	int		head;			/**< the oldest full buffer */
+	int		n_queued;		/**< the full buffers */
+	bool	in_flight;		/**< the head buffer is being written */
+};
+
+/** writes submitted by all the sinks */
+static unsigned long uring_writes = 0;
+/** times a caller waited for a buffer */
+static unsigned long uring_waits = 0;
+
+/**
+ * @fn int uring_setup(unsigned, struct io_uring_params *)
+ * @brief The io_uring_setup() system call.
+ */
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+/**
+ * @fn int uring_enter(int, unsigned, unsigned, unsigned)
+ * @brief The io_uring_enter() system call, retried if interrupted.
+ */
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+	unsigned flags) {
+	int status;
+
+	do {
+		status = syscall(__NR_io_uring_enter, ring_fd, to_submit,
+			min_complete, flags, NULL, 0);
+	} while ((status < 0) && (errno == EINTR));
+
+	return status;
+}
+
+/**
+ * @fn int uring_register(int, unsigned, void *, unsigned)
+ * @brief The io_uring_register() system call.
+ */
+static int uring_register(int ring_fd, unsigned opcode, void *arg,
+	unsigned nr_args) {
+	return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/**
+ * @fn char *buf_data(struct log_uring *, int)
+ * @brief The memory of a buffer.
+ */
+static inline char *buf_data(struct log_uring *uring, int buf) {
+	return uring->mem + (size_t) buf * URING_BUF_SIZE;
+}
+
+/**
+ * @fn int fill_buf(struct log_uring *)
+ * @brief The buffer being filled.
+ */
+static inline int fill_buf(struct log_uring *uring) {
+	return (uring->head + uring->n_queued) % URING_DEPTH;
+}
+
+/**
+ * @fn void retire_head(struct log_uring *)
+ * @brief The head buffer is written - make it the last one to fill.
+ */
+static void retire_head(struct log_uring *uring) {
+	int buf = uring->head;
+
+	uring->bufs[buf].len = 0;
+	uring->bufs[buf].done = 0;
+	uring->bufs[buf].n_records = 0;
+	uring->head = (buf + 1) % URING_DEPTH;
+	uring->n_queued--;
+}
+
+/**
+ * @fn int submit(struct log_uring *, int)
+ * @brief Submit a write of the rest of the head buffer, if it is full and
+ * nothing is in flight.
+ *
+ * If the write can't be submitted (the kernel may be short of memory, or the
+ * ring broken), the full buffers are written with write() instead, in order.
+ *
+ * @param uring the uring
+ * @param fd the file
+ * @return 0 on success, -1 if a buffer couldn't be written
+ */
+static int submit(struct log_uring *uring, int fd) {
+	int status = 0;
+
+	while (!uring->in_flight && (uring->n_queued > 0)) {
+		int buf = uring->head;
+		unsigned tail = *uring->sq_tail;
+		unsigned index = tail & *uring->sq_mask;
+		struct io_uring_sqe *sqe = &uring->sqes[index];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = uring->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long) (buf_data(uring, buf) +
+			uring->bufs[buf].done);
+		sqe->len = uring->bufs[buf].len - uring->bufs[buf].done;
+		sqe->off = (__u64) -1;		// the file position - O_APPEND
+		sqe->buf_index = buf;
+		sqe->user_data = buf;
+		uring->sq_array[index] = index;
+		__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+		if (uring_enter(uring->ring_fd, 1, 0, 0) >= 0) {
+			__atomic_add_fetch(&uring_writes, 1, __ATOMIC_RELAXED);
+			uring->in_flight = true;
+			break;
+		}
+
+		// the entry wasn't consumed - take it back, and write the batch
+		__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+		struct iovec part = {
+			.iov_base = buf_data(uring, buf) + uring->bufs[buf].done,
+			.iov_len = uring->bufs[buf].len - uring->bufs[buf].done,
+		};
+		if (log_sink_write_all(fd, &part, 1, uring->bufs[buf].n_records) != 0) {
+			status = -1;
+		}
+		retire_head(uring);
+	}
+
+	return status;
+}
+
+/**
+ * @fn bool wait_write(struct log_uring *)
+ * @brief Wait for the write in flight to complete.
+ * @param uring the uring
+ * @return false if the ring can't be waited on
+ */
+static bool wait_write(struct log_uring *uring) {
+	if (*uring->cq_head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return true;
+	}
+	return uring_enter(uring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) >= 0;
+}
+
+/**
+ * @fn int reap(struct log_uring *, int)
+ * @brief Handle the completion of the write in flight, if it is done, and
+ * submit the next one.
+ * @param uring the uring
+ * @param fd the file
+ * @return 0 on success, -1 if a batch couldn't be written
+ */
+static int reap(struct log_uring *uring, int fd) {
+	int status = 0;
+
+	if (!uring->in_flight) return 0;
+
+	unsigned head = *uring->cq_head;
+	if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+
+	struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+	int buf = cqe->user_data;
+	int res = cqe->res;
+	__atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+	uring->in_flight = false;
+
+	if ((res == -EAGAIN) || (res == -EINTR)) {
+		// try again
+	} else if (res < 0) {
+		// drop the batch, as a failed write() would
+		uring->bufs[buf].done = uring->bufs[buf].len;
+		uring->bufs[buf].n_records = 0;
+		status = -1;
+	} else {
+		uring->bufs[buf].done += res;
+	}
+
+	// the rest of a short write goes again
+	if (uring->bufs[buf].done >= uring->bufs[buf].len) {
+		log_sink_count_records(uring->bufs[buf].n_records);
+		retire_head(uring);
+	}
+
+	if (submit(uring, fd) != 0) status = -1;
+
+	return status;
+}
+
+/**
+ * @fn int queue_fill(struct log_uring *, int)
+ * @brief Queue the buffer being filled to be written, once there is another
+ * buffer to fill. The write is submitted if it is next.
+ * @param uring the uring
+ * @param fd the file
+ * @return 0 on success, -1 if a batch couldn't be written
+ */
+static int queue_fill(struct log_uring *uring, int fd) {
+	int buf = fill_buf(uring);
+	int status = 0;
+
+	if (uring->bufs[buf].len == 0) return 0;
+
+	while ((uring->n_queued + 1 >= URING_DEPTH) && uring->in_flight) {
+		__atomic_add_fetch(&uring_waits, 1, __ATOMIC_RELAXED);
+		if (!wait_write(uring)) {
+			// the ring is broken - write the batch now, ahead of the ones
+			// queued, rather than lose it
+			struct iovec part = {
+				.iov_base = buf_data(uring, buf),
+				.iov_len = uring->bufs[buf].len,
+			};
+			status = log_sink_write_all(fd, &part, 1,
+				uring->bufs[buf].n_records);
+			uring->bufs[buf].len = 0;
+			uring->bufs[buf].n_records = 0;
+			return status;
+		}
+		if (reap(uring, fd) != 0) status = -1;
+	}
+
+	uring->n_queued++;
+	if (submit(uring, fd) != 0) status = -1;
+
+	return status;
+}
+
+/**
+ * @fn int log_uring_flush(struct log_uring *, int)
+ * @brief Write every buffer, and wait for the writes.
+ * @param uring the uring
+ * @param fd the file
+ * @return 0 on success, -1 if a batch couldn't be written
+ */
+int log_uring_flush(struct log_uring *uring, int fd) {
+	int status = queue_fill(uring, fd);
+
+	while ((uring->n_queued > 0) && uring->in_flight) {
+		if (!wait_write(uring)) return -1;
+		if (reap(uring, fd) != 0) status = -1;
+	}
+
+	return status;
+}
+
+/**
+ * @fn int log_uring_writev(struct log_uring *, int, struct iovec const *,
+ *     int, bool)
+ * @brief Add a record, in parts, to the buffer being filled.
+ *
+ * A full buffer is queued to be written, and the record goes in the next one.
+ * A record bigger than a buffer is written with writev(), after the buffers.
+ *
+ * @param uring the uring
+ * @param fd the file
+ * @param iov the parts of the record
+ * @param iovcnt the number of parts
+ * @param line_buffered queue the record to be written at once
+ * @return 0 on success, -1 if this record, or a batch before it, couldn't be
+ * written
+ */
+int log_uring_writev(struct log_uring *uring, int fd, struct iovec const *iov,
+	int iovcnt, bool line_buffered) {
+	size_t len = 0;
+
+	for (int n = 0; n < iovcnt; n++) len += iov[n].iov_len;
+
+	// see if a write has completed - no system call
+	int status = reap(uring, fd);
+
+	if (len > URING_BUF_SIZE) {
+		struct iovec parts[iovcnt];
+
+		if (log_uring_flush(uring, fd) != 0) status = -1;
+		memcpy(parts, iov, iovcnt * sizeof(iov[0]));
+		if (log_sink_write_all(fd, parts, iovcnt, 1) != 0) status = -1;
+		return status;
+	}
+
+	if (uring->bufs[fill_buf(uring)].len + len > URING_BUF_SIZE) {
+		if (queue_fill(uring, fd) != 0) status = -1;
+	}
+
+	int buf = fill_buf(uring);
+	char *p = buf_data(uring, buf) + uring->bufs[buf].len;
+	for (int n = 0; n < iovcnt; n++) {
+		memcpy(p, iov[n].iov_base, iov[n].iov_len);
+		p += iov[n].iov_len;
+	}
+	uring->bufs[buf].len += len;
+	uring->bufs[buf].n_records++;
+
+	// written at once if nothing is ahead of it, or with the next record
+	if (line_buffered && (uring->n_queued + 1 < URING_DEPTH)) {
+		if (queue_fill(uring, fd) != 0) status = -1;
+	}
+
+	return status;
+}
+
+/**
+ * @fn struct log_uring *log_uring_open(void)
+ * @brief Set up an io_uring and its buffers.
+ * @return the uring, or NULL if io_uring can't be used
+ */
+struct log_uring *log_uring_open(void) {
+	struct io_uring_params params;
+	struct log_uring *uring = calloc(1, sizeof(*uring));
+
+	if (uring == NULL) return NULL;
+
+	uring->ring_fd = -1;
+	uring->sq_ring = MAP_FAILED;
+	uring->cq_ring = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+
+	uring->mem = aligned_alloc(URING_ALIGN, URING_DEPTH * URING_BUF_SIZE);
+	if (uring->mem == NULL) goto fail;
+
+	// one write in flight, and a spare
+	memset(&params, 0, sizeof(params));
+	uring->ring_fd = uring_setup(2, &params);
+	if (uring->ring_fd < 0) goto fail;
+
+	// writes at the file position need 5.6
+	if (!(params.features & IORING_FEAT_RW_CUR_POS)) goto fail;
+
+	uring->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_size > uring->sq_ring_size) {
+			uring->sq_ring_size = uring->cq_ring_size;
+		}
+		uring->cq_ring_size = 0;
+	}
+
+	uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) goto fail;
+
+	char *cq_ring = uring->sq_ring;
+	if (uring->cq_ring_size > 0) {
+		uring->cq_ring = mmap(NULL, uring->cq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			IORING_OFF_CQ_RING);
+		if (uring->cq_ring == MAP_FAILED) goto fail;
+		cq_ring = uring->cq_ring;
+	}
+
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) goto fail;
+
+	char *sq_ring = uring->sq_ring;
+	uring->sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+	uring->sq_mask = (unsigned *) (sq_ring + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+	uring->cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+	uring->cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+	uring->cq_mask = (unsigned *) (cq_ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+	// registered buffers save mapping them for each write - they count
+	// against RLIMIT_MEMLOCK, so go without if they can't be had
+	struct iovec bufs[URING_DEPTH];
+	for (int n = 0; n < URING_DEPTH; n++) {
+		bufs[n].iov_base = buf_data(uring, n);
+		bufs[n].iov_len = URING_BUF_SIZE;
+	}
+	uring->fixed = (uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS,
+		bufs, URING_DEPTH) == 0);
+
+	return uring;
+
+fail:
+	log_uring_close(uring);
+	return NULL;
+}
+
+/**
+ * @fn void log_uring_close(struct log_uring *)
+ * @brief Tear down an io_uring and free its buffers. The buffers must have
+ * been flushed.
+ * @param uring the uring
+ */
+void log_uring_close(struct log_uring *uring) {
+	if (uring->sqes != MAP_FAILED) munmap(uring->sqes, uring->sqes_size);
+	if (uring->cq_ring != MAP_FAILED) munmap(uring->cq_ring, uring->cq_ring_size);
+	if (uring->sq_ring != MAP_FAILED) munmap(uring->sq_ring, uring->sq_ring_size);
+	if (uring->ring_fd >= 0) close(uring->ring_fd);	// unregisters the buffers
+	free(uring->mem);
+	free(uring);
+}
+
+/**
+ * @fn void log_uring_get_stats(struct log_stats *)
+ * @brief Add the io_uring counters to the stats.
+ * @param stats the stats
+ */
+void log_uring_get_stats(struct log_stats *stats) {
+	stats->uring_writes += __atomic_load_n(&uring_writes, __ATOMIC_RELAXED);
+	stats->uring_waits += __atomic_load_n(&uring_waits, __ATOMIC_RELAXED);
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+/*
+ * Without <linux/io_uring.h>, no uring is ever opened, and the sinks write
+ * with write().
+ */
+
+struct log_uring *log_uring_open(void) {
+	return NULL;
+}
+
+int log_uring_writev(struct log_uring *uring, int fd, struct iovec const *iov,
+	int iovcnt, bool line_buffered) {
+	(void) uring; (void) fd; (void) iov; (void) iovcnt; (void) line_buffered;
+	return -1;
+}
+
+int log_uring_flush(struct log_uring *uring, int fd) {
+	(void) uring; (void) fd;
+	return -1;
+}
+
+void log_uring_close(struct log_uring *uring) {
+	(void) uring;
+}
+
+void log_uring_get_stats(struct log_stats *stats) {
+	(void) stats;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -57,6 +57,7 @@
 #endif /* DOXYGEN_SHOULD_SKIP_THIS */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/syscall.h>
@@ -65,12 +66,6 @@
 #include "private.h"
 
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
-#define XML_AMP		"&amp;"		/**< ampersand    */
-#define XML_LT		"&lt;"		/**< less than    */
-#define XML_GT		"&gt;"		/**< greater than */
-#define XML_QUOT	"&quot;"	/**< quote        */
-#define XML_APOS	"&apos;"	/**< apostrophe   */
-
 #define LABEL_LEN 16	/**< quiet doxygen */
 
 #define HEAD_1	"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>"
@@ -81,94 +76,43 @@
 #endif /* DOXYGEN_SHOULD_SKIP_THIS */
 
 static char java_level[LL_N_VALUES][LABEL_LEN] = {0};
-static char *get_level(int level) {
-	if (java_level[0][0] == '\0') {
-		for (int n = 0; n < LL_N_VALUES; n++) {
-			switch (n) {
-				case LL_SEVERE:
-				case LL_WARNING:
-				case LL_CONFIG:
-				case LL_FINE:
-				case LL_INFO:
-				case LL_FINER:
-				case LL_FINEST: {
-					snprintf(java_level[n], LABEL_LEN,
-						log_labels[n].english);
-				} break;
-				default:
-					snprintf(java_level[n], LABEL_LEN,
-						"%d", log_labels[n].java_level);
-			}
+static pthread_once_t java_level_once = PTHREAD_ONCE_INIT;
+static void java_level_init(void) {
+	for (int n = 0; n < LL_N_VALUES; n++) {
+		switch (n) {
+			case LL_SEVERE:
+			case LL_WARNING:
+			case LL_CONFIG:
+			case LL_FINE:
+			case LL_INFO:
+			case LL_FINER:
+			case LL_FINEST: {
+				snprintf(java_level[n], LABEL_LEN,
+					log_labels[n].english);
+			} break;
+			default:
+				snprintf(java_level[n], LABEL_LEN,
+					"%d", log_labels[n].java_level);
 		}
 	}
+}
+
+// channels are formatted at the same time, each under its own lock
+static char *get_level(int level) {
+	pthread_once(&java_level_once, java_level_init);
 	return java_level[level];
 }
 
 /**
- * @fn char *entity(int character) 
- * @brief replace special characters with their corresponding XML entities
- * @param character the character to potentially replace
- * @return a pointer to the entity string, or NULL if not an XML entity
+ * The most a record needs, besides its strings: the tags and the numbers.
  */
-static char *entity(int character) {
-	switch (character) {
-		case '&': return XML_AMP;
-		case '<': return XML_LT;
-		case '>': return XML_GT;
-		case '"': return XML_QUOT;
-		case '\'': return XML_APOS;
-		default: return NULL;
-	}
-}
+#define RECORD_FIXED_LEN 512
 
 /**
- * @fn char *escape_xml(char const *, char *, int)
- * @brief Escape '&', '<', '>', '\"', '\''
- * No special treatment of non-ascii characters is performed.
- * @param input the string to escape
- * @param buf a buffer to place the escaped output
- * @param len the length of that buffer.
+ * Copy a string literal (a tag fragment), and advance past it.
  */
-static char *escape_xml(char const *input, char *buf, int len) {
-	char const *ptr_in;
-	char *ptr_out;
-	char *substitute;
-	int n_written;
-
-	if ((input == NULL) || (buf == NULL) || (len == 0)) return NULL;
-
-	for (ptr_in = input, ptr_out = buf;
-		*ptr_in != '\0' && (ptr_out < buf + len);
-		ptr_in++) {
-		if ((substitute = entity(*ptr_in)) != NULL) {
-			n_written =
-				snprintf(ptr_out, len - (ptr_out - buf), "%s", substitute);
-			ptr_out += n_written;
-		} else {
-			*ptr_out++ = *ptr_in;
-		}
-	}
-
-	*ptr_out = '\0';	/* null terminate */
-
-	return buf;
-}
-
-static int do_xml_start(FILE *stream) {
-	return fprintf(stream, "<record>\n");
-}
-
-static int do_xml_text(FILE *stream, const char *label, const char *value) {
-	return fprintf(stream, "  <%s>%s</%s>\n", label, value, label);
-}
-
-static int do_xml_long(FILE *stream, const char *label, const long value) {
-	return fprintf(stream, "  <%s>%ld</%s>\n", label, value, label);
-}
-
-static int do_xml_end(FILE *stream) {
-	return fprintf(stream, "</record>\n");
-}
+#define PUT_LITERAL(p, literal) \
+	(memcpy((p), (literal), sizeof(literal) - 1), (p) + sizeof(literal) - 1)
 
 /**
  * @fn int log_do_xml_head(FILE *stream)
@@ -221,37 +165,66 @@ int log_do_xml_tail(FILE *stream) {
  */
 int log_fmt_xml(FILE *stream, int sequence, struct timespec *ts, int level,
 	const char *file, const char *function, int line, char *msg) {
+	return log_fmt_buffered(log_bfmt_xml, stream, sequence, ts, level,
+		file, function, line, msg);
+}
+
+/**
+ * @fn int log_bfmt_xml(struct log_buf *, struct log_record const *)
+ * @brief Buffer version of log_fmt_xml() and log_fmt_xml_records().
+ * @param out the buffer to append the record to
+ * @param r the record
+ * @return the length of the record, or -1 if out of memory
+ */
+int log_bfmt_xml(struct log_buf *out, struct log_record const *r) {
 	char date[TIMESTAMP_LEN];
-	char buf[BUFSIZ] = {0};
+	char const *label = get_level(r->level);
 	long int time_millis;
 	long int time_nanos;
 
-	(void) line;	/* suppress "unused variable" warning */
+	time_millis = r->ts->tv_sec * 1000 + r->ts->tv_nsec / 1000000;
+	time_nanos = r->ts->tv_nsec % 1000000;
 
-	time_millis = ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
-	time_nanos = ts->tv_nsec % 1000000;
-
-	int n_written = 0;
-
-	// TODO: escape file and function also
-	escape_xml(msg, buf, sizeof(buf));
-
-	log_format_timestamp(ts, FMT_UTC_OFFSET | FMT_ISO | SP_MILLI,
+	log_format_timestamp(r->ts, FMT_UTC_OFFSET | FMT_ISO | SP_MILLI,
 		date, sizeof(date));
-	n_written += do_xml_start(stream);
-	n_written += do_xml_text(stream, "date", date);
-	n_written += do_xml_long(stream, "millis", time_millis);
-	n_written += do_xml_long(stream, "nanos", time_nanos);
-	n_written += do_xml_long(stream, "sequence", sequence);
-	n_written += do_xml_text(stream, "logger", "tinylogger");
-	n_written += do_xml_text(stream, "level", get_level(level));
-	n_written += do_xml_text(stream, "class", file);
-	n_written += do_xml_text(stream, "method", function);
-	n_written += do_xml_long(stream, "thread", syscall(SYS_gettid));
-	n_written += do_xml_text(stream, "message", buf);
-	n_written += do_xml_end(stream);
 
-	return n_written;
+	char *buf = log_buf_reserve(out, RECORD_FIXED_LEN + strlen(date) +
+		strlen(label) + XML_ESCAPE_MAX * (strlen(r->file) +
+		strlen(r->function) + r->msg_len) + ESCAPE_SLACK);
+	if (buf == NULL) return -1;
+
+	char *p = buf;
+
+	p = PUT_LITERAL(p, "<record>\n  <date>");
+	p = stpcpy(p, date);
+	p = PUT_LITERAL(p, "</date>\n  <millis>");
+	p = log_put_long(p, time_millis);
+	p = PUT_LITERAL(p, "</millis>\n  <nanos>");
+	p = log_put_long(p, time_nanos);
+	p = PUT_LITERAL(p, "</nanos>\n  <sequence>");
+	char *digits = p;
+	p = log_put_long(p, r->sequence);
+	log_sequence_field = (struct log_sequence_field) {
+		.set = true,
+		.offset = digits - buf,
+		.len = p - digits,
+		.min = 1,
+	};
+	p = PUT_LITERAL(p, "</sequence>\n  <logger>tinylogger</logger>\n"
+		"  <level>");
+	p = stpcpy(p, label);
+	p = PUT_LITERAL(p, "</level>\n  <class>");
+	p = log_escape_xml(p, r->file);
+	p = PUT_LITERAL(p, "</class>\n  <method>");
+	p = log_escape_xml(p, r->function);
+	p = PUT_LITERAL(p, "</method>\n  <thread>");
+	p = log_put_long(p, r->tid);
+	p = PUT_LITERAL(p, "</thread>\n  <message>");
+	p = log_escape_xml(p, r->msg);
+	p = PUT_LITERAL(p, "</message>\n</record>\n");
+
+	out->len += p - buf;
+	return p - buf;
 }
 
 /**
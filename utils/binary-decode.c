@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tinylogger.h>
+
+/**
+ *
+ * The purpose of this program is to turn a log written with the log_fmt_binary
+ * formatter back into text, JSON or XML.
+ *
+ * The binary log must be decoded on a machine with the same data sizes and
+ * byte order as the one that wrote it. The packed printf arguments are in the
+ * native layout.
+ *
+ * The output is written to the stdout.
+ *
+ */
+
+/**
+ * The formats that may be selected with -f.
+ */
+static struct {
+	char *name;
+	log_formatter_t formatter;
+} formats[] = {
+	{"basic",			log_fmt_basic},
+	{"systemd",			log_fmt_systemd},
+	{"standard",		log_fmt_standard},
+	{"debug",			log_fmt_debug},
+	{"tall",			log_fmt_tall},
+	{"debug_tid",		log_fmt_debug_tid},
+	{"debug_tname",		log_fmt_debug_tname},
+	{"debug_tall",		log_fmt_debug_tall},
+	{"elapsed_time",	log_fmt_elapsed_time},
+	{"xml",				log_fmt_xml},
+	{"xml_records",		log_fmt_xml_records},
+	{"json",			log_fmt_json},
+	{"json_records",	log_fmt_json_records},
+};
+#define N_FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+static void usage(char *progname) {
+	fprintf(stderr, "Usage: %s [-f <format>] <input-file>\n", progname);
+	fprintf(stderr, "  formats:");
+	for (size_t n = 0; n < N_FORMATS; n++) {
+		fprintf(stderr, " %s", formats[n].name);
+	}
+	fprintf(stderr, "\n  default: debug_tall\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	log_formatter_t formatter = log_fmt_debug_tall;
+	char *filename = NULL;
+	FILE *fp;
+
+	for (int n = 1; n < argc; n++) {
+		if (strcmp(argv[n], "-f") == 0) {
+			if (++n >= argc) usage(argv[0]);
+			formatter = NULL;
+			for (size_t f = 0; f < N_FORMATS; f++) {
+				if (strcmp(argv[n], formats[f].name) == 0) {
+					formatter = formats[f].formatter;
+				}
+			}
+			if (formatter == NULL) usage(argv[0]);
+		} else if (filename == NULL) {
+			filename = argv[n];
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (filename == NULL) usage(argv[0]);
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	long n_msgs = log_decode_binary(fp, stdout, formatter);
+	fclose(fp);
+
+	if (n_msgs < 0) {
+		fprintf(stderr, "%s is not a valid binary log\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -26,67 +26,126 @@ else
 	cp logger/libtinylogger.a $ARCHIVE
 fi
 
-# add globals from external libraries to this list
+# add globals from external libraries to this list (whole names - a library
+# symbol such as log_close_channel must not be hidden by close)
 EXTERN_SYMS=()
+EXTERN_SYMS+=("access")
+EXTERN_SYMS+=("aligned_alloc")
+EXTERN_SYMS+=("atexit")
 EXTERN_SYMS+=("calloc")
 EXTERN_SYMS+=("clock_gettime")
+EXTERN_SYMS+=("close")
+EXTERN_SYMS+=("__cpu_indicator_init")
+EXTERN_SYMS+=("__cpu_model")
 EXTERN_SYMS+=("__ctype_b_loc")
 EXTERN_SYMS+=("dirname")
+EXTERN_SYMS+=("dl_iterate_phdr")
 EXTERN_SYMS+=("__errno_location")
 EXTERN_SYMS+=("exit")
+EXTERN_SYMS+=("fallocate")
 EXTERN_SYMS+=("fclose")
 EXTERN_SYMS+=("fflush")
 EXTERN_SYMS+=("fopen")
+EXTERN_SYMS+=("fopencookie")
 EXTERN_SYMS+=("fprintf")
 EXTERN_SYMS+=("fread")
 EXTERN_SYMS+=("free")
+EXTERN_SYMS+=("fstat")
+EXTERN_SYMS+=("ftruncate")
+EXTERN_SYMS+=("fwrite")
+EXTERN_SYMS+=("getc")
 EXTERN_SYMS+=("getenv")
 EXTERN_SYMS+=("getpid")
+EXTERN_SYMS+=("_GLOBAL_OFFSET_TABLE_")
+EXTERN_SYMS+=("gzclose")
+EXTERN_SYMS+=("gzdopen")
+EXTERN_SYMS+=("gzerror")
+EXTERN_SYMS+=("gzwrite")
 EXTERN_SYMS+=("index")
 EXTERN_SYMS+=("__isoc99_fscanf")
 EXTERN_SYMS+=("__libc_current_sigrtmax")
+EXTERN_SYMS+=("lstat")
 EXTERN_SYMS+=("__lxstat")
 EXTERN_SYMS+=("localtime_r")
 EXTERN_SYMS+=("malloc")
+EXTERN_SYMS+=("memcmp")
 EXTERN_SYMS+=("memcpy")
 EXTERN_SYMS+=("memset")
+EXTERN_SYMS+=("mmap")
+EXTERN_SYMS+=("munmap")
 EXTERN_SYMS+=("open")
+EXTERN_SYMS+=("open_memstream")
 EXTERN_SYMS+=("perror")
+EXTERN_SYMS+=("posix_fadvise")
+EXTERN_SYMS+=("pthread_atfork")
 EXTERN_SYMS+=("pthread_attr_destroy")
 EXTERN_SYMS+=("pthread_attr_init")
 EXTERN_SYMS+=("pthread_attr_setstacksize")
+EXTERN_SYMS+=("pthread_cond_broadcast")
+EXTERN_SYMS+=("pthread_cond_signal")
+EXTERN_SYMS+=("pthread_cond_timedwait")
+EXTERN_SYMS+=("pthread_cond_wait")
 EXTERN_SYMS+=("pthread_create")
+EXTERN_SYMS+=("pthread_equal")
 EXTERN_SYMS+=("pthread_getname_np")
 EXTERN_SYMS+=("pthread_join")
+EXTERN_SYMS+=("pthread_key_create")
 EXTERN_SYMS+=("pthread_kill")
+EXTERN_SYMS+=("pthread_mutex_destroy")
+EXTERN_SYMS+=("pthread_mutex_init")
 EXTERN_SYMS+=("pthread_mutex_lock")
+EXTERN_SYMS+=("pthread_mutex_trylock")
 EXTERN_SYMS+=("pthread_mutex_unlock")
+EXTERN_SYMS+=("pthread_once")
 EXTERN_SYMS+=("pthread_self")
 EXTERN_SYMS+=("pthread_setname_np")
+EXTERN_SYMS+=("pthread_setspecific")
 EXTERN_SYMS+=("pthread_sigmask")
 EXTERN_SYMS+=("puts")		# not on gcc (Raspbian 8.3.0-6+rpi1) 8.3.0
 EXTERN_SYMS+=("read")
+EXTERN_SYMS+=("realloc")
 EXTERN_SYMS+=("readlink")
+EXTERN_SYMS+=("rename")
+EXTERN_SYMS+=("rewind")
 EXTERN_SYMS+=("rindex")
+EXTERN_SYMS+=("sched_yield")
+EXTERN_SYMS+=("sem_init")
+EXTERN_SYMS+=("sem_post")
+EXTERN_SYMS+=("sem_timedwait")
+EXTERN_SYMS+=("sem_wait")
+EXTERN_SYMS+=("setpriority")
 EXTERN_SYMS+=("setvbuf")
 EXTERN_SYMS+=("sigaddset")
 EXTERN_SYMS+=("sigemptyset")
+EXTERN_SYMS+=("sigfillset")
 EXTERN_SYMS+=("sigwaitinfo")
 EXTERN_SYMS+=("snprintf")
+EXTERN_SYMS+=("stat")
 EXTERN_SYMS+=("stderr")
+EXTERN_SYMS+=("stpcpy")
 EXTERN_SYMS+=("strcasecmp")
+EXTERN_SYMS+=("strchr")
+EXTERN_SYMS+=("strchrnul")
 EXTERN_SYMS+=("strcmp")		# not on gcc (GCC) 8.3.1 20191121 (Red Hat 8.3.1-5)
 EXTERN_SYMS+=("strcpy")
 EXTERN_SYMS+=("strdup")
 EXTERN_SYMS+=("strerror_r")
+EXTERN_SYMS+=("strftime")
 EXTERN_SYMS+=("strlen")
 EXTERN_SYMS+=("strncat")
 EXTERN_SYMS+=("strncmp")	# not on gcc (GCC) 8.3.1 20191121 (Red Hat 8.3.1-5)
 EXTERN_SYMS+=("strncpy")
+EXTERN_SYMS+=("strnlen")
 EXTERN_SYMS+=("strstr")
 EXTERN_SYMS+=("strtok")
 EXTERN_SYMS+=("syscall")
+EXTERN_SYMS+=("sysconf")
+EXTERN_SYMS+=("time")
+EXTERN_SYMS+=("unlink")
+EXTERN_SYMS+=("usleep")
+EXTERN_SYMS+=("vfprintf")
 EXTERN_SYMS+=("vsnprintf")
+EXTERN_SYMS+=("writev")
 EXTERN_SYMS+=("__xstat")
 
 # the number of external globals
@@ -98,8 +157,8 @@ do
 	EXTERN_PATTERN=$EXTERN_PATTERN"|"${EXTERN_SYMS[i]}
 done
 
-GLOBALS=$(readelf -s $ARCHIVE | grep GLOBAL | tr -s " " "\\t" | cut -f 9-)
+GLOBALS=$(readelf -sW $ARCHIVE | grep GLOBAL | tr -s " " "\\t" | cut -f 9-)
 GLOBALS=$(echo "$GLOBALS" | sort | uniq)
-echo "$GLOBALS" | grep -E -v "$EXTERN_PATTERN"
+echo "$GLOBALS" | grep -E -v "^($EXTERN_PATTERN)$"
 
 rm $ARCHIVE
@@ -97,6 +97,15 @@ options["beehive"]="-q -v -z"
 options["check-timezone"]="--pass"
 # -q quick
 options["logrotate"]="-q"
+# -q quick
+options["async"]="-q"
+options["deferred"]="-q"
+options["binary"]="-q"
+options["escape"]="-q"
+options["channels"]="-q"
+options["scaling"]="-q"
+options["sinks"]="-q"
+options["rotation"]="-q"
 
 # run a test
 function run_test {
@@ -142,6 +151,9 @@ for PROG in ${PROGS_LIST[@]}; do
 	if [ $PROG_BASENAME = "file-to-json" ]; then
 		continue
 	fi
+	if [ $PROG_BASENAME = "binary-decode" ]; then
+		continue
+	fi
 	OPTIONS="${options[$PROG_BASENAME]}"
 	echo "==== testing ====> $PROG"
 